@@ -0,0 +1,105 @@
+/************************************************************************************
+Filename    :   CameraRays.h
+Content     :   Primary ray directions straight from an eye's field of view tangents
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// The projection ovrMatrix4f_Projection builds from an ovrFovPort maps the tangent of the
+// angle off the view axis linearly onto the image, -LeftTan to RightTan across and UpTan
+// to -DownTan down. So a ray direction, before normalizing, is the view axis plus tangents
+// along the camera's right and up axes, and is linear in the pixel: the direction through
+// the top left corner of the image plus a step per pixel across and down. The scene
+// rotates those three vectors by the eye's orientation once a frame and GenerateCameraRay
+// in Raytracing.hlsl only adds them up, with no projection matrix to invert or to divide by.
+//
+// CameraRayDirection in SecondaryRays.h unprojects through the inverted projection the way
+// the shader used to; DiffCameraRays checks the two agree on every pixel of an eye.
+
+#ifndef CameraRays_h
+#define CameraRays_h
+
+#include "SecondaryRays.h"
+
+// Tangents of the half angles of an eye's field of view, as in ovrFovPort.
+struct FovTangents
+{
+    float upTan;
+    float downTan;
+    float leftTan;
+    float rightTan;
+};
+
+struct CameraRayFrustum
+{
+    Float3 corner;      // Through the top left corner of the image, before normalizing
+    Float3 stepX;       // Added per pixel across
+    Float3 stepY;       // Added per pixel down
+};
+
+// rotation takes the camera's axes to world space; like Camera::GetViewMatrix it looks down -z with y up.
+inline CameraRayFrustum MakeCameraRayFrustum(const FovTangents& fov, const Quat& rotation, uint32_t width, uint32_t height)
+{
+    Float3 right = rotation.Rotate(Float3(1.0f, 0.0f, 0.0f));
+    Float3 up = rotation.Rotate(Float3(0.0f, 1.0f, 0.0f));
+    Float3 forward = rotation.Rotate(Float3(0.0f, 0.0f, -1.0f));
+    CameraRayFrustum frustum;
+    frustum.corner = forward - right * fov.leftTan + up * fov.upTan;
+    frustum.stepX = right * ((fov.leftTan + fov.rightTan) / width);
+    frustum.stepY = up * (-(fov.upTan + fov.downTan) / height);
+    return frustum;
+}
+
+// GenerateCameraRay in Raytracing.hlsl.
+inline Float3 FrustumRayDirection(const CameraRayFrustum& frustum, uint32_t x, uint32_t y)
+{
+    return Normalize(frustum.corner + frustum.stepX * (x + 0.5f) + frustum.stepY * (y + 0.5f));
+}
+
+struct CameraRayDiff
+{
+    uint32_t pixels = 0;
+    float maxRadians = 0.0f;        // Largest angle between the two rays of a pixel
+    double meanRadians = 0.0;
+    float pixelSpreadAngle = 0.0f;  // Between neighbouring pixels, to put the others in scale
+};
+
+// Compares every pixel's ray from the frustum with the one unprojected through projectionToWorld,
+// as uploaded before the frustum replaced it.
+inline CameraRayDiff DiffCameraRays(const float projectionToWorld[16], const Float3& eye, const CameraRayFrustum& frustum, uint32_t width, uint32_t height)
+{
+    CameraRayDiff diff;
+    double sum = 0.0;
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            Float3 reference = CameraRayDirection(projectionToWorld, eye, x, y, width, height);
+            Float3 direction = FrustumRayDirection(frustum, x, y);
+            // The cross product keeps its precision for the tiny angles expected here, unlike acos of the dot
+            float angle = atan2f(Length(Cross(reference, direction)), Dot(reference, direction));
+            diff.maxRadians = MaxF(diff.maxRadians, angle);
+            sum += angle;
+            diff.pixels++;
+        }
+    }
+    diff.meanRadians = diff.pixels ? sum / diff.pixels : 0.0;
+    Float3 centre = FrustumRayDirection(frustum, width / 2, height / 2);
+    Float3 below = FrustumRayDirection(frustum, width / 2, height / 2 + 1);
+    diff.pixelSpreadAngle = atan2f(Length(Cross(centre, below)), Dot(centre, below));
+    return diff;
+}
+
+#endif // CameraRays_h
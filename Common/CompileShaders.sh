@@ -0,0 +1,35 @@
+#!/bin/sh
+# Compiles the raytracing shader library and the compute shaders of every
+# sample with DXC and writes the same CompiledShaders headers the Visual Studio FxCompile
+# step produces.
+# The samples themselves need Windows and LibOVR, but the shaders can be built and
+# checked anywhere DXC runs, including the Linux releases of DirectXShaderCompiler.
+#
+# Usage: Common/CompileShaders.sh [output directory]      (DXC=/path/to/dxc to override)
+
+set -e
+
+DXC=${DXC:-dxc}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+OUT=${1:-"$ROOT/_shaders"}
+
+for SAMPLE in "OculusTinyRoomDXR" "OculusTinyRoomDXR _Lighting" "OculusTinyRoomDXR _Spheres" "OculusTinyRoomDXR _ModelLoading"
+do
+    mkdir -p "$OUT/$SAMPLE/CompiledShaders"
+    echo "Compiling $SAMPLE/Raytracing.hlsl"
+    "$DXC" -T lib_6_3 -Vn g_pRaytracing -Fh "$OUT/$SAMPLE/CompiledShaders/Raytracing.hlsl.h" "$ROOT/$SAMPLE/Raytracing.hlsl"
+    echo "Compiling $SAMPLE/InlineRaytracing.hlsl"
+    "$DXC" -T cs_6_5 -E MyInlineShadingShader -Vn g_pInlineRaytracing -Fh "$OUT/$SAMPLE/CompiledShaders/InlineRaytracing.hlsl.h" "$ROOT/$SAMPLE/InlineRaytracing.hlsl"
+    echo "Compiling $SAMPLE/SecondaryUpsample.hlsl"
+    "$DXC" -T cs_6_5 -E MySecondaryUpsampleShader -Vn g_pSecondaryUpsample -Fh "$OUT/$SAMPLE/CompiledShaders/SecondaryUpsample.hlsl.h" "$ROOT/$SAMPLE/SecondaryUpsample.hlsl"
+    echo "Compiling $SAMPLE/Denoise.hlsl"
+    "$DXC" -T cs_6_5 -E MyDenoiseShader -Vn g_pDenoise -Fh "$OUT/$SAMPLE/CompiledShaders/Denoise.hlsl.h" "$ROOT/$SAMPLE/Denoise.hlsl"
+    echo "Compiling $SAMPLE/ProbeTrace.hlsl"
+    "$DXC" -T cs_6_5 -E MyProbeTraceShader -Vn g_pProbeTrace -Fh "$OUT/$SAMPLE/CompiledShaders/ProbeTrace.hlsl.h" "$ROOT/$SAMPLE/ProbeTrace.hlsl"
+    echo "Compiling $SAMPLE/ProbeBlend.hlsl"
+    "$DXC" -T cs_6_5 -E MyProbeBlendShader -Vn g_pProbeBlend -Fh "$OUT/$SAMPLE/CompiledShaders/ProbeBlend.hlsl.h" "$ROOT/$SAMPLE/ProbeBlend.hlsl"
+    echo "Compiling $SAMPLE/ShadowCacheInvalidate.hlsl"
+    "$DXC" -T cs_6_5 -E MyShadowCacheInvalidateShader -Vn g_pShadowCacheInvalidate -Fh "$OUT/$SAMPLE/CompiledShaders/ShadowCacheInvalidate.hlsl.h" "$ROOT/$SAMPLE/ShadowCacheInvalidate.hlsl"
+    echo "Compiling $SAMPLE/RayBudgetStats.hlsl"
+    "$DXC" -T cs_6_5 -E MyRayBudgetStatsShader -Vn g_pRayBudgetStats -Fh "$OUT/$SAMPLE/CompiledShaders/RayBudgetStats.hlsl.h" "$ROOT/$SAMPLE/RayBudgetStats.hlsl"
+done
@@ -0,0 +1,427 @@
+/************************************************************************************
+Filename    :   Denoiser.h
+Content     :   CPU reference of the spatio-temporal denoiser of the inline path
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// Spatiotemporal variance-guided filtering, "Spatiotemporal Variance-Guided Filtering:
+// Real-Time Reconstruction for Path-Traced Global Illumination" (Schied et al.), applied to
+// the lighting and the reflection ShadeSecondary returns before ComposeSurface multiplies
+// in the albedo, so texture detail never gets blurred.
+//
+// Every frame a pixel's surface is reprojected into the previous frame and blended with
+// the history there when the G-buffer texels agree on instance, normal and distance. The
+// first and second moments of the luminance are accumulated next to it and give the
+// variance, or a 5x5 neighbourhood does while the history is shorter than four frames.
+// DENOISE_ITERATIONS a-trous passes with growing steps then filter the result, stopping at
+// depth, normal and instance edges and at luminance differences the variance cannot explain.
+//
+// Unlike the paper the history keeps the accumulated color from before the a-trous passes,
+// so each frame filters it afresh instead of feeding blur back into later frames.
+//
+// Denoise.hlsl runs both signals side by side with the same steps; the code below is the
+// reference for one of them, used to measure the filter against many-sample references.
+
+#ifndef Denoiser_h
+#define Denoiser_h
+
+#include <vector>
+#include "SecondaryRays.h"
+
+// Must match Denoise.hlsl
+#define DENOISE_ITERATIONS 4
+#define DENOISE_MAX_HISTORY 32.0f
+#define DENOISE_COLOR_ALPHA 0.2f
+#define DENOISE_MOMENTS_ALPHA 0.2f
+#define DENOISE_PHI_DEPTH 0.1f          // Relative hit distance difference per pixel of separation
+#define DENOISE_PHI_NORMAL 128.0f
+#define DENOISE_PHI_LUMINANCE 4.0f      // Standard deviations of luminance difference
+
+inline float Luminance(const Float3& c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
+// Where the surface of a pixel was in the previous frame: its position there with pixel
+// centres on integers, and its distance from the previous eye. previousHitT is negative
+// when the pixel has no surface or the surface was behind the previous camera.
+struct DenoiserMotion
+{
+    Float2 previousPixel;
+    float previousHitT = -1.0f;
+};
+
+// ReprojectSurface in Denoise.hlsl. previousWorldToProjection is the matrix as uploaded to
+// the scene constant buffer, which HLSL reads transposed like projectionToWorld.
+inline DenoiserMotion ReprojectSurface(const float previousWorldToProjection[16], const Float3& previousEye, const Float3& world,
+                                       uint32_t width, uint32_t height)
+{
+    const float* m = previousWorldToProjection;
+    float x = m[0] * world.x + m[1] * world.y + m[2] * world.z + m[3];
+    float y = m[4] * world.x + m[5] * world.y + m[6] * world.z + m[7];
+    float w = m[12] * world.x + m[13] * world.y + m[14] * world.z + m[15];
+    DenoiserMotion motion;
+    if (w <= 0.0f)
+        return motion;
+    motion.previousPixel = Float2((x / w * 0.5f + 0.5f) * width - 0.5f, (-y / w * 0.5f + 0.5f) * height - 0.5f);
+    motion.previousHitT = Length(world - previousEye);
+    return motion;
+}
+
+inline std::vector<DenoiserMotion> ReprojectGBuffer(const float projectionToWorld[16], const Float3& eye,
+                                                    const float previousWorldToProjection[16], const Float3& previousEye,
+                                                    uint32_t width, uint32_t height, const GBufferTexel* gbuffer)
+{
+    std::vector<DenoiserMotion> motion(size_t(width) * height);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            const GBufferTexel& texel = gbuffer[size_t(y) * width + x];
+            if (!texel.Hit())
+                continue;
+            Float3 world = eye + CameraRayDirection(projectionToWorld, eye, x, y, width, height) * texel.hitT;
+            motion[size_t(y) * width + x] = ReprojectSurface(previousWorldToProjection, previousEye, world, width, height);
+        }
+    }
+    return motion;
+}
+
+// A texel of the previous G-buffer continues the surface of the current one when it is the
+// same instance facing the same way at the distance the reprojection expects.
+inline bool SurfacesMatch(const GBufferTexel& current, const GBufferTexel& previous, float expectedHitT)
+{
+    return previous.Hit() && previous.Instance() == current.Instance() &&
+        Dot(previous.Normal(), current.Normal()) >= 0.9f &&
+        fabsf(previous.hitT - expectedHitT) <= DENOISE_PHI_DEPTH * expectedHitT;
+}
+
+// Depth, normal and instance part of the edge stopping weight between a pixel and a
+// neighbour separation pixels away.
+inline float DenoiseGeometryWeight(const GBufferTexel& p, const Float3& pNormal, const GBufferTexel& q, const Float3& qNormal, float separation)
+{
+    if (!q.Hit() || q.Instance() != p.Instance())
+        return 0.0f;
+    float depth = fabsf(p.hitT - q.hitT) / (DENOISE_PHI_DEPTH * p.hitT * separation + 1e-4f);
+    return expf(-depth) * powf(MaxF(Dot(pNormal, qNormal), 0.0f), DENOISE_PHI_NORMAL);
+}
+
+// The denoiser of one signal of one eye, holding its history between frames.
+struct SvgfDenoiser
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<Float3> historyColor;
+    std::vector<Float2> historyMoments;
+    std::vector<float> historyLength;       // Frames accumulated, 0 where there is no history
+    std::vector<GBufferTexel> historySurfaces;
+
+    void Reset()
+    {
+        size_t count = size_t(width) * height;
+        historyColor.assign(count, Float3());
+        historyMoments.assign(count, Float2());
+        historyLength.assign(count, 0.0f);
+        historySurfaces.assign(count, GBufferTexel{ 0, 0, -1.0f, 0 });
+    }
+
+    // Filters one frame of noisy into output, both width by height.
+    void Denoise(uint32_t width, uint32_t height, const GBufferTexel* gbuffer, const DenoiserMotion* motion, const Float3* noisy, Float3* output)
+    {
+        if (width != this->width || height != this->height)
+        {
+            this->width = width;
+            this->height = height;
+            Reset();
+        }
+
+        size_t count = size_t(width) * height;
+        std::vector<Float3> normals(count);
+        for (size_t i = 0; i < count; i++)
+            normals[i] = gbuffer[i].Hit() ? gbuffer[i].Normal() : Float3();
+
+        std::vector<Float3> color(count);
+        std::vector<Float2> moments(count);
+        std::vector<float> length(count, 0.0f);
+        std::vector<float> variance(count, 0.0f);
+        for (uint32_t y = 0; y < height; y++)
+            for (uint32_t x = 0; x < width; x++)
+                Accumulate(x, y, gbuffer, normals.data(), motion, noisy, color, moments, length, variance);
+        CommitHistory(gbuffer, color, moments, length);
+
+        std::vector<Float3> filteredColor(count);
+        std::vector<float> filteredVariance(count);
+        for (uint32_t iteration = 0; iteration < DENOISE_ITERATIONS; iteration++)
+        {
+            for (uint32_t y = 0; y < height; y++)
+                for (uint32_t x = 0; x < width; x++)
+                    FilterATrous(x, y, 1 << iteration, gbuffer, normals.data(), color, variance, filteredColor, filteredVariance);
+            color.swap(filteredColor);
+            variance.swap(filteredVariance);
+        }
+
+        for (size_t i = 0; i < count; i++)
+            output[i] = color[i];
+    }
+
+private:
+    // TemporalPass in Denoise.hlsl, reading the history of the previous frame.
+    void Accumulate(uint32_t x, uint32_t y, const GBufferTexel* gbuffer, const Float3* normals, const DenoiserMotion* motion, const Float3* noisy,
+                    std::vector<Float3>& color, std::vector<Float2>& moments, std::vector<float>& length, std::vector<float>& variance)
+    {
+        size_t i = size_t(y) * width + x;
+        const GBufferTexel& surface = gbuffer[i];
+        if (!surface.Hit())
+        {
+            color[i] = Float3();
+            moments[i] = Float2();
+            length[i] = 0.0f;
+            variance[i] = 0.0f;
+            return;
+        }
+
+        // Bilinear taps around the previous position, keeping those on the same surface
+        Float3 previousColor;
+        Float2 previousMoments;
+        float previousLength = 0.0f, weightSum = 0.0f;
+        if (motion[i].previousHitT >= 0.0f)
+        {
+            float px = motion[i].previousPixel.x, py = motion[i].previousPixel.y;
+            float fx = px - floorf(px), fy = py - floorf(py);
+            int x0 = (int)floorf(px), y0 = (int)floorf(py);
+            for (int tap = 0; tap < 4; tap++)
+            {
+                int tx = x0 + (tap & 1), ty = y0 + (tap >> 1);
+                if (tx < 0 || ty < 0 || tx >= (int)width || ty >= (int)height)
+                    continue;
+                float w = ((tap & 1) ? fx : 1.0f - fx) * ((tap >> 1) ? fy : 1.0f - fy);
+                size_t j = size_t(ty) * width + tx;
+                if (w <= 0.0f || historyLength[j] <= 0.0f || !SurfacesMatch(surface, historySurfaces[j], motion[i].previousHitT))
+                    continue;
+                previousColor += historyColor[j] * w;
+                previousMoments.x += historyMoments[j].x * w;
+                previousMoments.y += historyMoments[j].y * w;
+                previousLength += historyLength[j] * w;
+                weightSum += w;
+            }
+        }
+
+        bool valid = weightSum > 0.01f;
+        if (valid)
+        {
+            previousColor = previousColor / weightSum;
+            previousMoments = Float2(previousMoments.x / weightSum, previousMoments.y / weightSum);
+            previousLength /= weightSum;
+        }
+        length[i] = valid ? MinF(previousLength + 1.0f, DENOISE_MAX_HISTORY) : 1.0f;
+        float colorAlpha = valid ? MaxF(1.0f / length[i], DENOISE_COLOR_ALPHA) : 1.0f;
+        float momentsAlpha = valid ? MaxF(1.0f / length[i], DENOISE_MOMENTS_ALPHA) : 1.0f;
+
+        float luminance = Luminance(noisy[i]);
+        moments[i] = Float2(previousMoments.x + (luminance - previousMoments.x) * momentsAlpha,
+                            previousMoments.y + (luminance * luminance - previousMoments.y) * momentsAlpha);
+        color[i] = Lerp(previousColor, noisy[i], colorAlpha);
+
+        if (length[i] >= 4.0f)
+            variance[i] = MaxF(moments[i].y - moments[i].x * moments[i].x, 0.0f);
+        else
+        {
+            // Too little history: take the moments of the noisy neighbourhood on the same surface
+            // and boost them, since they are missing the variance between frames
+            float m1 = 0.0f, m2 = 0.0f, neighbourWeights = 0.0f;
+            for (int dy = -2; dy <= 2; dy++)
+            {
+                for (int dx = -2; dx <= 2; dx++)
+                {
+                    int qx = (int)x + dx, qy = (int)y + dy;
+                    if (qx < 0 || qy < 0 || qx >= (int)width || qy >= (int)height)
+                        continue;
+                    size_t j = size_t(qy) * width + qx;
+                    float w = (dx == 0 && dy == 0) ? 1.0f :
+                        DenoiseGeometryWeight(surface, normals[i], gbuffer[j], normals[j], sqrtf(float(dx * dx + dy * dy)));
+                    float l = Luminance(noisy[j]);
+                    m1 += l * w;
+                    m2 += l * l * w;
+                    neighbourWeights += w;
+                }
+            }
+            m1 /= neighbourWeights;
+            m2 /= neighbourWeights;
+            variance[i] = MaxF(m2 - m1 * m1, 0.0f) * (4.0f / length[i]);
+        }
+    }
+
+    void CommitHistory(const GBufferTexel* gbuffer, const std::vector<Float3>& color, const std::vector<Float2>& moments, const std::vector<float>& length)
+    {
+        historyColor = color;
+        historyMoments = moments;
+        historyLength = length;
+        historySurfaces.assign(gbuffer, gbuffer + size_t(width) * height);
+    }
+
+    // ATrousPass in Denoise.hlsl: a 5x5 B3 spline kernel with step pixels between its taps.
+    void FilterATrous(uint32_t x, uint32_t y, int step, const GBufferTexel* gbuffer, const Float3* normals,
+                      const std::vector<Float3>& color, const std::vector<float>& variance,
+                      std::vector<Float3>& filteredColor, std::vector<float>& filteredVariance)
+    {
+        static const float kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+        size_t i = size_t(y) * width + x;
+        const GBufferTexel& surface = gbuffer[i];
+        if (!surface.Hit())
+        {
+            filteredColor[i] = Float3();
+            filteredVariance[i] = 0.0f;
+            return;
+        }
+
+        // The variance steering the luminance weight is blurred over 3x3 first
+        float blurredVariance = 0.0f;
+        for (int dy = -1; dy <= 1; dy++)
+        {
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                int qx = (int)ClampF(float((int)x + dx), 0.0f, float(width - 1));
+                int qy = (int)ClampF(float((int)y + dy), 0.0f, float(height - 1));
+                float w = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+                blurredVariance += variance[size_t(qy) * width + qx] * w;
+            }
+        }
+        float luminanceScale = DENOISE_PHI_LUMINANCE * sqrtf(MaxF(blurredVariance, 0.0f)) + 1e-10f;
+        float luminance = Luminance(color[i]);
+
+        Float3 sum;
+        float varianceSum = 0.0f, weightSum = 0.0f;
+        for (int dy = -2; dy <= 2; dy++)
+        {
+            for (int dx = -2; dx <= 2; dx++)
+            {
+                int qx = (int)x + dx * step, qy = (int)y + dy * step;
+                if (qx < 0 || qy < 0 || qx >= (int)width || qy >= (int)height)
+                    continue;
+                size_t j = size_t(qy) * width + qx;
+                float w = kernel[dx < 0 ? -dx : dx] * kernel[dy < 0 ? -dy : dy];
+                if (dx != 0 || dy != 0)
+                {
+                    w *= DenoiseGeometryWeight(surface, normals[i], gbuffer[j], normals[j], step * sqrtf(float(dx * dx + dy * dy)));
+                    w *= expf(-fabsf(luminance - Luminance(color[j])) / luminanceScale);
+                }
+                sum += color[j] * w;
+                varianceSum += variance[j] * w * w;
+                weightSum += w;
+            }
+        }
+        filteredColor[i] = sum / weightSum;
+        filteredVariance[i] = varianceSum / (weightSum * weightSum);
+    }
+};
+
+struct ImageError
+{
+    double rmse = 0.0;
+    double relMse = 0.0;        // Squared error over the squared reference plus 0.01, per pixel
+    uint32_t pixels = 0;
+};
+
+// Error of an image against a reference over the pixels the G-buffer has a surface in.
+inline ImageError CompareImages(const Float3* image, const Float3* reference, const GBufferTexel* gbuffer, size_t count)
+{
+    ImageError error;
+    double squared = 0.0, relative = 0.0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!gbuffer[i].Hit())
+            continue;
+        for (int c = 0; c < 3; c++)
+        {
+            double d = double(image[i][c]) - reference[i][c];
+            squared += d * d;
+            relative += d * d / (double(reference[i][c]) * reference[i][c] + 0.01);
+        }
+        error.pixels++;
+    }
+    if (error.pixels)
+    {
+        error.rmse = sqrt(squared / (3.0 * error.pixels));
+        error.relMse = relative / (3.0 * error.pixels);
+    }
+    return error;
+}
+
+struct DenoiserQuality
+{
+    ImageError noisy;           // Of the last frame straight from the light samples
+    ImageError denoised;        // Of the last frame through SvgfDenoiser
+    uint32_t frames = 0;
+};
+
+// Shades the direct lighting of a G-buffer readback on the CPU for frames frames of a still
+// camera, runs it through SvgfDenoiser and compares the last frame, before and after, with
+// the mean of referenceFrames more. Only a crop of up to cropSize pixels square around the
+// centre is shaded, which keeps the cost to a few million shadow rays.
+inline DenoiserQuality MeasureDenoiser(const SceneQuery& query, const float projectionToWorld[16], const Float3& eye, const LightBVH& lights,
+                                       uint32_t lightSamples, uint32_t width, uint32_t height, const GBufferTexel* gbuffer,
+                                       uint32_t frames = 8, uint32_t referenceFrames = 64, uint32_t cropSize = 256)
+{
+    uint32_t cropWidth = width < cropSize ? width : cropSize, cropHeight = height < cropSize ? height : cropSize;
+    uint32_t x0 = (width - cropWidth) / 2, y0 = (height - cropHeight) / 2;
+    size_t count = size_t(cropWidth) * cropHeight;
+
+    std::vector<GBufferTexel> crop(count);
+    std::vector<Float3> hitPoints(count);
+    std::vector<DenoiserMotion> motion(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t x = x0 + uint32_t(i % cropWidth), y = y0 + uint32_t(i / cropWidth);
+        crop[i] = gbuffer[size_t(y) * width + x];
+        hitPoints[i] = eye + CameraRayDirection(projectionToWorld, eye, x, y, width, height) * crop[i].hitT;
+        // Nothing moves, every pixel finds itself
+        motion[i].previousPixel = Float2(float(i % cropWidth), float(i / cropWidth));
+        motion[i].previousHitT = crop[i].hitT;
+    }
+
+    auto ShadeFrame = [&](uint32_t frameIndex, std::vector<Float3>& lighting)
+        {
+            query.ParallelFor(count, [&](size_t i) {
+                uint32_t x = x0 + uint32_t(i % cropWidth), y = y0 + uint32_t(i / cropWidth);
+                if (!crop[i].Hit())
+                    lighting[i] = Float3();
+                else if (crop[i].Unlit())
+                    lighting[i] = Float3(1.0f);
+                else
+                    lighting[i] = ResolveDirectLighting(query, hitPoints[i], crop[i].Normal(), lights, lightSamples, frameIndex, x, y);
+            });
+        };
+
+    DenoiserQuality quality;
+    SvgfDenoiser denoiser;
+    std::vector<Float3> noisy(count), denoised(count);
+    for (uint32_t frame = 0; frame < frames; frame++)
+    {
+        ShadeFrame(frame, noisy);
+        denoiser.Denoise(cropWidth, cropHeight, crop.data(), motion.data(), noisy.data(), denoised.data());
+    }
+    quality.frames = frames;
+
+    std::vector<Float3> reference(count), lighting(count);
+    for (uint32_t frame = 0; frame < referenceFrames; frame++)
+    {
+        ShadeFrame(frames + frame, lighting);
+        for (size_t i = 0; i < count; i++)
+            reference[i] += lighting[i] / float(referenceFrames);
+    }
+    quality.noisy = CompareImages(noisy.data(), reference.data(), crop.data(), count);
+    quality.denoised = CompareImages(denoised.data(), reference.data(), crop.data(), count);
+    return quality;
+}
+
+#endif // Denoiser_h
@@ -0,0 +1,330 @@
+/************************************************************************************
+Filename    :   FrameProfiler.h
+Content     :   Scoped CPU zones per frame, with a Chrome trace export and percentiles
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// PROFILE_ZONE("name") times the rest of its scope on the calling thread. Each thread
+// appends its finished zones to a buffer of its own, so a zone costs two clock reads and
+// an uncontended lock. PROFILE_FRAME_END() closes the frame: it drains every thread's
+// buffer into the frame history, adds each zone's total for the frame to a rolling window
+// of FRAME_PROFILER_HISTORY frames for SummarizeZones, and keeps the events of the last
+// FRAME_PROFILER_TRACE_FRAMES frames for WriteChromeTrace, which chrome://tracing and
+// Perfetto open as is. Names must be string literals, or outlive the profiler.
+//
+// Timing is std::chrono::steady_clock, which is QueryPerformanceCounter on Windows; the
+// time stamp counter would be cheaper to read but needs calibrating against it anyway.
+// FRAME_PROFILER defaults to 1 in debug builds and 0 with NDEBUG, where the macros compile
+// to nothing; define it to 1 to profile a release build.
+
+#ifndef FrameProfiler_h
+#define FrameProfiler_h
+
+#ifndef FRAME_PROFILER
+#ifdef NDEBUG
+#define FRAME_PROFILER 0
+#else
+#define FRAME_PROFILER 1
+#endif
+#endif
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#define FRAME_PROFILER_HISTORY 240          // Frames SummarizeZones takes percentiles over
+
+struct ZoneSummary
+{
+    std::string name;
+    uint32_t frames = 0;        // Of the window the zone ran in
+    double callsPerFrame = 0.0;
+    // Of the zone's total time per frame, over the frames it ran in
+    double p50Milliseconds = 0.0;
+    double p95Milliseconds = 0.0;
+    double p99Milliseconds = 0.0;
+    double maxMilliseconds = 0.0;
+};
+
+// Totals of a zone for the last frames it ran in, oldest overwritten first. GpuTimer.h keeps
+// its zones in these too.
+struct ZoneWindow
+{
+    float milliseconds[FRAME_PROFILER_HISTORY];
+    uint32_t calls[FRAME_PROFILER_HISTORY];
+    uint64_t lastFrame = 0;     // Frame numbers start at 1
+    uint32_t next = 0;
+    uint32_t count = 0;
+
+    // Another total in the same frame, as from a second name with the same text, adds up with the first.
+    void Add(uint64_t frame, double frameMilliseconds, uint32_t frameCalls)
+    {
+        if (count > 0 && lastFrame == frame)
+        {
+            uint32_t last = (next + FRAME_PROFILER_HISTORY - 1) % FRAME_PROFILER_HISTORY;
+            milliseconds[last] += float(frameMilliseconds);
+            calls[last] += frameCalls;
+            return;
+        }
+        milliseconds[next] = float(frameMilliseconds);
+        calls[next] = frameCalls;
+        next = (next + 1) % FRAME_PROFILER_HISTORY;
+        count = (std::min)(count + 1, uint32_t(FRAME_PROFILER_HISTORY));
+        lastFrame = frame;
+    }
+
+    // False once the zone has not run for a whole window before currentFrame.
+    bool Summarize(const std::string& name, uint64_t currentFrame, ZoneSummary& summary) const
+    {
+        if (count == 0 || currentFrame - lastFrame >= FRAME_PROFILER_HISTORY)
+            return false;
+        summary.name = name;
+        summary.frames = count;
+        std::vector<float> sorted(milliseconds, milliseconds + count);
+        std::sort(sorted.begin(), sorted.end());
+        auto Percentile = [&](double p) { return double(sorted[size_t(p * (sorted.size() - 1) + 0.5)]); };
+        summary.p50Milliseconds = Percentile(0.5);
+        summary.p95Milliseconds = Percentile(0.95);
+        summary.p99Milliseconds = Percentile(0.99);
+        summary.maxMilliseconds = sorted.back();
+        uint64_t totalCalls = 0;
+        for (uint32_t i = 0; i < count; i++)
+            totalCalls += calls[i];
+        summary.callsPerFrame = double(totalCalls) / count;
+        return true;
+    }
+};
+
+// Slowest median first.
+inline void SortZoneSummaries(std::vector<ZoneSummary>& summaries)
+{
+    std::sort(summaries.begin(), summaries.end(),
+        [](const ZoneSummary& a, const ZoneSummary& b) { return a.p50Milliseconds > b.p50Milliseconds; });
+}
+
+#if FRAME_PROFILER
+
+#include <cstdio>
+#include <chrono>
+#include <mutex>
+#include <deque>
+#include <map>
+#include <memory>
+
+#define FRAME_PROFILER_TRACE_FRAMES 300     // Frames WriteChromeTrace writes out
+
+struct ProfileEvent
+{
+    const char* name;
+    int64_t start;      // Nanoseconds since the profiler started
+    int64_t end;
+};
+
+// Zones of one thread since the last PROFILE_FRAME_END.
+struct ProfileThreadBuffer
+{
+    std::mutex mutex;
+    std::vector<ProfileEvent> events;
+    uint32_t id = 0;
+    bool retired = false;       // The thread has exited, dropped once drained
+};
+
+struct FrameProfiler
+{
+    struct TracedEvent
+    {
+        ProfileEvent event;
+        uint32_t threadId;
+    };
+
+    struct Frame
+    {
+        int64_t start;
+        int64_t end;
+        std::vector<TracedEvent> events;
+    };
+
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::mutex mutex;           // Guards threads; the frame history is only touched by PROFILE_FRAME_END and the readers
+    std::vector<std::unique_ptr<ProfileThreadBuffer>> threads;
+    uint32_t nextThreadId = 1;
+    std::deque<Frame> frames;
+    std::map<std::string, ZoneWindow> zones;
+    uint64_t frameCount = 0;
+    int64_t frameStart = 0;
+
+    static FrameProfiler& Get()
+    {
+        static FrameProfiler profiler;
+        return profiler;
+    }
+
+    int64_t Now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    ProfileThreadBuffer& ThreadBuffer()
+    {
+        // Retires the buffer when its thread exits, so short lived worker threads do not pile up
+        struct Handle
+        {
+            ProfileThreadBuffer* buffer = nullptr;
+            ~Handle()
+            {
+                if (buffer)
+                {
+                    std::lock_guard<std::mutex> lock(buffer->mutex);
+                    buffer->retired = true;
+                }
+            }
+        };
+        thread_local Handle handle;
+        if (!handle.buffer)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.push_back(std::unique_ptr<ProfileThreadBuffer>(new ProfileThreadBuffer()));
+            handle.buffer = threads.back().get();
+            handle.buffer->id = nextThreadId++;
+        }
+        return *handle.buffer;
+    }
+
+    void EndFrame()
+    {
+        Frame frame;
+        frame.start = frameStart;
+        frame.end = Now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = 0; i < threads.size();)
+            {
+                ProfileThreadBuffer& buffer = *threads[i];
+                bool retired;
+                {
+                    std::lock_guard<std::mutex> bufferLock(buffer.mutex);
+                    for (const ProfileEvent& event : buffer.events)
+                        frame.events.push_back(TracedEvent{ event, buffer.id });
+                    buffer.events.clear();
+                    retired = buffer.retired;
+                }
+                if (retired)
+                {
+                    threads[i] = std::move(threads.back());
+                    threads.pop_back();
+                }
+                else
+                    i++;
+            }
+        }
+        frameCount++;
+        frameStart = frame.end;
+
+        // Sum up every zone's calls this frame, then add them to its window
+        std::map<const char*, std::pair<double, uint32_t>> totals;
+        for (const TracedEvent& traced : frame.events)
+        {
+            std::pair<double, uint32_t>& total = totals[traced.event.name];
+            total.first += (traced.event.end - traced.event.start) * 1e-6;
+            total.second++;
+        }
+        for (const auto& total : totals)
+            zones[total.first].Add(frameCount, total.second.first, total.second.second);
+
+        frames.push_back(std::move(frame));
+        if (frames.size() > FRAME_PROFILER_TRACE_FRAMES)
+            frames.pop_front();
+    }
+
+    // Zones that ran in the last FRAME_PROFILER_HISTORY frames, slowest median first.
+    std::vector<ZoneSummary> SummarizeZones() const
+    {
+        std::vector<ZoneSummary> summaries;
+        ZoneSummary summary;
+        for (const auto& zone : zones)
+        {
+            if (zone.second.Summarize(zone.first, frameCount, summary))
+                summaries.push_back(summary);
+        }
+        SortZoneSummaries(summaries);
+        return summaries;
+    }
+
+    // Complete events in microseconds, with every frame as a zone of its own on a separate row.
+    bool WriteChromeTrace(const char* path) const
+    {
+        FILE* file = fopen(path, "w");
+        if (!file)
+            return false;
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Frames\"}}");
+        for (const Frame& frame : frames)
+        {
+            fprintf(file, ",\n{\"name\":\"Frame\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f}",
+                frame.start * 1e-3, (frame.end - frame.start) * 1e-3);
+            for (const TracedEvent& traced : frame.events)
+            {
+                fprintf(file, ",\n{\"name\":\"");
+                // Zone names are identifiers and short phrases, only quotes and backslashes need escaping
+                for (const char* c = traced.event.name; *c; c++)
+                {
+                    if (*c == '"' || *c == '\\')
+                        fputc('\\', file);
+                    fputc(*c, file);
+                }
+                fprintf(file, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    traced.threadId, traced.event.start * 1e-3, (traced.event.end - traced.event.start) * 1e-3);
+            }
+        }
+        fprintf(file, "\n]}\n");
+        return fclose(file) == 0;
+    }
+};
+
+struct ProfileZone
+{
+    ProfileThreadBuffer& buffer;
+    const char* name;
+    int64_t start;
+
+    explicit ProfileZone(const char* name)
+        : buffer(FrameProfiler::Get().ThreadBuffer()), name(name), start(FrameProfiler::Get().Now()) {}
+
+    ~ProfileZone()
+    {
+        int64_t end = FrameProfiler::Get().Now();
+        std::lock_guard<std::mutex> lock(buffer.mutex);
+        buffer.events.push_back(ProfileEvent{ name, start, end });
+    }
+
+    ProfileZone(const ProfileZone&) = delete;
+    ProfileZone& operator=(const ProfileZone&) = delete;
+};
+
+#define PROFILE_ZONE_NAME2(line) profileZone##line
+#define PROFILE_ZONE_NAME(line) PROFILE_ZONE_NAME2(line)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_ZONE_NAME(__LINE__)(name)
+#define PROFILE_FRAME_END() FrameProfiler::Get().EndFrame()
+
+#else
+
+#define PROFILE_ZONE(name)
+#define PROFILE_FRAME_END()
+
+#endif // FRAME_PROFILER
+
+#endif // FrameProfiler_h
@@ -0,0 +1,245 @@
+/************************************************************************************
+Filename    :   GpuTimer.h
+Content     :   GPU zones from timestamp queries, read back a few frames late
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// A zone is a pair of timestamps written into a command list around the work it times. Each
+// frame slot, one per swap chain buffer, owns a range of queries: the frame's zones take
+// them in order, and EndFrame records one resolve of the range into the backend's readback.
+// BeginFrame is called once the fence says the GPU is done with the slot's last frame, so
+// reading those timestamps never waits on the GPU; they are SwapChainNumFrames frames old.
+// Each zone's total per frame then goes into a ZoneWindow, as FrameProfiler.h does on the CPU.
+//
+// The backend is a template parameter and provides:
+//   CommandList                                       what the timestamps are written into
+//   uint64_t Frequency() const                        timestamp ticks per second
+//   void WriteTimestamp(CommandList*, uint32_t query)
+//   void Resolve(CommandList*, uint32_t firstQuery, uint32_t count)
+//   const uint64_t* Read(uint32_t firstQuery, uint32_t count) const    once the resolve has run
+// D3D12TimestampBackend in Win32_DirectX12AppUtil.h uses a timestamp query heap and a mapped
+// readback buffer; MockTimestampBackend below writes synthetic ticks, so everything but the
+// queries themselves runs off the GPU.
+
+#ifndef GpuTimer_h
+#define GpuTimer_h
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "FrameProfiler.h"
+
+#define GPU_TIMER_INVALID_ZONE 0xffffffffu
+#define GPU_TIMER_FRAME_ZONE "GPU frame"    // From the first timestamp of a frame to its last
+
+template <typename Backend>
+struct GpuTimer
+{
+    typedef typename Backend::CommandList CommandList;
+
+    struct FrameSlot
+    {
+        std::vector<const char*> names;     // Of the zones begun this frame, in query order
+        std::vector<uint8_t> ended;
+        bool resolved = false;              // EndFrame recorded the resolve, BeginFrame has not read it yet
+    };
+
+    Backend backend;
+    uint32_t zonesPerFrame = 0;
+    std::vector<FrameSlot> slots;
+    uint32_t currentSlot = 0;
+    uint64_t frameCount = 0;                // Frames read back so far
+    uint64_t droppedZones = 0;              // Begun with every query of their frame in use
+    uint64_t invalidZones = 0;              // Never ended, or ended before they began
+    std::map<std::string, ZoneWindow> zones;
+
+    // The backend needs QueryCount() queries, created after this.
+    void Init(uint32_t frameSlots, uint32_t maxZonesPerFrame)
+    {
+        zonesPerFrame = maxZonesPerFrame;
+        slots.assign(frameSlots, FrameSlot());
+        for (FrameSlot& slot : slots)
+        {
+            slot.names.reserve(zonesPerFrame);
+            slot.ended.reserve(zonesPerFrame);
+        }
+        currentSlot = 0;
+    }
+
+    uint32_t QueryCount() const { return uint32_t(slots.size()) * zonesPerFrame * 2; }
+
+    uint32_t FirstQuery(uint32_t slot) const { return slot * zonesPerFrame * 2; }
+
+    // Reads back the slot's last frame, which the GPU must have finished, and starts a new frame in it.
+    void BeginFrame(uint32_t slot)
+    {
+        Collect(slot);
+        currentSlot = slot;
+    }
+
+    // Returns the zone to pass to End, or GPU_TIMER_INVALID_ZONE once the frame's queries run out.
+    uint32_t Begin(CommandList* commandList, const char* name)
+    {
+        if (slots.empty())
+            return GPU_TIMER_INVALID_ZONE;
+        FrameSlot& slot = slots[currentSlot];
+        uint32_t zone = uint32_t(slot.names.size());
+        if (zone >= zonesPerFrame)
+        {
+            droppedZones++;
+            return GPU_TIMER_INVALID_ZONE;
+        }
+        slot.names.push_back(name);
+        slot.ended.push_back(0);
+        backend.WriteTimestamp(commandList, FirstQuery(currentSlot) + zone * 2);
+        return zone;
+    }
+
+    void End(CommandList* commandList, uint32_t zone)
+    {
+        if (zone == GPU_TIMER_INVALID_ZONE)
+            return;
+        FrameSlot& slot = slots[currentSlot];
+        slot.ended[zone] = 1;
+        backend.WriteTimestamp(commandList, FirstQuery(currentSlot) + zone * 2 + 1);
+    }
+
+    // Resolves the frame's queries. commandList has to execute after every list the frame's zones were written to.
+    void EndFrame(CommandList* commandList)
+    {
+        if (slots.empty())
+            return;
+        FrameSlot& slot = slots[currentSlot];
+        if (slot.names.empty())
+            return;
+        backend.Resolve(commandList, FirstQuery(currentSlot), uint32_t(slot.names.size()) * 2);
+        slot.resolved = true;
+    }
+
+    // For a frame that never reaches the GPU; its zones are forgotten.
+    void DiscardFrame()
+    {
+        if (slots.empty())
+            return;
+        FrameSlot& slot = slots[currentSlot];
+        slot.names.clear();
+        slot.ended.clear();
+        slot.resolved = false;
+    }
+
+    void Collect(uint32_t slotIndex)
+    {
+        FrameSlot& slot = slots[slotIndex];
+        if (slot.resolved)
+        {
+            uint32_t queryCount = uint32_t(slot.names.size()) * 2;
+            const uint64_t* timestamps = backend.Read(FirstQuery(slotIndex), queryCount);
+            double millisecondsPerTick = 1000.0 / double(backend.Frequency());
+            frameCount++;
+
+            // Zones of the same name add up, as a scene's two eyes would under one name
+            std::map<const char*, std::pair<double, uint32_t>> totals;
+            uint64_t first = UINT64_MAX, last = 0;
+            for (uint32_t zone = 0; zone < slot.names.size(); zone++)
+            {
+                uint64_t begin = timestamps[zone * 2], end = timestamps[zone * 2 + 1];
+                if (!slot.ended[zone] || end < begin)
+                {
+                    invalidZones++;
+                    continue;
+                }
+                std::pair<double, uint32_t>& total = totals[slot.names[zone]];
+                total.first += (end - begin) * millisecondsPerTick;
+                total.second++;
+                first = (std::min)(first, begin);
+                last = (std::max)(last, end);
+            }
+            for (const auto& total : totals)
+                zones[total.first].Add(frameCount, total.second.first, total.second.second);
+            if (last >= first)
+                zones[GPU_TIMER_FRAME_ZONE].Add(frameCount, (last - first) * millisecondsPerTick, 1);
+        }
+        slot.names.clear();
+        slot.ended.clear();
+        slot.resolved = false;
+    }
+
+    // Zones read back in the last FRAME_PROFILER_HISTORY frames, slowest median first.
+    std::vector<ZoneSummary> SummarizeZones() const
+    {
+        std::vector<ZoneSummary> summaries;
+        ZoneSummary summary;
+        for (const auto& zone : zones)
+        {
+            if (zone.second.Summarize(zone.first, frameCount, summary))
+                summaries.push_back(summary);
+        }
+        SortZoneSummaries(summaries);
+        return summaries;
+    }
+
+    // Times the rest of the scope on commandList.
+    struct Scope
+    {
+        GpuTimer& timer;
+        CommandList* commandList;
+        uint32_t zone;
+
+        Scope(GpuTimer& timer, CommandList* commandList, const char* name)
+            : timer(timer), commandList(commandList), zone(timer.Begin(commandList, name)) {}
+        ~Scope() { timer.End(commandList, zone); }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+};
+
+// Stands in for the GPU. A command list is a clock that the caller advances by the ticks the
+// work it stands for would take; a timestamp is the clock when it is written, and a resolve
+// copies the timestamps into the readback right away, rather than when the list would run.
+struct MockTimestampBackend
+{
+    struct CommandList
+    {
+        uint64_t ticks = 0;
+        void Advance(uint64_t elapsed) { ticks += elapsed; }
+    };
+
+    uint64_t frequency = 1000000000;
+    std::vector<uint64_t> queries;
+    std::vector<uint64_t> readback;
+
+    void Create(uint32_t queryCount)
+    {
+        queries.assign(queryCount, 0);
+        readback.assign(queryCount, 0);
+    }
+
+    uint64_t Frequency() const { return frequency; }
+
+    void WriteTimestamp(CommandList* commandList, uint32_t query) { queries[query] = commandList->ticks; }
+
+    void Resolve(CommandList*, uint32_t firstQuery, uint32_t count)
+    {
+        memcpy(readback.data() + firstQuery, queries.data() + firstQuery, count * sizeof(uint64_t));
+    }
+
+    const uint64_t* Read(uint32_t firstQuery, uint32_t) const { return readback.data() + firstQuery; }
+};
+
+#endif // GpuTimer_h
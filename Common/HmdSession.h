@@ -0,0 +1,663 @@
+/************************************************************************************
+Filename    :   HmdSession.h
+Content     :   The LibOVR calls of the samples behind one interface, with a headless stand-in
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// HmdSession has a method for every ovr_ function MainLoop uses, taking the same arguments
+// less the ovrSession, so the samples call Hmd->EndFrame(...) where they called
+// ovr_EndFrame(session, ...). OvrHmdSession forwards to LibOVR. SimulatedHmdSession answers
+// from an HmdSimulator instead, and makes the texture swap chains and the mirror texture out
+// of plain D3D12 resources, so the samples run with no headset, Link or Oculus runtime.
+//
+// CreateHmdSession picks one from the command line: -simulate runs the default script of
+// HmdSimulator.h, -simulate=path runs the script in that file. -record=path wraps either in a
+// TraceHmdSession that writes a pose trace; -replay=path wraps it in one that feeds that
+// trace back to MainLoop in place of the poses, controllers and keys, and quits at its end.
+
+#ifndef HmdSession_h
+#define HmdSession_h
+
+#include <fstream>
+#include <sstream>
+#include "OVR_CAPI_D3D.h"
+#include "Win32_DirectX12AppUtil.h"
+#include "HmdSimulator.h"
+#include "PoseTrace.h"
+
+struct HmdSession
+{
+    virtual ~HmdSession() {}
+
+    virtual bool Initialize() = 0;
+    virtual void Shutdown() = 0;
+    virtual ovrResult Create(ovrGraphicsLuid* luid) = 0;
+    virtual void Destroy() = 0;
+
+    virtual ovrHmdDesc GetHmdDesc() = 0;
+    virtual ovrResult SetTrackingOriginType(ovrTrackingOrigin origin) = 0;
+    virtual ovrResult RecenterTrackingOrigin() = 0;
+    virtual ovrResult GetSessionStatus(ovrSessionStatus* sessionStatus) = 0;
+    virtual ovrSizei GetFovTextureSize(ovrEyeType eye, ovrFovPort fov, float pixelsPerDisplayPixel) = 0;
+    virtual ovrEyeRenderDesc GetRenderDesc(ovrEyeType eye, ovrFovPort fov) = 0;
+    virtual double GetTimeInSeconds() = 0;
+
+    virtual ovrResult WaitToBeginFrame(long long frameIndex) = 0;
+    virtual ovrResult BeginFrame(long long frameIndex) = 0;
+    virtual ovrResult EndFrame(long long frameIndex, const ovrViewScaleDesc* viewScaleDesc, ovrLayerHeader const* const* layerPtrList, unsigned int layerCount) = 0;
+
+    virtual void GetEyePoses(long long frameIndex, ovrBool latencyMarker, const ovrPosef hmdToEyePose[2], ovrPosef outEyePoses[2], double* outSensorSampleTime) = 0;
+    virtual ovrTrackingState GetTrackingState(double absTime, ovrBool latencyMarker) = 0;
+    virtual ovrResult GetInputState(ovrControllerType controllerType, ovrInputState* inputState) = 0;
+
+    virtual ovrResult CreateTextureSwapChainDX(IUnknown* d3dPtr, const ovrTextureSwapChainDesc* desc, ovrTextureSwapChain* outTextureSwapChain) = 0;
+    virtual ovrResult GetTextureSwapChainLength(ovrTextureSwapChain chain, int* outLength) = 0;
+    virtual ovrResult GetTextureSwapChainBufferDX(ovrTextureSwapChain chain, int index, IID iid, void** outBuffer) = 0;
+    virtual ovrResult GetTextureSwapChainCurrentIndex(ovrTextureSwapChain chain, int* outIndex) = 0;
+    virtual ovrResult CommitTextureSwapChain(ovrTextureSwapChain chain) = 0;
+    virtual void DestroyTextureSwapChain(ovrTextureSwapChain chain) = 0;
+
+    virtual ovrResult CreateMirrorTextureWithOptionsDX(IUnknown* d3dPtr, const ovrMirrorTextureDesc* desc, ovrMirrorTexture* outMirrorTexture) = 0;
+    virtual ovrResult GetMirrorTextureBufferDX(ovrMirrorTexture mirrorTexture, IID iid, void** outBuffer) = 0;
+    virtual void DestroyMirrorTexture(ovrMirrorTexture mirrorTexture) = 0;
+};
+
+//---------------------------------------------------------------------
+struct OvrHmdSession : HmdSession
+{
+    ovrSession session = nullptr;
+
+    bool Initialize() override
+    {
+        ovrInitParams initParams = { ovrInit_RequestVersion | ovrInit_FocusAware, OVR_MINOR_VERSION, NULL, 0, 0 };
+        return OVR_SUCCESS(ovr_Initialize(&initParams));
+    }
+    void Shutdown() override { ovr_Shutdown(); }
+    ovrResult Create(ovrGraphicsLuid* luid) override { return ovr_Create(&session, luid); }
+    void Destroy() override { ovr_Destroy(session); session = nullptr; }
+
+    ovrHmdDesc GetHmdDesc() override { return ovr_GetHmdDesc(session); }
+    ovrResult SetTrackingOriginType(ovrTrackingOrigin origin) override { return ovr_SetTrackingOriginType(session, origin); }
+    ovrResult RecenterTrackingOrigin() override { return ovr_RecenterTrackingOrigin(session); }
+    ovrResult GetSessionStatus(ovrSessionStatus* sessionStatus) override { return ovr_GetSessionStatus(session, sessionStatus); }
+    ovrSizei GetFovTextureSize(ovrEyeType eye, ovrFovPort fov, float pixelsPerDisplayPixel) override { return ovr_GetFovTextureSize(session, eye, fov, pixelsPerDisplayPixel); }
+    ovrEyeRenderDesc GetRenderDesc(ovrEyeType eye, ovrFovPort fov) override { return ovr_GetRenderDesc(session, eye, fov); }
+    double GetTimeInSeconds() override { return ovr_GetTimeInSeconds(); }
+
+    ovrResult WaitToBeginFrame(long long frameIndex) override { return ovr_WaitToBeginFrame(session, frameIndex); }
+    ovrResult BeginFrame(long long frameIndex) override { return ovr_BeginFrame(session, frameIndex); }
+    ovrResult EndFrame(long long frameIndex, const ovrViewScaleDesc* viewScaleDesc, ovrLayerHeader const* const* layerPtrList, unsigned int layerCount) override
+    {
+        return ovr_EndFrame(session, frameIndex, viewScaleDesc, layerPtrList, layerCount);
+    }
+
+    void GetEyePoses(long long frameIndex, ovrBool latencyMarker, const ovrPosef hmdToEyePose[2], ovrPosef outEyePoses[2], double* outSensorSampleTime) override
+    {
+        ovr_GetEyePoses(session, frameIndex, latencyMarker, hmdToEyePose, outEyePoses, outSensorSampleTime);
+    }
+    ovrTrackingState GetTrackingState(double absTime, ovrBool latencyMarker) override { return ovr_GetTrackingState(session, absTime, latencyMarker); }
+    ovrResult GetInputState(ovrControllerType controllerType, ovrInputState* inputState) override { return ovr_GetInputState(session, controllerType, inputState); }
+
+    ovrResult CreateTextureSwapChainDX(IUnknown* d3dPtr, const ovrTextureSwapChainDesc* desc, ovrTextureSwapChain* outTextureSwapChain) override
+    {
+        return ovr_CreateTextureSwapChainDX(session, d3dPtr, desc, outTextureSwapChain);
+    }
+    ovrResult GetTextureSwapChainLength(ovrTextureSwapChain chain, int* outLength) override { return ovr_GetTextureSwapChainLength(session, chain, outLength); }
+    ovrResult GetTextureSwapChainBufferDX(ovrTextureSwapChain chain, int index, IID iid, void** outBuffer) override
+    {
+        return ovr_GetTextureSwapChainBufferDX(session, chain, index, iid, outBuffer);
+    }
+    ovrResult GetTextureSwapChainCurrentIndex(ovrTextureSwapChain chain, int* outIndex) override { return ovr_GetTextureSwapChainCurrentIndex(session, chain, outIndex); }
+    ovrResult CommitTextureSwapChain(ovrTextureSwapChain chain) override { return ovr_CommitTextureSwapChain(session, chain); }
+    void DestroyTextureSwapChain(ovrTextureSwapChain chain) override { ovr_DestroyTextureSwapChain(session, chain); }
+
+    ovrResult CreateMirrorTextureWithOptionsDX(IUnknown* d3dPtr, const ovrMirrorTextureDesc* desc, ovrMirrorTexture* outMirrorTexture) override
+    {
+        return ovr_CreateMirrorTextureWithOptionsDX(session, d3dPtr, desc, outMirrorTexture);
+    }
+    ovrResult GetMirrorTextureBufferDX(ovrMirrorTexture mirrorTexture, IID iid, void** outBuffer) override
+    {
+        return ovr_GetMirrorTextureBufferDX(session, mirrorTexture, iid, outBuffer);
+    }
+    void DestroyMirrorTexture(ovrMirrorTexture mirrorTexture) override { ovr_DestroyMirrorTexture(session, mirrorTexture); }
+};
+
+//---------------------------------------------------------------------
+struct SimulatedHmdSession : HmdSession
+{
+    // The handles LibOVR gives out are opaque pointers, these stand behind them here.
+    struct TextureChain
+    {
+        std::vector<ComPtr<ID3D12Resource>> buffers;
+        int currentIndex = 0;
+    };
+
+    static const int TextureChainLength = 3;
+
+    HmdSimulator simulator;
+
+    static ovrFovPort FovPort(const FovTangents& fov) { return ovrFovPort{ fov.upTan, fov.downTan, fov.leftTan, fov.rightTan }; }
+    static FovTangents Tangents(const ovrFovPort& fov) { return FovTangents{ fov.UpTan, fov.DownTan, fov.LeftTan, fov.RightTan }; }
+
+    static ovrPosef OvrPose(const HmdSimPose& pose)
+    {
+        ovrPosef ovrPose;
+        ovrPose.Orientation = ovrQuatf{ pose.orientation.x, pose.orientation.y, pose.orientation.z, pose.orientation.w };
+        ovrPose.Position = ovrVector3f{ pose.position.x, pose.position.y, pose.position.z };
+        return ovrPose;
+    }
+
+    static HmdSimPose SimPose(const ovrPosef& pose)
+    {
+        HmdSimPose simPose;
+        simPose.orientation = Quat(pose.Orientation.x, pose.Orientation.y, pose.Orientation.z, pose.Orientation.w);
+        simPose.position = Float3(pose.Position.x, pose.Position.y, pose.Position.z);
+        return simPose;
+    }
+
+    static ovrPoseStatef OvrPoseState(const HmdSimPose& pose, double time)
+    {
+        ovrPoseStatef state = {};
+        state.ThePose = OvrPose(pose);
+        state.TimeInSeconds = time;
+        return state;
+    }
+
+    bool Initialize() override { return true; }
+    void Shutdown() override {}
+
+    ovrResult Create(ovrGraphicsLuid* luid) override
+    {
+        // InitDevice picks its own adapter, so any LUID will do
+        memset(luid, 0, sizeof(*luid));
+        simulator.Start();
+        return ovrSuccess;
+    }
+
+    void Destroy() override
+    {
+        if (simulator.frames > 0)
+        {
+            Util.Output("Simulated HMD: %llu frames, %llu late, %.2f ms mean and %.2f ms max from BeginFrame to EndFrame\n",
+                simulator.frames, simulator.lateFrames, simulator.totalFrameMilliseconds / simulator.frames, simulator.maxFrameMilliseconds);
+        }
+    }
+
+    ovrHmdDesc GetHmdDesc() override
+    {
+        ovrHmdDesc desc = {};
+        desc.Type = ovrHmd_CV1;
+        strcpy_s(desc.ProductName, "Simulated HMD");
+        strcpy_s(desc.Manufacturer, "OculusTinyRoomDXR");
+        desc.AvailableTrackingCaps = desc.DefaultTrackingCaps = ovrTrackingCap_Orientation | ovrTrackingCap_Position;
+        for (int eye = 0; eye < ovrEye_Count; eye++)
+            desc.DefaultEyeFov[eye] = desc.MaxEyeFov[eye] = FovPort(simulator.config.fov[eye]);
+        desc.Resolution = ovrSizei{ int(simulator.config.resolutionWidth), int(simulator.config.resolutionHeight) };
+        desc.DisplayRefreshRate = simulator.config.refreshRate;
+        return desc;
+    }
+
+    ovrResult SetTrackingOriginType(ovrTrackingOrigin) override { return ovrSuccess; }
+    ovrResult RecenterTrackingOrigin() override { return ovrSuccess; }
+
+    ovrResult GetSessionStatus(ovrSessionStatus* sessionStatus) override
+    {
+        memset(sessionStatus, 0, sizeof(*sessionStatus));
+        sessionStatus->IsVisible = ovrTrue;
+        sessionStatus->HmdPresent = ovrTrue;
+        sessionStatus->HmdMounted = ovrTrue;
+        sessionStatus->HasInputFocus = ovrTrue;
+        sessionStatus->ShouldQuit = simulator.Finished() ? ovrTrue : ovrFalse;
+        return ovrSuccess;
+    }
+
+    ovrSizei GetFovTextureSize(ovrEyeType eye, ovrFovPort fov, float pixelsPerDisplayPixel) override
+    {
+        uint32_t width, height;
+        simulator.FovTextureSize(eye, Tangents(fov), pixelsPerDisplayPixel, width, height);
+        return ovrSizei{ int(width), int(height) };
+    }
+
+    ovrEyeRenderDesc GetRenderDesc(ovrEyeType eye, ovrFovPort fov) override
+    {
+        ovrEyeRenderDesc desc = {};
+        desc.Eye = eye;
+        desc.Fov = fov;
+        ovrSizei size = GetFovTextureSize(eye, fov, 1.0f);
+        desc.DistortedViewport = ovrRecti{ { eye == ovrEye_Left ? 0 : size.w, 0 }, size };
+        desc.PixelsPerTanAngleAtCenter = ovrVector2f{ size.w / (fov.LeftTan + fov.RightTan), size.h / (fov.UpTan + fov.DownTan) };
+        desc.HmdToEyePose = OvrPose(simulator.HmdToEyePose(eye));
+        return desc;
+    }
+
+    double GetTimeInSeconds() override { return simulator.Now(); }
+
+    ovrResult WaitToBeginFrame(long long frameIndex) override { simulator.WaitToBeginFrame(frameIndex); return ovrSuccess; }
+    ovrResult BeginFrame(long long frameIndex) override { simulator.BeginFrame(frameIndex); return ovrSuccess; }
+
+    ovrResult EndFrame(long long frameIndex, const ovrViewScaleDesc*, ovrLayerHeader const* const* layerPtrList, unsigned int layerCount) override
+    {
+        if (layerCount > 0 && !layerPtrList)
+            return ovrError_InvalidParameter;
+        simulator.EndFrame(frameIndex);
+        return ovrSuccess;
+    }
+
+    void GetEyePoses(long long frameIndex, ovrBool, const ovrPosef hmdToEyePose[2], ovrPosef outEyePoses[2], double* outSensorSampleTime) override
+    {
+        // Exactly where the script puts the head when the frame is shown, no prediction error
+        HmdSimState state = simulator.StateAt(simulator.DisplayTime(frameIndex));
+        for (int eye = 0; eye < ovrEye_Count; eye++)
+            outEyePoses[eye] = OvrPose(HmdSimulator::EyePose(state.head, SimPose(hmdToEyePose[eye])));
+        if (outSensorSampleTime)
+            *outSensorSampleTime = simulator.Now();
+    }
+
+    ovrTrackingState GetTrackingState(double absTime, ovrBool) override
+    {
+        HmdSimState state = simulator.StateAt(absTime);
+        ovrTrackingState trackingState = {};
+        trackingState.HeadPose = OvrPoseState(state.head, absTime);
+        trackingState.StatusFlags = ovrStatus_OrientationTracked | ovrStatus_PositionTracked;
+        for (int hand = 0; hand < ovrHand_Count; hand++)
+        {
+            trackingState.HandPoses[hand] = OvrPoseState(state.hands[hand], absTime);
+            trackingState.HandStatusFlags[hand] = ovrStatus_OrientationTracked | ovrStatus_PositionTracked;
+        }
+        trackingState.CalibratedOrigin.Orientation.w = 1.0f;
+        return trackingState;
+    }
+
+    ovrResult GetInputState(ovrControllerType controllerType, ovrInputState* inputState) override
+    {
+        static const struct { uint32_t simButton; unsigned int ovrButton; } c_buttons[] =
+        {
+            { HmdSimButton_A, ovrButton_A }, { HmdSimButton_B, ovrButton_B }, { HmdSimButton_X, ovrButton_X }, { HmdSimButton_Y, ovrButton_Y },
+            { HmdSimButton_LThumb, ovrButton_LThumb }, { HmdSimButton_RThumb, ovrButton_RThumb }, { HmdSimButton_Enter, ovrButton_Enter },
+        };
+        double time = simulator.Now();
+        HmdSimInput input = simulator.StateAt(time).input;
+        memset(inputState, 0, sizeof(*inputState));
+        inputState->TimeInSeconds = time;
+        inputState->ControllerType = controllerType;
+        for (const auto& button : c_buttons)
+            inputState->Buttons |= (input.buttons & button.simButton) ? button.ovrButton : 0;
+        for (int hand = 0; hand < ovrHand_Count; hand++)
+        {
+            inputState->IndexTrigger[hand] = inputState->IndexTriggerNoDeadzone[hand] = inputState->IndexTriggerRaw[hand] = input.indexTrigger[hand];
+            ovrVector2f stick = { input.thumbstick[hand][0], input.thumbstick[hand][1] };
+            inputState->Thumbstick[hand] = inputState->ThumbstickNoDeadzone[hand] = inputState->ThumbstickRaw[hand] = stick;
+        }
+        return ovrSuccess;
+    }
+
+    // The formats LibOVR creates for the typeless flag, so the samples' views of them still work.
+    static DXGI_FORMAT TextureFormat(ovrTextureFormat format, bool typeless)
+    {
+        switch (format)
+        {
+        case OVR_FORMAT_R8G8B8A8_UNORM:         return typeless ? DXGI_FORMAT_R8G8B8A8_TYPELESS : DXGI_FORMAT_R8G8B8A8_UNORM;
+        case OVR_FORMAT_R8G8B8A8_UNORM_SRGB:    return typeless ? DXGI_FORMAT_R8G8B8A8_TYPELESS : DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+        case OVR_FORMAT_D16_UNORM:              return typeless ? DXGI_FORMAT_R16_TYPELESS : DXGI_FORMAT_D16_UNORM;
+        case OVR_FORMAT_D24_UNORM_S8_UINT:      return typeless ? DXGI_FORMAT_R24G8_TYPELESS : DXGI_FORMAT_D24_UNORM_S8_UINT;
+        case OVR_FORMAT_D32_FLOAT:              return typeless ? DXGI_FORMAT_R32_TYPELESS : DXGI_FORMAT_D32_FLOAT;
+        case OVR_FORMAT_D32_FLOAT_S8X24_UINT:   return typeless ? DXGI_FORMAT_R32G8X24_TYPELESS : DXGI_FORMAT_D32_FLOAT_S8X24_UINT;
+        default:                                return DXGI_FORMAT_UNKNOWN;
+        }
+    }
+
+    // Swap chain buffers start out the way the runtime hands them over, ready to be read by the compositor.
+    ovrResult CreateTextureSwapChainDX(IUnknown*, const ovrTextureSwapChainDesc* desc, ovrTextureSwapChain* outTextureSwapChain) override
+    {
+        DXGI_FORMAT format = TextureFormat(desc->Format, (desc->MiscFlags & ovrTextureMisc_DX_Typeless) != 0);
+        if (format == DXGI_FORMAT_UNKNOWN)
+            return ovrError_InvalidParameter;
+        D3D12_RESOURCE_FLAGS flags = D3D12_RESOURCE_FLAG_NONE;
+        if (desc->BindFlags & ovrTextureBind_DX_RenderTarget)
+            flags |= D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET;
+        if (desc->BindFlags & ovrTextureBind_DX_UnorderedAccess)
+            flags |= D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+        if (desc->BindFlags & ovrTextureBind_DX_DepthStencil)
+            flags |= D3D12_RESOURCE_FLAG_ALLOW_DEPTH_STENCIL;
+        const D3D12_HEAP_PROPERTIES heapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
+        const D3D12_RESOURCE_DESC textureDesc = CD3DX12_RESOURCE_DESC::Tex2D(format, desc->Width, desc->Height, UINT16(desc->ArraySize),
+            UINT16(desc->MipLevels), desc->SampleCount, 0, flags);
+
+        TextureChain* chain = new TextureChain();
+        chain->buffers.resize(desc->StaticImage ? 1 : TextureChainLength);
+        for (ComPtr<ID3D12Resource>& buffer : chain->buffers)
+        {
+            if (FAILED(DIRECTX.Device->CreateCommittedResource(&heapProperties, D3D12_HEAP_FLAG_NONE, &textureDesc,
+                D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE, nullptr, IID_PPV_ARGS(&buffer))))
+            {
+                delete chain;
+                return ovrError_MemoryAllocationFailure;
+            }
+        }
+        *outTextureSwapChain = reinterpret_cast<ovrTextureSwapChain>(chain);
+        return ovrSuccess;
+    }
+
+    ovrResult GetTextureSwapChainLength(ovrTextureSwapChain chain, int* outLength) override
+    {
+        *outLength = int(reinterpret_cast<TextureChain*>(chain)->buffers.size());
+        return ovrSuccess;
+    }
+
+    ovrResult GetTextureSwapChainBufferDX(ovrTextureSwapChain chain, int index, IID iid, void** outBuffer) override
+    {
+        TextureChain* textureChain = reinterpret_cast<TextureChain*>(chain);
+        if (index < 0 || index >= int(textureChain->buffers.size()))
+            return ovrError_InvalidParameter;
+        return SUCCEEDED(textureChain->buffers[index]->QueryInterface(iid, outBuffer)) ? ovrSuccess : ovrError_InvalidParameter;
+    }
+
+    ovrResult GetTextureSwapChainCurrentIndex(ovrTextureSwapChain chain, int* outIndex) override
+    {
+        *outIndex = reinterpret_cast<TextureChain*>(chain)->currentIndex;
+        return ovrSuccess;
+    }
+
+    ovrResult CommitTextureSwapChain(ovrTextureSwapChain chain) override
+    {
+        TextureChain* textureChain = reinterpret_cast<TextureChain*>(chain);
+        textureChain->currentIndex = (textureChain->currentIndex + 1) % int(textureChain->buffers.size());
+        return ovrSuccess;
+    }
+
+    void DestroyTextureSwapChain(ovrTextureSwapChain chain) override { delete reinterpret_cast<TextureChain*>(chain); }
+
+    // Nothing composites into it; it keeps whatever the sample copies in.
+    ovrResult CreateMirrorTextureWithOptionsDX(IUnknown*, const ovrMirrorTextureDesc* desc, ovrMirrorTexture* outMirrorTexture) override
+    {
+        DXGI_FORMAT format = TextureFormat(desc->Format, (desc->MiscFlags & ovrTextureMisc_DX_Typeless) != 0);
+        if (format == DXGI_FORMAT_UNKNOWN)
+            return ovrError_InvalidParameter;
+        const D3D12_HEAP_PROPERTIES heapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
+        const D3D12_RESOURCE_DESC textureDesc = CD3DX12_RESOURCE_DESC::Tex2D(format, desc->Width, desc->Height, 1, 1, 1, 0,
+            D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET);
+        TextureChain* mirror = new TextureChain();
+        mirror->buffers.resize(1);
+        if (FAILED(DIRECTX.Device->CreateCommittedResource(&heapProperties, D3D12_HEAP_FLAG_NONE, &textureDesc,
+            D3D12_RESOURCE_STATE_RENDER_TARGET, nullptr, IID_PPV_ARGS(&mirror->buffers[0]))))
+        {
+            delete mirror;
+            return ovrError_MemoryAllocationFailure;
+        }
+        *outMirrorTexture = reinterpret_cast<ovrMirrorTexture>(mirror);
+        return ovrSuccess;
+    }
+
+    ovrResult GetMirrorTextureBufferDX(ovrMirrorTexture mirrorTexture, IID iid, void** outBuffer) override
+    {
+        TextureChain* mirror = reinterpret_cast<TextureChain*>(mirrorTexture);
+        return SUCCEEDED(mirror->buffers[0]->QueryInterface(iid, outBuffer)) ? ovrSuccess : ovrError_InvalidParameter;
+    }
+
+    void DestroyMirrorTexture(ovrMirrorTexture mirrorTexture) override { delete reinterpret_cast<TextureChain*>(mirrorTexture); }
+};
+
+//---------------------------------------------------------------------
+// Forwards to another session. Recording, it writes what that session reports in each frame,
+// with the keys held, to a pose trace. Replaying, it reports the trace's frames in its place
+// and sets DIRECTX.Key from them, so MainLoop runs through the recorded frames whatever the
+// session underneath reports; the session still paces the frames and owns the textures.
+struct TraceHmdSession : HmdSession
+{
+    HmdSession* session;
+    bool replaying;
+    PoseTraceWriter writer;
+    std::vector<PoseTraceFrame> replayFrames;
+    size_t replayFrame = 0;
+    bool replayReported = false;
+    bool hasInputFocus = true;      // From the last session status, for the frame being recorded
+    PoseTraceFrame frame = {};      // Being recorded or replayed
+
+    TraceHmdSession(HmdSession* session, bool replaying) : session(session), replaying(replaying) {}
+    ~TraceHmdSession() { delete session; }
+
+    static PoseTracePose TracePose(const ovrPosef& pose)
+    {
+        PoseTracePose tracePose = { { pose.Orientation.x, pose.Orientation.y, pose.Orientation.z, pose.Orientation.w },
+                                    { pose.Position.x, pose.Position.y, pose.Position.z } };
+        return tracePose;
+    }
+
+    static ovrPosef OvrPose(const PoseTracePose& pose)
+    {
+        ovrPosef ovrPose;
+        ovrPose.Orientation = ovrQuatf{ pose.orientation[0], pose.orientation[1], pose.orientation[2], pose.orientation[3] };
+        ovrPose.Position = ovrVector3f{ pose.position[0], pose.position[1], pose.position[2] };
+        return ovrPose;
+    }
+
+    bool Initialize() override { return session->Initialize(); }
+    void Shutdown() override { session->Shutdown(); }
+    ovrResult Create(ovrGraphicsLuid* luid) override { return session->Create(luid); }
+
+    void Destroy() override
+    {
+        if (!replaying)
+            Util.Output("Pose trace: %llu frames recorded\n", writer.frames);
+        session->Destroy();
+    }
+
+    ovrHmdDesc GetHmdDesc() override { return session->GetHmdDesc(); }
+    ovrResult SetTrackingOriginType(ovrTrackingOrigin origin) override { return session->SetTrackingOriginType(origin); }
+    ovrResult RecenterTrackingOrigin() override { return session->RecenterTrackingOrigin(); }
+
+    ovrResult GetSessionStatus(ovrSessionStatus* sessionStatus) override
+    {
+        ovrResult result = session->GetSessionStatus(sessionStatus);
+        if (!replaying)
+        {
+            hasInputFocus = sessionStatus->HasInputFocus != ovrFalse;
+            return result;
+        }
+
+        // The recorded poses are relative to the origin they were recorded against
+        sessionStatus->ShouldRecenter = ovrFalse;
+        if (replayFrame < replayFrames.size())
+        {
+            sessionStatus->HasInputFocus = (replayFrames[replayFrame].flags & PoseTraceFlag_HasInputFocus) ? ovrTrue : ovrFalse;
+        }
+        else
+        {
+            if (!replayReported)
+            {
+                Util.Output("Pose trace: %llu frames replayed\n", (unsigned long long)replayFrames.size());
+                ReportFrameProfile("replay_trace.json");
+                replayReported = true;
+            }
+            sessionStatus->ShouldQuit = ovrTrue;
+        }
+        return result;
+    }
+
+    ovrSizei GetFovTextureSize(ovrEyeType eye, ovrFovPort fov, float pixelsPerDisplayPixel) override { return session->GetFovTextureSize(eye, fov, pixelsPerDisplayPixel); }
+    ovrEyeRenderDesc GetRenderDesc(ovrEyeType eye, ovrFovPort fov) override { return session->GetRenderDesc(eye, fov); }
+    double GetTimeInSeconds() override { return session->GetTimeInSeconds(); }
+
+    ovrResult WaitToBeginFrame(long long frameIndex) override { return session->WaitToBeginFrame(frameIndex); }
+
+    // MainLoop reads the keys after BeginFrame, so this is where they are taken or put back.
+    ovrResult BeginFrame(long long frameIndex) override
+    {
+        if (!replaying)
+        {
+            memset(&frame, 0, sizeof(frame));
+            frame.flags = hasInputFocus ? PoseTraceFlag_HasInputFocus : 0;
+            for (int key = 0; key < 256; key++)
+                frame.SetKey(key, DIRECTX.Key[key]);
+        }
+        else if (replayFrame < replayFrames.size())
+        {
+            frame = replayFrames[replayFrame];
+            for (int key = 0; key < 256; key++)
+                DIRECTX.Key[key] = frame.Key(key);
+        }
+        return session->BeginFrame(frameIndex);
+    }
+
+    ovrResult EndFrame(long long frameIndex, const ovrViewScaleDesc* viewScaleDesc, ovrLayerHeader const* const* layerPtrList, unsigned int layerCount) override
+    {
+        if (!replaying)
+            writer.Write(frame);
+        else
+            replayFrame++;
+        return session->EndFrame(frameIndex, viewScaleDesc, layerPtrList, layerCount);
+    }
+
+    void GetEyePoses(long long frameIndex, ovrBool latencyMarker, const ovrPosef hmdToEyePose[2], ovrPosef outEyePoses[2], double* outSensorSampleTime) override
+    {
+        session->GetEyePoses(frameIndex, latencyMarker, hmdToEyePose, outEyePoses, outSensorSampleTime);
+        for (int eye = 0; eye < ovrEye_Count; eye++)
+        {
+            if (replaying)
+                outEyePoses[eye] = OvrPose(frame.eyes[eye]);
+            else
+                frame.eyes[eye] = TracePose(outEyePoses[eye]);
+        }
+    }
+
+    ovrTrackingState GetTrackingState(double absTime, ovrBool latencyMarker) override
+    {
+        ovrTrackingState trackingState = session->GetTrackingState(absTime, latencyMarker);
+        if (replaying)
+            trackingState.StatusFlags = frame.trackingStatus;
+        else
+            frame.trackingStatus = trackingState.StatusFlags;
+        for (int hand = 0; hand < ovrHand_Count; hand++)
+        {
+            if (replaying)
+                trackingState.HandPoses[hand].ThePose = OvrPose(frame.hands[hand]);
+            else
+                frame.hands[hand] = TracePose(trackingState.HandPoses[hand].ThePose);
+        }
+        return trackingState;
+    }
+
+    ovrResult GetInputState(ovrControllerType controllerType, ovrInputState* inputState) override
+    {
+        ovrResult result = session->GetInputState(controllerType, inputState);
+        if (replaying)
+            inputState->Buttons = frame.buttons;
+        else
+            frame.buttons = inputState->Buttons;
+        for (int hand = 0; hand < ovrHand_Count; hand++)
+        {
+            if (replaying)
+            {
+                inputState->Thumbstick[hand] = ovrVector2f{ frame.thumbstick[hand][0], frame.thumbstick[hand][1] };
+                inputState->IndexTrigger[hand] = frame.indexTrigger[hand];
+                inputState->HandTrigger[hand] = frame.handTrigger[hand];
+            }
+            else
+            {
+                frame.thumbstick[hand][0] = inputState->Thumbstick[hand].x;
+                frame.thumbstick[hand][1] = inputState->Thumbstick[hand].y;
+                frame.indexTrigger[hand] = inputState->IndexTrigger[hand];
+                frame.handTrigger[hand] = inputState->HandTrigger[hand];
+            }
+        }
+        return result;
+    }
+
+    ovrResult CreateTextureSwapChainDX(IUnknown* d3dPtr, const ovrTextureSwapChainDesc* desc, ovrTextureSwapChain* outTextureSwapChain) override
+    {
+        return session->CreateTextureSwapChainDX(d3dPtr, desc, outTextureSwapChain);
+    }
+    ovrResult GetTextureSwapChainLength(ovrTextureSwapChain chain, int* outLength) override { return session->GetTextureSwapChainLength(chain, outLength); }
+    ovrResult GetTextureSwapChainBufferDX(ovrTextureSwapChain chain, int index, IID iid, void** outBuffer) override
+    {
+        return session->GetTextureSwapChainBufferDX(chain, index, iid, outBuffer);
+    }
+    ovrResult GetTextureSwapChainCurrentIndex(ovrTextureSwapChain chain, int* outIndex) override { return session->GetTextureSwapChainCurrentIndex(chain, outIndex); }
+    ovrResult CommitTextureSwapChain(ovrTextureSwapChain chain) override { return session->CommitTextureSwapChain(chain); }
+    void DestroyTextureSwapChain(ovrTextureSwapChain chain) override { session->DestroyTextureSwapChain(chain); }
+
+    ovrResult CreateMirrorTextureWithOptionsDX(IUnknown* d3dPtr, const ovrMirrorTextureDesc* desc, ovrMirrorTexture* outMirrorTexture) override
+    {
+        return session->CreateMirrorTextureWithOptionsDX(d3dPtr, desc, outMirrorTexture);
+    }
+    ovrResult GetMirrorTextureBufferDX(ovrMirrorTexture mirrorTexture, IID iid, void** outBuffer) override
+    {
+        return session->GetMirrorTextureBufferDX(mirrorTexture, iid, outBuffer);
+    }
+    void DestroyMirrorTexture(ovrMirrorTexture mirrorTexture) override { session->DestroyMirrorTexture(mirrorTexture); }
+};
+
+// The value of the option name (which ends in '=') in the command line, up to the next space; empty without it.
+inline std::string CommandLineValue(const char* commandLine, const char* name)
+{
+    const char* option = commandLine ? strstr(commandLine, name) : nullptr;
+    if (!option)
+        return std::string();
+    const char* value = option + strlen(name);
+    return std::string(value, strcspn(value, " \t"));
+}
+
+// -simulate[=script] in the command line picks the simulator, anything else LibOVR;
+// -record=path or -replay=path then puts a TraceHmdSession around it.
+inline HmdSession* CreateHmdSession(const char* commandLine)
+{
+    HmdSession* session = nullptr;
+    if (commandLine && strstr(commandLine, "-simulate"))
+    {
+        SimulatedHmdSession* simulated = new SimulatedHmdSession();
+        std::string script = c_defaultHmdScript;
+        std::string scriptPath = CommandLineValue(commandLine, "-simulate=");
+        if (!scriptPath.empty())
+        {
+            std::ifstream file(scriptPath);
+            if (!file)
+                FATALERROR(("Could not open the HMD script " + scriptPath).c_str());
+            std::stringstream text;
+            text << file.rdbuf();
+            script = text.str();
+        }
+        std::string error;
+        if (!ParseHmdScript(script, simulated->simulator.config, simulated->simulator.script, error))
+            FATALERROR(("HMD script " + error).c_str());
+        session = simulated;
+    }
+    else
+    {
+        session = new OvrHmdSession();
+    }
+
+    std::string recordPath = CommandLineValue(commandLine, "-record=");
+    std::string replayPath = CommandLineValue(commandLine, "-replay=");
+    if (recordPath.empty() && replayPath.empty())
+        return session;
+    if (!recordPath.empty() && !replayPath.empty())
+        FATALERROR("-record and -replay cannot be used together");
+
+    TraceHmdSession* traced = new TraceHmdSession(session, !replayPath.empty());
+    if (traced->replaying)
+    {
+        std::string error;
+        if (!ReadPoseTrace(replayPath, traced->replayFrames, error))
+            FATALERROR(("Pose trace " + error).c_str());
+    }
+    else if (!traced->writer.Open(recordPath))
+    {
+        FATALERROR(("Could not write the pose trace " + recordPath).c_str());
+    }
+    return traced;
+}
+
+#endif // HmdSession_h
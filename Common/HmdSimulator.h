@@ -0,0 +1,450 @@
+/************************************************************************************
+Filename    :   HmdSimulator.h
+Content     :   A scripted stand-in for a headset: display, frame timing, head, hands and input
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// SimulatedHmdSession in HmdSession.h answers the LibOVR calls of the samples from this, so
+// they run without a headset or the Oculus runtime. Nothing in here knows about either.
+//
+// A script is plain text, one setting or keyframe per line, # starts a comment:
+//   resolution 2160 1200          both eyes side by side, as ovrHmdDesc::Resolution
+//   refresh 90                    Hz
+//   ipd 0.064                     metres
+//   fov left 1.33 1.33 1.06 1.09  tangents up, down, left, right; eye is left, right or both
+//   frames 3000                   the session asks to quit after this many frames, 0 never
+//   unpaced                       frames follow each other at once, with display times still
+//                                 a refresh period apart, so every run sees the same poses
+//   loop 16                       keyframe times wrap at this many seconds, 0 holds the last keys
+//   2.5 head 0 1.6 0 45 -10 0     at 2.5s: position, then yaw, pitch and roll in degrees
+//   2.5 lefthand ...              righthand likewise
+//   2.5 sticks 0 1 0 0            left x y, right x y
+//   2.5 triggers 0 1              left and right index triggers
+//   2.5 buttons A RThumb          held from then on, none for no buttons
+// Poses and analog values are interpolated between keyframes, buttons switch at them.
+//
+// Paced frames sleep until their vsync the way ovr_WaitToBeginFrame blocks, and a frame
+// that ends after its display time counts as late. A frame that starts more than a period
+// behind skips to the next vsync instead of trying to catch up.
+
+#ifndef HmdSimulator_h
+#define HmdSimulator_h
+
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include "VectorMath.h"
+#include "CameraRays.h"
+
+struct HmdSimPose
+{
+    Float3 position;
+    Quat orientation;
+};
+
+enum HmdSimButton
+{
+    HmdSimButton_A = 1 << 0,
+    HmdSimButton_B = 1 << 1,
+    HmdSimButton_X = 1 << 2,
+    HmdSimButton_Y = 1 << 3,
+    HmdSimButton_LThumb = 1 << 4,
+    HmdSimButton_RThumb = 1 << 5,
+    HmdSimButton_Enter = 1 << 6,
+};
+
+struct HmdSimInput
+{
+    float thumbstick[2][2] = {};    // Left then right hand, x then y
+    float indexTrigger[2] = {};
+    uint32_t buttons = 0;           // HmdSimButton bits
+};
+
+struct HmdSimState
+{
+    HmdSimPose head;
+    HmdSimPose hands[2];
+    HmdSimInput input;
+};
+
+struct HmdSimulatorConfig
+{
+    uint32_t resolutionWidth = 2160;
+    uint32_t resolutionHeight = 1200;
+    float refreshRate = 90.0f;
+    float ipd = 0.064f;
+    FovTangents fov[2] = { { 1.329f, 1.329f, 1.058f, 1.092f }, { 1.329f, 1.329f, 1.092f, 1.058f } };
+    bool paced = true;
+    uint64_t frameLimit = 0;
+};
+
+// Yaw about y, pitch about x and roll about z, applied roll first like XMQuaternionRotationRollPitchYaw.
+inline Quat HmdSimOrientation(float yawDegrees, float pitchDegrees, float rollDegrees)
+{
+    const float toRadians = 3.14159265f / 180.0f;
+    return Quat::AxisAngle(Float3(0.0f, 0.0f, 1.0f), rollDegrees * toRadians) *
+        Quat::AxisAngle(Float3(1.0f, 0.0f, 0.0f), pitchDegrees * toRadians) *
+        Quat::AxisAngle(Float3(0.0f, 1.0f, 0.0f), yawDegrees * toRadians);
+}
+
+struct HmdScript
+{
+    template <typename Value>
+    struct Key
+    {
+        double time;
+        Value value;
+    };
+    struct Analog
+    {
+        float values[4];
+    };
+
+    std::vector<Key<HmdSimPose>> head;
+    std::vector<Key<HmdSimPose>> hands[2];
+    std::vector<Key<Analog>> sticks;
+    std::vector<Key<Analog>> triggers;
+    std::vector<Key<uint32_t>> buttons;
+    double loop = 0.0;
+
+    // Index of the last key at or before time, or -1.
+    template <typename Value>
+    static int KeyBefore(const std::vector<Key<Value>>& keys, double time)
+    {
+        int index = -1;
+        while (index + 1 < int(keys.size()) && keys[index + 1].time <= time)
+            index++;
+        return index;
+    }
+
+    // Position along the segment from key index to the next one, 0 when there is none.
+    template <typename Value>
+    static float SegmentFraction(const std::vector<Key<Value>>& keys, int index, double time)
+    {
+        if (index < 0 || index + 1 >= int(keys.size()) || keys[index + 1].time <= keys[index].time)
+            return 0.0f;
+        return float((time - keys[index].time) / (keys[index + 1].time - keys[index].time));
+    }
+
+    static HmdSimPose EvaluatePose(const std::vector<Key<HmdSimPose>>& keys, double time, const HmdSimPose& fallback)
+    {
+        if (keys.empty())
+            return fallback;
+        int index = KeyBefore(keys, time);
+        if (index < 0)
+            return keys[0].value;
+        if (index + 1 >= int(keys.size()))
+            return keys[index].value;
+        float t = SegmentFraction(keys, index, time);
+        HmdSimPose pose;
+        pose.position = Lerp(keys[index].value.position, keys[index + 1].value.position, t);
+        pose.orientation = Slerp(keys[index].value.orientation, keys[index + 1].value.orientation, t);
+        return pose;
+    }
+
+    static Analog EvaluateAnalog(const std::vector<Key<Analog>>& keys, double time)
+    {
+        Analog analog = {};
+        if (keys.empty())
+            return analog;
+        int index = KeyBefore(keys, time);
+        if (index < 0)
+            return keys[0].value;
+        if (index + 1 >= int(keys.size()))
+            return keys[index].value;
+        float t = SegmentFraction(keys, index, time);
+        for (int i = 0; i < 4; i++)
+            analog.values[i] = keys[index].value.values[i] + (keys[index + 1].value.values[i] - keys[index].value.values[i]) * t;
+        return analog;
+    }
+
+    HmdSimState Evaluate(double time) const
+    {
+        if (loop > 0.0)
+        {
+            time = fmod(time, loop);
+            if (time < 0.0)
+                time += loop;
+        }
+        HmdSimState state;
+        HmdSimPose standing;
+        standing.position = Float3(0.0f, 1.6f, 0.0f);
+        state.head = EvaluatePose(head, time, standing);
+        for (int hand = 0; hand < 2; hand++)
+        {
+            HmdSimPose held;
+            held.position = Float3(hand == 0 ? -0.2f : 0.2f, 1.3f, -0.35f);
+            state.hands[hand] = EvaluatePose(hands[hand], time, held);
+        }
+        Analog stickValues = EvaluateAnalog(sticks, time);
+        Analog triggerValues = EvaluateAnalog(triggers, time);
+        for (int hand = 0; hand < 2; hand++)
+        {
+            state.input.thumbstick[hand][0] = stickValues.values[hand * 2];
+            state.input.thumbstick[hand][1] = stickValues.values[hand * 2 + 1];
+            state.input.indexTrigger[hand] = triggerValues.values[hand];
+        }
+        int buttonKey = KeyBefore(buttons, time);
+        state.input.buttons = buttonKey >= 0 ? buttons[buttonKey].value : 0;
+        return state;
+    }
+};
+
+// Fills config and script from the text; on failure error names the line and nothing is to be trusted.
+inline bool ParseHmdScript(const std::string& text, HmdSimulatorConfig& config, HmdScript& script, std::string& error)
+{
+    std::istringstream lines(text);
+    std::string line;
+    int lineNumber = 0;
+    auto Fail = [&](const char* what)
+        {
+            error = "Line " + std::to_string(lineNumber) + ": " + what + ": " + line;
+            return false;
+        };
+    while (std::getline(lines, line))
+    {
+        lineNumber++;
+        std::string content = line.substr(0, line.find('#'));
+        std::istringstream tokens(content);
+        std::string word;
+        if (!(tokens >> word))
+            continue;
+
+        if (word == "resolution")
+        {
+            if (!(tokens >> config.resolutionWidth >> config.resolutionHeight) || !config.resolutionWidth || !config.resolutionHeight)
+                return Fail("expected a width and height");
+        }
+        else if (word == "refresh")
+        {
+            if (!(tokens >> config.refreshRate) || config.refreshRate <= 0.0f)
+                return Fail("expected a refresh rate in Hz");
+        }
+        else if (word == "ipd")
+        {
+            if (!(tokens >> config.ipd))
+                return Fail("expected a distance in metres");
+        }
+        else if (word == "fov")
+        {
+            std::string eye;
+            FovTangents fov;
+            if (!(tokens >> eye >> fov.upTan >> fov.downTan >> fov.leftTan >> fov.rightTan))
+                return Fail("expected an eye and four tangents");
+            if (eye == "left" || eye == "both")
+                config.fov[0] = fov;
+            if (eye == "right" || eye == "both")
+                config.fov[1] = fov;
+            if (eye != "left" && eye != "right" && eye != "both")
+                return Fail("the eye is left, right or both");
+        }
+        else if (word == "frames")
+        {
+            if (!(tokens >> config.frameLimit))
+                return Fail("expected a frame count");
+        }
+        else if (word == "unpaced")
+            config.paced = false;
+        else if (word == "loop")
+        {
+            if (!(tokens >> script.loop) || script.loop < 0.0)
+                return Fail("expected a length in seconds");
+        }
+        else
+        {
+            // A keyframe: the time, then the channel
+            double time;
+            std::istringstream timeToken(word);
+            std::string channel;
+            if (!(timeToken >> time) || !(tokens >> channel))
+                return Fail("unknown setting");
+            if (channel == "head" || channel == "lefthand" || channel == "righthand")
+            {
+                Float3 position;
+                float yaw, pitch, roll;
+                if (!(tokens >> position.x >> position.y >> position.z >> yaw >> pitch >> roll))
+                    return Fail("expected a position and yaw, pitch and roll");
+                HmdSimPose pose;
+                pose.position = position;
+                pose.orientation = HmdSimOrientation(yaw, pitch, roll);
+                std::vector<HmdScript::Key<HmdSimPose>>& keys = channel == "head" ? script.head : script.hands[channel == "lefthand" ? 0 : 1];
+                keys.push_back({ time, pose });
+            }
+            else if (channel == "sticks" || channel == "triggers")
+            {
+                HmdScript::Analog analog = {};
+                int count = channel == "sticks" ? 4 : 2;
+                for (int i = 0; i < count; i++)
+                {
+                    if (!(tokens >> analog.values[i]))
+                        return Fail(channel == "sticks" ? "expected left x y and right x y" : "expected left and right");
+                }
+                (channel == "sticks" ? script.sticks : script.triggers).push_back({ time, analog });
+            }
+            else if (channel == "buttons")
+            {
+                static const struct { const char* name; uint32_t bit; } c_buttons[] =
+                {
+                    { "A", HmdSimButton_A }, { "B", HmdSimButton_B }, { "X", HmdSimButton_X }, { "Y", HmdSimButton_Y },
+                    { "LThumb", HmdSimButton_LThumb }, { "RThumb", HmdSimButton_RThumb }, { "Enter", HmdSimButton_Enter },
+                };
+                uint32_t held = 0;
+                std::string name;
+                while (tokens >> name)
+                {
+                    if (name == "none")
+                        continue;
+                    uint32_t bit = 0;
+                    for (const auto& button : c_buttons)
+                        bit = name == button.name ? button.bit : bit;
+                    if (!bit)
+                        return Fail("unknown button");
+                    held |= bit;
+                }
+                script.buttons.push_back({ time, held });
+            }
+            else
+                return Fail("unknown channel");
+        }
+    }
+
+    // Keys may come in any order in the file
+    auto ByTime = [](const auto& a, const auto& b) { return a.time < b.time; };
+    std::stable_sort(script.head.begin(), script.head.end(), ByTime);
+    for (int hand = 0; hand < 2; hand++)
+        std::stable_sort(script.hands[hand].begin(), script.hands[hand].end(), ByTime);
+    std::stable_sort(script.sticks.begin(), script.sticks.end(), ByTime);
+    std::stable_sort(script.triggers.begin(), script.triggers.end(), ByTime);
+    std::stable_sort(script.buttons.begin(), script.buttons.end(), ByTime);
+    return true;
+}
+
+// Looks slowly left and right from standing height, with the hands held out in front.
+static const char c_defaultHmdScript[] =
+    "loop 16\n"
+    "0 head 0 1.6 0 0 0 0\n"
+    "4 head 0 1.6 0 45 -10 0\n"
+    "8 head 0 1.6 0 0 0 0\n"
+    "12 head 0 1.6 0 -45 10 0\n"
+    "16 head 0 1.6 0 0 0 0\n";
+
+struct HmdSimulator
+{
+    HmdSimulatorConfig config;
+    HmdScript script;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point frameBegin = start;
+    double slip = 0.0;              // Whole refresh periods lost to frames that started too late
+    long long currentFrame = -1;
+
+    uint64_t frames = 0;
+    uint64_t lateFrames = 0;        // Ended after their display time, paced only
+    double totalFrameMilliseconds = 0.0;    // From BeginFrame to EndFrame
+    double maxFrameMilliseconds = 0.0;
+
+    void Start()
+    {
+        start = std::chrono::steady_clock::now();
+        frameBegin = start;
+        slip = 0.0;
+        currentFrame = -1;
+        frames = lateFrames = 0;
+        totalFrameMilliseconds = maxFrameMilliseconds = 0.0;
+    }
+
+    double Period() const { return 1.0 / config.refreshRate; }
+
+    double Elapsed() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); }
+
+    // The vsync after the one the frame begins at.
+    double DisplayTime(long long frameIndex) const { return (frameIndex + 1) * Period() + slip; }
+
+    // Seconds since Start; unpaced, when the current frame began.
+    double Now() const
+    {
+        if (config.paced)
+            return Elapsed();
+        return currentFrame < 0 ? 0.0 : DisplayTime(currentFrame) - Period();
+    }
+
+    void WaitToBeginFrame(long long frameIndex)
+    {
+        currentFrame = frameIndex;
+        if (!config.paced)
+            return;
+        double begin = frameIndex * Period() + slip;
+        double now = Elapsed();
+        if (now > begin + Period())
+        {
+            slip += ceil((now - begin) / Period()) * Period();
+            begin = frameIndex * Period() + slip;
+        }
+        std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(begin)));
+    }
+
+    void BeginFrame(long long frameIndex)
+    {
+        currentFrame = frameIndex;
+        frameBegin = std::chrono::steady_clock::now();
+    }
+
+    void EndFrame(long long frameIndex)
+    {
+        double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameBegin).count();
+        frames++;
+        totalFrameMilliseconds += milliseconds;
+        maxFrameMilliseconds = milliseconds > maxFrameMilliseconds ? milliseconds : maxFrameMilliseconds;
+        if (config.paced && Elapsed() > DisplayTime(frameIndex))
+            lateFrames++;
+    }
+
+    bool Finished() const { return config.frameLimit > 0 && frames >= config.frameLimit; }
+
+    HmdSimState StateAt(double time) const { return script.Evaluate(time); }
+
+    // Relative to the head, as ovrEyeRenderDesc::HmdToEyePose.
+    HmdSimPose HmdToEyePose(int eye) const
+    {
+        HmdSimPose pose;
+        pose.position = Float3(eye == 0 ? -0.5f * config.ipd : 0.5f * config.ipd, 0.0f, 0.0f);
+        return pose;
+    }
+
+    static HmdSimPose EyePose(const HmdSimPose& head, const HmdSimPose& hmdToEye)
+    {
+        HmdSimPose eye;
+        eye.position = head.position + head.orientation.Rotate(hmdToEye.position);
+        eye.orientation = hmdToEye.orientation * head.orientation;
+        return eye;
+    }
+
+    // The default field of view fills half the panel's width and its height; a wider one
+    // needs more pixels at the same density.
+    void FovTextureSize(int eye, const FovTangents& fov, float pixelsPerDisplayPixel, uint32_t& width, uint32_t& height) const
+    {
+        const FovTangents& panel = config.fov[eye];
+        float pixelsPerTanX = 0.5f * config.resolutionWidth / (panel.leftTan + panel.rightTan);
+        float pixelsPerTanY = config.resolutionHeight / (panel.upTan + panel.downTan);
+        width = uint32_t(ceilf(pixelsPerTanX * (fov.leftTan + fov.rightTan) * pixelsPerDisplayPixel));
+        height = uint32_t(ceilf(pixelsPerTanY * (fov.upTan + fov.downTan) * pixelsPerDisplayPixel));
+    }
+};
+
+#endif // HmdSimulator_h
@@ -0,0 +1,92 @@
+/************************************************************************************
+Filename    :   InstancePacking.h
+Content     :   Per frame instance work of Scene: world transforms, TLAS descs and shading data
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// Scene calls these with SceneInstances, D3D12_RAYTRACING_INSTANCE_DESC and its own
+// TextureData and InstanceData. They are templates over those types so that code without
+// D3D12 or DirectXMath can pass lookalikes with the same member names and run the same loops.
+
+#ifndef InstancePacking_h
+#define InstancePacking_h
+
+#include <cstdint>
+#include <cstring>
+#include "VectorMath.h"
+
+// local then model, both row vector 4x4s as DirectXMath keeps them, into the row major 3x4
+// with the translation in the last column that D3D12_RAYTRACING_INSTANCE_DESC::Transform takes.
+inline void ComposeInstanceTransform(const float local[4][4], const float model[4][4], float world[3][4])
+{
+    for (int r = 0; r < 3; r++)
+    {
+        for (int c = 0; c < 4; c++)
+            world[r][c] = local[c][0] * model[0][r] + local[c][1] * model[1][r] + local[c][2] * model[2][r] + local[c][3] * model[3][r];
+    }
+}
+
+// Writes the TLAS input for the live instances, compacted to the front of descs, and returns
+// how many there are. Instances outside the view lose hitLayer, and are left out once no
+// layer remains. InstanceID stays the slot index so shading lookups are stable across spawns
+// and despawns.
+template <typename Instances, typename InstanceDesc>
+uint32_t PackInstanceDescs(const Instances& instances, InstanceDesc* descs, uint32_t hitLayer, uint32_t rayTypeCount)
+{
+    uint32_t numSlots = instances.Count();
+    uint32_t numPacked = 0;
+    for (uint32_t i = 0; i < numSlots; i++)
+    {
+        if (!instances.alive[i])
+            continue;
+
+        uint32_t mask = instances.outsideView[i] ? (instances.masks[i] & ~hitLayer) : instances.masks[i];
+        if (mask == 0)
+            continue;
+
+        InstanceDesc& desc = descs[numPacked++];
+        memcpy(desc.Transform, &instances.worldTransforms[i], sizeof(desc.Transform));
+        desc.InstanceID = i;
+        desc.InstanceMask = mask;
+        desc.InstanceContributionToHitGroupIndex = instances.hitGroups[i] * rayTypeCount;
+        desc.Flags = 0;
+        desc.AccelerationStructure = instances.blasAddresses[i];
+    }
+    return numPacked;
+}
+
+// Writes the per-instance shading table read by the hit shaders through InstanceID().
+template <typename Instances, typename TextureData, typename InstanceData>
+void PackInstanceConstants(const Instances& instances, const TextureData* textures, InstanceData* pInstanceData)
+{
+    uint32_t numSlots = instances.Count();
+    // Instance colors come from 8 bit channels, so the doubled and clamped tint is exact in 8 bits too
+    auto TintChannel = [](float value) { return uint32_t(ClampF(value * 2.0f, 0.0f, 1.0f) * 255.0f + 0.5f); };
+    for (uint32_t i = 0; i < numSlots; i++)
+    {
+        const TextureData& texture = textures[instances.textureIds[i]];
+        const auto& color = instances.colors[i];
+        pInstanceData[i].geometryOffset = instances.geometryOffsets[i];
+        pInstanceData[i].vertexOffset = instances.vertexOffsets[i];
+        pInstanceData[i].textureId = instances.textureIds[i];
+        pInstanceData[i].textureSize = texture.width | (texture.height << 16);
+        pInstanceData[i].uvScale = instances.uvScales[i];
+        pInstanceData[i].tint = TintChannel(color.x) | (TintChannel(color.y) << 8) | (TintChannel(color.z) << 16) | (255u << 24);
+        pInstanceData[i].textureMipLevels = texture.mipLevels;
+    }
+}
+
+#endif // InstancePacking_h
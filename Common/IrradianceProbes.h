@@ -0,0 +1,408 @@
+/************************************************************************************
+Filename    :   IrradianceProbes.h
+Content     :   Irradiance probe grid layout, encoding and sampling the shaders use
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// The flat ambient term of DirectLighting is replaced by irradiance interpolated from a
+// regular grid of probes over the scene bounds, in the manner of "Dynamic Diffuse Global
+// Illumination with Ray-Traced Irradiance Fields" (Majercik et al.).
+//
+// Every frame ProbeTrace.hlsl shoots PROBE_RAYS rays from a budget of probes, taken in
+// turn round the grid, and shades their hits with DirectLighting, which itself samples
+// the probes and so adds a bounce per update. ProbeBlend.hlsl then folds the rays into
+// two octahedral maps per probe: cosine weighted irradiance, and the mean and mean
+// squared distance to geometry that keeps light from leaking through walls. Each map
+// is a tile of an atlas with a one texel border copied from the opposite edge, so that
+// bilinear filtering wraps correctly over the octahedron's seams.
+//
+// Irradiance here is the cosine weighted mean radiance, E / pi, which is what the repo's
+// albedo * lighting shading multiplies albedo by.
+//
+// Everything below matches Raytracing.hlsl and the two update shaders step by step.
+
+#ifndef IrradianceProbes_h
+#define IrradianceProbes_h
+
+#include <vector>
+#include "LightBVH.h"
+
+// Must match Raytracing.hlsl
+#define PROBE_IRRADIANCE_TEXELS 6       // Interior texels per side of a probe's irradiance tile
+#define PROBE_VISIBILITY_TEXELS 14      // and of its visibility tile, both plus a one texel border
+#define PROBE_RAYS 64
+#define PROBE_MAX_COUNT 4096
+#define PROBE_MAX_ATLAS_TEXELS 16384    // D3D12_REQ_TEXTURE2D_U_OR_V_DIMENSION
+#define PROBE_VISIBILITY_SHARPNESS 50.0f
+#define PROBE_NORMAL_BIAS 0.2f          // Of the smallest spacing
+#define PROBE_AMBIENT 0.05f             // Where no probe has been updated yet
+
+// Probes sit at the centres of the cells of a regular grid. Probe (x, y, z) has the index
+// x + counts[0] * (y + counts[1] * z), and its tiles are in column x and row
+// y + counts[1] * z of the atlases.
+struct ProbeGrid
+{
+    Float3 origin;
+    Float3 spacing;
+    uint32_t counts[3] = { 0, 0, 0 };
+    float maxDistance = 0.0f;           // Probe rays stop at the grid's diagonal
+
+    bool Empty() const { return Count() == 0; }
+    uint32_t Count() const { return counts[0] * counts[1] * counts[2]; }
+    float NormalBias() const { return PROBE_NORMAL_BIAS * MinF(spacing.x, MinF(spacing.y, spacing.z)); }
+
+    // The coarsest roughly cubic cells that keep the count within maxProbes and both atlases
+    // within the largest texture D3D12 allows.
+    static ProbeGrid Fit(const Aabb& bounds, uint32_t maxProbes)
+    {
+        ProbeGrid grid;
+        if (bounds.IsEmpty() || maxProbes == 0)
+            return grid;
+        Float3 size = bounds.hi - bounds.lo;
+        float cell = MaxF(cbrtf(MaxF(size.x, 1e-3f) * MaxF(size.y, 1e-3f) * MaxF(size.z, 1e-3f) / maxProbes), 1e-3f);
+        for (;;)
+        {
+            uint64_t total = 1;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                grid.counts[axis] = (uint32_t)MaxF(1.0f, ceilf(size[axis] / cell));
+                total *= grid.counts[axis];
+            }
+            if (total <= maxProbes && grid.AtlasWidth(PROBE_VISIBILITY_TEXELS) <= PROBE_MAX_ATLAS_TEXELS &&
+                grid.AtlasHeight(PROBE_VISIBILITY_TEXELS) <= PROBE_MAX_ATLAS_TEXELS)
+                break;
+            cell *= 1.05f;
+        }
+        for (int axis = 0; axis < 3; axis++)
+            grid.spacing[axis] = MaxF(size[axis] / grid.counts[axis], 1e-3f);
+        grid.origin = bounds.lo + grid.spacing * 0.5f;
+        grid.maxDistance = Length(size) + 1e-3f;
+        return grid;
+    }
+
+    void Coords(uint32_t probe, uint32_t coords[3]) const
+    {
+        coords[0] = probe % counts[0];
+        coords[1] = (probe / counts[0]) % counts[1];
+        coords[2] = probe / (counts[0] * counts[1]);
+    }
+
+    uint32_t Index(const uint32_t coords[3]) const
+    {
+        return coords[0] + counts[0] * (coords[1] + counts[1] * coords[2]);
+    }
+
+    Float3 Position(uint32_t probe) const
+    {
+        uint32_t coords[3];
+        Coords(probe, coords);
+        return origin + spacing * Float3((float)coords[0], (float)coords[1], (float)coords[2]);
+    }
+
+    // Atlas size in texels for tiles of interiorTexels per side
+    uint32_t AtlasWidth(uint32_t interiorTexels) const { return counts[0] * (interiorTexels + 2); }
+    uint32_t AtlasHeight(uint32_t interiorTexels) const { return counts[1] * counts[2] * (interiorTexels + 2); }
+
+    // Top left texel of a probe's tile, border included
+    void TileOrigin(uint32_t probe, uint32_t interiorTexels, uint32_t& x, uint32_t& y) const
+    {
+        uint32_t coords[3];
+        Coords(probe, coords);
+        x = coords[0] * (interiorTexels + 2);
+        y = (coords[1] + counts[1] * coords[2]) * (interiorTexels + 2);
+    }
+};
+
+//-----------------------------------------------------------
+// Octahedral mapping of the unit sphere onto [-1, 1]^2, the lower hemisphere folded over
+// the diagonals. PackNormalOctahedral quantizes the same mapping.
+inline Float2 OctahedralEncode(const Float3& n)
+{
+    float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    float x = n.x / l1, y = n.y / l1;
+    if (n.z < 0.0f)
+    {
+        float fx = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float fy = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
+    }
+    return Float2(x, y);
+}
+
+inline Float3 OctahedralDecode(const Float2& e)
+{
+    Float3 n(e.x, e.y, 1.0f - fabsf(e.x) - fabsf(e.y));
+    if (n.z < 0.0f)
+    {
+        float x = (1.0f - fabsf(e.y)) * (e.x >= 0.0f ? 1.0f : -1.0f);
+        float y = (1.0f - fabsf(e.x)) * (e.y >= 0.0f ? 1.0f : -1.0f);
+        n.x = x;
+        n.y = y;
+    }
+    return Normalize(n);
+}
+
+// Direction of the texel at (tx, ty) of a tile, border included. Border texels take the
+// direction of the interior texel they copy.
+inline void ProbeBorderSource(uint32_t tx, uint32_t ty, uint32_t interiorTexels, uint32_t& sx, uint32_t& sy)
+{
+    uint32_t last = interiorTexels + 1;
+    bool borderX = tx == 0 || tx == last, borderY = ty == 0 || ty == last;
+    sx = tx;
+    sy = ty;
+    if (borderX && borderY)
+    {
+        // Corners take the diagonally opposite interior corner
+        sx = tx == 0 ? interiorTexels : 1;
+        sy = ty == 0 ? interiorTexels : 1;
+    }
+    else if (borderY)
+    {
+        // Top and bottom rows mirror the adjacent interior row
+        sx = last - tx;
+        sy = ty == 0 ? 1 : interiorTexels;
+    }
+    else if (borderX)
+    {
+        sx = tx == 0 ? 1 : interiorTexels;
+        sy = last - ty;
+    }
+}
+
+inline Float3 ProbeTexelDirection(uint32_t tx, uint32_t ty, uint32_t interiorTexels)
+{
+    uint32_t sx, sy;
+    ProbeBorderSource(tx, ty, interiorTexels, sx, sy);
+    return OctahedralDecode(Float2((sx - 0.5f) / interiorTexels * 2.0f - 1.0f, (sy - 0.5f) / interiorTexels * 2.0f - 1.0f));
+}
+
+// Continuous tile coordinate of a direction, with texel centres on integers, for bilinear filtering.
+inline Float2 ProbeTileCoordinate(const Float3& direction, uint32_t interiorTexels)
+{
+    Float2 e = OctahedralEncode(direction);
+    return Float2((e.x * 0.5f + 0.5f) * interiorTexels + 0.5f, (e.y * 0.5f + 0.5f) * interiorTexels + 0.5f);
+}
+
+//-----------------------------------------------------------
+// Ray directions of an update: a spherical Fibonacci set, turned by a fresh random
+// rotation every frame so that successive updates of a probe see different directions.
+inline Float3 SphericalFibonacci(uint32_t i, uint32_t n)
+{
+    const float goldenFraction = 0.61803398875f;
+    float phi = 6.28318530718f * (i * goldenFraction - floorf(i * goldenFraction));
+    float cosTheta = 1.0f - (2.0f * i + 1.0f) / n;
+    float sinTheta = sqrtf(ClampF(1.0f - cosTheta * cosTheta, 0.0f, 1.0f));
+    return Float3(cosf(phi) * sinTheta, sinf(phi) * sinTheta, cosTheta);
+}
+
+// Uniformly distributed rotation, "Uniform Random Rotations" (Shoemake).
+inline Quat ProbeRayRotation(uint32_t seed)
+{
+    uint32_t state = PcgHash(seed);
+    float u1 = RandomUnorm(state), u2 = RandomUnorm(state), u3 = RandomUnorm(state);
+    float a = sqrtf(1.0f - u1), b = sqrtf(u1);
+    return Quat(a * sinf(6.28318530718f * u2), a * cosf(6.28318530718f * u2),
+                b * sinf(6.28318530718f * u3), b * cosf(6.28318530718f * u3));
+}
+
+inline Float3 ProbeRayDirection(uint32_t ray, const Quat& rotation)
+{
+    return rotation.Rotate(SphericalFibonacci(ray, PROBE_RAYS));
+}
+
+// What ProbeTrace.hlsl writes per ray. Misses keep black radiance and the grid's maxDistance.
+struct ProbeRay
+{
+    Float3 direction;
+    Float3 radiance;
+    float distance;
+};
+
+// New value of a texel facing direction from one update's rays. hysteresis is the weight of
+// the previous value, zero the first time a probe is updated.
+inline Float3 BlendProbeIrradiance(const Float3& previous, const Float3& direction, const ProbeRay* rays, uint32_t count, float hysteresis)
+{
+    Float3 sum;
+    float weight = 0.0f;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        float w = MaxF(0.0f, Dot(direction, rays[i].direction));
+        sum += rays[i].radiance * w;
+        weight += w;
+    }
+    if (weight <= 1e-4f)
+        return previous;
+    return Lerp(sum / weight, previous, hysteresis);
+}
+
+inline Float2 BlendProbeVisibility(const Float2& previous, const Float3& direction, const ProbeRay* rays, uint32_t count, float hysteresis, float maxDistance)
+{
+    float mean = 0.0f, meanSq = 0.0f, weight = 0.0f;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        float w = powf(MaxF(0.0f, Dot(direction, rays[i].direction)), PROBE_VISIBILITY_SHARPNESS);
+        float distance = MinF(rays[i].distance, maxDistance);
+        mean += distance * w;
+        meanSq += distance * distance * w;
+        weight += w;
+    }
+    if (weight <= 1e-4f)
+        return previous;
+    return Float2(mean / weight + (previous.x - mean / weight) * hysteresis, meanSq / weight + (previous.y - meanSq / weight) * hysteresis);
+}
+
+//-----------------------------------------------------------
+// CPU copy of the two atlases, updated and sampled exactly as the GPU does.
+struct ProbeAtlas
+{
+    ProbeGrid grid;
+    std::vector<Float3> irradiance;
+    std::vector<Float2> visibility;
+    std::vector<uint8_t> updated;       // The GPU keeps this in the irradiance atlas' alpha
+
+    void Init(const ProbeGrid& probeGrid)
+    {
+        grid = probeGrid;
+        irradiance.assign(size_t(grid.AtlasWidth(PROBE_IRRADIANCE_TEXELS)) * grid.AtlasHeight(PROBE_IRRADIANCE_TEXELS), Float3());
+        visibility.assign(size_t(grid.AtlasWidth(PROBE_VISIBILITY_TEXELS)) * grid.AtlasHeight(PROBE_VISIBILITY_TEXELS), Float2());
+        updated.assign(grid.Count(), 0);
+    }
+
+    void UpdateProbe(uint32_t probe, const ProbeRay* rays, uint32_t count, float hysteresis)
+    {
+        if (!updated[probe])
+            hysteresis = 0.0f;
+        UpdateTile(probe, PROBE_IRRADIANCE_TEXELS, [&](uint32_t texel, const Float3& direction)
+        {
+            irradiance[texel] = BlendProbeIrradiance(irradiance[texel], direction, rays, count, hysteresis);
+        });
+        UpdateTile(probe, PROBE_VISIBILITY_TEXELS, [&](uint32_t texel, const Float3& direction)
+        {
+            visibility[texel] = BlendProbeVisibility(visibility[texel], direction, rays, count, hysteresis, grid.maxDistance);
+        });
+        updated[probe] = 1;
+    }
+
+    Float3 Irradiance(uint32_t probe, const Float3& direction) const
+    {
+        return Bilinear(irradiance, probe, PROBE_IRRADIANCE_TEXELS, direction);
+    }
+
+    Float2 Visibility(uint32_t probe, const Float3& direction) const
+    {
+        Float3 v = Bilinear(visibility, probe, PROBE_VISIBILITY_TEXELS, direction);
+        return Float2(v.x, v.y);
+    }
+
+    // Irradiance at p with normal n from the eight probes around it: trilinear weights, less
+    // for probes behind the surface and for probes that the visibility maps say cannot see p.
+    Float3 Sample(const Float3& p, const Float3& n) const
+    {
+        if (grid.Empty())
+            return Float3(PROBE_AMBIENT);
+        Float3 biased = p + n * grid.NormalBias();
+        Float3 cell = (biased - grid.origin) / grid.spacing;
+        uint32_t base[3];
+        Float3 alpha;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float c = ClampF(floorf(cell[axis]), 0.0f, (float)(grid.counts[axis] - 1));
+            base[axis] = (uint32_t)c;
+            alpha[axis] = ClampF(cell[axis] - c, 0.0f, 1.0f);
+        }
+
+        Float3 sum;
+        float weightSum = 0.0f;
+        for (uint32_t corner = 0; corner < 8; corner++)
+        {
+            uint32_t coords[3];
+            float trilinear = 1.0f;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                uint32_t offset = (corner >> axis) & 1;
+                coords[axis] = base[axis] + offset < grid.counts[axis] ? base[axis] + offset : grid.counts[axis] - 1;
+                trilinear *= offset ? alpha[axis] : 1.0f - alpha[axis];
+            }
+            uint32_t probe = grid.Index(coords);
+            if (!updated[probe])
+                continue;
+            Float3 probePosition = grid.Position(probe);
+
+            float facing = (Dot(Normalize(probePosition - p), n) + 1.0f) * 0.5f;
+            float weight = facing * facing + 0.2f;
+
+            Float3 toPoint = biased - probePosition;
+            float distance = Length(toPoint);
+            if (distance > 1e-4f)
+            {
+                Float2 moments = Visibility(probe, toPoint / distance);
+                if (distance > moments.x)
+                {
+                    float variance = fabsf(moments.x * moments.x - moments.y);
+                    float d = distance - moments.x;
+                    float chebyshev = variance / (variance + d * d);
+                    weight *= MaxF(0.05f, chebyshev * chebyshev * chebyshev);
+                }
+            }
+
+            // Crush tiny weights so that probes seen through a wall fade out completely
+            weight = MaxF(weight, 1e-6f);
+            if (weight < 0.2f)
+                weight *= weight * weight / (0.2f * 0.2f);
+            weight *= trilinear;
+
+            sum += Irradiance(probe, n) * weight;
+            weightSum += weight;
+        }
+        return weightSum > 1e-4f ? sum / weightSum : Float3(PROBE_AMBIENT);
+    }
+
+private:
+    template <typename Texel>
+    void UpdateTile(uint32_t probe, uint32_t interiorTexels, Texel texel)
+    {
+        uint32_t width = grid.AtlasWidth(interiorTexels);
+        uint32_t x0, y0;
+        grid.TileOrigin(probe, interiorTexels, x0, y0);
+        for (uint32_t ty = 0; ty < interiorTexels + 2; ty++)
+            for (uint32_t tx = 0; tx < interiorTexels + 2; tx++)
+                texel((y0 + ty) * width + x0 + tx, ProbeTexelDirection(tx, ty, interiorTexels));
+    }
+
+    template <typename T>
+    static Float3 Channels(const T& t);
+
+    template <typename T>
+    Float3 Bilinear(const std::vector<T>& atlas, uint32_t probe, uint32_t interiorTexels, const Float3& direction) const
+    {
+        uint32_t width = grid.AtlasWidth(interiorTexels);
+        uint32_t x0, y0;
+        grid.TileOrigin(probe, interiorTexels, x0, y0);
+        Float2 c = ProbeTileCoordinate(direction, interiorTexels);
+        float fx = floorf(c.x), fy = floorf(c.y);
+        uint32_t x = x0 + (uint32_t)fx, y = y0 + (uint32_t)fy;
+        float ax = c.x - fx, ay = c.y - fy;
+        Float3 top = Lerp(Channels(atlas[y * width + x]), Channels(atlas[y * width + x + 1]), ax);
+        Float3 bottom = Lerp(Channels(atlas[(y + 1) * width + x]), Channels(atlas[(y + 1) * width + x + 1]), ax);
+        return Lerp(top, bottom, ay);
+    }
+};
+
+template <> inline Float3 ProbeAtlas::Channels(const Float3& t) { return t; }
+template <> inline Float3 ProbeAtlas::Channels(const Float2& t) { return Float3(t.x, t.y, 0.0f); }
+
+#endif // IrradianceProbes_h
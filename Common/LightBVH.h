@@ -0,0 +1,271 @@
+/************************************************************************************
+Filename    :   LightBVH.h
+Content     :   Light BVH and the importance sampled light selection the shaders use
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// A hit no longer shoots a shadow ray at every light. Lights sit in a binary BVH built
+// here on the CPU and uploaded next to them; DirectLighting in Raytracing.hlsl walks it
+// from the root, picking a child at every level with a probability proportional to its
+// importance for the shaded point, and ends at one light whose selection probability
+// divides its contribution. Each of the lightSamples picks costs one shadow ray however
+// many lights the scene has.
+//
+// Importance is the summed power under a node over the squared distance to its bounds,
+// clamped by their half diagonal so that points inside a cluster do not favour it without
+// bound, and zero for bounds wholly below the surface's horizon.
+//
+// Everything below matches Raytracing.hlsl step by step, including the random numbers,
+// so SecondaryRays.h can reproduce the shadow ray a pixel traced.
+
+#ifndef LightBVH_h
+#define LightBVH_h
+
+#include <vector>
+#include <algorithm>
+#include "SceneQuery.h"
+
+// Must match Raytracing.hlsl
+#define LIGHT_LEAF 0x80000000u
+#define LIGHT_NONE 0xffffffffu
+#define LIGHT_MAX_SAMPLES 2
+#define MAX_LIGHTS 1024
+
+// A point light, or a spherical area light when radius is above zero.
+struct LightSource
+{
+    Float3 position;
+    float radius;
+    Float3 color;
+    float intensity;    // Irradiance at unit distance facing the light
+
+    LightSource() : radius(0.0f), color(1.0f, 1.0f, 1.0f), intensity(1.0f) {}
+    LightSource(const Float3& position, const Float3& color, float intensity, float radius = 0.0f)
+        : position(position), radius(radius), color(color), intensity(intensity) {}
+
+    float Power() const { return intensity * (0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z); }
+    Aabb Bounds() const { return Aabb(position - Float3(radius), position + Float3(radius)); }
+};
+
+static_assert(sizeof(LightSource) == 32, "LightSource must match the HLSL structured buffer stride");
+
+// Nodes are stored depth first: an inner node's first child follows it and child holds
+// the index of the second. Leaves hold LIGHT_LEAF with the index of their light.
+struct LightNode
+{
+    Float3 boundsLo;
+    float power;
+    Float3 boundsHi;
+    uint32_t child;
+};
+
+static_assert(sizeof(LightNode) == 32, "LightNode must match the HLSL structured buffer stride");
+
+struct LightBVH
+{
+    std::vector<LightSource> lights;
+    std::vector<LightNode> nodes;
+
+    void Build(const std::vector<LightSource>& sceneLights)
+    {
+        lights = sceneLights;
+        nodes.clear();
+        if (lights.empty())
+            return;
+        nodes.reserve(2 * lights.size() - 1);
+        std::vector<uint32_t> order(lights.size());
+        for (uint32_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        BuildNode(order, 0, (uint32_t)order.size());
+    }
+
+private:
+    // Splits at the median along the longest axis of the light centres.
+    uint32_t BuildNode(std::vector<uint32_t>& order, uint32_t first, uint32_t count)
+    {
+        uint32_t index = (uint32_t)nodes.size();
+        nodes.push_back(LightNode());
+
+        Aabb bounds, centres;
+        float power = 0.0f;
+        for (uint32_t i = first; i < first + count; i++)
+        {
+            bounds.Grow(lights[order[i]].Bounds());
+            centres.Grow(lights[order[i]].position);
+            power += lights[order[i]].Power();
+        }
+
+        uint32_t child = LIGHT_LEAF | order[first];
+        if (count > 1)
+        {
+            Float3 extent = centres.hi - centres.lo;
+            int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+            uint32_t half = count / 2;
+            std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+                [&](uint32_t a, uint32_t b) { return lights[a].position[axis] < lights[b].position[axis]; });
+            BuildNode(order, first, half);
+            child = BuildNode(order, first + half, count - half);
+        }
+
+        nodes[index].boundsLo = bounds.lo;
+        nodes[index].boundsHi = bounds.hi;
+        nodes[index].power = power;
+        nodes[index].child = child;
+        return index;
+    }
+};
+
+inline float LightNodeImportance(const LightNode& node, const Float3& p, const Float3& n)
+{
+    // The corner furthest along the normal decides whether any of the node is above the horizon
+    Float3 furthest(n.x > 0.0f ? node.boundsHi.x : node.boundsLo.x,
+                    n.y > 0.0f ? node.boundsHi.y : node.boundsLo.y,
+                    n.z > 0.0f ? node.boundsHi.z : node.boundsLo.z);
+    if (node.power <= 0.0f || Dot(furthest - p, n) <= 0.0f)
+        return 0.0f;
+    Float3 centre = (node.boundsLo + node.boundsHi) * 0.5f;
+    float halfDiagonalSq = LengthSq(node.boundsHi - node.boundsLo) * 0.25f;
+    return node.power / MaxF(LengthSq(centre - p), MaxF(halfDiagonalSq, 1e-4f));
+}
+
+struct LightSample
+{
+    uint32_t light = LIGHT_NONE;
+    float pdf = 0.0f;   // Probability of having picked this light
+};
+
+// Walks from the root with one uniform number, reusing what is left of it at every level.
+// The walk stops with no light where a node's bounds reach above the horizon but neither
+// child's do, which an oblique normal allows.
+inline LightSample SampleLightBVH(const LightNode* nodes, uint32_t nodeCount, const Float3& p, const Float3& n, float u)
+{
+    LightSample sample;
+    if (nodeCount == 0)
+        return sample;
+
+    uint32_t index = 0;
+    float pdf = 1.0f;
+    while (!(nodes[index].child & LIGHT_LEAF))
+    {
+        uint32_t left = index + 1, right = nodes[index].child;
+        float leftImportance = LightNodeImportance(nodes[left], p, n);
+        float rightImportance = LightNodeImportance(nodes[right], p, n);
+        if (leftImportance + rightImportance <= 0.0f)
+            return sample;
+        float leftProbability = leftImportance / (leftImportance + rightImportance);
+        if (u < leftProbability)
+        {
+            u = u / leftProbability;
+            pdf *= leftProbability;
+            index = left;
+        }
+        else
+        {
+            u = (u - leftProbability) / (1.0f - leftProbability);
+            pdf *= 1.0f - leftProbability;
+            index = right;
+        }
+        u = MinF(u, 0.99999994f);
+    }
+    sample.light = nodes[index].child & ~LIGHT_LEAF;
+    sample.pdf = pdf;
+    return sample;
+}
+
+// Probability of SampleLightBVH returning each light, to check it against a histogram.
+inline std::vector<float> LightSelectionProbabilities(const LightBVH& bvh, const Float3& p, const Float3& n)
+{
+    std::vector<float> probabilities(bvh.lights.size(), 0.0f);
+    if (bvh.nodes.empty())
+        return probabilities;
+
+    std::vector<std::pair<uint32_t, float>> stack(1, std::make_pair(0u, 1.0f));
+    while (!stack.empty())
+    {
+        std::pair<uint32_t, float> entry = stack.back();
+        stack.pop_back();
+        const LightNode& node = bvh.nodes[entry.first];
+        if (node.child & LIGHT_LEAF)
+        {
+            probabilities[node.child & ~LIGHT_LEAF] += entry.second;
+            continue;
+        }
+        float leftImportance = LightNodeImportance(bvh.nodes[entry.first + 1], p, n);
+        float rightImportance = LightNodeImportance(bvh.nodes[node.child], p, n);
+        if (leftImportance + rightImportance <= 0.0f)
+            continue;
+        float leftProbability = leftImportance / (leftImportance + rightImportance);
+        stack.push_back(std::make_pair(entry.first + 1, entry.second * leftProbability));
+        stack.push_back(std::make_pair(node.child, entry.second * (1.0f - leftProbability)));
+    }
+    return probabilities;
+}
+
+// PCG hash, "Hash Functions for GPU Rendering" (Jarzynski and Olano).
+inline uint32_t PcgHash(uint32_t v)
+{
+    uint32_t state = v * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+inline float RandomUnorm(uint32_t& state)
+{
+    state = PcgHash(state);
+    return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+// Seed of one light sample; sample counts the samples of all earlier bounces of the pixel too.
+inline uint32_t LightSampleSeed(uint32_t x, uint32_t y, uint32_t frameIndex, uint32_t sample)
+{
+    return PcgHash(x + PcgHash(y + PcgHash(frameIndex * 64u + sample)));
+}
+
+// Where the shadow ray of a picked light aims: the centre of a point light, or a point of
+// the hemisphere of a spherical light that faces p. The picked point is then lit from like
+// a point light, which softens the shadow without integrating the sphere's solid angle.
+inline Float3 SampleLightPoint(const LightSource& light, const Float3& p, float u1, float u2)
+{
+    if (light.radius <= 0.0f)
+        return light.position;
+    Float3 w = Normalize(p - light.position);
+    // Orthonormal basis around w, "Building an Orthonormal Basis, Revisited" (Duff et al.)
+    float flip = w.z >= 0.0f ? 1.0f : -1.0f;
+    float a = -1.0f / (flip + w.z);
+    float b = w.x * w.y * a;
+    Float3 t(1.0f + flip * w.x * w.x * a, flip * b, -flip * w.x);
+    Float3 s(b, flip + w.y * w.y * a, -w.y);
+    float z = u1;
+    float r = sqrtf(MaxF(0.0f, 1.0f - z * z));
+    float phi = 6.28318530718f * u2;
+    return light.position + (t * (r * cosf(phi)) + s * (r * sinf(phi)) + w * z) * light.radius;
+}
+
+// One light sample of a hit as DirectLighting draws it. Returns false when no light is
+// above the surface, in which case no shadow ray is traced.
+inline bool SampleSceneLight(const LightBVH& bvh, const Float3& p, const Float3& n, uint32_t seed, LightSample& sample, Float3& target)
+{
+    uint32_t state = seed;
+    sample = SampleLightBVH(bvh.nodes.data(), (uint32_t)bvh.nodes.size(), p, n, RandomUnorm(state));
+    if (sample.pdf <= 0.0f)
+        return false;
+    float u1 = RandomUnorm(state);
+    float u2 = RandomUnorm(state);
+    target = SampleLightPoint(bvh.lights[sample.light], p, u1, u2);
+    return true;
+}
+
+#endif // LightBVH_h
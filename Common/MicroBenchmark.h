@@ -0,0 +1,135 @@
+/************************************************************************************
+Filename    :   MicroBenchmark.h
+Content     :   Timing repeated runs of a CPU kernel, with their spread, written out as JSON
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// Measure runs a kernel warmups times untimed, then repetitions times with each run timed on
+// its own, and keeps the mean, variance and order statistics of those times. The prepare
+// step runs before every run, outside the timing, for kernels that work in place. Timing is
+// std::chrono::steady_clock, as in FrameProfiler.h.
+
+#ifndef MicroBenchmark_h
+#define MicroBenchmark_h
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct MicroBenchmarkResult
+{
+    std::string name;
+    uint64_t items;             // Work per run, e.g. pixels or vertices, for the throughput
+    std::vector<double> milliseconds;
+    double meanMilliseconds;
+    double varianceMilliseconds;    // Sample variance, in ms^2
+    double minMilliseconds;
+    double medianMilliseconds;
+    double maxMilliseconds;
+
+    double StandardDeviation() const { return sqrt(varianceMilliseconds); }
+    double ItemsPerSecond() const { return meanMilliseconds > 0.0 ? items * 1000.0 / meanMilliseconds : 0.0; }
+};
+
+struct MicroBenchmark
+{
+    int warmups = 3;
+    int repetitions = 20;
+    std::vector<MicroBenchmarkResult> results;
+
+    template <typename Prepare, typename Run>
+    const MicroBenchmarkResult& Measure(const char* name, uint64_t items, Prepare prepare, Run run)
+    {
+        for (int w = 0; w < warmups; w++)
+        {
+            prepare();
+            run();
+        }
+
+        MicroBenchmarkResult result;
+        result.name = name;
+        result.items = items;
+        for (int r = 0; r < repetitions; r++)
+        {
+            prepare();
+            auto start = std::chrono::steady_clock::now();
+            run();
+            result.milliseconds.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+
+        double sum = 0.0;
+        for (double ms : result.milliseconds)
+            sum += ms;
+        size_t count = result.milliseconds.size();
+        result.meanMilliseconds = count ? sum / count : 0.0;
+        double squares = 0.0;
+        for (double ms : result.milliseconds)
+            squares += (ms - result.meanMilliseconds) * (ms - result.meanMilliseconds);
+        result.varianceMilliseconds = count > 1 ? squares / (count - 1) : 0.0;
+
+        std::vector<double> sorted = result.milliseconds;
+        std::sort(sorted.begin(), sorted.end());
+        result.minMilliseconds = count ? sorted.front() : 0.0;
+        result.maxMilliseconds = count ? sorted.back() : 0.0;
+        result.medianMilliseconds = !count ? 0.0 : (count & 1) ? sorted[count / 2] : 0.5 * (sorted[count / 2 - 1] + sorted[count / 2]);
+
+        results.push_back(result);
+        return results.back();
+    }
+
+    template <typename Run>
+    const MicroBenchmarkResult& Measure(const char* name, uint64_t items, Run run)
+    {
+        return Measure(name, items, []() {}, run);
+    }
+
+    // One line per benchmark, for reading at a terminal.
+    void Print(FILE* file) const
+    {
+        fprintf(file, "%-34s %12s %10s %10s %10s %10s %14s\n", "Benchmark", "Items", "mean ms", "stddev", "median", "min", "items/s");
+        for (const MicroBenchmarkResult& result : results)
+            fprintf(file, "%-34s %12llu %10.4f %10.4f %10.4f %10.4f %14.0f\n", result.name.c_str(), (unsigned long long)result.items,
+                result.meanMilliseconds, result.StandardDeviation(), result.medianMilliseconds, result.minMilliseconds, result.ItemsPerSecond());
+    }
+
+    // Names are written as they are, so they must not need escaping.
+    bool WriteJson(const char* path) const
+    {
+        FILE* file = fopen(path, "w");
+        if (!file)
+            return false;
+        fprintf(file, "{\n  \"warmups\": %d,\n  \"repetitions\": %d,\n  \"benchmarks\": [", warmups, repetitions);
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const MicroBenchmarkResult& result = results[i];
+            fprintf(file, "%s\n    {\"name\": \"%s\", \"items\": %llu, \"mean_ms\": %.6f, \"variance_ms2\": %.9f, \"stddev_ms\": %.6f, "
+                "\"min_ms\": %.6f, \"median_ms\": %.6f, \"max_ms\": %.6f, \"items_per_second\": %.1f, \"runs_ms\": [",
+                i ? "," : "", result.name.c_str(), (unsigned long long)result.items, result.meanMilliseconds, result.varianceMilliseconds,
+                result.StandardDeviation(), result.minMilliseconds, result.medianMilliseconds, result.maxMilliseconds, result.ItemsPerSecond());
+            for (size_t r = 0; r < result.milliseconds.size(); r++)
+                fprintf(file, "%s%.6f", r ? ", " : "", result.milliseconds[r]);
+            fprintf(file, "]}");
+        }
+        fprintf(file, "\n  ]\n}\n");
+        return fclose(file) == 0;
+    }
+};
+
+#endif // MicroBenchmark_h
@@ -0,0 +1,91 @@
+/************************************************************************************
+Filename    :   ObjMesh.h
+Content     :   Turns the face corners of a tinyobj mesh into indexed, deduplicated vertices
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// VertexBuffer::AddGlobalObj and Model::InitFromObj both build their vertices through these.
+// The vertex type is a template parameter so the same code runs without DirectXMath: it needs
+// a constructor from the 8 floats, operator== and position, normal and uv members with x, y
+// (and z) fields, as Vertex in Win32_DirectX12AppUtil.h has.
+
+#ifndef ObjMesh_h
+#define ObjMesh_h
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+// Win32_DirectX12AppUtil.h includes it first with TINYOBJLOADER_IMPLEMENTATION, which has no guard
+#ifndef TINY_OBJ_LOADER_H_
+#include "tiny_obj_loader.h"
+#endif
+
+template <typename VertexType>
+struct ObjVertexHash
+{
+    std::size_t operator()(const VertexType& vertex) const
+    {
+        return ((std::hash<float>()(vertex.position.x) ^ (std::hash<float>()(vertex.position.y) << 1)) >> 1) ^
+            ((std::hash<float>()(vertex.position.z) ^ (std::hash<float>()(vertex.normal.x) << 1)) >> 1) ^
+            ((std::hash<float>()(vertex.normal.y) ^ (std::hash<float>()(vertex.normal.z) << 1)) >> 1) ^
+            ((std::hash<float>()(vertex.uv.x) ^ (std::hash<float>()(vertex.uv.y) << 1)) >> 1);
+    }
+};
+
+// The vertex of one face corner, with a zero normal or uv where the OBJ has none.
+template <typename VertexType>
+VertexType ObjCornerVertex(const tinyobj::attrib_t& attrib, const tinyobj::index_t& index)
+{
+    VertexType vertex = { 0, 0, 0, 0, 0, 0, 0, 0 };
+
+    vertex.position.x = attrib.vertices[3 * index.vertex_index + 0];
+    vertex.position.y = attrib.vertices[3 * index.vertex_index + 1];
+    vertex.position.z = attrib.vertices[3 * index.vertex_index + 2];
+
+    if (index.normal_index >= 0) {
+        vertex.normal.x = attrib.normals[3 * index.normal_index + 0];
+        vertex.normal.y = attrib.normals[3 * index.normal_index + 1];
+        vertex.normal.z = attrib.normals[3 * index.normal_index + 2];
+    }
+
+    if (index.texcoord_index >= 0) {
+        vertex.uv.x = attrib.texcoords[2 * index.texcoord_index + 0];
+        vertex.uv.y = attrib.texcoords[2 * index.texcoord_index + 1];
+    }
+    return vertex;
+}
+
+// Gives each distinct vertex one index into the vertices it has been added to.
+template <typename VertexType>
+struct ObjVertexIndexer
+{
+    std::unordered_map<VertexType, unsigned int, ObjVertexHash<VertexType>> uniqueVertices;
+
+    void Add(const VertexType& vertex, std::vector<VertexType>& vertices, std::vector<unsigned int>& indices)
+    {
+        // Check if the vertex is unique
+        if (uniqueVertices.count(vertex) == 0) {
+            uniqueVertices[vertex] = static_cast<unsigned int>(vertices.size());
+            vertices.push_back(vertex);
+        }
+
+        indices.push_back(uniqueVertices[vertex]);
+    }
+
+    void Clear() { uniqueVertices.clear(); }
+};
+
+#endif // ObjMesh_h
@@ -0,0 +1,166 @@
+/************************************************************************************
+Filename    :   OpacityClasses.h
+Content     :   Load time opacity classification of alpha tested triangles
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// Marking a whole mesh non-opaque runs the any hit alpha test on every triangle of it.
+// Instead each triangle's UV footprint is rasterized against the alpha channel once at
+// load time: triangles that only cover opaque texels stay in the opaque geometry, ones
+// that only cover cut out texels are dropped, and only the mixed rest goes into a
+// non-opaque geometry with the alpha tested hit group.
+//
+// PassesAlphaTest compares bilinearly filtered alpha against one half. A filtered value
+// is a blend of the four texels around the sample, so the footprint is grown by a texel
+// and a half on every side; a triangle is only opaque or transparent when every texel
+// that can reach one of its samples agrees.
+
+#ifndef OpacityClasses_h
+#define OpacityClasses_h
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+
+// PassesAlphaTest in Raytracing.hlsl
+#define ALPHA_CUTOFF 128
+
+enum TriangleOpacity
+{
+    TriangleOpacity_Opaque = 0,
+    TriangleOpacity_Transparent,
+    TriangleOpacity_Mixed,
+};
+
+// Alpha channel of a texture as the alpha test sees it, wrapping like TriangleSurface.
+struct AlphaMask
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<uint8_t> alpha;
+    uint32_t opaqueTexels = 0;      // Texels at or above ALPHA_CUTOFF
+
+    AlphaMask() {}
+
+    // pixels are packed RGBA with alpha in the top byte, as Texture loads them.
+    AlphaMask(const uint32_t* pixels, uint32_t width, uint32_t height) : width(width), height(height), alpha(size_t(width) * height)
+    {
+        for (size_t i = 0; i < alpha.size(); i++)
+        {
+            alpha[i] = uint8_t(pixels[i] >> 24);
+            opaqueTexels += alpha[i] >= ALPHA_CUTOFF;
+        }
+    }
+
+    bool Empty() const { return alpha.empty(); }
+    bool FullyOpaque() const { return opaqueTexels == alpha.size(); }
+    bool FullyTransparent() const { return opaqueTexels == 0; }
+
+    bool Opaque(int64_t x, int64_t y) const
+    {
+        int64_t wx = x % (int64_t)width, wy = y % (int64_t)height;
+        if (wx < 0) wx += width;
+        if (wy < 0) wy += height;
+        return alpha[size_t(wy) * width + size_t(wx)] >= ALPHA_CUTOFF;
+    }
+};
+
+// uvs are the three texture coordinates of the triangle as stored in its vertices, u0 v0 u1 v1 u2 v2.
+inline TriangleOpacity ClassifyTriangleOpacity(const AlphaMask& mask, const float uvs[6])
+{
+    if (mask.Empty() || mask.FullyOpaque())
+        return TriangleOpacity_Opaque;
+    if (mask.FullyTransparent())
+        return TriangleOpacity_Transparent;
+
+    // Texel space with texel centres on integer coordinates
+    double px[3], py[3];
+    for (int i = 0; i < 3; i++)
+    {
+        px[i] = uvs[2 * i] * (double)mask.width - 0.5;
+        py[i] = uvs[2 * i + 1] * (double)mask.height - 0.5;
+    }
+
+    const double margin = 1.5;
+    double minX = fmin(px[0], fmin(px[1], px[2])) - margin, maxX = fmax(px[0], fmax(px[1], px[2])) + margin;
+    double minY = fmin(py[0], fmin(py[1], py[2])) - margin, maxY = fmax(py[0], fmax(py[1], py[2])) + margin;
+    int64_t x0 = (int64_t)ceil(minX), x1 = (int64_t)floor(maxX);
+    int64_t y0 = (int64_t)ceil(minY), y1 = (int64_t)floor(maxY);
+
+    // A footprint spanning the whole texture both ways reaches every texel, and the mask has both kinds
+    if (x1 - x0 + 1 >= (int64_t)mask.width && y1 - y0 + 1 >= (int64_t)mask.height)
+        return TriangleOpacity_Mixed;
+
+    // Edge normals scaled to give signed distances, positive inside. Degenerate triangles keep
+    // zero normals and so test their whole grown bounding box.
+    double area2 = (px[1] - px[0]) * (py[2] - py[0]) - (px[2] - px[0]) * (py[1] - py[0]);
+    double orientation = area2 < 0.0 ? -1.0 : 1.0;
+    double nx[3] = {}, ny[3] = {}, offset[3] = {};
+    if (fabs(area2) > 1e-12)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            int j = (i + 1) % 3;
+            double ex = px[j] - px[i], ey = py[j] - py[i];
+            double length = sqrt(ex * ex + ey * ey);
+            if (length <= 0.0)
+                continue;
+            nx[i] = -ey / length * orientation;
+            ny[i] = ex / length * orientation;
+            offset[i] = -(nx[i] * px[i] + ny[i] * py[i]);
+        }
+    }
+
+    bool sawOpaque = false, sawTransparent = false;
+    for (int64_t y = y0; y <= y1; y++)
+    {
+        for (int64_t x = x0; x <= x1; x++)
+        {
+            bool inside = true;
+            for (int i = 0; i < 3 && inside; i++)
+                inside = nx[i] * x + ny[i] * y + offset[i] >= -margin;
+            if (!inside)
+                continue;
+            if (mask.Opaque(x, y))
+                sawOpaque = true;
+            else
+                sawTransparent = true;
+            if (sawOpaque && sawTransparent)
+                return TriangleOpacity_Mixed;
+        }
+    }
+    return sawTransparent ? TriangleOpacity_Transparent : TriangleOpacity_Opaque;
+}
+
+// Triangle counts of one model, for the load time report.
+struct OpacityStats
+{
+    uint32_t opaque = 0;
+    uint32_t transparent = 0;   // Culled from the BLAS
+    uint32_t mixed = 0;         // Need the any hit alpha test
+
+    uint32_t Total() const { return opaque + transparent + mixed; }
+    float MixedFraction() const { return Total() ? float(mixed) / Total() : 0.0f; }
+
+    void Add(TriangleOpacity opacity)
+    {
+        if (opacity == TriangleOpacity_Opaque) opaque++;
+        else if (opacity == TriangleOpacity_Transparent) transparent++;
+        else mixed++;
+    }
+};
+
+#endif // OpacityClasses_h
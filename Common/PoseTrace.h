@@ -0,0 +1,144 @@
+/************************************************************************************
+Filename    :   PoseTrace.h
+Content     :   Per frame poses, controller input and keys, recorded to a binary trace
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// A trace holds everything MainLoop reads from the headset, the controllers and the keyboard
+// in one frame, so replaying it moves the camera and the hands exactly as they moved when it
+// was recorded, whatever the frame times of the build replaying it. TraceHmdSession in
+// HmdSession.h records and replays it around another session.
+//
+// The file is a PoseTraceHeader followed by one fixed size PoseTraceFrame per frame, in the
+// byte order of the machine that wrote it. The frame count is not stored: a recording cut
+// short still reads back up to its last whole frame.
+
+#ifndef PoseTrace_h
+#define PoseTrace_h
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define POSE_TRACE_MAGIC    0x43525450u     // "PTRC"
+#define POSE_TRACE_VERSION  1
+
+struct PoseTracePose
+{
+    float orientation[4];   // x, y, z, w
+    float position[3];
+};
+
+enum PoseTraceFlag
+{
+    PoseTraceFlag_HasInputFocus = 1 << 0,
+};
+
+struct PoseTraceFrame
+{
+    PoseTracePose eyes[2];          // As ovr_GetEyePoses returned them, IPD included
+    PoseTracePose hands[2];
+    uint32_t trackingStatus;        // ovrTrackingState::StatusFlags
+    uint32_t buttons;               // ovrInputState::Buttons
+    float thumbstick[2][2];
+    float indexTrigger[2];
+    float handTrigger[2];
+    uint32_t flags;                 // PoseTraceFlag bits
+    uint8_t keys[32];               // A bit per virtual key code
+
+    bool Key(int key) const { return (keys[key >> 3] >> (key & 7)) & 1; }
+    void SetKey(int key, bool down)
+    {
+        if (down)
+            keys[key >> 3] |= uint8_t(1 << (key & 7));
+        else
+            keys[key >> 3] &= uint8_t(~(1 << (key & 7)));
+    }
+};
+
+struct PoseTraceHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t frameSize;     // sizeof(PoseTraceFrame) of the writer, so a layout change is caught
+    uint32_t reserved;
+};
+
+//-----------------------------------------------------------
+struct PoseTraceWriter
+{
+    std::ofstream file;
+    uint64_t frames = 0;
+
+    bool Open(const std::string& path)
+    {
+        file.open(path, std::ios::binary | std::ios::trunc);
+        if (!file)
+            return false;
+        PoseTraceHeader header = { POSE_TRACE_MAGIC, POSE_TRACE_VERSION, uint32_t(sizeof(PoseTraceFrame)), 0 };
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        frames = 0;
+        return bool(file);
+    }
+
+    bool IsOpen() const { return file.is_open(); }
+
+    void Write(const PoseTraceFrame& frame)
+    {
+        file.write(reinterpret_cast<const char*>(&frame), sizeof(frame));
+        frames++;
+    }
+
+    void Close() { file.close(); }
+};
+
+// Reads the whole trace; on failure says why in error.
+inline bool ReadPoseTrace(const std::string& path, std::vector<PoseTraceFrame>& frames, std::string& error)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        error = "could not open " + path;
+        return false;
+    }
+    std::streamoff size = file.tellg();
+    file.seekg(0);
+
+    PoseTraceHeader header = {};
+    if (size < std::streamoff(sizeof(header)) || !file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        header.magic != POSE_TRACE_MAGIC)
+    {
+        error = path + " is not a pose trace";
+        return false;
+    }
+    if (header.version != POSE_TRACE_VERSION || header.frameSize != sizeof(PoseTraceFrame))
+    {
+        error = path + " was written by an incompatible build";
+        return false;
+    }
+
+    frames.resize(size_t((size - std::streamoff(sizeof(header))) / std::streamoff(sizeof(PoseTraceFrame))));
+    if (!frames.empty() && !file.read(reinterpret_cast<char*>(frames.data()), frames.size() * sizeof(PoseTraceFrame)))
+    {
+        error = "could not read " + path;
+        return false;
+    }
+    return true;
+}
+
+#endif // PoseTrace_h
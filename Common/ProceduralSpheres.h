@@ -0,0 +1,84 @@
+/************************************************************************************
+Filename    :   ProceduralSpheres.h
+Content     :   Sphere primitives for procedural AABB BLASes and a CPU reference of their intersection
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// A procedural BLAS holds one AABB per sphere. The spheres themselves live in a
+// structured buffer that the intersection and closest hit shaders index with
+// PrimitiveIndex(), so the layout below must match SpherePrimitive in Raytracing.hlsl.
+
+#ifndef ProceduralSpheres_h
+#define ProceduralSpheres_h
+
+#include <vector>
+#include "SceneQuery.h"
+
+struct SpherePrimitive
+{
+    Float3 center;          // Object space
+    float radius;
+    Float3 albedo;
+    float reflectivity;     // Weight of the mirror bounce on top of the diffuse color
+
+    SpherePrimitive() : radius(0.5f), albedo(0.0f, 0.7f, 0.7f), reflectivity(1.0f) {}
+    SpherePrimitive(const Float3& center, float radius, const Float3& albedo, float reflectivity)
+        : center(center), radius(radius), albedo(albedo), reflectivity(reflectivity) {}
+
+    Aabb Bounds() const { return Aabb(center - Float3(radius), center + Float3(radius)); }
+};
+
+static_assert(sizeof(SpherePrimitive) == 32, "SpherePrimitive must match the HLSL structured buffer stride");
+
+// CPU copy of RaySphereIntersectionTest in Raytracing.hlsl, including its numerically stable
+// quadratic and the choice between the near and far root. Returns the hit t or FLT_MAX.
+inline float ReferenceRaySphereIntersection(const Float3& origin, const Float3& direction, float tMin, float tMax,
+                                            const Float3& center, float radius)
+{
+    Float3 L = origin - center;
+    float a = Dot(direction, direction);
+    float b = 2.0f * Dot(direction, L);
+    float c = Dot(L, L) - radius * radius;
+    float discr = b * b - 4.0f * a * c;
+    if (discr < 0.0f)
+        return FLT_MAX;
+
+    float t0, t1;
+    if (discr == 0.0f)
+    {
+        t0 = t1 = -0.5f * b / a;
+    }
+    else
+    {
+        float q = (b > 0.0f) ? -0.5f * (b + sqrtf(discr)) : -0.5f * (b - sqrtf(discr));
+        t0 = q / a;
+        t1 = c / q;
+    }
+    if (t0 > t1)
+    {
+        float tmp = t0;
+        t0 = t1;
+        t1 = tmp;
+    }
+
+    if (t0 >= tMin && t0 <= tMax)
+        return t0;
+    if (t1 >= tMin && t1 <= tMax)
+        return t1;
+    return FLT_MAX;
+}
+
+#endif // ProceduralSpheres_h
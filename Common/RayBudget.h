@@ -0,0 +1,255 @@
+/************************************************************************************
+Filename    :   RayBudget.h
+Content     :   Spreads a per frame secondary ray budget over screen tiles by importance
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// The screen is cut into RAY_BUDGET_TILE_SIZE tiles. RayBudgetStats.hlsl sums up what each
+// tile showed last frame: how many of its pixels are lit, how many reflect and how much,
+// and how bright they came out. AllocateRayBudget turns that into light samples and
+// reflection bounces per tile that fit a ray count, and ShadeSecondary in Raytracing.hlsl
+// clamps lightSamples and maxBounces to them.
+//
+// Every tile keeps one light sample whatever the budget, since none would leave it
+// unshadowed; those rays are reported as mandatoryRays. The rest of the budget goes in
+// increments of one sample or one bounce for a tile, always to the increment that buys
+// the most per ray:
+//   - a light sample takes a tile's noise from 1 / n to 1 / (n + 1) of one sample's,
+//     weighed by its mean luminance, since noise shows in proportion to the signal;
+//   - bounce k shows the reflectivity to the power k of its reflective pixels.
+// Both are weighed by closeness to the fovea, which without eye tracking is the fixed
+// point of the eye's image in settings. Rays are counted as ShadeSecondary would trace
+// them at most: a sample per lit pixel, and per bounce of a reflective pixel a reflection
+// ray plus the samples lighting what it finds.
+
+#ifndef RayBudget_h
+#define RayBudget_h
+
+#include <vector>
+#include <queue>
+#include <chrono>
+#include "SecondaryRays.h"
+
+// Must match Raytracing.hlsl and RayBudgetStats.hlsl
+#define RAY_BUDGET_TILE_SIZE 16
+#define RAY_BUDGET_UNIT 255.0f      // Sums of RayBudgetTileStats count in steps of 1 / RAY_BUDGET_UNIT
+
+// What one tile showed in a frame, as RayBudgetStats.hlsl writes it.
+struct RayBudgetTileStats
+{
+    uint32_t litPixels;         // Surface pixels that are not SURFACE_UNLIT
+    uint32_t reflectivePixels;  // Surface pixels with a reflectivity above zero
+    uint32_t reflectivitySum;   // Of the reflective pixels
+    uint32_t luminanceSum;      // Of the final color of the lit pixels
+
+    float MeanReflectivity() const { return reflectivePixels ? reflectivitySum / (RAY_BUDGET_UNIT * reflectivePixels) : 0.0f; }
+    float MeanLuminance() const { return litPixels ? luminanceSum / (RAY_BUDGET_UNIT * litPixels) : 0.0f; }
+};
+
+static_assert(sizeof(RayBudgetTileStats) == 16, "RayBudgetTileStats must match the HLSL structured buffer stride");
+
+// Packed as ShadeSecondary reads it: light samples in the low byte, reflection bounces in the next.
+inline uint32_t PackRayBudget(uint32_t lightSamples, uint32_t bounces) { return lightSamples | (bounces << 8); }
+inline uint32_t RayBudgetLightSamples(uint32_t packed) { return packed & 0xff; }
+inline uint32_t RayBudgetBounces(uint32_t packed) { return (packed >> 8) & 0xff; }
+
+inline uint32_t RayBudgetTiles(uint32_t pixels) { return (pixels + RAY_BUDGET_TILE_SIZE - 1) / RAY_BUDGET_TILE_SIZE; }
+
+struct RayBudgetSettings
+{
+    double rayTarget = 0.0;             // Secondary rays to spend on the frame
+    uint32_t maxLightSamples = 1;       // The scene's lightSamples, no tile gets more
+    uint32_t maxBounces = 1;            // The scene's maxBounces
+    float raysPerPixel = 1.0f;          // 1 / secondaryScale squared, the share of pixels that trace
+    float foveaX = 0.5f;                // Of the eye's image, 0 to 1 across
+    float foveaY = 0.5f;
+    float foveaRadius = 0.3f;           // Distance from the fovea at which importance halves, in image widths
+    float luminanceFloor = 0.05f;       // Keeps dark tiles from counting for nothing
+    float reflectionWeight = 1.0f;      // Of a bounce against a light sample
+};
+
+struct RayBudgetAllocation
+{
+    std::vector<uint32_t> tiles;        // PackRayBudget for each tile, row by row
+    double rays = 0.0;                  // The allocation traces at most this many
+    double mandatoryRays = 0.0;         // Of the first light sample of every tile, granted over budget too
+};
+
+inline float RayBudgetFoveation(uint32_t tileX, uint32_t tileY, uint32_t tilesX, uint32_t tilesY, const RayBudgetSettings& settings)
+{
+    float dx = (tileX + 0.5f) / tilesX - settings.foveaX;
+    // Tiles are square, so vertical distances are in image widths too
+    float dy = ((tileY + 0.5f) / tilesY - settings.foveaY) * tilesY / tilesX;
+    float d2 = (dx * dx + dy * dy) / (settings.foveaRadius * settings.foveaRadius);
+    return 1.0f / (1.0f + d2);
+}
+
+// Most rays a tile traces with the given light samples and bounces, see the top of the file.
+inline double RayBudgetTileRays(const RayBudgetTileStats& stats, uint32_t lightSamples, uint32_t bounces, float raysPerPixel)
+{
+    return (double(stats.litPixels) * lightSamples + double(stats.reflectivePixels) * bounces * (1.0 + lightSamples)) * raysPerPixel;
+}
+
+inline RayBudgetAllocation AllocateRayBudget(uint32_t tilesX, uint32_t tilesY, const RayBudgetTileStats* stats, const RayBudgetSettings& settings)
+{
+    RayBudgetAllocation allocation;
+    uint32_t tileCount = tilesX * tilesY;
+    allocation.tiles.assign(tileCount, 0);
+    std::vector<float> foveation(tileCount);
+    for (uint32_t i = 0; i < tileCount; i++)
+    {
+        foveation[i] = RayBudgetFoveation(i % tilesX, i / tilesX, tilesX, tilesY, settings);
+        // Tiles that showed nothing last frame may show something now
+        if (settings.maxLightSamples > 0)
+        {
+            allocation.tiles[i] = PackRayBudget(1, 0);
+            allocation.mandatoryRays += RayBudgetTileRays(stats[i], 1, 0, settings.raysPerPixel);
+        }
+    }
+    allocation.rays = allocation.mandatoryRays;
+
+    // Candidates remember the tile's allocation they were priced against, and are priced again
+    // when it changed since; a bounce changes what a light sample costs and the other way round.
+    struct Candidate
+    {
+        float value;                // Per ray
+        uint32_t tile;
+        uint32_t packed;
+        bool bounce;
+        bool operator<(const Candidate& other) const { return value < other.value; }
+    };
+    auto Price = [&](uint32_t tile, bool bounce, Candidate& candidate)
+        {
+            uint32_t packed = allocation.tiles[tile];
+            uint32_t samples = RayBudgetLightSamples(packed), bounces = RayBudgetBounces(packed);
+            const RayBudgetTileStats& s = stats[tile];
+            float gain;
+            if (bounce)
+            {
+                if (bounces >= settings.maxBounces || s.reflectivePixels == 0)
+                    return false;
+                gain = settings.reflectionWeight * powf(s.MeanReflectivity(), float(bounces + 1)) * s.reflectivePixels;
+            }
+            else
+            {
+                if (samples == 0 || samples >= settings.maxLightSamples)
+                    return false;
+                float luminance = MaxF(s.MeanLuminance(), settings.luminanceFloor);
+                gain = (1.0f / samples - 1.0f / (samples + 1)) * luminance * s.litPixels;
+            }
+            double cost = RayBudgetTileRays(s, samples + (bounce ? 0 : 1), bounces + (bounce ? 1 : 0), settings.raysPerPixel)
+                - RayBudgetTileRays(s, samples, bounces, settings.raysPerPixel);
+            if (cost <= 0.0 || gain <= 0.0f)
+                return false;
+            candidate.value = float(gain * foveation[tile] / cost);
+            candidate.tile = tile;
+            candidate.packed = packed;
+            candidate.bounce = bounce;
+            return true;
+        };
+
+    std::priority_queue<Candidate> candidates;
+    Candidate candidate;
+    for (uint32_t i = 0; i < tileCount; i++)
+    {
+        if (Price(i, false, candidate))
+            candidates.push(candidate);
+        if (Price(i, true, candidate))
+            candidates.push(candidate);
+    }
+    while (!candidates.empty())
+    {
+        candidate = candidates.top();
+        candidates.pop();
+        uint32_t tile = candidate.tile;
+        if (candidate.packed != allocation.tiles[tile])
+        {
+            if (Price(tile, candidate.bounce, candidate))
+                candidates.push(candidate);
+            continue;
+        }
+        uint32_t samples = RayBudgetLightSamples(candidate.packed), bounces = RayBudgetBounces(candidate.packed);
+        uint32_t next = candidate.bounce ? PackRayBudget(samples, bounces + 1) : PackRayBudget(samples + 1, bounces);
+        double cost = RayBudgetTileRays(stats[tile], RayBudgetLightSamples(next), RayBudgetBounces(next), settings.raysPerPixel)
+            - RayBudgetTileRays(stats[tile], samples, bounces, settings.raysPerPixel);
+        // Too dear for what is left, though a cheaper increment elsewhere may still fit
+        if (allocation.rays + cost > settings.rayTarget)
+            continue;
+        allocation.tiles[tile] = next;
+        allocation.rays += cost;
+        if (Price(tile, candidate.bounce, candidate))
+            candidates.push(candidate);
+    }
+    return allocation;
+}
+
+// RayBudgetStats.hlsl on a readback of the G-buffer and the R8G8B8A8 image shaded from it.
+inline std::vector<RayBudgetTileStats> GatherRayBudgetStats(uint32_t width, uint32_t height, const GBufferTexel* gbuffer, const uint32_t* color)
+{
+    uint32_t tilesX = RayBudgetTiles(width), tilesY = RayBudgetTiles(height);
+    std::vector<RayBudgetTileStats> stats(size_t(tilesX) * tilesY, RayBudgetTileStats{ 0, 0, 0, 0 });
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            const GBufferTexel& texel = gbuffer[size_t(y) * width + x];
+            if (!texel.Hit())
+                continue;
+            RayBudgetTileStats& tile = stats[(y / RAY_BUDGET_TILE_SIZE) * tilesX + x / RAY_BUDGET_TILE_SIZE];
+            if (!texel.Unlit())
+            {
+                uint32_t c = color[size_t(y) * width + x];
+                float luminance = (0.2126f * (c & 0xff) + 0.7152f * ((c >> 8) & 0xff) + 0.0722f * ((c >> 16) & 0xff)) / 255.0f;
+                tile.litPixels++;
+                tile.luminanceSum += uint32_t(ClampF(luminance, 0.0f, 1.0f) * RAY_BUDGET_UNIT + 0.5f);
+            }
+            float reflectivity = texel.Reflectivity();
+            if (reflectivity > 0.0f)
+            {
+                tile.reflectivePixels++;
+                tile.reflectivitySum += uint32_t(ClampF(reflectivity, 0.0f, 1.0f) * RAY_BUDGET_UNIT + 0.5f);
+            }
+        }
+    }
+    return stats;
+}
+
+struct RayBudgetReport
+{
+    uint32_t tiles = 0;
+    double unbudgetedRays = 0.0;        // What every tile would trace at the scene's full settings
+    double rays = 0.0;                  // Of the allocation, at most
+    double mandatoryRays = 0.0;
+    double milliseconds = 0.0;          // Of AllocateRayBudget
+};
+
+// Times AllocateRayBudget on the statistics of a frame and compares what it spends with the
+// full settings.
+inline RayBudgetReport MeasureRayBudget(uint32_t tilesX, uint32_t tilesY, const RayBudgetTileStats* stats, const RayBudgetSettings& settings)
+{
+    RayBudgetReport report;
+    report.tiles = tilesX * tilesY;
+    for (uint32_t i = 0; i < report.tiles; i++)
+        report.unbudgetedRays += RayBudgetTileRays(stats[i], settings.maxLightSamples, stats[i].reflectivePixels ? settings.maxBounces : 0, settings.raysPerPixel);
+    auto start = std::chrono::steady_clock::now();
+    RayBudgetAllocation allocation = AllocateRayBudget(tilesX, tilesY, stats, settings);
+    report.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    report.rays = allocation.rays;
+    report.mandatoryRays = allocation.mandatoryRays;
+    return report;
+}
+
+#endif // RayBudget_h
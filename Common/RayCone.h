@@ -0,0 +1,96 @@
+/************************************************************************************
+Filename    :   RayCone.h
+Content     :   CPU reference of the ray cone texture LOD used by the closest hit shaders
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// Ray cones follow "Texture Level of Detail Strategies for Real-Time Ray Tracing"
+// (Akenine-Moller et al., Ray Tracing Gems). Every primary ray starts as a cone with the
+// angle between neighbouring pixels; its width grows with distance and is carried through
+// mirror reflections unchanged in spread, since all reflecting triangles are flat. At a
+// hit the mip is
+//
+//     lod = 0.5 * log2(texelArea / worldArea) + log2(width) - log2(|dot(direction, normal)|)
+//
+// The functions below match Raytracing.hlsl term by term, so the shader can be checked
+// against them for a given hit.
+
+#ifndef RayCone_h
+#define RayCone_h
+
+#include "CameraRays.h"
+
+struct RayCone
+{
+    float width;
+    float spreadAngle;
+
+    RayCone(float width = 0.0f, float spreadAngle = 0.0f) : width(width), spreadAngle(spreadAngle) {}
+
+    RayCone Propagate(float t) const { return RayCone(width + spreadAngle * t, spreadAngle); }
+};
+
+// Angle between the rays through the centre pixel and the one below it, the
+// pixelSpreadAngle of the scene constants. Taken from the cross product, since acos of a dot
+// this close to 1 has only a few bits left at headset resolutions.
+inline float PixelSpreadAngle(const float projectionToWorld[16], const Float3& eye, uint32_t width, uint32_t height)
+{
+    Float3 centre = CameraRayDirection(projectionToWorld, eye, width / 2, height / 2, width, height);
+    Float3 below = CameraRayDirection(projectionToWorld, eye, width / 2, height / 2 + 1, width, height);
+    return atan2f(Length(Cross(centre, below)), Dot(centre, below));
+}
+
+// The same for the rays of a frustum, as the scene uploads it.
+inline float PixelSpreadAngle(const CameraRayFrustum& frustum, uint32_t width, uint32_t height)
+{
+    Float3 centre = FrustumRayDirection(frustum, width / 2, height / 2);
+    Float3 below = FrustumRayDirection(frustum, width / 2, height / 2 + 1);
+    return atan2f(Length(Cross(centre, below)), Dot(centre, below));
+}
+
+struct TexCoord
+{
+    float u, v;
+};
+
+// Twice the area of a triangle in texels, with the instance UV scale already applied to the coordinates.
+inline float TriangleTexelArea(const TexCoord& t0, const TexCoord& t1, const TexCoord& t2, uint32_t textureWidth, uint32_t textureHeight)
+{
+    float du1 = (t1.u - t0.u) * textureWidth, dv1 = (t1.v - t0.v) * textureHeight;
+    float du2 = (t2.u - t0.u) * textureWidth, dv2 = (t2.v - t0.v) * textureHeight;
+    return fabsf(du1 * dv2 - du2 * dv1);
+}
+
+// Unclamped mip level of a cone of the given width hitting a triangle; worldCross is the
+// cross product of its world space edges, twice its area in length along its normal.
+inline float RayConeTextureLod(float texelArea, const Float3& worldCross, float coneWidth, const Float3& rayDirection)
+{
+    float worldArea = Length(worldCross);
+    float lod = 0.5f * log2f(texelArea / MaxF(worldArea, 1e-12f));
+    lod += log2f(coneWidth);
+    lod -= log2f(fabsf(Dot(rayDirection, worldCross / MaxF(worldArea, 1e-12f))));
+    return lod;
+}
+
+// What the sampler sees: a zero width is the top mip, anything else is kept inside the texture's own chain.
+inline float ClampTextureLod(float lod, float coneWidth, uint32_t mipLevels)
+{
+    if (coneWidth <= 0.0f)
+        return 0.0f;
+    return ClampF(lod, 0.0f, mipLevels - 1.0f);
+}
+
+#endif // RayCone_h
@@ -0,0 +1,844 @@
+/************************************************************************************
+Filename    :   SceneQuery.h
+Content     :   Batched CPU ray casts, sphere sweeps and box overlaps over scene geometry
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// Mirrors the two level layout the GPU traces: meshes play the role of BLASes and
+// instances carry the same 3x4 transform, InstanceID and InstanceMask as the TLAS
+// input, so gameplay code (controller pointing, teleport targets, camera collision)
+// can ask questions about the scene without waiting frames for a GPU readback.
+// Queries only read the structure, so batches are split across worker threads.
+
+#ifndef SceneQuery_h
+#define SceneQuery_h
+
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include "VectorMath.h"
+
+#define QUERY_NO_HIT 0xffffffff
+
+enum QueryRayFlags : uint32_t
+{
+    QUERY_CLOSEST_HIT = 0,
+    QUERY_ANY_HIT = 1,  // Stop at the first hit found, like RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH
+    QUERY_CULL_BACK_FACING = 2,     // Like RAY_FLAG_CULL_BACK_FACING_TRIANGLES, also skips leaving a sphere
+};
+
+struct QueryRay
+{
+    Float3 origin;
+    float tMin = 0.0f;
+    Float3 direction;
+    float tMax = FLT_MAX;
+    uint32_t mask = 0xff;
+    uint32_t flags = QUERY_CLOSEST_HIT;
+};
+
+// Sphere of the given radius moved from origin along the normalized direction.
+struct QuerySweep
+{
+    Float3 origin;
+    float radius = 0.0f;
+    Float3 direction;
+    float maxDistance = FLT_MAX;
+    uint32_t mask = 0xff;
+};
+
+struct QueryOverlap
+{
+    Aabb bounds;
+    uint32_t mask = 0xff;
+};
+
+struct QueryHit
+{
+    float t = FLT_MAX;
+    uint32_t instanceId = QUERY_NO_HIT;
+    uint32_t primitiveIndex = 0;
+    Float3 normal;              // World space, facing the query
+
+    bool Hit() const { return instanceId != QUERY_NO_HIT; }
+};
+
+struct QuerySphere
+{
+    Float3 center;
+    float radius;
+};
+
+//-----------------------------------------------------------
+// Bounding volume hierarchy over a set of boxes. Children of an interior node are
+// stored next to each other; leaves reference a range of primIndices.
+struct QueryBvh
+{
+    struct Node
+    {
+        Aabb bounds;
+        uint32_t firstChildOrPrim;
+        uint32_t primCount;     // 0 for interior nodes
+    };
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> primIndices;
+
+    enum { MaxLeafSize = 4, MaxDepth = 64 };
+
+    void Build(const std::vector<Aabb>& primBounds)
+    {
+        nodes.clear();
+        primIndices.resize(primBounds.size());
+        for (uint32_t i = 0; i < primIndices.size(); i++)
+            primIndices[i] = i;
+        if (primBounds.empty())
+            return;
+
+        std::vector<Float3> centers(primBounds.size());
+        for (size_t i = 0; i < primBounds.size(); i++)
+            centers[i] = primBounds[i].Center();
+
+        nodes.reserve(primBounds.size() * 2);
+        nodes.push_back(Node());
+        Subdivide(0, 0, (uint32_t)primIndices.size(), primBounds, centers, 0);
+    }
+
+    const Aabb& Bounds() const { return nodes[0].bounds; }
+
+private:
+    void Subdivide(uint32_t nodeIndex, uint32_t first, uint32_t count,
+                   const std::vector<Aabb>& primBounds, const std::vector<Float3>& centers, int depth)
+    {
+        Aabb bounds, centerBounds;
+        for (uint32_t i = first; i < first + count; i++)
+        {
+            bounds.Grow(primBounds[primIndices[i]]);
+            centerBounds.Grow(centers[primIndices[i]]);
+        }
+        nodes[nodeIndex].bounds = bounds;
+
+        Float3 spread = centerBounds.hi - centerBounds.lo;
+        int axis = (spread.x > spread.y && spread.x > spread.z) ? 0 : (spread.y > spread.z ? 1 : 2);
+        if (count <= MaxLeafSize || depth >= MaxDepth - 2 || spread[axis] <= 0.0f)
+        {
+            nodes[nodeIndex].firstChildOrPrim = first;
+            nodes[nodeIndex].primCount = count;
+            return;
+        }
+
+        // Median split on the widest centroid axis keeps the tree balanced and the build cheap.
+        uint32_t half = count / 2;
+        std::nth_element(primIndices.begin() + first, primIndices.begin() + first + half, primIndices.begin() + first + count,
+            [&](uint32_t a, uint32_t b) { return centers[a][axis] < centers[b][axis]; });
+
+        uint32_t left = (uint32_t)nodes.size();
+        nodes[nodeIndex].firstChildOrPrim = left;
+        nodes[nodeIndex].primCount = 0;
+        nodes.push_back(Node());
+        nodes.push_back(Node());
+        Subdivide(left, first, half, primBounds, centers, depth + 1);
+        Subdivide(left + 1, first + half, count - half, primBounds, centers, depth + 1);
+    }
+};
+
+//-----------------------------------------------------------
+// Exact primitive tests shared by the query types.
+struct QueryGeometry
+{
+    // Slab test, returns the entry distance or FLT_MAX on a miss.
+    static float RayBox(const Float3& origin, const Float3& invDir, const Aabb& box, float tMin, float tMax)
+    {
+        float t0 = tMin, t1 = tMax;
+        for (int a = 0; a < 3; a++)
+        {
+            float tNear = (box.lo[a] - origin[a]) * invDir[a];
+            float tFar = (box.hi[a] - origin[a]) * invDir[a];
+            if (tNear > tFar) { float tmp = tNear; tNear = tFar; tFar = tmp; }
+            t0 = tNear > t0 ? tNear : t0;
+            t1 = tFar < t1 ? tFar : t1;
+            if (t0 > t1)
+                return FLT_MAX;
+        }
+        return t0;
+    }
+
+    // Moller-Trumbore, both faces unless culled. Triangles wound clockwise as seen from the
+    // origin are front facing, as in DXR. Returns t or FLT_MAX.
+    static float RayTriangle(const Float3& origin, const Float3& dir, const Float3& a, const Float3& b, const Float3& c, float tMin, float tMax,
+                             bool cullBackFacing = false)
+    {
+        Float3 e1 = b - a;
+        Float3 e2 = c - a;
+        Float3 p = Cross(dir, e2);
+        float det = Dot(e1, p);
+        if (cullBackFacing ? det < 1e-12f : fabsf(det) < 1e-12f)
+            return FLT_MAX;
+        float invDet = 1.0f / det;
+        Float3 s = origin - a;
+        float u = Dot(s, p) * invDet;
+        if (u < 0.0f || u > 1.0f)
+            return FLT_MAX;
+        Float3 q = Cross(s, e1);
+        float v = Dot(dir, q) * invDet;
+        if (v < 0.0f || u + v > 1.0f)
+            return FLT_MAX;
+        float t = Dot(e2, q) * invDet;
+        return (t >= tMin && t <= tMax) ? t : FLT_MAX;
+    }
+
+    // Nearest t >= tMin where the ray enters the sphere, or leaves it unless entryOnly. FLT_MAX on a miss.
+    // dir need not be normalized.
+    static float RaySphere(const Float3& origin, const Float3& dir, const Float3& center, float radius, float tMin, float tMax,
+                           bool entryOnly = false)
+    {
+        Float3 oc = origin - center;
+        float a = Dot(dir, dir);
+        float b = Dot(oc, dir);
+        float c = Dot(oc, oc) - radius * radius;
+        float h = b * b - a * c;
+        if (h < 0.0f || a <= 0.0f)
+            return FLT_MAX;
+        h = sqrtf(h);
+        float t = (-b - h) / a;
+        if (t < tMin && !entryOnly)
+            t = (-b + h) / a;
+        return (t >= tMin && t <= tMax) ? t : FLT_MAX;
+    }
+
+    // Closest point on triangle abc to p (Ericson, Real-Time Collision Detection 5.1.5).
+    static Float3 ClosestPointOnTriangle(const Float3& p, const Float3& a, const Float3& b, const Float3& c)
+    {
+        Float3 ab = b - a, ac = c - a, ap = p - a;
+        float d1 = Dot(ab, ap), d2 = Dot(ac, ap);
+        if (d1 <= 0.0f && d2 <= 0.0f) return a;
+        Float3 bp = p - b;
+        float d3 = Dot(ab, bp), d4 = Dot(ac, bp);
+        if (d3 >= 0.0f && d4 <= d3) return b;
+        float vc = d1 * d4 - d3 * d2;
+        if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+        Float3 cp = p - c;
+        float d5 = Dot(ab, cp), d6 = Dot(ac, cp);
+        if (d6 >= 0.0f && d5 <= d6) return c;
+        float vb = d5 * d2 - d1 * d6;
+        if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+        float va = d3 * d6 - d5 * d4;
+        if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+        float denom = 1.0f / (va + vb + vc);
+        return a + ab * (vb * denom) + ac * (vc * denom);
+    }
+
+    // Ray against the side of the capsule around segment pa-pb. dir must be normalized.
+    static float RayCylinder(const Float3& origin, const Float3& dir, const Float3& pa, const Float3& pb, float radius, float tMax)
+    {
+        Float3 ba = pb - pa;
+        Float3 oa = origin - pa;
+        float baba = Dot(ba, ba);
+        float bard = Dot(ba, dir);
+        float baoa = Dot(ba, oa);
+        float a = baba - bard * bard;
+        if (a < 1e-12f)
+            return FLT_MAX;     // Parallel to the segment, the end caps handle it
+        float b = baba * Dot(oa, dir) - baoa * bard;
+        float c = baba * Dot(oa, oa) - baoa * baoa - radius * radius * baba;
+        float h = b * b - a * c;
+        if (h < 0.0f)
+            return FLT_MAX;
+        float t = (-b - sqrtf(h)) / a;
+        float y = baoa + t * bard;
+        return (t >= 0.0f && t <= tMax && y > 0.0f && y < baba) ? t : FLT_MAX;
+    }
+
+    // Distance a sphere travels along the normalized dir before touching the triangle.
+    static float SweepSphereTriangle(const Float3& origin, const Float3& dir, float radius,
+                                     const Float3& a, const Float3& b, const Float3& c, float tMax)
+    {
+        Float3 closest = ClosestPointOnTriangle(origin, a, b, c);
+        if (LengthSq(closest - origin) <= radius * radius)
+            return 0.0f;
+
+        float best = FLT_MAX;
+
+        // Face: the plane pushed out by the radius towards the sphere.
+        Float3 n = Normalize(Cross(b - a, c - a));
+        float dist = Dot(origin - a, n);
+        if (dist < 0.0f)
+        {
+            n = -n;
+            dist = -dist;
+        }
+        float approach = -Dot(dir, n);
+        if (approach > 0.0f)
+        {
+            float t = (dist - radius) / approach;
+            Float3 contact = origin + dir * t - n * radius;
+            if (t >= 0.0f && t <= tMax && LengthSq(ClosestPointOnTriangle(contact, a, b, c) - contact) < 1e-10f)
+                best = t;
+        }
+
+        // Edges and corners: capsules around each edge.
+        const Float3* verts[3] = { &a, &b, &c };
+        for (int e = 0; e < 3; e++)
+        {
+            const Float3& p0 = *verts[e];
+            const Float3& p1 = *verts[(e + 1) % 3];
+            best = MinF(best, RayCylinder(origin, dir, p0, p1, radius, MinF(best, tMax)));
+            best = MinF(best, RaySphere(origin, dir, p0, radius, 0.0f, MinF(best, tMax)));
+        }
+        return best;
+    }
+
+    // Separating axis test between a triangle and a box (Akenine-Moller).
+    static bool TriangleOverlapsBox(const Float3& a, const Float3& b, const Float3& c, const Aabb& box)
+    {
+        Float3 center = box.Center();
+        Float3 h = box.Extents();
+        Float3 v[3] = { a - center, b - center, c - center };
+        Float3 f[3] = { v[1] - v[0], v[2] - v[1], v[0] - v[2] };
+
+        // Box face normals
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float lo = MinF(v[0][axis], MinF(v[1][axis], v[2][axis]));
+            float hi = MaxF(v[0][axis], MaxF(v[1][axis], v[2][axis]));
+            if (lo > h[axis] || hi < -h[axis])
+                return false;
+        }
+
+        // Triangle normal
+        Float3 n = Cross(f[0], f[1]);
+        float r = h.x * fabsf(n.x) + h.y * fabsf(n.y) + h.z * fabsf(n.z);
+        if (fabsf(Dot(n, v[0])) > r)
+            return false;
+
+        // Cross products of the edges with the box axes
+        Float3 axes[3] = { Float3(1, 0, 0), Float3(0, 1, 0), Float3(0, 0, 1) };
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                Float3 axis = Cross(axes[i], f[j]);
+                float p0 = Dot(v[0], axis), p1 = Dot(v[1], axis), p2 = Dot(v[2], axis);
+                float rr = h.x * fabsf(axis.x) + h.y * fabsf(axis.y) + h.z * fabsf(axis.z);
+                if (MinF(p0, MinF(p1, p2)) > rr || MaxF(p0, MaxF(p1, p2)) < -rr)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    static bool SphereOverlapsBox(const Float3& center, float radius, const Aabb& box)
+    {
+        Float3 closest = Max(box.lo, Min(center, box.hi));
+        return LengthSq(closest - center) <= radius * radius;
+    }
+};
+
+//-----------------------------------------------------------
+// Geometry of one BLAS: either an indexed triangle list or procedural spheres.
+struct QueryMesh
+{
+    std::vector<Float3> positions;
+    std::vector<uint32_t> indices;
+    std::vector<QuerySphere> spheres;
+    QueryBvh bvh;
+
+    bool IsProcedural() const { return !spheres.empty(); }
+    uint32_t PrimitiveCount() const { return IsProcedural() ? (uint32_t)spheres.size() : (uint32_t)(indices.size() / 3); }
+
+    Aabb PrimitiveBounds(uint32_t prim) const
+    {
+        Aabb b;
+        if (IsProcedural())
+        {
+            b = Aabb(spheres[prim].center, spheres[prim].center).Expanded(spheres[prim].radius);
+        }
+        else
+        {
+            b.Grow(positions[indices[prim * 3 + 0]]);
+            b.Grow(positions[indices[prim * 3 + 1]]);
+            b.Grow(positions[indices[prim * 3 + 2]]);
+        }
+        return b;
+    }
+
+    void BuildBvh()
+    {
+        std::vector<Aabb> bounds(PrimitiveCount());
+        for (uint32_t i = 0; i < bounds.size(); i++)
+            bounds[i] = PrimitiveBounds(i);
+        bvh.Build(bounds);
+    }
+};
+
+//-----------------------------------------------------------
+struct QueryInstance
+{
+    uint32_t meshId;
+    uint32_t instanceId;
+    uint32_t mask;
+    Transform3x4 objectToWorld;
+    Transform3x4 worldToObject;
+    float maxInverseScale;
+};
+
+//-----------------------------------------------------------
+struct SceneQuery
+{
+    std::vector<QueryMesh> meshes;
+    std::vector<QueryInstance> instances;
+    QueryBvh topLevel;
+    unsigned threadCount = (std::max)(1u, std::thread::hardware_concurrency());
+    size_t minBatchPerThread = 64;
+
+    // positions points at the first float3 of a vertex, successive vertices are stride bytes apart.
+    uint32_t AddTriangleMesh(const float* positions, size_t strideInBytes, size_t vertexCount, const uint32_t* indices, size_t indexCount)
+    {
+        QueryMesh mesh;
+        mesh.positions.resize(vertexCount);
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(positions);
+        for (size_t i = 0; i < vertexCount; i++)
+        {
+            const float* v = reinterpret_cast<const float*>(p + i * strideInBytes);
+            mesh.positions[i] = Float3(v[0], v[1], v[2]);
+        }
+        mesh.indices.assign(indices, indices + indexCount);
+        mesh.BuildBvh();
+        meshes.push_back(mesh);
+        return (uint32_t)meshes.size() - 1;
+    }
+
+    uint32_t AddSphereMesh(const QuerySphere* spheres, size_t count)
+    {
+        QueryMesh mesh;
+        mesh.spheres.assign(spheres, spheres + count);
+        mesh.BuildBvh();
+        meshes.push_back(mesh);
+        return (uint32_t)meshes.size() - 1;
+    }
+
+    // Instances are replaced wholesale each update, then CommitInstances rebuilds the top level.
+    void ClearInstances() { instances.clear(); }
+
+    void AddInstance(uint32_t meshId, const Transform3x4& objectToWorld, uint32_t mask, uint32_t instanceId)
+    {
+        if (mask == 0 || meshes[meshId].PrimitiveCount() == 0)
+            return;
+        QueryInstance instance;
+        instance.meshId = meshId;
+        instance.instanceId = instanceId;
+        instance.mask = mask;
+        instance.objectToWorld = objectToWorld;
+        instance.worldToObject = objectToWorld.Inverse();
+        instance.maxInverseScale = instance.worldToObject.StretchBound();
+        instances.push_back(instance);
+    }
+
+    void CommitInstances()
+    {
+        std::vector<Aabb> bounds(instances.size());
+        for (size_t i = 0; i < instances.size(); i++)
+            bounds[i] = instances[i].objectToWorld.TransformAabb(meshes[instances[i].meshId].bvh.Bounds());
+        topLevel.Build(bounds);
+    }
+
+    Aabb Bounds() const { return topLevel.nodes.empty() ? Aabb() : topLevel.Bounds(); }
+
+    //-------------------------------------------------------
+    // Batched entry points. Results are written at the same index as the query.
+
+    void Raycast(const QueryRay* rays, QueryHit* hits, size_t count) const
+    {
+        ParallelFor(count, [&](size_t i) { hits[i] = Raycast(rays[i]); });
+    }
+
+    void Sweep(const QuerySweep* sweeps, QueryHit* hits, size_t count) const
+    {
+        ParallelFor(count, [&](size_t i) { hits[i] = Sweep(sweeps[i]); });
+    }
+
+    // Each result lists the InstanceIDs whose geometry touches the box.
+    void Overlap(const QueryOverlap* boxes, std::vector<uint32_t>* results, size_t count) const
+    {
+        ParallelFor(count, [&](size_t i) { Overlap(boxes[i], results[i]); });
+    }
+
+    //-------------------------------------------------------
+    // Single queries
+
+    QueryHit Raycast(const QueryRay& ray) const
+    {
+        QueryHit hit;
+        hit.t = ray.tMax;
+        bool anyHit = (ray.flags & QUERY_ANY_HIT) != 0;
+        bool cull = (ray.flags & QUERY_CULL_BACK_FACING) != 0;
+        Float3 invDir = Reciprocal(ray.direction);
+
+        TraverseTopLevel(ray.origin, invDir, 0.0f, ray.mask, hit.t, [&](const QueryInstance& instance) {
+            Float3 o = instance.worldToObject.TransformPoint(ray.origin);
+            Float3 d = instance.worldToObject.TransformVector(ray.direction);
+            const QueryMesh& mesh = meshes[instance.meshId];
+            bool found = false;
+
+            TraverseMesh(mesh, o, Reciprocal(d), 0.0f, hit.t, [&](uint32_t prim) {
+                float t;
+                if (mesh.IsProcedural())
+                {
+                    t = QueryGeometry::RaySphere(o, d, mesh.spheres[prim].center, mesh.spheres[prim].radius, ray.tMin, hit.t, cull);
+                }
+                else
+                {
+                    const uint32_t* tri = &mesh.indices[prim * 3];
+                    t = QueryGeometry::RayTriangle(o, d, mesh.positions[tri[0]], mesh.positions[tri[1]], mesh.positions[tri[2]], ray.tMin, hit.t, cull);
+                }
+                if (t < hit.t)
+                {
+                    hit.t = t;
+                    hit.instanceId = instance.instanceId;
+                    hit.primitiveIndex = prim;
+                    hit.normal = ObjectNormal(mesh, prim, o + d * t);
+                    hit.normal = Normalize(TransformNormal(instance, hit.normal));
+                    if (Dot(hit.normal, ray.direction) > 0.0f)
+                        hit.normal = -hit.normal;
+                    found = true;
+                }
+                return anyHit && found;
+            });
+            return anyHit && found;
+        });
+        return hit;
+    }
+
+    QueryHit Sweep(const QuerySweep& sweep) const
+    {
+        QueryHit hit;
+        hit.t = sweep.maxDistance;
+        Float3 invDir = Reciprocal(sweep.direction);
+
+        TraverseTopLevel(sweep.origin, invDir, sweep.radius, sweep.mask, hit.t, [&](const QueryInstance& instance) {
+            // Traverse in object space with a radius that bounds the (possibly stretched) sphere,
+            // then do the exact test in world space.
+            Float3 o = instance.worldToObject.TransformPoint(sweep.origin);
+            Float3 d = instance.worldToObject.TransformVector(sweep.direction);
+            float objectRadius = sweep.radius * instance.maxInverseScale;
+            const QueryMesh& mesh = meshes[instance.meshId];
+
+            TraverseMesh(mesh, o, Reciprocal(d), objectRadius, hit.t, [&](uint32_t prim) {
+                float t;
+                Float3 contactNormal;
+                if (mesh.IsProcedural())
+                {
+                    Float3 center = instance.objectToWorld.TransformPoint(mesh.spheres[prim].center);
+                    float radius = mesh.spheres[prim].radius * instance.objectToWorld.MaxScale();
+                    t = QueryGeometry::RaySphere(sweep.origin, sweep.direction, center, radius + sweep.radius, 0.0f, hit.t);
+                    if (t < hit.t && LengthSq(sweep.origin - center) <= (radius + sweep.radius) * (radius + sweep.radius))
+                        t = 0.0f;
+                    contactNormal = sweep.origin + sweep.direction * t - center;
+                }
+                else
+                {
+                    const uint32_t* tri = &mesh.indices[prim * 3];
+                    Float3 a = instance.objectToWorld.TransformPoint(mesh.positions[tri[0]]);
+                    Float3 b = instance.objectToWorld.TransformPoint(mesh.positions[tri[1]]);
+                    Float3 c = instance.objectToWorld.TransformPoint(mesh.positions[tri[2]]);
+                    t = QueryGeometry::SweepSphereTriangle(sweep.origin, sweep.direction, sweep.radius, a, b, c, hit.t);
+                    Float3 center = sweep.origin + sweep.direction * (t < FLT_MAX ? t : 0.0f);
+                    contactNormal = center - QueryGeometry::ClosestPointOnTriangle(center, a, b, c);
+                }
+                if (t < hit.t)
+                {
+                    hit.t = t;
+                    hit.instanceId = instance.instanceId;
+                    hit.primitiveIndex = prim;
+                    hit.normal = Normalize(contactNormal);
+                }
+                return false;
+            });
+            return false;
+        });
+        return hit;
+    }
+
+    void Overlap(const QueryOverlap& query, std::vector<uint32_t>& result) const
+    {
+        result.clear();
+        if (topLevel.nodes.empty())
+            return;
+
+        uint32_t stack[QueryBvh::MaxDepth];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const QueryBvh::Node& node = topLevel.nodes[stack[--stackSize]];
+            if (!node.bounds.Overlaps(query.bounds))
+                continue;
+            if (node.primCount == 0)
+            {
+                stack[stackSize++] = node.firstChildOrPrim;
+                stack[stackSize++] = node.firstChildOrPrim + 1;
+                continue;
+            }
+            for (uint32_t i = node.firstChildOrPrim; i < node.firstChildOrPrim + node.primCount; i++)
+            {
+                const QueryInstance& instance = instances[topLevel.primIndices[i]];
+                if ((instance.mask & query.mask) != 0 && InstanceOverlapsBox(instance, query.bounds))
+                    result.push_back(instance.instanceId);
+            }
+        }
+    }
+
+private:
+    static Float3 Reciprocal(const Float3& d)
+    {
+        // Keep the sign of zero components so the slab test still rejects correctly.
+        return Float3(d.x != 0.0f ? 1.0f / d.x : (std::signbit(d.x) ? -FLT_MAX : FLT_MAX),
+                      d.y != 0.0f ? 1.0f / d.y : (std::signbit(d.y) ? -FLT_MAX : FLT_MAX),
+                      d.z != 0.0f ? 1.0f / d.z : (std::signbit(d.z) ? -FLT_MAX : FLT_MAX));
+    }
+
+    static Float3 ObjectNormal(const QueryMesh& mesh, uint32_t prim, const Float3& objectHit)
+    {
+        if (mesh.IsProcedural())
+            return objectHit - mesh.spheres[prim].center;
+        const uint32_t* tri = &mesh.indices[prim * 3];
+        const Float3& a = mesh.positions[tri[0]];
+        return Cross(mesh.positions[tri[1]] - a, mesh.positions[tri[2]] - a);
+    }
+
+    // Normals go through the inverse transpose of the object to world transform.
+    static Float3 TransformNormal(const QueryInstance& instance, const Float3& n)
+    {
+        const Transform3x4& w = instance.worldToObject;
+        return Float3(w.m[0][0] * n.x + w.m[1][0] * n.y + w.m[2][0] * n.z,
+                      w.m[0][1] * n.x + w.m[1][1] * n.y + w.m[2][1] * n.z,
+                      w.m[0][2] * n.x + w.m[1][2] * n.y + w.m[2][2] * n.z);
+    }
+
+    bool InstanceOverlapsBox(const QueryInstance& instance, const Aabb& box) const
+    {
+        // Walk the mesh with the box taken to object space, then test exactly in world space.
+        const QueryMesh& mesh = meshes[instance.meshId];
+        Aabb objectBox = instance.worldToObject.TransformAabb(box);
+        uint32_t stack[QueryBvh::MaxDepth];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const QueryBvh::Node& node = mesh.bvh.nodes[stack[--stackSize]];
+            if (!node.bounds.Overlaps(objectBox))
+                continue;
+            if (node.primCount == 0)
+            {
+                stack[stackSize++] = node.firstChildOrPrim;
+                stack[stackSize++] = node.firstChildOrPrim + 1;
+                continue;
+            }
+            for (uint32_t i = node.firstChildOrPrim; i < node.firstChildOrPrim + node.primCount; i++)
+            {
+                uint32_t prim = mesh.bvh.primIndices[i];
+                if (mesh.IsProcedural())
+                {
+                    Float3 center = instance.objectToWorld.TransformPoint(mesh.spheres[prim].center);
+                    float radius = mesh.spheres[prim].radius * instance.objectToWorld.MaxScale();
+                    if (QueryGeometry::SphereOverlapsBox(center, radius, box))
+                        return true;
+                }
+                else
+                {
+                    const uint32_t* tri = &mesh.indices[prim * 3];
+                    if (QueryGeometry::TriangleOverlapsBox(instance.objectToWorld.TransformPoint(mesh.positions[tri[0]]),
+                                                           instance.objectToWorld.TransformPoint(mesh.positions[tri[1]]),
+                                                           instance.objectToWorld.TransformPoint(mesh.positions[tri[2]]), box))
+                        return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Visits instances whose bounds (grown by radius) the ray enters before tMax, nearest box first.
+    // visit returns true to stop the traversal. tMax is re-read so closer hits prune the rest.
+    template <typename Visit>
+    void TraverseTopLevel(const Float3& origin, const Float3& invDir, float radius, uint32_t mask, const float& tMax, Visit visit) const
+    {
+        if (topLevel.nodes.empty())
+            return;
+
+        uint32_t stack[QueryBvh::MaxDepth];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const QueryBvh::Node& node = topLevel.nodes[stack[--stackSize]];
+            if (QueryGeometry::RayBox(origin, invDir, node.bounds.Expanded(radius), 0.0f, tMax) == FLT_MAX)
+                continue;
+            if (node.primCount == 0)
+            {
+                PushChildrenNearFirst(topLevel, node, origin, invDir, radius, tMax, stack, stackSize);
+                continue;
+            }
+            for (uint32_t i = node.firstChildOrPrim; i < node.firstChildOrPrim + node.primCount; i++)
+            {
+                const QueryInstance& instance = instances[topLevel.primIndices[i]];
+                if ((instance.mask & mask) != 0 && visit(instance))
+                    return;
+            }
+        }
+    }
+
+    template <typename Visit>
+    void TraverseMesh(const QueryMesh& mesh, const Float3& origin, const Float3& invDir, float radius, const float& tMax, Visit visit) const
+    {
+        uint32_t stack[QueryBvh::MaxDepth];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const QueryBvh::Node& node = mesh.bvh.nodes[stack[--stackSize]];
+            if (QueryGeometry::RayBox(origin, invDir, node.bounds.Expanded(radius), 0.0f, tMax) == FLT_MAX)
+                continue;
+            if (node.primCount == 0)
+            {
+                PushChildrenNearFirst(mesh.bvh, node, origin, invDir, radius, tMax, stack, stackSize);
+                continue;
+            }
+            for (uint32_t i = node.firstChildOrPrim; i < node.firstChildOrPrim + node.primCount; i++)
+            {
+                if (visit(mesh.bvh.primIndices[i]))
+                    return;
+            }
+        }
+    }
+
+    static void PushChildrenNearFirst(const QueryBvh& bvh, const QueryBvh::Node& node, const Float3& origin, const Float3& invDir,
+                                      float radius, float tMax, uint32_t* stack, int& stackSize)
+    {
+        uint32_t left = node.firstChildOrPrim;
+        float tLeft = QueryGeometry::RayBox(origin, invDir, bvh.nodes[left].bounds.Expanded(radius), 0.0f, tMax);
+        float tRight = QueryGeometry::RayBox(origin, invDir, bvh.nodes[left + 1].bounds.Expanded(radius), 0.0f, tMax);
+        // The nearer child goes on top of the stack so it is visited first.
+        if (tLeft <= tRight)
+        {
+            if (tRight != FLT_MAX) stack[stackSize++] = left + 1;
+            if (tLeft != FLT_MAX) stack[stackSize++] = left;
+        }
+        else
+        {
+            if (tLeft != FLT_MAX) stack[stackSize++] = left;
+            if (tRight != FLT_MAX) stack[stackSize++] = left + 1;
+        }
+    }
+
+public:
+    // Splits count iterations over the worker threads; also used by references built on the scene.
+    template <typename Body>
+    void ParallelFor(size_t count, Body body) const
+    {
+        size_t workers = (std::min)((size_t)threadCount, (count + minBatchPerThread - 1) / minBatchPerThread);
+        if (workers <= 1)
+        {
+            for (size_t i = 0; i < count; i++)
+                body(i);
+            return;
+        }
+
+        size_t chunk = (count + workers - 1) / workers;
+        std::vector<std::thread> threads;
+        threads.reserve(workers - 1);
+        for (size_t w = 1; w < workers; w++)
+        {
+            size_t begin = w * chunk;
+            size_t end = (std::min)(count, begin + chunk);
+            threads.push_back(std::thread([=, &body]() {
+                for (size_t i = begin; i < end; i++)
+                    body(i);
+            }));
+        }
+        for (size_t i = 0; i < (std::min)(count, chunk); i++)
+            body(i);
+        for (size_t t = 0; t < threads.size(); t++)
+            threads[t].join();
+    }
+};
+
+//-----------------------------------------------------------
+// Throughput of each query type over random queries inside the scene bounds. Every batch
+// goes through ParallelFor, which starts its worker threads afresh on each call, so the
+// figures include creating and joining those threads once per batch of batchSize queries.
+struct SceneQueryBenchmarkResult
+{
+    double closestHitRaysPerSecond;
+    double anyHitRaysPerSecond;
+    double sweepsPerSecond;
+    double overlapsPerSecond;
+};
+
+inline SceneQueryBenchmarkResult BenchmarkSceneQuery(const SceneQuery& query, size_t batchSize, int repetitions, uint32_t seed = 1)
+{
+    Aabb bounds = query.Bounds();
+    Float3 size = bounds.hi - bounds.lo;
+    uint32_t state = seed;
+    auto random = [&]() {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) * (1.0f / 16777216.0f);
+    };
+    auto randomPoint = [&]() { return bounds.lo + Float3(random() * size.x, random() * size.y, random() * size.z); };
+    auto randomDirection = [&]() {
+        float z = random() * 2.0f - 1.0f;
+        float phi = random() * 6.2831853f;
+        float r = sqrtf(MaxF(0.0f, 1.0f - z * z));
+        return Float3(r * cosf(phi), r * sinf(phi), z);
+    };
+
+    std::vector<QueryRay> rays(batchSize);
+    std::vector<QuerySweep> sweeps(batchSize);
+    std::vector<QueryOverlap> boxes(batchSize);
+    for (size_t i = 0; i < batchSize; i++)
+    {
+        rays[i].origin = randomPoint();
+        rays[i].direction = randomDirection();
+        sweeps[i].origin = rays[i].origin;
+        sweeps[i].direction = rays[i].direction;
+        sweeps[i].radius = 0.25f;
+        sweeps[i].maxDistance = Length(size);
+        Float3 center = randomPoint();
+        boxes[i].bounds = Aabb(center - Float3(0.5f), center + Float3(0.5f));
+    }
+
+    std::vector<QueryHit> hits(batchSize);
+    std::vector<std::vector<uint32_t>> overlaps(batchSize);
+    auto measure = [&](auto run) {
+        run();  // Warm up caches
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repetitions; r++)
+            run();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return seconds > 0.0 ? (double)(batchSize * repetitions) / seconds : 0.0;
+    };
+
+    SceneQueryBenchmarkResult result;
+    result.closestHitRaysPerSecond = measure([&]() { query.Raycast(rays.data(), hits.data(), batchSize); });
+    for (size_t i = 0; i < batchSize; i++)
+        rays[i].flags = QUERY_ANY_HIT;
+    result.anyHitRaysPerSecond = measure([&]() { query.Raycast(rays.data(), hits.data(), batchSize); });
+    result.sweepsPerSecond = measure([&]() { query.Sweep(sweeps.data(), hits.data(), batchSize); });
+    result.overlapsPerSecond = measure([&]() { query.Overlap(boxes.data(), overlaps.data(), batchSize); });
+    return result;
+}
+
+#endif // SceneQuery_h
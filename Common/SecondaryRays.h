@@ -0,0 +1,222 @@
+/************************************************************************************
+Filename    :   SecondaryRays.h
+Content     :   CPU reference of the shadow and reflection rays traced from the G-buffer
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// With the inline path the raygen shader only stores the first surface of every pixel in
+// a G-buffer, and InlineRaytracing.hlsl resolves its shadow and reflection rays with
+// RayQuery. Next to the color it writes what those two rays found to its SecondaryRays
+// target. The code below decodes the same G-buffer and casts the same rays through
+// SceneQuery, so a readback of both targets can be diffed against the CPU scene.
+
+#ifndef SecondaryRays_h
+#define SecondaryRays_h
+
+#include <vector>
+#include "SceneQuery.h"
+#include "LightBVH.h"
+#include "IrradianceProbes.h"
+
+// Must match Raytracing.hlsl
+#define SURFACE_UNLIT 0x10000
+#define SURFACE_INSTANCE_SHIFT 20
+#ifndef LAYER_SHADOW
+#define LAYER_SHADOW 2
+#define LAYER_REFLECT 4
+#endif
+
+// Layout of SurfacePayload, one texel of the R32G32B32A32_UINT G-buffer.
+struct GBufferTexel
+{
+    uint32_t packedAlbedo;
+    uint32_t packedNormal;
+    float hitT;             // Negative where the primary ray missed
+    uint32_t material;
+
+    bool Hit() const { return hitT >= 0.0f; }
+    bool Unlit() const { return (material & SURFACE_UNLIT) != 0; }
+    uint32_t Instance() const { return material >> SURFACE_INSTANCE_SHIFT; }
+    float Reflectivity() const;
+    Float3 Normal() const;
+};
+
+static_assert(sizeof(GBufferTexel) == 16, "GBufferTexel must match the G-buffer format");
+
+// One texel of the R32G32_FLOAT SecondaryRays target.
+struct SecondaryRayResult
+{
+    float visibility;       // Of the first light sample at the primary surface, 1 when unlit, missed or unlit by any light
+    float reflectionT;      // Distance to the surface seen in the reflection, negative for none
+
+    SecondaryRayResult() : visibility(1.0f), reflectionT(-1.0f) {}
+};
+
+static_assert(sizeof(SecondaryRayResult) == 8, "SecondaryRayResult must match the SecondaryRays format");
+
+// f16tof32 of the low 16 bits.
+inline float HalfToFloat(uint32_t h)
+{
+    uint32_t sign = (h >> 15) & 1;
+    int exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    float v;
+    if (exponent == 0)
+        v = ldexpf((float)mantissa, -24);
+    else if (exponent == 31)
+        v = mantissa ? NAN : INFINITY;
+    else
+        v = ldexpf((float)(mantissa | 0x400), exponent - 25);
+    return sign ? -v : v;
+}
+
+inline float GBufferTexel::Reflectivity() const { return HalfToFloat(material & 0xffff); }
+
+// UnpackNormalOctahedral in Raytracing.hlsl.
+inline Float3 GBufferTexel::Normal() const
+{
+    float ex = (packedNormal & 0xffff) / 65535.0f * 2.0f - 1.0f;
+    float ey = (packedNormal >> 16) / 65535.0f * 2.0f - 1.0f;
+    Float3 n(ex, ey, 1.0f - fabsf(ex) - fabsf(ey));
+    float t = ClampF(-n.z, 0.0f, 1.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return Normalize(n);
+}
+
+// GenerateCameraRay in Raytracing.hlsl. projectionToWorld is the matrix as uploaded to the
+// scene constant buffer, which HLSL reads transposed.
+inline Float3 CameraRayDirection(const float projectionToWorld[16], const Float3& eye, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    float sx = (x + 0.5f) / width * 2.0f - 1.0f;
+    float sy = -((y + 0.5f) / height * 2.0f - 1.0f);
+    const float* m = projectionToWorld;
+    float w = m[12] * sx + m[13] * sy + m[15];
+    Float3 world((m[0] * sx + m[1] * sy + m[3]) / w,
+                 (m[4] * sx + m[5] * sy + m[7]) / w,
+                 (m[8] * sx + m[9] * sy + m[11]) / w);
+    return Normalize(world - eye);
+}
+
+inline Float3 Reflect(const Float3& d, const Float3& n) { return d - n * (2.0f * Dot(d, n)); }
+
+// IsInShadow in Raytracing.hlsl, negated.
+inline bool LightVisible(const SceneQuery& query, const Float3& hitPoint, const Float3& lightPosition)
+{
+    QueryRay shadowRay;
+    shadowRay.origin = hitPoint;
+    shadowRay.direction = Normalize(lightPosition - hitPoint);
+    shadowRay.tMin = 0.001f;
+    shadowRay.tMax = Length(lightPosition - hitPoint);
+    shadowRay.mask = LAYER_SHADOW;
+    shadowRay.flags = QUERY_ANY_HIT | QUERY_CULL_BACK_FACING;
+    return !query.Raycast(shadowRay).Hit();
+}
+
+// DirectLighting in Raytracing.hlsl at the primary surface of pixel x, y in frame frameIndex.
+// Without a copy of the probe atlases the indirect term is the flat PROBE_AMBIENT.
+inline Float3 ResolveDirectLighting(const SceneQuery& query, const Float3& hitPoint, const Float3& normal, const LightBVH& lights,
+                                    uint32_t lightSamples, uint32_t frameIndex, uint32_t x, uint32_t y, const ProbeAtlas* probes = nullptr)
+{
+    Float3 lighting = probes ? probes->Sample(hitPoint, normal) : Float3(PROBE_AMBIENT);
+    uint32_t sampleCount = lightSamples < LIGHT_MAX_SAMPLES ? lightSamples : LIGHT_MAX_SAMPLES;
+    for (uint32_t i = 0; i < sampleCount; i++)
+    {
+        LightSample lightSample;
+        Float3 lightPosition;
+        if (!SampleSceneLight(lights, hitPoint, normal, LightSampleSeed(x, y, frameIndex, i), lightSample, lightPosition))
+            continue;
+        if (!LightVisible(query, hitPoint, lightPosition))
+            continue;
+        const LightSource& light = lights.lights[lightSample.light];
+        float maxDist = Length(lightPosition - hitPoint);
+        float NdotL = MaxF(Dot(normal, (lightPosition - hitPoint) / maxDist), 0.0f);
+        lighting += light.color * (light.intensity * NdotL / (maxDist * maxDist * lightSample.pdf * sampleCount));
+    }
+    return lighting;
+}
+
+// The rays ShadeSurface traces at the primary surface of pixel x, y, cast through SceneQuery.
+// The shadow ray goes to the first light DirectLighting samples there in frame frameIndex.
+inline SecondaryRayResult ResolveSecondaryRays(const SceneQuery& query, const Float3& origin, const Float3& direction,
+                                               const GBufferTexel& texel, const LightBVH& lights, uint32_t frameIndex,
+                                               uint32_t x, uint32_t y, uint32_t maxBounces)
+{
+    SecondaryRayResult result;
+    if (!texel.Hit())
+        return result;
+
+    Float3 hitPoint = origin + direction * texel.hitT;
+    Float3 normal = texel.Normal();
+    LightSample lightSample;
+    Float3 lightPosition;
+    if (!texel.Unlit() && SampleSceneLight(lights, hitPoint, normal, LightSampleSeed(x, y, frameIndex, 0), lightSample, lightPosition))
+        result.visibility = LightVisible(query, hitPoint, lightPosition) ? 1.0f : 0.0f;
+
+    if (texel.Reflectivity() > 0.0f && maxBounces > 0)
+    {
+        QueryRay reflectRay;
+        reflectRay.origin = hitPoint;
+        reflectRay.direction = Reflect(direction, normal);
+        reflectRay.tMin = 0.001f;
+        reflectRay.tMax = 10000.0f;
+        reflectRay.mask = LAYER_REFLECT;
+        reflectRay.flags = QUERY_CULL_BACK_FACING;
+        QueryHit hit = query.Raycast(reflectRay);
+        result.reflectionT = hit.Hit() ? hit.t : -1.0f;
+    }
+    return result;
+}
+
+struct SecondaryRayDiff
+{
+    uint32_t surfacePixels = 0;         // Pixels whose primary ray hit something
+    uint32_t visibilityMismatches = 0;
+    uint32_t reflectionMismatches = 0;  // Hit versus miss, or distances further apart than the tolerance
+};
+
+// Compares a readback of the G-buffer and the SecondaryRays target of one eye with the CPU
+// reference. Pixels along silhouettes and shadow edges can land either way, so a handful of
+// mismatches is expected; a broken path shows up as a large fraction.
+inline SecondaryRayDiff DiffSecondaryRays(const SceneQuery& query, const float projectionToWorld[16], const Float3& eye,
+                                          const LightBVH& lights, uint32_t frameIndex, uint32_t maxBounces, uint32_t width, uint32_t height,
+                                          const GBufferTexel* gbuffer, const SecondaryRayResult* gpu, float tolerance = 0.01f)
+{
+    std::vector<SecondaryRayResult> reference(size_t(width) * height);
+    query.ParallelFor(reference.size(), [&](size_t i) {
+        uint32_t x = uint32_t(i % width), y = uint32_t(i / width);
+        Float3 direction = CameraRayDirection(projectionToWorld, eye, x, y, width, height);
+        reference[i] = ResolveSecondaryRays(query, eye, direction, gbuffer[i], lights, frameIndex, x, y, maxBounces);
+    });
+
+    SecondaryRayDiff diff;
+    for (size_t i = 0; i < reference.size(); i++)
+    {
+        if (!gbuffer[i].Hit())
+            continue;
+        diff.surfacePixels++;
+        if (reference[i].visibility != gpu[i].visibility)
+            diff.visibilityMismatches++;
+        bool referenceHit = reference[i].reflectionT >= 0.0f;
+        bool gpuHit = gpu[i].reflectionT >= 0.0f;
+        if (referenceHit != gpuHit ||
+            (referenceHit && fabsf(reference[i].reflectionT - gpu[i].reflectionT) > tolerance * MaxF(1.0f, reference[i].reflectionT)))
+            diff.reflectionMismatches++;
+    }
+    return diff;
+}
+
+#endif // SecondaryRays_h
@@ -0,0 +1,354 @@
+/************************************************************************************
+Filename    :   ShadowCache.h
+Content     :   World space shadow visibility cache the shaders consult before a shadow ray
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// Shading points are binned into cubic cells of shadowCacheCellSize, split further by the
+// dominant axis of their normal so the two sides of a thin wall do not share a cell. For
+// each light, an entry of an open addressed hash table counts the shadow rays traced from
+// the cell and how many of them reached the light. Once SHADOW_CACHE_MIN_SAMPLES rays of
+// a cell all agree, later hits in it take that answer and skip the ray. Cells on a shadow
+// edge never agree and keep tracing, so hard edges stay exact; the cost is that an edge
+// crossing a cell the samples happened to miss is off by up to a cell.
+//
+// Entries are claimed with a compare-exchange on their key and never freed, so probing
+// chains stay intact. Invalidating an entry zeroes its counts and it fills up again.
+// An entry is invalidated when the box of a moved instance, before or after the move,
+// meets the segment from its cell to its light, grown by the cell and the light radius,
+// or when its light moved. A table whose probing window is full leaves the cell
+// uncached, which only costs the ray.
+//
+// Everything below matches Raytracing.hlsl and ShadowCacheInvalidate.hlsl step by step.
+
+#ifndef ShadowCache_h
+#define ShadowCache_h
+
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include "SecondaryRays.h"
+
+// Must match Raytracing.hlsl
+#define SHADOW_CACHE_CAPACITY (1u << 18)        // Entries, a power of two
+#define SHADOW_CACHE_PROBES 8                   // Slots tried from the hashed one before giving up
+#define SHADOW_CACHE_MIN_SAMPLES 16
+#define SHADOW_CACHE_NONE 0xffffffffu
+#define SHADOW_CACHE_ANY_LIGHT 0xffffffffu
+#define SHADOW_CACHE_MAX_INVALIDATIONS 64       // Per frame, more clear the whole table
+
+// One invalidation as uploaded to the ShadowInvalidations buffer: the box an instance moved
+// out of or into, or with a light index, every entry of a light that moved.
+struct ShadowCacheInvalidation
+{
+    Float3 lo;
+    uint32_t light = SHADOW_CACHE_ANY_LIGHT;
+    Float3 hi;
+    uint32_t padding = 0;
+
+    ShadowCacheInvalidation() {}
+    explicit ShadowCacheInvalidation(const Aabb& bounds) : lo(bounds.lo), hi(bounds.hi) {}
+    static ShadowCacheInvalidation Light(uint32_t light)
+    {
+        ShadowCacheInvalidation invalidation;
+        invalidation.light = light;
+        return invalidation;
+    }
+};
+
+static_assert(sizeof(ShadowCacheInvalidation) == 32, "ShadowCacheInvalidation must match the HLSL structured buffer stride");
+
+// Stride of the GPU table, see ShadowCacheEntry in Raytracing.hlsl.
+#define SHADOW_CACHE_ENTRY_SIZE 32
+
+struct ShadowCacheCell
+{
+    int32_t cell[3];
+    uint32_t lightFace;     // Light above the three bits of the normal's dominant face
+};
+
+inline ShadowCacheCell MakeShadowCacheCell(const Float3& p, const Float3& n, uint32_t light, float cellSize)
+{
+    ShadowCacheCell c;
+    for (int axis = 0; axis < 3; axis++)
+        c.cell[axis] = (int32_t)floorf(p[axis] / cellSize);
+    Float3 a = Abs(n);
+    int axis = a.x >= a.y && a.x >= a.z ? 0 : (a.y >= a.z ? 1 : 2);
+    c.lightFace = (light << 3) | uint32_t(axis * 2 + (n[axis] < 0.0f ? 1 : 0));
+    return c;
+}
+
+inline uint32_t ShadowCacheHash(const ShadowCacheCell& c)
+{
+    return PcgHash(uint32_t(c.cell[0]) + PcgHash(uint32_t(c.cell[1]) + PcgHash(uint32_t(c.cell[2]) + PcgHash(c.lightFace))));
+}
+
+// Told apart from the slot hash by hashing in the opposite order. Never zero, which marks a free entry.
+inline uint32_t ShadowCacheChecksum(const ShadowCacheCell& c)
+{
+    return PcgHash(c.lightFace + PcgHash(uint32_t(c.cell[2]) + PcgHash(uint32_t(c.cell[1]) + PcgHash(uint32_t(c.cell[0]))))) | 1u;
+}
+
+// Slab test of the segment from a to b against a box.
+inline bool SegmentOverlapsAabb(const Float3& a, const Float3& b, const Aabb& box)
+{
+    float t0 = 0.0f, t1 = 1.0f;
+    Float3 d = b - a;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (fabsf(d[axis]) < 1e-8f)
+        {
+            if (a[axis] < box.lo[axis] || a[axis] > box.hi[axis])
+                return false;
+            continue;
+        }
+        float inv = 1.0f / d[axis];
+        float tNear = (box.lo[axis] - a[axis]) * inv, tFar = (box.hi[axis] - a[axis]) * inv;
+        if (tNear > tFar) { float t = tNear; tNear = tFar; tFar = t; }
+        t0 = MaxF(t0, tNear);
+        t1 = MinF(t1, tFar);
+        if (t0 > t1)
+            return false;
+    }
+    return true;
+}
+
+// Whether an invalidation reaches the entry of a cell. Entries of lights that no longer exist always go.
+inline bool ShadowCacheInvalidates(const ShadowCacheInvalidation& invalidation, const ShadowCacheCell& c,
+                                   const LightSource* lights, uint32_t lightCount, float cellSize)
+{
+    uint32_t light = c.lightFace >> 3;
+    if (invalidation.light != SHADOW_CACHE_ANY_LIGHT)
+        return light == invalidation.light;
+    if (light >= lightCount)
+        return true;
+    Float3 centre = Float3(c.cell[0] + 0.5f, c.cell[1] + 0.5f, c.cell[2] + 0.5f) * cellSize;
+    float grow = 0.866025f * cellSize + lights[light].radius;
+    return SegmentOverlapsAabb(centre, lights[light].position, Aabb(invalidation.lo, invalidation.hi).Expanded(grow));
+}
+
+//-----------------------------------------------------------
+// CPU copy of the table, safe to use from ParallelFor like the GPU table is from every thread.
+struct ShadowCache
+{
+    float cellSize;
+    std::vector<std::atomic<uint32_t>> keys;
+    std::vector<std::atomic<uint32_t>> visible;
+    std::vector<std::atomic<uint32_t>> samples;
+    std::vector<ShadowCacheCell> cells;     // Written by whoever claims the entry
+
+    explicit ShadowCache(float cellSize, uint32_t capacity = SHADOW_CACHE_CAPACITY)
+        : cellSize(cellSize), keys(capacity), visible(capacity), samples(capacity), cells(capacity) {}
+
+    uint32_t Capacity() const { return (uint32_t)keys.size(); }
+
+    // Slot of the cell's entry, claimed if need be; SHADOW_CACHE_NONE when the probing window is full.
+    uint32_t Find(const ShadowCacheCell& c)
+    {
+        uint32_t key = ShadowCacheChecksum(c);
+        uint32_t slot = ShadowCacheHash(c);
+        for (uint32_t i = 0; i < SHADOW_CACHE_PROBES; i++)
+        {
+            uint32_t index = (slot + i) & (Capacity() - 1);
+            uint32_t previous = 0;
+            if (keys[index].compare_exchange_strong(previous, key))
+            {
+                cells[index] = c;
+                return index;
+            }
+            if (previous == key)
+                return index;
+        }
+        return SHADOW_CACHE_NONE;
+    }
+
+    // ShadowVisibility in Raytracing.hlsl, with the ray traced by trace() only when the cell has no answer.
+    template <typename Trace>
+    float Visibility(const Float3& p, const Float3& n, uint32_t light, Trace trace, bool* cached = nullptr)
+    {
+        uint32_t entry = Find(MakeShadowCacheCell(p, n, light, cellSize));
+        if (entry != SHADOW_CACHE_NONE)
+        {
+            uint32_t sampleCount = samples[entry].load();
+            uint32_t visibleCount = visible[entry].load();
+            if (sampleCount >= SHADOW_CACHE_MIN_SAMPLES && (visibleCount == 0 || visibleCount == sampleCount))
+            {
+                if (cached)
+                    *cached = true;
+                return visibleCount == 0 ? 0.0f : 1.0f;
+            }
+        }
+        if (cached)
+            *cached = false;
+        float visibility = trace() ? 1.0f : 0.0f;
+        if (entry != SHADOW_CACHE_NONE)
+        {
+            samples[entry]++;
+            visible[entry] += uint32_t(visibility);
+        }
+        return visibility;
+    }
+
+    // ShadowCacheInvalidate.hlsl over the whole table. Returns how many entries lost their counts.
+    uint32_t Invalidate(const ShadowCacheInvalidation* invalidations, uint32_t count, const LightSource* lights, uint32_t lightCount)
+    {
+        uint32_t invalidated = 0;
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            if (keys[i].load() == 0 || samples[i].load() == 0)
+                continue;
+            for (uint32_t r = 0; r < count; r++)
+            {
+                if (ShadowCacheInvalidates(invalidations[r], cells[i], lights, lightCount, cellSize))
+                {
+                    samples[i] = 0;
+                    visible[i] = 0;
+                    invalidated++;
+                    break;
+                }
+            }
+        }
+        return invalidated;
+    }
+
+    void Clear()
+    {
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            keys[i] = 0;
+            samples[i] = 0;
+            visible[i] = 0;
+        }
+    }
+
+    uint32_t Occupied() const
+    {
+        uint32_t occupied = 0;
+        for (size_t i = 0; i < keys.size(); i++)
+            occupied += keys[i].load() != 0;
+        return occupied;
+    }
+};
+
+//-----------------------------------------------------------
+struct ShadowCacheStats
+{
+    uint32_t frames = 0;
+    uint64_t tracedRays = 0;            // Over all frames through the cache
+    uint64_t cachedRays = 0;            // Answered by the cache instead
+    uint64_t mismatches = 0;            // Cached answers a traced ray disagrees with
+    uint32_t entries = 0;               // Occupied after the last frame
+    uint32_t invalidated = 0;           // By a box the size of a cell around the crop's centre hit
+    double uncachedMilliseconds = 0.0;  // Last frame, every ray traced
+    double cachedMilliseconds = 0.0;    // Last frame through the cache
+    double invalidateMilliseconds = 0.0;
+
+    double HitRate() const { return tracedRays + cachedRays ? double(cachedRays) / double(tracedRays + cachedRays) : 0.0; }
+};
+
+// Runs the first light sample of every pixel of a G-buffer readback through a ShadowCache for
+// frames frames of a still camera, as DirectLighting does, timing the last frame with and
+// without it and checking every cached answer against a traced ray. Then times one
+// invalidation sweep for a box around the hit at the centre of the crop. Only a crop of up to
+// cropSize pixels square around the centre is shaded, like MeasureDenoiser.
+inline ShadowCacheStats MeasureShadowCache(const SceneQuery& query, const float projectionToWorld[16], const Float3& eye, const LightBVH& lights,
+                                           uint32_t width, uint32_t height, const GBufferTexel* gbuffer, float cellSize,
+                                           uint32_t frames = 32, uint32_t cropSize = 256)
+{
+    ShadowCacheStats stats;
+    uint32_t cropWidth = width < cropSize ? width : cropSize, cropHeight = height < cropSize ? height : cropSize;
+    uint32_t x0 = (width - cropWidth) / 2, y0 = (height - cropHeight) / 2;
+    size_t count = size_t(cropWidth) * cropHeight;
+    if (count == 0 || lights.lights.empty() || cellSize <= 0.0f)
+        return stats;
+
+    std::vector<GBufferTexel> crop(count);
+    std::vector<Float3> hitPoints(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t x = x0 + uint32_t(i % cropWidth), y = y0 + uint32_t(i / cropWidth);
+        crop[i] = gbuffer[size_t(y) * width + x];
+        hitPoints[i] = eye + CameraRayDirection(projectionToWorld, eye, x, y, width, height) * crop[i].hitT;
+    }
+
+    ShadowCache cache(cellSize);
+    std::vector<uint8_t> cachedAnswer(count), answer(count);
+    std::atomic<uint64_t> traced(0), cached(0), mismatches(0);
+    for (uint32_t frame = 0; frame < frames; frame++)
+    {
+        auto Shade = [&](bool useCache)
+            {
+                query.ParallelFor(count, [&](size_t i) {
+                    cachedAnswer[i] = 0;
+                    if (!crop[i].Hit() || crop[i].Unlit())
+                        return;
+                    uint32_t x = x0 + uint32_t(i % cropWidth), y = y0 + uint32_t(i / cropWidth);
+                    Float3 normal = crop[i].Normal();
+                    LightSample lightSample;
+                    Float3 target;
+                    if (!SampleSceneLight(lights, hitPoints[i], normal, LightSampleSeed(x, y, frame, 0), lightSample, target))
+                        return;
+                    auto Trace = [&]() { return LightVisible(query, hitPoints[i], target); };
+                    if (!useCache)
+                    {
+                        answer[i] = Trace();
+                        return;
+                    }
+                    bool wasCached = false;
+                    answer[i] = cache.Visibility(hitPoints[i], normal, lightSample.light, Trace, &wasCached) > 0.0f;
+                    cachedAnswer[i] = wasCached;
+                    (wasCached ? cached : traced)++;
+                });
+            };
+
+        auto start = std::chrono::steady_clock::now();
+        Shade(true);
+        stats.cachedMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        // Check the cached answers before the uncached timing overwrites them
+        query.ParallelFor(count, [&](size_t i) {
+            if (!cachedAnswer[i])
+                return;
+            uint32_t x = x0 + uint32_t(i % cropWidth), y = y0 + uint32_t(i / cropWidth);
+            LightSample lightSample;
+            Float3 target;
+            SampleSceneLight(lights, hitPoints[i], crop[i].Normal(), LightSampleSeed(x, y, frame, 0), lightSample, target);
+            if (LightVisible(query, hitPoints[i], target) != (answer[i] != 0))
+                mismatches++;
+        });
+
+        if (frame + 1 == frames)
+        {
+            start = std::chrono::steady_clock::now();
+            Shade(false);
+            stats.uncachedMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+    stats.frames = frames;
+    stats.tracedRays = traced.load();
+    stats.cachedRays = cached.load();
+    stats.mismatches = mismatches.load();
+    stats.entries = cache.Occupied();
+
+    Float3 centre = hitPoints[count / 2 + cropWidth / 2];
+    ShadowCacheInvalidation invalidation(Aabb(centre - Float3(cellSize), centre + Float3(cellSize)));
+    auto start = std::chrono::steady_clock::now();
+    stats.invalidated = cache.Invalidate(&invalidation, 1, lights.lights.data(), (uint32_t)lights.lights.size());
+    stats.invalidateMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+#endif // ShadowCache_h
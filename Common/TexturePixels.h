@@ -0,0 +1,147 @@
+/************************************************************************************
+Filename    :   TexturePixels.h
+Content     :   The CPU side of Texture: decoding, mip reduction and the generated patterns
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// Texture in Win32_DirectX12AppUtil.h derives from TexturePixels and only adds the upload.
+// Pixels are RGBA8 packed into a uint32_t as 0xAABBGGRR, the byte order of R8G8B8A8_UNORM.
+// The translation unit that defines STB_IMAGE_IMPLEMENTATION provides the decoder.
+
+#ifndef TexturePixels_h
+#define TexturePixels_h
+
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+// A second include after STB_IMAGE_IMPLEMENTATION would compile the decoder twice
+#ifndef STBI_INCLUDE_STB_IMAGE_H
+#include "stb_image.h"
+#endif
+
+struct TexturePixels
+{
+    enum AutoFill { AUTO_WHITE = 1, AUTO_WALL, AUTO_FLOOR, AUTO_CEILING, AUTO_GRID, AUTO_GRADE_256 };
+
+    // Levels DownsampleMip can box filter down to, halving while both sides stay even.
+    static unsigned int MipChainLength(int sizeW, int sizeH)
+    {
+        unsigned int levels = 1;
+        for (; sizeW > 1 && sizeH > 1 && !(sizeW & 1) && !(sizeH & 1); sizeW >>= 1, sizeH >>= 1)
+            levels++;
+        return levels;
+    }
+
+    static void PackRgba8(const uint8_t* rgba, int count, uint32_t* pixels)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            uint8_t r = rgba[i * 4];
+            uint8_t g = rgba[i * 4 + 1];
+            uint8_t b = rgba[i * 4 + 2];
+            uint8_t a = rgba[i * 4 + 3];
+            pixels[i] = (a << 24) | (b << 16) | (g << 8) | r;
+        }
+    }
+
+    // Returns malloc'd pixels, or nullptr when either file cannot be decoded. maskPath optionally
+    // names a separate coverage map, like an mtl map_d, that replaces the alpha channel.
+    static uint32_t* Decode(const char* filePath, const char* maskPath, int& width, int& height)
+    {
+        int channels;
+        uint8_t* data = stbi_load(filePath, &width, &height, &channels, 4);
+        if (!data)
+            return nullptr;
+        uint32_t* pixels = (uint32_t*)malloc(sizeof(uint32_t) * width * height);
+        if (pixels)
+            PackRgba8(data, width * height, pixels);
+        stbi_image_free(data);
+
+        if (pixels && maskPath)
+        {
+            int maskWidth, maskHeight;
+            uint8_t* mask = stbi_load(maskPath, &maskWidth, &maskHeight, &channels, 1);
+            if (!mask)
+            {
+                free(pixels);
+                return nullptr;
+            }
+            // Nearest texel when the mask is authored at another size
+            for (int y = 0; y < height; ++y)
+            {
+                for (int x = 0; x < width; ++x)
+                {
+                    uint32_t a = mask[(y * maskHeight / height) * maskWidth + x * maskWidth / width];
+                    pixels[y * width + x] = (pixels[y * width + x] & 0x00ffffff) | (a << 24);
+                }
+            }
+            stbi_image_free(mask);
+        }
+        return pixels;
+    }
+
+    // Box filters the sizeW x sizeH level in place into the next one, packed at the front of pix.
+    static void DownsampleMip(uint32_t* pix, int sizeW, int sizeH)
+    {
+        for (int j = 0; j < (sizeH & ~1); j += 2)
+        {
+            uint8_t* psrc = (uint8_t*)pix + (sizeW * j * 4);
+            uint8_t* pdest = (uint8_t*)pix + (sizeW * j);
+            for (int i = 0; i < sizeW >> 1; i++, psrc += 8, pdest += 4)
+            {
+                pdest[0] = (((int)psrc[0]) + psrc[4] + psrc[sizeW * 4 + 0] + psrc[sizeW * 4 + 4]) >> 2;
+                pdest[1] = (((int)psrc[1]) + psrc[5] + psrc[sizeW * 4 + 1] + psrc[sizeW * 4 + 5]) >> 2;
+                pdest[2] = (((int)psrc[2]) + psrc[6] + psrc[sizeW * 4 + 2] + psrc[sizeW * 4 + 6]) >> 2;
+                pdest[3] = (((int)psrc[3]) + psrc[7] + psrc[sizeW * 4 + 3] + psrc[sizeW * 4 + 7]) >> 2;
+            }
+        }
+    }
+
+    static void ConvertToSRGB(uint32_t* linear)
+    {
+        uint32_t drgb[3];
+        for (int k = 0; k < 3; k++)
+        {
+            float rgb = ((float)((*linear >> (k * 8)) & 0xff)) / 255.0f;
+            rgb = powf(rgb, 2.2f);
+            drgb[k] = (uint32_t)(rgb * 255.0f);
+        }
+        *linear = (*linear & 0xff000000) + (drgb[2] << 16) + (drgb[1] << 8) + (drgb[0] << 0);
+    }
+
+    static void FillPattern(AutoFill autoFillData, int sizeW, int sizeH, uint32_t* pix)
+    {
+        for (int j = 0; j < sizeH; j++)
+        {
+            for (int i = 0; i < sizeW; i++)
+            {
+                uint32_t* curr = &pix[j * sizeW + i];
+                switch (autoFillData)
+                {
+                case(AUTO_WALL): *curr = (((j / 4 & 15) == 0) || (((i / 4 & 15) == 0) && ((((i / 4 & 31) == 0) ^ ((j / 4 >> 4) & 1)) == 0))) ? 0xff3c3c3c : 0xffb4b4b4; break;
+                case(AUTO_FLOOR): *curr = (((i >> 7) ^ (j >> 7)) & 1) ? 0xffb4b4b4 : 0xff505050; break;
+                case(AUTO_CEILING): *curr = (i / 4 == 0 || j / 4 == 0) ? 0xff505050 : 0xffb4b4b4; break;
+                case(AUTO_WHITE): *curr = 0xffffffff; break;
+                case(AUTO_GRADE_256): *curr = 0xff000000 + i * 0x010101; break;
+                case(AUTO_GRID): *curr = (i < 4) || (i > (sizeW - 5)) || (j < 4) || (j > (sizeH - 5)) ? 0xffffffff : 0xff000000; break;
+                default: *curr = 0xffffffff; break;
+                }
+            }
+        }
+    }
+};
+
+#endif // TexturePixels_h
@@ -0,0 +1,257 @@
+/************************************************************************************
+Filename    :   VectorMath.h
+Content     :   Small portable vector types for the CPU side scene modules
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// These deliberately avoid DirectXMath and Windows headers so the modules built on
+// them (scene queries, sampling references, ...) also compile with other toolchains.
+// Note that Windows.h defines min/max macros, so nothing in here calls std::min/std::max.
+
+#ifndef VectorMath_h
+#define VectorMath_h
+
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+
+inline float MinF(float a, float b) { return a < b ? a : b; }
+inline float MaxF(float a, float b) { return a > b ? a : b; }
+inline float ClampF(float v, float lo, float hi) { return v < lo ? lo : (v > hi ? hi : v); }
+
+//-----------------------------------------------------------
+struct Float2
+{
+    float x, y;
+
+    Float2() : x(0), y(0) {}
+    Float2(float x, float y) : x(x), y(y) {}
+};
+
+//-----------------------------------------------------------
+struct Float3
+{
+    float x, y, z;
+
+    Float3() : x(0), y(0), z(0) {}
+    Float3(float x, float y, float z) : x(x), y(y), z(z) {}
+    explicit Float3(float v) : x(v), y(v), z(v) {}
+
+    float operator[](int i) const { return (&x)[i]; }
+    float& operator[](int i) { return (&x)[i]; }
+};
+
+inline Float3 operator+(const Float3& a, const Float3& b) { return Float3(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline Float3 operator-(const Float3& a, const Float3& b) { return Float3(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline Float3 operator*(const Float3& a, const Float3& b) { return Float3(a.x * b.x, a.y * b.y, a.z * b.z); }
+inline Float3 operator/(const Float3& a, const Float3& b) { return Float3(a.x / b.x, a.y / b.y, a.z / b.z); }
+inline Float3 operator*(const Float3& a, float s) { return Float3(a.x * s, a.y * s, a.z * s); }
+inline Float3 operator*(float s, const Float3& a) { return Float3(a.x * s, a.y * s, a.z * s); }
+inline Float3 operator/(const Float3& a, float s) { return a * (1.0f / s); }
+inline Float3 operator-(const Float3& a) { return Float3(-a.x, -a.y, -a.z); }
+inline Float3& operator+=(Float3& a, const Float3& b) { a = a + b; return a; }
+inline Float3& operator-=(Float3& a, const Float3& b) { a = a - b; return a; }
+inline Float3& operator*=(Float3& a, float s) { a = a * s; return a; }
+
+inline float Dot(const Float3& a, const Float3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline Float3 Cross(const Float3& a, const Float3& b) { return Float3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x); }
+inline float LengthSq(const Float3& a) { return Dot(a, a); }
+inline float Length(const Float3& a) { return sqrtf(Dot(a, a)); }
+inline Float3 Normalize(const Float3& a) { float len = Length(a); return len > 0.0f ? a / len : a; }
+inline Float3 Abs(const Float3& a) { return Float3(fabsf(a.x), fabsf(a.y), fabsf(a.z)); }
+inline Float3 Min(const Float3& a, const Float3& b) { return Float3(MinF(a.x, b.x), MinF(a.y, b.y), MinF(a.z, b.z)); }
+inline Float3 Max(const Float3& a, const Float3& b) { return Float3(MaxF(a.x, b.x), MaxF(a.y, b.y), MaxF(a.z, b.z)); }
+inline Float3 Lerp(const Float3& a, const Float3& b, float t) { return a + (b - a) * t; }
+inline float MaxComponent(const Float3& a) { return MaxF(a.x, MaxF(a.y, a.z)); }
+
+//-----------------------------------------------------------
+struct Aabb
+{
+    Float3 lo, hi;   // Not min/max, which collide with the Windows.h macros
+
+    Aabb() : lo(FLT_MAX), hi(-FLT_MAX) {}
+    Aabb(const Float3& lo, const Float3& hi) : lo(lo), hi(hi) {}
+
+    bool IsEmpty() const { return lo.x > hi.x || lo.y > hi.y || lo.z > hi.z; }
+    void Grow(const Float3& p) { lo = Min(lo, p); hi = Max(hi, p); }
+    void Grow(const Aabb& b) { lo = Min(lo, b.lo); hi = Max(hi, b.hi); }
+    Float3 Center() const { return (lo + hi) * 0.5f; }
+    Float3 Extents() const { return (hi - lo) * 0.5f; }
+
+    float SurfaceArea() const
+    {
+        if (IsEmpty())
+            return 0.0f;
+        Float3 d = hi - lo;
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    bool Overlaps(const Aabb& b) const
+    {
+        return lo.x <= b.hi.x && hi.x >= b.lo.x &&
+               lo.y <= b.hi.y && hi.y >= b.lo.y &&
+               lo.z <= b.hi.z && hi.z >= b.lo.z;
+    }
+
+    bool Contains(const Float3& p) const
+    {
+        return p.x >= lo.x && p.x <= hi.x && p.y >= lo.y && p.y <= hi.y && p.z >= lo.z && p.z <= hi.z;
+    }
+
+    Aabb Expanded(float r) const { return Aabb(lo - Float3(r), hi + Float3(r)); }
+};
+
+//-----------------------------------------------------------
+struct Quat
+{
+    float x, y, z, w;
+
+    Quat() : x(0), y(0), z(0), w(1) {}
+    Quat(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
+
+    static Quat AxisAngle(const Float3& axis, float angle)
+    {
+        Float3 a = Normalize(axis) * sinf(angle * 0.5f);
+        return Quat(a.x, a.y, a.z, cosf(angle * 0.5f));
+    }
+
+    Float3 Rotate(const Float3& v) const
+    {
+        // v' = v + 2w(q x v) + 2q x (q x v)
+        Float3 q(x, y, z);
+        Float3 t = Cross(q, v) * 2.0f;
+        return v + t * w + Cross(q, t);
+    }
+};
+
+// Same convention as XMQuaternionMultiply: the result rotates by a, then by b.
+inline Quat operator*(const Quat& a, const Quat& b)
+{
+    return Quat(b.w * a.x + b.x * a.w + b.y * a.z - b.z * a.y,
+                b.w * a.y - b.x * a.z + b.y * a.w + b.z * a.x,
+                b.w * a.z + b.x * a.y - b.y * a.x + b.z * a.w,
+                b.w * a.w - b.x * a.x - b.y * a.y - b.z * a.z);
+}
+
+// Takes the shorter way round; falls back to a normalized lerp when a and b are nearly the same.
+inline Quat Slerp(const Quat& a, Quat b, float t)
+{
+    float cosAngle = a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+    if (cosAngle < 0.0f)
+    {
+        b = Quat(-b.x, -b.y, -b.z, -b.w);
+        cosAngle = -cosAngle;
+    }
+    float wa = 1.0f - t, wb = t;
+    if (cosAngle < 0.9995f)
+    {
+        float angle = acosf(cosAngle);
+        float invSin = 1.0f / sinf(angle);
+        wa = sinf(wa * angle) * invSin;
+        wb = sinf(wb * angle) * invSin;
+    }
+    Quat q(a.x * wa + b.x * wb, a.y * wa + b.y * wb, a.z * wa + b.z * wb, a.w * wa + b.w * wb);
+    float invLength = 1.0f / sqrtf(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+    return Quat(q.x * invLength, q.y * invLength, q.z * invLength, q.w * invLength);
+}
+
+//-----------------------------------------------------------
+// Row major affine transform in the layout of D3D12_RAYTRACING_INSTANCE_DESC::Transform,
+// so p' = m * p with the translation in the last column.
+struct Transform3x4
+{
+    float m[3][4];
+
+    Transform3x4()
+    {
+        for (int r = 0; r < 3; r++)
+            for (int c = 0; c < 4; c++)
+                m[r][c] = (r == c) ? 1.0f : 0.0f;
+    }
+
+    Float3 TransformPoint(const Float3& p) const
+    {
+        return Float3(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                      m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                      m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    Float3 TransformVector(const Float3& v) const
+    {
+        return Float3(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                      m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                      m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    Aabb TransformAabb(const Aabb& b) const
+    {
+        Float3 c = TransformPoint(b.Center());
+        Float3 e = b.Extents();
+        Float3 we(fabsf(m[0][0]) * e.x + fabsf(m[0][1]) * e.y + fabsf(m[0][2]) * e.z,
+                  fabsf(m[1][0]) * e.x + fabsf(m[1][1]) * e.y + fabsf(m[1][2]) * e.z,
+                  fabsf(m[2][0]) * e.x + fabsf(m[2][1]) * e.y + fabsf(m[2][2]) * e.z);
+        return Aabb(c - we, c + we);
+    }
+
+    // Largest axis scale, the longest column of the linear part; exact for rotation times scale.
+    float MaxScale() const
+    {
+        float maxSq = 0.0f;
+        for (int c = 0; c < 3; c++)
+            maxSq = MaxF(maxSq, m[0][c] * m[0][c] + m[1][c] * m[1][c] + m[2][c] * m[2][c]);
+        return sqrtf(maxSq);
+    }
+
+    // Upper bound on how far the linear part can stretch any vector (Frobenius norm), also under shear.
+    float StretchBound() const
+    {
+        float sum = 0.0f;
+        for (int r = 0; r < 3; r++)
+            for (int c = 0; c < 3; c++)
+                sum += m[r][c] * m[r][c];
+        return sqrtf(sum);
+    }
+
+    Transform3x4 Inverse() const
+    {
+        float a = m[0][0], b = m[0][1], c = m[0][2];
+        float d = m[1][0], e = m[1][1], f = m[1][2];
+        float g = m[2][0], h = m[2][1], i = m[2][2];
+        float A = e * i - f * h, B = f * g - d * i, C = d * h - e * g;
+        float det = a * A + b * B + c * C;
+        float invDet = (det != 0.0f) ? 1.0f / det : 0.0f;
+
+        Transform3x4 inv;
+        inv.m[0][0] = A * invDet;
+        inv.m[0][1] = (c * h - b * i) * invDet;
+        inv.m[0][2] = (b * f - c * e) * invDet;
+        inv.m[1][0] = B * invDet;
+        inv.m[1][1] = (a * i - c * g) * invDet;
+        inv.m[1][2] = (c * d - a * f) * invDet;
+        inv.m[2][0] = C * invDet;
+        inv.m[2][1] = (b * g - a * h) * invDet;
+        inv.m[2][2] = (a * e - b * d) * invDet;
+
+        Float3 t(m[0][3], m[1][3], m[2][3]);
+        Float3 it = -inv.TransformVector(t);
+        inv.m[0][3] = it.x;
+        inv.m[1][3] = it.y;
+        inv.m[2][3] = it.z;
+        return inv;
+    }
+};
+
+#endif // VectorMath_h
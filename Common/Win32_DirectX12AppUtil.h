@@ -35,6 +35,9 @@ limitations under the License.
 #include <dxgi1_6.h>
 #include <new>
 #include <stdio.h>
+#include <chrono>
+#include "FrameProfiler.h"
+#include "GpuTimer.h"
 #include "DirectXMath.h"
 using namespace DirectX;
 
@@ -43,10 +46,20 @@ using namespace DirectX;
 #include <wrl/client.h>
 using Microsoft::WRL::ComPtr;
 #include "CompiledShaders\Raytracing.hlsl.h"
+#include "CompiledShaders\InlineRaytracing.hlsl.h"
+#include "CompiledShaders\SecondaryUpsample.hlsl.h"
+#include "CompiledShaders\Denoise.hlsl.h"
+#include "CompiledShaders\ProbeTrace.hlsl.h"
+#include "CompiledShaders\ProbeBlend.hlsl.h"
+#include "CompiledShaders\ShadowCacheInvalidate.hlsl.h"
+#include "CompiledShaders\RayBudgetStats.hlsl.h"
 #define  TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#include "OpacityClasses.h"
+#include "TexturePixels.h"
+#include "ObjMesh.h"
 
 #pragma comment(lib, "dxgi.lib")
 #pragma comment(lib, "d3d12.lib")
@@ -208,6 +221,35 @@ enum DrawContext
     DrawContext_Count,
 };
 
+// Material classes, one hit group record each. Must match MATERIAL_CLASS_ in Raytracing.hlsl.
+enum MaterialClass
+{
+    MaterialClass_Diffuse = 0,
+    MaterialClass_Reflective,
+    MaterialClass_AlphaTested,
+    MaterialClass_Procedural,
+
+    MaterialClass_Count,
+};
+
+#define MATERIAL_FLAG_REFLECTIVE 1
+#define MATERIAL_FLAG_ALPHA_TESTED 2
+
+// Local root constants of a hit group record, l_material in Raytracing.hlsl.
+struct MaterialConstants
+{
+    UINT materialClass;
+    UINT flags;
+};
+
+static const MaterialConstants c_materialClasses[MaterialClass_Count] =
+{
+    { MaterialClass_Diffuse, 0 },
+    { MaterialClass_Reflective, MATERIAL_FLAG_REFLECTIVE },
+    { MaterialClass_AlphaTested, MATERIAL_FLAG_ALPHA_TESTED },
+    { MaterialClass_Procedural, 0 },
+};
+
 static void ThrowIfFailed(HRESULT hr, const wchar_t* message = L"")
 {
 
@@ -227,6 +269,47 @@ static void ThrowIfFalse(bool condition)
     }
 }
 
+// GpuTimer's backend on the direct queue: a timestamp query heap, resolved into a readback
+// buffer that stays mapped. GpuTimer only reads a frame slot's range after the slot's fence.
+struct D3D12TimestampBackend
+{
+    typedef ID3D12GraphicsCommandList CommandList;
+
+    ComPtr<ID3D12QueryHeap> queryHeap;
+    ComPtr<ID3D12Resource> readback;
+    uint64_t* mappedTimestamps = nullptr;
+    uint64_t frequency = 1;
+
+    void Create(ID3D12Device* device, ID3D12CommandQueue* commandQueue, uint32_t queryCount)
+    {
+        D3D12_QUERY_HEAP_DESC queryHeapDesc = {};
+        queryHeapDesc.Type = D3D12_QUERY_HEAP_TYPE_TIMESTAMP;
+        queryHeapDesc.Count = queryCount;
+        ThrowIfFailed(device->CreateQueryHeap(&queryHeapDesc, IID_PPV_ARGS(&queryHeap)));
+        const D3D12_HEAP_PROPERTIES readbackHeapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK);
+        const D3D12_RESOURCE_DESC readbackDesc = CD3DX12_RESOURCE_DESC::Buffer(UINT64(queryCount) * sizeof(uint64_t));
+        ThrowIfFailed(device->CreateCommittedResource(&readbackHeapProperties, D3D12_HEAP_FLAG_NONE, &readbackDesc,
+            D3D12_RESOURCE_STATE_COPY_DEST, nullptr, IID_PPV_ARGS(&readback)));
+        ThrowIfFailed(readback->Map(0, nullptr, reinterpret_cast<void**>(&mappedTimestamps)));
+        ThrowIfFailed(commandQueue->GetTimestampFrequency(&frequency));
+    }
+
+    uint64_t Frequency() const { return frequency; }
+
+    void WriteTimestamp(CommandList* commandList, uint32_t query)
+    {
+        commandList->EndQuery(queryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, query);
+    }
+
+    void Resolve(CommandList* commandList, uint32_t firstQuery, uint32_t count)
+    {
+        commandList->ResolveQueryData(queryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, firstQuery, count, readback.Get(), firstQuery * sizeof(uint64_t));
+    }
+
+    const uint64_t* Read(uint32_t firstQuery, uint32_t) const { return mappedTimestamps + firstQuery; }
+};
+
+typedef GpuTimer<D3D12TimestampBackend> D3D12GpuTimer;
 
 //---------------------------------------------------------------------
 struct DirectX12
@@ -260,6 +343,7 @@ struct DirectX12
 
     // Root signatures
     ComPtr<ID3D12RootSignature> m_raytracingGlobalRootSignature;
+    ComPtr<ID3D12RootSignature> m_hitGroupLocalRootSignature;
     //ComPtr<ID3D12RootSignature> m_raytracingLocalRootSignature;
     //ComPtr<ID3D12RootSignature> m_raytracingAABBLocalRootSignature;
 
@@ -282,11 +366,63 @@ struct DirectX12
     D3D12_GPU_DESCRIPTOR_HANDLE m_raytracingDepthOutputResourceUAVGpuDescriptors[2];
     UINT m_raytracingDepthOutputResourceUAVDescriptorHeapIndexs[2];
 
+    // Inline raytracing, see InlineRaytracing.hlsl. Picked before InitDevice and turned back
+    // off there when the device is below raytracing tier 1.1.
+    bool inlineRaytracing = false;
+    bool inlineRaytracingSupported = false;
+    ComPtr<ID3D12PipelineState> m_inlineShadingPipeline;
+    ComPtr<ID3D12PipelineState> m_secondaryUpsamplePipeline;
+    ComPtr<ID3D12PipelineState> m_denoisePipeline;
+    ComPtr<ID3D12PipelineState> m_probeTracePipeline;
+    ComPtr<ID3D12PipelineState> m_probeBlendPipeline;
+    ComPtr<ID3D12PipelineState> m_shadowCacheInvalidatePipeline;
+    ComPtr<ID3D12PipelineState> m_rayBudgetStatsPipeline;
+
+    // Primary surfaces the raygen shader hands to the inline pass, and what its shadow and
+    // reflection rays found. Always bound, the DispatchRays path just leaves them alone.
+    ComPtr<ID3D12Resource> m_gBuffers[2];
+    D3D12_GPU_DESCRIPTOR_HANDLE m_gBufferUAVGpuDescriptors[2];
+    ComPtr<ID3D12Resource> m_secondaryRayOutputs[2];
+    D3D12_GPU_DESCRIPTOR_HANDLE m_secondaryRayOutputUAVGpuDescriptors[2];
+    // Lighting and reflection of the inline pass at reduced resolution, see SecondaryUpsample.hlsl.
+    // Sized for a secondaryScale of 2, larger scales use their top left corner.
+    ComPtr<ID3D12Resource> m_lowResLightingOutputs[2];
+    D3D12_GPU_DESCRIPTOR_HANDLE m_lowResLightingUAVGpuDescriptors[2];
+    ComPtr<ID3D12Resource> m_lowResReflectionOutputs[2];
+    D3D12_GPU_DESCRIPTOR_HANDLE m_lowResReflectionUAVGpuDescriptors[2];
+    // Denoise.hlsl: the signals and their a-trous ping-pong, and the history with the G-buffer
+    // it was accumulated on, in two sets that alternate between frames.
+    static const UINT denoiseSignalSlices = 4;
+    static const UINT denoiseHistorySlices = 6;
+    ComPtr<ID3D12Resource> m_denoiseSignals[2];
+    D3D12_GPU_DESCRIPTOR_HANDLE m_denoiseSignalsUAVGpuDescriptors[2];
+    ComPtr<ID3D12Resource> m_denoiseHistory[2];
+    D3D12_GPU_DESCRIPTOR_HANDLE m_denoiseHistoryUAVGpuDescriptors[2];
+    ComPtr<ID3D12Resource> m_denoiseSurfaces[2];
+    D3D12_GPU_DESCRIPTOR_HANDLE m_denoiseSurfacesUAVGpuDescriptors[2];
+    // Irradiance probe atlases and the rays of one update, shared by both eyes, see IrradianceProbes.h.
+    // Sized by the scene's probe grid through CreateProbeResources.
+    ComPtr<ID3D12Resource> m_probeIrradiance;
+    D3D12_GPU_DESCRIPTOR_HANDLE m_probeIrradianceUAVGpuDescriptor;
+    ComPtr<ID3D12Resource> m_probeVisibility;
+    D3D12_GPU_DESCRIPTOR_HANDLE m_probeVisibilityUAVGpuDescriptor;
+    ComPtr<ID3D12Resource> m_probeRays;
+    D3D12_GPU_DESCRIPTOR_HANDLE m_probeRaysUAVGpuDescriptor;
+    // Shadow visibility cache of both eyes, see ShadowCache.h.
+    ComPtr<ID3D12Resource> m_shadowCache;
+    D3D12_GPU_DESCRIPTOR_HANDLE m_shadowCacheUAVGpuDescriptor;
+    // What each screen tile of the eye's last frame showed, for the ray budget, see RayBudget.h.
+    ComPtr<ID3D12Resource> m_rayBudgetStats[2];
+    D3D12_GPU_DESCRIPTOR_HANDLE m_rayBudgetStatsUAVGpuDescriptors[2];
+    // GPU zones of each frame, read back when its swap chain slot comes round again.
+    D3D12GpuTimer gpuTimer;
+
     UINT eyeWidth;
     UINT eyeHeight;
 
     ComPtr<ID3D12Resource> m_missShaderTable;
     ComPtr<ID3D12Resource> m_hitGroupShaderTable;
+    UINT m_hitGroupShaderRecordSize;
     ComPtr<ID3D12Resource> m_rayGenShaderTable;
 
     
@@ -485,6 +621,13 @@ struct DirectX12
         HRESULT hr = Device->QueryInterface(IID_PPV_ARGS(&m_dxrDevice));
         if (FAILED(hr))
             exit(1);
+
+        // RayQuery needs tier 1.1, older devices keep to DispatchRays
+        D3D12_FEATURE_DATA_D3D12_OPTIONS5 featureSupportData = {};
+        inlineRaytracingSupported = SUCCEEDED(Device->CheckFeatureSupport(D3D12_FEATURE_D3D12_OPTIONS5, &featureSupportData, sizeof(featureSupportData)))
+            && featureSupportData.RaytracingTier >= D3D12_RAYTRACING_TIER_1_1;
+        if (!inlineRaytracingSupported)
+            inlineRaytracing = false;
         //hr = PerFrameResources[0].CommandLists[0]->QueryInterface(IID_PPV_ARGS(&m_dxrCommandList));
         //if (FAILED(hr))
         //    exit(1);
@@ -498,13 +641,31 @@ struct DirectX12
             SceneConstantSlot,
             VertexBufferSlot,
             TextureSlot,
+            SphereBufferSlot,
+            GBufferSlot,
+            SecondaryRaysSlot,
+            LightBufferSlot,
+            LightNodeBufferSlot,
+            LowResLightingSlot,
+            LowResReflectionSlot,
+            DenoiseSignalsSlot,
+            DenoiseHistorySlot,
+            DenoiseSurfacesSlot,
+            DenoiseConstantSlot,
+            ProbeIrradianceSlot,
+            ProbeVisibilitySlot,
+            ProbeRaysSlot,
+            ShadowCacheSlot,
+            ShadowInvalidationSlot,
+            RayBudgetStatsSlot,
+            RayBudgetTilesSlot,
             Count
         };
     };
 
     struct LocalRootSignatureParams {
         enum Value {
-            ViewportConstantSlot = 0,
+            MaterialConstantSlot = 0,
             Count
         };
     };
@@ -535,6 +696,30 @@ struct DirectX12
             vertexBufferDescriptors.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 2, 1);
             CD3DX12_DESCRIPTOR_RANGE textureDescriptorRange;
             textureDescriptorRange.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 3);
+            CD3DX12_DESCRIPTOR_RANGE gBufferDescriptor;
+            gBufferDescriptor.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 2);
+            CD3DX12_DESCRIPTOR_RANGE secondaryRaysDescriptor;
+            secondaryRaysDescriptor.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 3);
+            CD3DX12_DESCRIPTOR_RANGE lowResLightingDescriptor;
+            lowResLightingDescriptor.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 4);
+            CD3DX12_DESCRIPTOR_RANGE lowResReflectionDescriptor;
+            lowResReflectionDescriptor.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 5);
+            CD3DX12_DESCRIPTOR_RANGE denoiseSignalsDescriptor;
+            denoiseSignalsDescriptor.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 6);
+            CD3DX12_DESCRIPTOR_RANGE denoiseHistoryDescriptor;
+            denoiseHistoryDescriptor.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 7);
+            CD3DX12_DESCRIPTOR_RANGE denoiseSurfacesDescriptor;
+            denoiseSurfacesDescriptor.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 8);
+            CD3DX12_DESCRIPTOR_RANGE probeIrradianceDescriptor;
+            probeIrradianceDescriptor.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 9);
+            CD3DX12_DESCRIPTOR_RANGE probeVisibilityDescriptor;
+            probeVisibilityDescriptor.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 10);
+            CD3DX12_DESCRIPTOR_RANGE probeRaysDescriptor;
+            probeRaysDescriptor.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 11);
+            CD3DX12_DESCRIPTOR_RANGE shadowCacheDescriptor;
+            shadowCacheDescriptor.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 12);
+            CD3DX12_DESCRIPTOR_RANGE rayBudgetStatsDescriptor;
+            rayBudgetStatsDescriptor.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 13);
             CD3DX12_ROOT_PARAMETER rootParameters[GlobalRootSignatureParams::Count];
             rootParameters[GlobalRootSignatureParams::OutputViewSlot].InitAsDescriptorTable(1, &UAVDescriptor);
             rootParameters[GlobalRootSignatureParams::OutputDepthSlot].InitAsDescriptorTable(1, &UAVDescriptor1);
@@ -542,10 +727,42 @@ struct DirectX12
             rootParameters[GlobalRootSignatureParams::SceneConstantSlot].InitAsConstantBufferView(0);
             rootParameters[GlobalRootSignatureParams::VertexBufferSlot].InitAsDescriptorTable(1, &vertexBufferDescriptors);
             rootParameters[GlobalRootSignatureParams::TextureSlot].InitAsDescriptorTable(1, &textureDescriptorRange, D3D12_SHADER_VISIBILITY_ALL);
-            CD3DX12_ROOT_SIGNATURE_DESC globalRootSignatureDesc(ARRAYSIZE(rootParameters), rootParameters);
+            rootParameters[GlobalRootSignatureParams::SphereBufferSlot].InitAsShaderResourceView(0, 1);
+            rootParameters[GlobalRootSignatureParams::GBufferSlot].InitAsDescriptorTable(1, &gBufferDescriptor);
+            rootParameters[GlobalRootSignatureParams::SecondaryRaysSlot].InitAsDescriptorTable(1, &secondaryRaysDescriptor);
+            rootParameters[GlobalRootSignatureParams::LightBufferSlot].InitAsShaderResourceView(1, 1);
+            rootParameters[GlobalRootSignatureParams::LightNodeBufferSlot].InitAsShaderResourceView(2, 1);
+            rootParameters[GlobalRootSignatureParams::LowResLightingSlot].InitAsDescriptorTable(1, &lowResLightingDescriptor);
+            rootParameters[GlobalRootSignatureParams::LowResReflectionSlot].InitAsDescriptorTable(1, &lowResReflectionDescriptor);
+            rootParameters[GlobalRootSignatureParams::DenoiseSignalsSlot].InitAsDescriptorTable(1, &denoiseSignalsDescriptor);
+            rootParameters[GlobalRootSignatureParams::DenoiseHistorySlot].InitAsDescriptorTable(1, &denoiseHistoryDescriptor);
+            rootParameters[GlobalRootSignatureParams::DenoiseSurfacesSlot].InitAsDescriptorTable(1, &denoiseSurfacesDescriptor);
+            // Pass, history parity and whether the history is valid, see Denoise.hlsl
+            rootParameters[GlobalRootSignatureParams::DenoiseConstantSlot].InitAsConstants(3, 2);
+            rootParameters[GlobalRootSignatureParams::ProbeIrradianceSlot].InitAsDescriptorTable(1, &probeIrradianceDescriptor);
+            rootParameters[GlobalRootSignatureParams::ProbeVisibilitySlot].InitAsDescriptorTable(1, &probeVisibilityDescriptor);
+            rootParameters[GlobalRootSignatureParams::ProbeRaysSlot].InitAsDescriptorTable(1, &probeRaysDescriptor);
+            rootParameters[GlobalRootSignatureParams::ShadowCacheSlot].InitAsDescriptorTable(1, &shadowCacheDescriptor);
+            rootParameters[GlobalRootSignatureParams::ShadowInvalidationSlot].InitAsShaderResourceView(3, 1);
+            rootParameters[GlobalRootSignatureParams::RayBudgetStatsSlot].InitAsDescriptorTable(1, &rayBudgetStatsDescriptor);
+            rootParameters[GlobalRootSignatureParams::RayBudgetTilesSlot].InitAsShaderResourceView(4, 1);
+            // Trilinear and clamped, TriangleSurface wraps by hand since slices can be larger than their texture
+            CD3DX12_STATIC_SAMPLER_DESC textureSampler(0, D3D12_FILTER_MIN_MAG_MIP_LINEAR,
+                D3D12_TEXTURE_ADDRESS_MODE_CLAMP, D3D12_TEXTURE_ADDRESS_MODE_CLAMP, D3D12_TEXTURE_ADDRESS_MODE_CLAMP);
+            CD3DX12_ROOT_SIGNATURE_DESC globalRootSignatureDesc(ARRAYSIZE(rootParameters), rootParameters, 1, &textureSampler);
             SerializeAndCreateRaytracingRootSignature(globalRootSignatureDesc, &m_raytracingGlobalRootSignature);
         }
 
+        // Hit group local root signature
+        // Every hit group record carries the MaterialConstants of its material class.
+        {
+            CD3DX12_ROOT_PARAMETER rootParameters[LocalRootSignatureParams::Count];
+            rootParameters[LocalRootSignatureParams::MaterialConstantSlot].InitAsConstants(SizeOfInUint32(MaterialConstants), 1);
+            CD3DX12_ROOT_SIGNATURE_DESC localRootSignatureDesc(ARRAYSIZE(rootParameters), rootParameters);
+            localRootSignatureDesc.Flags = D3D12_ROOT_SIGNATURE_FLAG_LOCAL_ROOT_SIGNATURE;
+            SerializeAndCreateRaytracingRootSignature(localRootSignatureDesc, &m_hitGroupLocalRootSignature);
+        }
+
         //// Local Root Signature
         //// This is a root signature that enables a shader to have unique arguments that come from shader tables.
         //{
@@ -590,12 +807,21 @@ struct DirectX12
         return buffer;
     }
 
+    // Ray types with their own hit group records, matching RAY_TYPE_ in Raytracing.hlsl.
+    // Each material class has RAY_TYPE_COUNT consecutive hit group records.
+#define RAY_TYPE_COUNT 2
+
     const wchar_t* c_raygenShaderName = L"MyRaygenShader";
     const wchar_t* c_closestHitShaderName = L"MyClosestHitShader";
+    const wchar_t* c_alphaTestAnyHitShaderName = L"MyAlphaTestAnyHitShader";
+    const wchar_t* c_shadowAlphaTestAnyHitShaderName = L"MyShadowAlphaTestAnyHitShader";
     const wchar_t* c_aabbClosestHitShaderName = L"MySphereClosestHitShader";
     const wchar_t* c_intersectionShaderName = L"MySimpleIntersectionShader";
     const wchar_t* c_missShaderName = L"MyMissShader";
+    const wchar_t* c_shadowMissShaderName = L"MyShadowMissShader";
     const wchar_t* c_triangleHitGroupName = L"TriangleHitGroup";
+    const wchar_t* c_alphaTestedHitGroupName = L"AlphaTestedHitGroup";
+    const wchar_t* c_shadowAlphaTestedHitGroupName = L"ShadowAlphaTestedHitGroup";
     const wchar_t* c_aabbHitGroupName = L"AABBHitGroup";
 
 
@@ -604,7 +830,20 @@ struct DirectX12
 // This is a root signature that enables a shader to have unique arguments that come from shader tables.
     void CreateLocalRootSignatureSubobjects(CD3DX12_STATE_OBJECT_DESC* raytracingPipeline)
     {
-        // Hit group and miss shaders in this sample are not using a local root signature and thus one is not associated with them.
+        // Ray gen and miss shaders in this sample are not using a local root signature and thus one is not associated with them.
+
+        // Material constants for every hit group
+        {
+            auto localRootSignature = raytracingPipeline->CreateSubobject<CD3DX12_LOCAL_ROOT_SIGNATURE_SUBOBJECT>();
+            localRootSignature->SetRootSignature(m_hitGroupLocalRootSignature.Get());
+            // Shader association
+            auto rootSignatureAssociation = raytracingPipeline->CreateSubobject<CD3DX12_SUBOBJECT_TO_EXPORTS_ASSOCIATION_SUBOBJECT>();
+            rootSignatureAssociation->SetSubobjectToAssociate(*localRootSignature);
+            rootSignatureAssociation->AddExport(c_triangleHitGroupName);
+            rootSignatureAssociation->AddExport(c_alphaTestedHitGroupName);
+            rootSignatureAssociation->AddExport(c_shadowAlphaTestedHitGroupName);
+            rootSignatureAssociation->AddExport(c_aabbHitGroupName);
+        }
 
         // Local root signature to be used in a ray gen shader.
         //{
@@ -774,6 +1013,20 @@ struct DirectX12
         hitGroup->SetHitGroupExport(c_triangleHitGroupName);
         hitGroup->SetHitGroupType(D3D12_HIT_GROUP_TYPE_TRIANGLES);
 
+        // Same closest hit, with an any hit that drops texels below half coverage.
+        // It only runs on geometry that is not flagged opaque.
+        auto alphaTestedGroup = raytracingPipeline.CreateSubobject<CD3DX12_HIT_GROUP_SUBOBJECT>();
+        alphaTestedGroup->SetClosestHitShaderImport(c_closestHitShaderName);
+        alphaTestedGroup->SetAnyHitShaderImport(c_alphaTestAnyHitShaderName);
+        alphaTestedGroup->SetHitGroupExport(c_alphaTestedHitGroupName);
+        alphaTestedGroup->SetHitGroupType(D3D12_HIT_GROUP_TYPE_TRIANGLES);
+
+        // The same test for shadow rays, which carry a ShadowPayload and never run a closest hit.
+        auto shadowAlphaTestedGroup = raytracingPipeline.CreateSubobject<CD3DX12_HIT_GROUP_SUBOBJECT>();
+        shadowAlphaTestedGroup->SetAnyHitShaderImport(c_shadowAlphaTestAnyHitShaderName);
+        shadowAlphaTestedGroup->SetHitGroupExport(c_shadowAlphaTestedHitGroupName);
+        shadowAlphaTestedGroup->SetHitGroupType(D3D12_HIT_GROUP_TYPE_TRIANGLES);
+
         auto aabbGroup = raytracingPipeline.CreateSubobject<CD3DX12_HIT_GROUP_SUBOBJECT>();
         aabbGroup->SetIntersectionShaderImport(c_intersectionShaderName);
         aabbGroup->SetClosestHitShaderImport(c_aabbClosestHitShaderName);
@@ -783,7 +1036,9 @@ struct DirectX12
         // Shader config
         // Defines the maximum sizes in bytes for the ray payload and attribute structure.
         auto shaderConfig = raytracingPipeline.CreateSubobject<CD3DX12_RAYTRACING_SHADER_CONFIG_SUBOBJECT>();
-        UINT payloadSize = 11 * sizeof(float) + sizeof(UINT);   // float4 color, float depth, float3 origin, float3 direction
+        // The largest payload of any ray type: SurfacePayload, packed albedo and normal, hit distance and material.
+        // Shadow payloads are 4 bytes.
+        UINT payloadSize = 4 * sizeof(UINT);
         UINT attributeSize = 6 * sizeof(float); // float2 barycentrics
         shaderConfig->Config(payloadSize, attributeSize);
 
@@ -801,7 +1056,8 @@ struct DirectX12
         auto pipelineConfig = raytracingPipeline.CreateSubobject<CD3DX12_RAYTRACING_PIPELINE_CONFIG_SUBOBJECT>();
         // PERFOMANCE TIP: Set max recursion depth as low as needed 
         // as drivers may apply optimization strategies for low recursion depths. 
-        UINT maxRecursionDepth = 3; // ~ primary rays only. 
+        // Bounces and shadow rays are all traced from the raygen shader, so hits never trace further.
+        UINT maxRecursionDepth = 1; // ~ primary rays only. 
         pipelineConfig->Config(maxRecursionDepth);
 
 #if _DEBUG
@@ -1058,8 +1314,13 @@ struct DirectX12
         CreateRootSignatures();
         CreateRaytracingPipelineStateObject();
         BuildShaderTables();
+        CreateInlineShadingPipeline();
         CreateRaytracingOutputResource(eyeWidth, eyeHeight);
 
+        // The TLAS build, each eye's raytracing and output copy and the mirror copy, with room to spare
+        gpuTimer.Init(SwapChainNumFrames, 16);
+        gpuTimer.backend.Create(Device, CommandQueue, gpuTimer.QueryCount());
+
         return true;
     }
 
@@ -1295,14 +1556,20 @@ struct DirectX12
 
         void* rayGenShaderIdentifier;
         void* missShaderIdentifier;
+        void* shadowMissShaderIdentifier;
         void* hitGroupShaderIdentifier;
+        void* alphaTestedHitGroupShaderIdentifier;
+        void* shadowAlphaTestedHitGroupShaderIdentifier;
         void* hitGroupShaderIdentifier1;
 
         auto GetShaderIdentifiers = [&](auto* stateObjectProperties)
             {
                 rayGenShaderIdentifier = stateObjectProperties->GetShaderIdentifier(c_raygenShaderName);
                 missShaderIdentifier = stateObjectProperties->GetShaderIdentifier(c_missShaderName);
+                shadowMissShaderIdentifier = stateObjectProperties->GetShaderIdentifier(c_shadowMissShaderName);
                 hitGroupShaderIdentifier = stateObjectProperties->GetShaderIdentifier(c_triangleHitGroupName);
+                alphaTestedHitGroupShaderIdentifier = stateObjectProperties->GetShaderIdentifier(c_alphaTestedHitGroupName);
+                shadowAlphaTestedHitGroupShaderIdentifier = stateObjectProperties->GetShaderIdentifier(c_shadowAlphaTestedHitGroupName);
                 hitGroupShaderIdentifier1 = stateObjectProperties->GetShaderIdentifier(c_aabbHitGroupName);
             };
 
@@ -1332,21 +1599,36 @@ struct DirectX12
         }
 
         // Miss shader table
+        // Index 0 is used by primary and bounce rays, index 1 by shadow rays.
         {
-            UINT numShaderRecords = 1;
+            UINT numShaderRecords = 2;
             UINT shaderRecordSize = shaderIdentifierSize;
             ShaderTable missShaderTable(Device, numShaderRecords, shaderRecordSize, L"MissShaderTable");
             missShaderTable.push_back(ShaderRecord(missShaderIdentifier, shaderIdentifierSize));
+            missShaderTable.push_back(ShaderRecord(shadowMissShaderIdentifier, shaderIdentifierSize));
             m_missShaderTable = missShaderTable.GetResource();
         }
 
         // Hit group shader table
+        // One record per ray type for each material class, see RAY_TYPE_COUNT. Diffuse and reflective
+        // share a hit group and differ only in their constants. Shadow rays skip closest hit shaders,
+        // so only the alpha tested class needs a hit group of its own for them.
         {
-            UINT numShaderRecords = 3;
-            UINT shaderRecordSize = shaderIdentifierSize;
+            void* materialHitGroups[MaterialClass_Count][RAY_TYPE_COUNT] = {
+                { hitGroupShaderIdentifier, hitGroupShaderIdentifier },
+                { hitGroupShaderIdentifier, hitGroupShaderIdentifier },
+                { alphaTestedHitGroupShaderIdentifier, shadowAlphaTestedHitGroupShaderIdentifier },
+                { hitGroupShaderIdentifier1, hitGroupShaderIdentifier1 } };
+            UINT numShaderRecords = MaterialClass_Count * RAY_TYPE_COUNT;
+            UINT shaderRecordSize = shaderIdentifierSize + sizeof(MaterialConstants);
             ShaderTable hitGroupShaderTable(Device, numShaderRecords, shaderRecordSize, L"HitGroupShaderTable");
-            hitGroupShaderTable.push_back(ShaderRecord(hitGroupShaderIdentifier, shaderIdentifierSize));
-            hitGroupShaderTable.push_back(ShaderRecord(hitGroupShaderIdentifier1, shaderIdentifierSize));
+            for (UINT materialClass = 0; materialClass < MaterialClass_Count; materialClass++)
+            {
+                MaterialConstants rootArguments = c_materialClasses[materialClass];
+                for (UINT rayType = 0; rayType < RAY_TYPE_COUNT; rayType++)
+                    hitGroupShaderTable.push_back(ShaderRecord(materialHitGroups[materialClass][rayType], shaderIdentifierSize, &rootArguments, sizeof(rootArguments)));
+            }
+            m_hitGroupShaderRecordSize = hitGroupShaderTable.GetShaderRecordSize();
             m_hitGroupShaderTable = hitGroupShaderTable.GetResource();
         }
     }
@@ -1359,6 +1641,53 @@ struct DirectX12
     //    return descriptorIndexToUse;
     //}
 
+    // The compute pass of the inline path, it shares the global root signature with the raytracing pipeline.
+    void CreateInlineShadingPipeline()
+    {
+        if (!inlineRaytracingSupported)
+            return;
+
+        D3D12_COMPUTE_PIPELINE_STATE_DESC computeDesc = {};
+        computeDesc.pRootSignature = m_raytracingGlobalRootSignature.Get();
+        computeDesc.CS = CD3DX12_SHADER_BYTECODE((void*)g_pInlineRaytracing, ARRAYSIZE(g_pInlineRaytracing));
+        ThrowIfFailed(Device->CreateComputePipelineState(&computeDesc, IID_PPV_ARGS(&m_inlineShadingPipeline)));
+        computeDesc.CS = CD3DX12_SHADER_BYTECODE((void*)g_pSecondaryUpsample, ARRAYSIZE(g_pSecondaryUpsample));
+        ThrowIfFailed(Device->CreateComputePipelineState(&computeDesc, IID_PPV_ARGS(&m_secondaryUpsamplePipeline)));
+        computeDesc.CS = CD3DX12_SHADER_BYTECODE((void*)g_pDenoise, ARRAYSIZE(g_pDenoise));
+        ThrowIfFailed(Device->CreateComputePipelineState(&computeDesc, IID_PPV_ARGS(&m_denoisePipeline)));
+        computeDesc.CS = CD3DX12_SHADER_BYTECODE((void*)g_pProbeTrace, ARRAYSIZE(g_pProbeTrace));
+        ThrowIfFailed(Device->CreateComputePipelineState(&computeDesc, IID_PPV_ARGS(&m_probeTracePipeline)));
+        computeDesc.CS = CD3DX12_SHADER_BYTECODE((void*)g_pProbeBlend, ARRAYSIZE(g_pProbeBlend));
+        ThrowIfFailed(Device->CreateComputePipelineState(&computeDesc, IID_PPV_ARGS(&m_probeBlendPipeline)));
+        computeDesc.CS = CD3DX12_SHADER_BYTECODE((void*)g_pShadowCacheInvalidate, ARRAYSIZE(g_pShadowCacheInvalidate));
+        ThrowIfFailed(Device->CreateComputePipelineState(&computeDesc, IID_PPV_ARGS(&m_shadowCacheInvalidatePipeline)));
+        computeDesc.CS = CD3DX12_SHADER_BYTECODE((void*)g_pRayBudgetStats, ARRAYSIZE(g_pRayBudgetStats));
+        ThrowIfFailed(Device->CreateComputePipelineState(&computeDesc, IID_PPV_ARGS(&m_rayBudgetStatsPipeline)));
+    }
+
+    // Called by the scene once its probe grid is known, before the first frame. Every slot is
+    // bound on every dispatch, so scenes without a grid still get a texel of each. Committed
+    // resources start out zeroed, which is what marks every probe as never updated.
+    void CreateProbeResources(UINT irradianceWidth, UINT irradianceHeight, UINT visibilityWidth, UINT visibilityHeight, UINT raysWidth, UINT raysHeight)
+    {
+        auto defaultHeapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
+        auto CreateTexture = [&](DXGI_FORMAT format, UINT width, UINT height, ComPtr<ID3D12Resource>& resource, D3D12_GPU_DESCRIPTOR_HANDLE& gpuDescriptor)
+            {
+                auto textureDesc = CD3DX12_RESOURCE_DESC::Tex2D(format, width, height, 1, 1, 1, 0, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+                ThrowIfFailed(Device->CreateCommittedResource(
+                    &defaultHeapProperties, D3D12_HEAP_FLAG_NONE, &textureDesc, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, nullptr, IID_PPV_ARGS(&resource)));
+                D3D12_UNORDERED_ACCESS_VIEW_DESC UAVDesc = {};
+                UAVDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
+                D3D12_CPU_DESCRIPTOR_HANDLE uavDescriptorHandle = CbvSrvHandleProvider.AllocCpuHandle();
+                Device->CreateUnorderedAccessView(resource.Get(), nullptr, &UAVDesc, uavDescriptorHandle);
+                gpuDescriptor = CbvSrvHandleProvider.GpuHandleFromCpuHandle(uavDescriptorHandle);
+            };
+        CreateTexture(DXGI_FORMAT_R16G16B16A16_FLOAT, irradianceWidth, irradianceHeight, m_probeIrradiance, m_probeIrradianceUAVGpuDescriptor);
+        // Mean squared distances outgrow half precision in large scenes
+        CreateTexture(DXGI_FORMAT_R32G32_FLOAT, visibilityWidth, visibilityHeight, m_probeVisibility, m_probeVisibilityUAVGpuDescriptor);
+        CreateTexture(DXGI_FORMAT_R32G32B32A32_FLOAT, raysWidth, raysHeight, m_probeRays, m_probeRaysUAVGpuDescriptor);
+    }
+
     void CreateRaytracingOutputResource(UINT width, UINT height)
     {
         //auto device = m_deviceResources->GetD3DDevice();
@@ -1418,6 +1747,90 @@ struct DirectX12
             Device->CreateUnorderedAccessView(m_raytracingDepthOutputs[1].Get(), nullptr, &UAVDesc, uavDescriptorHandle);
             m_raytracingDepthOutputResourceUAVGpuDescriptors[1] = CbvSrvHandleProvider.GpuHandleFromCpuHandle(uavDescriptorHandle);
         }
+
+        // G-buffers and secondary ray results of the inline path
+        for (int eye = 0; eye < 2; eye++)
+        {
+            uavDesc = CD3DX12_RESOURCE_DESC::Tex2D(DXGI_FORMAT_R32G32B32A32_UINT, width, height, 1, 1, 1, 0, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            ThrowIfFailed(Device->CreateCommittedResource(
+                &defaultHeapProperties, D3D12_HEAP_FLAG_NONE, &uavDesc, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, nullptr, IID_PPV_ARGS(&m_gBuffers[eye])));
+            D3D12_CPU_DESCRIPTOR_HANDLE uavDescriptorHandle = CbvSrvHandleProvider.AllocCpuHandle();
+            D3D12_UNORDERED_ACCESS_VIEW_DESC UAVDesc = {};
+            UAVDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
+            Device->CreateUnorderedAccessView(m_gBuffers[eye].Get(), nullptr, &UAVDesc, uavDescriptorHandle);
+            m_gBufferUAVGpuDescriptors[eye] = CbvSrvHandleProvider.GpuHandleFromCpuHandle(uavDescriptorHandle);
+
+            uavDesc = CD3DX12_RESOURCE_DESC::Tex2D(DXGI_FORMAT_R32G32_FLOAT, width, height, 1, 1, 1, 0, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            ThrowIfFailed(Device->CreateCommittedResource(
+                &defaultHeapProperties, D3D12_HEAP_FLAG_NONE, &uavDesc, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, nullptr, IID_PPV_ARGS(&m_secondaryRayOutputs[eye])));
+            uavDescriptorHandle = CbvSrvHandleProvider.AllocCpuHandle();
+            Device->CreateUnorderedAccessView(m_secondaryRayOutputs[eye].Get(), nullptr, &UAVDesc, uavDescriptorHandle);
+            m_secondaryRayOutputUAVGpuDescriptors[eye] = CbvSrvHandleProvider.GpuHandleFromCpuHandle(uavDescriptorHandle);
+
+            uavDesc = CD3DX12_RESOURCE_DESC::Tex2D(DXGI_FORMAT_R16G16B16A16_FLOAT, (width + 1) / 2, (height + 1) / 2, 1, 1, 1, 0, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            ThrowIfFailed(Device->CreateCommittedResource(
+                &defaultHeapProperties, D3D12_HEAP_FLAG_NONE, &uavDesc, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, nullptr, IID_PPV_ARGS(&m_lowResLightingOutputs[eye])));
+            uavDescriptorHandle = CbvSrvHandleProvider.AllocCpuHandle();
+            Device->CreateUnorderedAccessView(m_lowResLightingOutputs[eye].Get(), nullptr, &UAVDesc, uavDescriptorHandle);
+            m_lowResLightingUAVGpuDescriptors[eye] = CbvSrvHandleProvider.GpuHandleFromCpuHandle(uavDescriptorHandle);
+
+            ThrowIfFailed(Device->CreateCommittedResource(
+                &defaultHeapProperties, D3D12_HEAP_FLAG_NONE, &uavDesc, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, nullptr, IID_PPV_ARGS(&m_lowResReflectionOutputs[eye])));
+            uavDescriptorHandle = CbvSrvHandleProvider.AllocCpuHandle();
+            Device->CreateUnorderedAccessView(m_lowResReflectionOutputs[eye].Get(), nullptr, &UAVDesc, uavDescriptorHandle);
+            m_lowResReflectionUAVGpuDescriptors[eye] = CbvSrvHandleProvider.GpuHandleFromCpuHandle(uavDescriptorHandle);
+
+            auto CreateArray = [&](DXGI_FORMAT format, UINT slices, ComPtr<ID3D12Resource>& resource, D3D12_GPU_DESCRIPTOR_HANDLE& gpuDescriptor)
+                {
+                    auto arrayDesc = CD3DX12_RESOURCE_DESC::Tex2D(format, width, height, UINT16(slices), 1, 1, 0, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+                    ThrowIfFailed(Device->CreateCommittedResource(
+                        &defaultHeapProperties, D3D12_HEAP_FLAG_NONE, &arrayDesc, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, nullptr, IID_PPV_ARGS(&resource)));
+                    D3D12_UNORDERED_ACCESS_VIEW_DESC arrayUAVDesc = {};
+                    arrayUAVDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2DARRAY;
+                    arrayUAVDesc.Texture2DArray.ArraySize = slices;
+                    D3D12_CPU_DESCRIPTOR_HANDLE arrayDescriptorHandle = CbvSrvHandleProvider.AllocCpuHandle();
+                    Device->CreateUnorderedAccessView(resource.Get(), nullptr, &arrayUAVDesc, arrayDescriptorHandle);
+                    gpuDescriptor = CbvSrvHandleProvider.GpuHandleFromCpuHandle(arrayDescriptorHandle);
+                };
+            CreateArray(DXGI_FORMAT_R16G16B16A16_FLOAT, denoiseSignalSlices, m_denoiseSignals[eye], m_denoiseSignalsUAVGpuDescriptors[eye]);
+            CreateArray(DXGI_FORMAT_R16G16B16A16_FLOAT, denoiseHistorySlices, m_denoiseHistory[eye], m_denoiseHistoryUAVGpuDescriptors[eye]);
+            CreateArray(DXGI_FORMAT_R32G32B32A32_UINT, 2, m_denoiseSurfaces[eye], m_denoiseSurfacesUAVGpuDescriptors[eye]);
+        }
+    }
+
+    // Called by the scene with the layout of ShadowCache.h. Starts out zeroed, every entry free.
+    void CreateShadowCache(UINT entryCount, UINT entrySize)
+    {
+        auto defaultHeapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
+        auto bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(UINT64(entryCount) * entrySize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+        ThrowIfFailed(Device->CreateCommittedResource(
+            &defaultHeapProperties, D3D12_HEAP_FLAG_NONE, &bufferDesc, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, nullptr, IID_PPV_ARGS(&m_shadowCache)));
+        D3D12_UNORDERED_ACCESS_VIEW_DESC UAVDesc = {};
+        UAVDesc.ViewDimension = D3D12_UAV_DIMENSION_BUFFER;
+        UAVDesc.Buffer.NumElements = entryCount;
+        UAVDesc.Buffer.StructureByteStride = entrySize;
+        D3D12_CPU_DESCRIPTOR_HANDLE uavDescriptorHandle = CbvSrvHandleProvider.AllocCpuHandle();
+        Device->CreateUnorderedAccessView(m_shadowCache.Get(), nullptr, &UAVDesc, uavDescriptorHandle);
+        m_shadowCacheUAVGpuDescriptor = CbvSrvHandleProvider.GpuHandleFromCpuHandle(uavDescriptorHandle);
+    }
+
+    // Called by the scene with the tile count of an eye and the size of RayBudgetTileStats.
+    void CreateRayBudgetStats(UINT tileCount, UINT statsSize)
+    {
+        auto defaultHeapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
+        auto bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(UINT64(tileCount) * statsSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+        for (int eye = 0; eye < 2; eye++)
+        {
+            ThrowIfFailed(Device->CreateCommittedResource(
+                &defaultHeapProperties, D3D12_HEAP_FLAG_NONE, &bufferDesc, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, nullptr, IID_PPV_ARGS(&m_rayBudgetStats[eye])));
+            D3D12_UNORDERED_ACCESS_VIEW_DESC UAVDesc = {};
+            UAVDesc.ViewDimension = D3D12_UAV_DIMENSION_BUFFER;
+            UAVDesc.Buffer.NumElements = tileCount;
+            UAVDesc.Buffer.StructureByteStride = statsSize;
+            D3D12_CPU_DESCRIPTOR_HANDLE uavDescriptorHandle = CbvSrvHandleProvider.AllocCpuHandle();
+            Device->CreateUnorderedAccessView(m_rayBudgetStats[eye].Get(), nullptr, &UAVDesc, uavDescriptorHandle);
+            m_rayBudgetStatsUAVGpuDescriptors[eye] = CbvSrvHandleProvider.GpuHandleFromCpuHandle(uavDescriptorHandle);
+        }
     }
 
     SwapChainFrameResources& CurrentFrameResources()
@@ -1574,6 +1987,7 @@ struct DirectX12
 
     void WaitForPreviousFrame()
     {
+        PROFILE_ZONE("WaitForPreviousFrame");
         {
             DirectX12::SwapChainFrameResources& currFrameRes = CurrentFrameResources();
 
@@ -1597,6 +2011,7 @@ struct DirectX12
             {
                 WaitForSingleObject(currFrameRes.PresentFenceEvent, INFINITE);
             }
+            gpuTimer.BeginFrame(SwapChainFrameIndex);
 
 
                 VALIDATE((SwapChainFrameIndex == SwapChain->GetCurrentBackBufferIndex()), "Swap chain index validation failed");
@@ -1637,6 +2052,7 @@ struct DirectX12
 
     void SubmitCommandListAndPresent(bool finalContextUsed)
     {
+        PROFILE_ZONE("SubmitCommandListAndPresent");
         if (finalContextUsed)
         {
             DirectX12::SwapChainFrameResources& currFrameRes = CurrentFrameResources();
@@ -1650,6 +2066,8 @@ struct DirectX12
                 D3D12_RESOURCE_STATE_PRESENT);
             currFrameRes.CommandLists[ActiveContext]->ResourceBarrier(1, &rb);
 
+            // The final list runs after the eyes', so it can resolve every zone of the frame
+            gpuTimer.EndFrame(currFrameRes.CommandLists[DrawContext_Final]);
             SubmitCommandList(DrawContext_Final);
 
             // Present the frame.
@@ -1658,6 +2076,8 @@ struct DirectX12
 
             WaitForPreviousFrame();
         }
+        else
+            gpuTimer.DiscardFrame();
 
 
         InitFrame(finalContextUsed);
@@ -1666,10 +2086,12 @@ struct DirectX12
     // Copy the raytracing output to the backbuffer.
     void CopyRaytracingOutputToBackbuffer(ID3D12Resource* renderTarget, ID3D12Resource* depthTarget)
     {
+        PROFILE_ZONE("CopyRaytracingOutputToBackbuffer");
         //auto commandList = m_deviceResources->GetCommandList();
         //auto renderTarget = m_deviceResources->GetRenderTarget();
 
         DirectX12::SwapChainFrameResources& currFrameRes = CurrentFrameResources();
+        D3D12GpuTimer::Scope gpuZone(gpuTimer, currFrameRes.CommandLists[ActiveContext], ActiveEyeIndex == 0 ? "Output copy left eye" : "Output copy right eye");
 
         D3D12_RESOURCE_BARRIER preCopyBarriers[4];
         preCopyBarriers[0] = CD3DX12_RESOURCE_BARRIER::Transition(renderTarget, D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_COPY_DEST);
@@ -1710,7 +2132,7 @@ struct DirectX12
 static struct DirectX12 DIRECTX;
 
 //------------------------------------------------------------
-struct Texture
+struct Texture : TexturePixels
 {
     ID3D12Resource* TextureRes;
     CD3DX12_CPU_DESCRIPTOR_HANDLE SrvHandle;
@@ -1718,8 +2140,8 @@ struct Texture
 
     int SizeW, SizeH;
     UINT MipLevels;
+    AlphaMask alphaMask;    // Top mip coverage of file textures with cut out texels, empty otherwise
 
-    enum AutoFill { AUTO_WHITE = 1, AUTO_WALL, AUTO_FLOOR, AUTO_CEILING, AUTO_GRID, AUTO_GRADE_256 };
     const static UINT numTextures = 6;
     static UINT maxWidth;
     static UINT maxHeight;
@@ -1787,7 +2209,7 @@ public:
 
     Texture(bool rendertarget, int sizeW, int sizeH, AutoFill autoFillData = (AutoFill)0, int sampleCount = 1)
     {
-        Init(sizeW, sizeH, rendertarget, 1, sampleCount);
+        Init(sizeW, sizeH, rendertarget, rendertarget ? 1 : MipChainLength(sizeW, sizeH), sampleCount);
         if (!rendertarget && autoFillData)
             AutoFillTexture(autoFillData);
     }
@@ -1799,27 +2221,19 @@ public:
         DIRECTX.RtvHandleProvider.FreeCpuHandle(RtvHandle);
     }
 
-    Texture(const char* filePath)
+    // maskPath optionally names a separate coverage map, like an mtl map_d, that replaces the alpha channel.
+    Texture(const char* filePath, const char* maskPath = nullptr)
     {
-        int channels;
         int width, height;
-        uint8_t* data = stbi_load(filePath, &width, &height, &channels, 4);
-        ThrowIfFalse(data != nullptr);
-        uint32_t* pixels = (uint32_t*)malloc(sizeof(uint32_t) * width * height);
+        uint32_t* pixels = Decode(filePath, maskPath, width, height);
         ThrowIfFalse(pixels != nullptr);
 
-        for (int i = 0; i < width * height; ++i)
-        {
-            uint8_t r = data[i * 4];
-            uint8_t g = data[i * 4 + 1];
-            uint8_t b = data[i * 4 + 2];
-            uint8_t a = data[i * 4 + 3];
-            pixels[i] = (a << 24) | (b << 16) | (g << 8) | r;
-        }
+        // FillTexture reuses the pixels for the smaller mips, so take the coverage first
+        AlphaMask coverage(pixels, width, height);
+        if (!coverage.FullyOpaque())
+            alphaMask = std::move(coverage);
 
-        stbi_image_free(data);
-
-        Init(width, height, false, 1, 1);
+        Init(width, height, false, MipChainLength(width, height), 1);
         FillTexture(pixels);
     }
 
@@ -1904,18 +2318,7 @@ public:
                 }
             }
 
-            for (int j = 0; j < (sizeH & ~1); j += 2)
-            {
-                uint8_t* psrc = (uint8_t*)pix + (sizeW * j * 4);
-                uint8_t* pdest = (uint8_t*)pix + (sizeW * j);
-                for (int i = 0; i < sizeW >> 1; i++, psrc += 8, pdest += 4)
-                {
-                    pdest[0] = (((int)psrc[0]) + psrc[4] + psrc[sizeW * 4 + 0] + psrc[sizeW * 4 + 4]) >> 2;
-                    pdest[1] = (((int)psrc[1]) + psrc[5] + psrc[sizeW * 4 + 1] + psrc[sizeW * 4 + 5]) >> 2;
-                    pdest[2] = (((int)psrc[2]) + psrc[6] + psrc[sizeW * 4 + 2] + psrc[sizeW * 4 + 6]) >> 2;
-                    pdest[3] = (((int)psrc[3]) + psrc[7] + psrc[sizeW * 4 + 3] + psrc[sizeW * 4 + 7]) >> 2;
-                }
-            }
+            DownsampleMip(pix, sizeW, sizeH);
             sizeW >>= 1;
             sizeH >>= 1;
         }
@@ -1926,38 +2329,10 @@ public:
         }
     }
 
-    static void ConvertToSRGB(uint32_t* linear)
-    {
-        uint32_t drgb[3];
-        for (int k = 0; k < 3; k++)
-        {
-            float rgb = ((float)((*linear >> (k * 8)) & 0xff)) / 255.0f;
-            rgb = pow(rgb, 2.2f);
-            drgb[k] = (uint32_t)(rgb * 255.0f);
-        }
-        *linear = (*linear & 0xff000000) + (drgb[2] << 16) + (drgb[1] << 8) + (drgb[0] << 0);
-    }
-
     void AutoFillTexture(AutoFill autoFillData)
     {
         uint32_t* pix = (uint32_t*)malloc(sizeof(uint32_t) * SizeW * SizeH);
-        for (int j = 0; j < SizeH; j++)
-        {
-            for (int i = 0; i < SizeW; i++)
-            {
-                uint32_t* curr = &pix[j * SizeW + i];
-                switch (autoFillData)
-                {
-                case(AUTO_WALL): *curr = (((j / 4 & 15) == 0) || (((i / 4 & 15) == 0) && ((((i / 4 & 31) == 0) ^ ((j / 4 >> 4) & 1)) == 0))) ? 0xff3c3c3c : 0xffb4b4b4; break;
-                case(AUTO_FLOOR): *curr = (((i >> 7) ^ (j >> 7)) & 1) ? 0xffb4b4b4 : 0xff505050; break;
-                case(AUTO_CEILING): *curr = (i / 4 == 0 || j / 4 == 0) ? 0xff505050 : 0xffb4b4b4; break;
-                case(AUTO_WHITE): *curr = 0xffffffff; break;
-                case(AUTO_GRADE_256): *curr = 0xff000000 + i * 0x010101; break;
-                case(AUTO_GRID): *curr = (i < 4) || (i > (SizeW - 5)) || (j < 4) || (j > (SizeH - 5)) ? 0xffffffff : 0xff000000; break;
-                default: *curr = 0xffffffff; break;
-                }
-            }
-        }
+        FillPattern(autoFillData, SizeW, SizeH, pix);
         FillTexture(pix);
         free(pix);
     }
@@ -1971,14 +2346,17 @@ UINT Texture::maxWidth = 0;
 struct Material
 {
     UINT TexIndex;
+    MaterialClass materialClass;    // Picks the hit group record of the instances using it
 
     Material()
     {
         this->TexIndex = 0;
+        this->materialClass = MaterialClass_Diffuse;
     }
-    Material(UINT TexIndex)
+    Material(UINT TexIndex, MaterialClass materialClass = MaterialClass_Diffuse)
     {
         this->TexIndex = TexIndex;
+        this->materialClass = materialClass;
     }
 };
 
@@ -2005,6 +2383,20 @@ struct Vertex
 
 
 #include <unordered_map>
+#include <map>
+#include <algorithm>
+#include <cfloat>
+#include "SceneQuery.h"
+#include "LightBVH.h"
+#include "SecondaryRays.h"
+#include "Denoiser.h"
+#include "IrradianceProbes.h"
+#include "ShadowCache.h"
+#include "RayBudget.h"
+#include "CameraRays.h"
+#include "RayCone.h"
+#include "ProceduralSpheres.h"
+#include "InstancePacking.h"
 //-----------------------------------------------------
 struct VertexBuffer
 {
@@ -2015,7 +2407,37 @@ struct VertexBuffer
     std::vector<std::pair<UINT, UINT>> globalStartVBIndices;
     std::vector<std::pair<UINT, UINT>> globalStartIBIndices;
     std::vector<ID3D12Resource*> m_globalBottomLevelAccelerationStructures;
+    std::vector<D3D12_RAYTRACING_AABB> blasBounds;  // Object space bounds of each BLAS, used for culling
+    std::vector<SpherePrimitive> spheres;
+    std::vector<std::pair<UINT, UINT>> sphereRanges; // First sphere and count of each procedural BLAS
+    DirectX12::D3DBuffer sphereBuffer;
     UINT numVertexBuffers = 0;
+    std::vector<bool> alphaTestedRanges;    // Ranges built as non-opaque geometry, indexed like globalStartIBIndices
+
+    void SetAlphaTested(UINT range)
+    {
+        if (alphaTestedRanges.size() <= range)
+            alphaTestedRanges.resize(range + 1, false);
+        alphaTestedRanges[range] = true;
+    }
+
+    bool IsAlphaTested(UINT range) const { return range < alphaTestedRanges.size() && alphaTestedRanges[range]; }
+
+    D3D12_RAYTRACING_AABB ComputeBounds(UINT firstVertex, UINT vertexCount) const
+    {
+        D3D12_RAYTRACING_AABB bounds = { FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        for (UINT i = firstVertex; i < firstVertex + vertexCount; i++)
+        {
+            const XMFLOAT3& p = globalVertices[i].position;
+            bounds.MinX = min(bounds.MinX, p.x);
+            bounds.MinY = min(bounds.MinY, p.y);
+            bounds.MinZ = min(bounds.MinZ, p.z);
+            bounds.MaxX = max(bounds.MaxX, p.x);
+            bounds.MaxY = max(bounds.MaxY, p.y);
+            bounds.MaxZ = max(bounds.MaxZ, p.z);
+        }
+        return bounds;
+    }
 
     void InitBox()
     {
@@ -2235,6 +2657,7 @@ struct VertexBuffer
 
 
             m_globalBottomLevelAccelerationStructures.push_back(dummyResource);
+            blasBounds.push_back(ComputeBounds(globalStartVBIndices[i].first, globalStartVBIndices[i].second));
 
             D3D12_RAYTRACING_GEOMETRY_DESC geometryDesc = {};
             geometryDesc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
@@ -2250,7 +2673,8 @@ struct VertexBuffer
             // Mark the geometry as opaque. 
             // PERFORMANCE TIP: mark geometry as opaque whenever applicable as it can enable important ray processing optimizations.
             // Note: When rays encounter opaque geometry an any hit shader will not be executed whether it is present or not.
-            geometryDesc.Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE;
+            // Only the triangles that OpacityClasses.h found partly cut out are left for the alpha test.
+            geometryDesc.Flags = IsAlphaTested(i) ? D3D12_RAYTRACING_GEOMETRY_FLAG_NONE : D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE;
 
             // Get required sizes for an acceleration structure.
             D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE;
@@ -2318,6 +2742,7 @@ struct VertexBuffer
 
         ID3D12Resource* pResource;
         m_globalBottomLevelAccelerationStructures.push_back(pResource);
+        blasBounds.push_back(ComputeBounds(0, (UINT)globalVertices.size()));
 
         D3D12_RAYTRACING_GEOMETRY_DESC geometryDesc = {};
         geometryDesc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
@@ -2392,73 +2817,115 @@ struct VertexBuffer
         scratchResource->Release();
     }
 
+    // Queues spheres for one procedural BLAS with an AABB per sphere. Returns the BLAS index,
+    // which is what a ModelComponent takes as its vbIndex.
+    UINT AddSpheres(const std::vector<SpherePrimitive>& newSpheres)
+    {
+        sphereRanges.push_back(std::pair<UINT, UINT>((UINT)spheres.size(), (UINT)newSpheres.size()));
+        spheres.insert(spheres.end(), newSpheres.begin(), newSpheres.end());
+        return (UINT)sphereRanges.size() - 1;
+    }
+
+    // Builds a procedural BLAS for each AddSpheres call. If none were made a single sphere of
+    // radius 0.5 is added, which is what the scenes placing one sphere per instance expect.
     void InitAABBBottomLevelAccelerationObject()
     {
-        // Reset the command list for the acceleration structure construction.
-        DIRECTX.CurrentFrameResources().CommandLists[DrawContext_Final]->Reset(DIRECTX.CurrentFrameResources().CommandAllocators[DrawContext_Final], nullptr);
+        if (sphereRanges.empty())
+        {
+            AddSpheres(std::vector<SpherePrimitive>(1));
+        }
 
-        ID3D12Resource* pResource;
-        m_globalBottomLevelAccelerationStructures.push_back(pResource);
+        std::vector<D3D12_RAYTRACING_AABB> aabbs(spheres.size());
+        for (size_t i = 0; i < spheres.size(); i++)
+        {
+            Aabb bounds = spheres[i].Bounds();
+            aabbs[i] = { bounds.lo.x, bounds.lo.y, bounds.lo.z, bounds.hi.x, bounds.hi.y, bounds.hi.z };
+        }
+        DIRECTX.AllocateUploadBuffer(DIRECTX.Device, aabbs.data(), aabbs.size() * sizeof(D3D12_RAYTRACING_AABB), &vertexBuffer.resource);
 
-        D3D12_RAYTRACING_AABB aabb = { -0.5f, -0.5f, -0.5f, 0.5f, 0.5f, 0.5f };
-        DIRECTX.AllocateUploadBuffer(DIRECTX.Device, &aabb, sizeof(D3D12_RAYTRACING_AABB), &vertexBuffer.resource);
+        // Read by the sphere shaders at the instance's first sphere + PrimitiveIndex()
+        DIRECTX.AllocateUploadBuffer(DIRECTX.Device, spheres.data(), spheres.size() * sizeof(SpherePrimitive), &sphereBuffer.resource, L"SphereBuffer");
 
-        D3D12_RAYTRACING_GEOMETRY_DESC aabbDescTemplate = {};
-        aabbDescTemplate.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS;
-        aabbDescTemplate.AABBs.AABBCount = 1;
-        aabbDescTemplate.AABBs.AABBs.StrideInBytes = sizeof(D3D12_RAYTRACING_AABB);
-        aabbDescTemplate.AABBs.AABBs.StartAddress = vertexBuffer.resource->GetGPUVirtualAddress();
-        aabbDescTemplate.Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE;
+        for (UINT range = 0; range < sphereRanges.size(); range++)
+        {
+            // Reset the command list for the acceleration structure construction.
+            DIRECTX.CurrentFrameResources().CommandLists[DrawContext_Final]->Reset(DIRECTX.CurrentFrameResources().CommandAllocators[DrawContext_Final], nullptr);
 
+            UINT firstSphere = sphereRanges[range].first;
+            UINT numSpheres = sphereRanges[range].second;
+            UINT blasIndex = (UINT)m_globalBottomLevelAccelerationStructures.size();
+            ID3D12Resource* pResource = nullptr;
+            m_globalBottomLevelAccelerationStructures.push_back(pResource);
 
-        // Get required sizes for an acceleration structure.
-        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE;
+            D3D12_RAYTRACING_AABB rangeBounds = { FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+            for (UINT i = firstSphere; i < firstSphere + numSpheres; i++)
+            {
+                rangeBounds.MinX = (std::min)(rangeBounds.MinX, aabbs[i].MinX);
+                rangeBounds.MinY = (std::min)(rangeBounds.MinY, aabbs[i].MinY);
+                rangeBounds.MinZ = (std::min)(rangeBounds.MinZ, aabbs[i].MinZ);
+                rangeBounds.MaxX = (std::max)(rangeBounds.MaxX, aabbs[i].MaxX);
+                rangeBounds.MaxY = (std::max)(rangeBounds.MaxY, aabbs[i].MaxY);
+                rangeBounds.MaxZ = (std::max)(rangeBounds.MaxZ, aabbs[i].MaxZ);
+            }
+            blasBounds.push_back(rangeBounds);
 
-        D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS bottomLevelInputs = {};
-        bottomLevelInputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
-        bottomLevelInputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
-        bottomLevelInputs.Flags = buildFlags;
-        bottomLevelInputs.NumDescs = 1;
-        bottomLevelInputs.pGeometryDescs = &aabbDescTemplate;
+            D3D12_RAYTRACING_GEOMETRY_DESC aabbDescTemplate = {};
+            aabbDescTemplate.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS;
+            aabbDescTemplate.AABBs.AABBCount = numSpheres;
+            aabbDescTemplate.AABBs.AABBs.StrideInBytes = sizeof(D3D12_RAYTRACING_AABB);
+            aabbDescTemplate.AABBs.AABBs.StartAddress = vertexBuffer.resource->GetGPUVirtualAddress() + firstSphere * sizeof(D3D12_RAYTRACING_AABB);
+            aabbDescTemplate.Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE;
 
-        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO bottomLevelPrebuildInfo = {};
-        DIRECTX.m_dxrDevice->GetRaytracingAccelerationStructurePrebuildInfo(&bottomLevelInputs, &bottomLevelPrebuildInfo);
-        ThrowIfFalse(bottomLevelPrebuildInfo.ResultDataMaxSizeInBytes > 0);
 
-        ID3D12Resource* scratchResource;
-        DIRECTX.AllocateUAVBuffer(DIRECTX.Device, bottomLevelPrebuildInfo.ScratchDataSizeInBytes, &scratchResource, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, L"ScratchResource");
+            // Get required sizes for an acceleration structure.
+            D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE;
 
-        {
-            D3D12_RESOURCE_STATES initialResourceState = D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE;
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS bottomLevelInputs = {};
+            bottomLevelInputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            bottomLevelInputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            bottomLevelInputs.Flags = buildFlags;
+            bottomLevelInputs.NumDescs = 1;
+            bottomLevelInputs.pGeometryDescs = &aabbDescTemplate;
 
-            DIRECTX.AllocateUAVBuffer(DIRECTX.Device, bottomLevelPrebuildInfo.ResultDataMaxSizeInBytes, &m_globalBottomLevelAccelerationStructures[0], initialResourceState, L"BottomLevelAccelerationStructure");
-        }
+            D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO bottomLevelPrebuildInfo = {};
+            DIRECTX.m_dxrDevice->GetRaytracingAccelerationStructurePrebuildInfo(&bottomLevelInputs, &bottomLevelPrebuildInfo);
+            ThrowIfFalse(bottomLevelPrebuildInfo.ResultDataMaxSizeInBytes > 0);
 
-        // Bottom Level Acceleration Structure desc
-        D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC bottomLevelBuildDesc = {};
-        {
-            bottomLevelBuildDesc.Inputs = bottomLevelInputs;
-            bottomLevelBuildDesc.ScratchAccelerationStructureData = scratchResource->GetGPUVirtualAddress();
-            bottomLevelBuildDesc.DestAccelerationStructureData = m_globalBottomLevelAccelerationStructures[0]->GetGPUVirtualAddress();
-        }
+            ID3D12Resource* scratchResource;
+            DIRECTX.AllocateUAVBuffer(DIRECTX.Device, bottomLevelPrebuildInfo.ScratchDataSizeInBytes, &scratchResource, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, L"ScratchResource");
 
+            {
+                D3D12_RESOURCE_STATES initialResourceState = D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE;
 
-        auto BuildAccelerationStructure = [&](auto* raytracingCommandList)
+                DIRECTX.AllocateUAVBuffer(DIRECTX.Device, bottomLevelPrebuildInfo.ResultDataMaxSizeInBytes, &m_globalBottomLevelAccelerationStructures[blasIndex], initialResourceState, L"BottomLevelAccelerationStructure");
+            }
+
+            // Bottom Level Acceleration Structure desc
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC bottomLevelBuildDesc = {};
             {
-                raytracingCommandList->BuildRaytracingAccelerationStructure(&bottomLevelBuildDesc, 0, nullptr);
-                CD3DX12_RESOURCE_BARRIER barrier = CD3DX12_RESOURCE_BARRIER::UAV(m_globalBottomLevelAccelerationStructures[0]);
-                DIRECTX.CurrentFrameResources().CommandLists[DrawContext_Final]->ResourceBarrier(1, &barrier);
-            };
+                bottomLevelBuildDesc.Inputs = bottomLevelInputs;
+                bottomLevelBuildDesc.ScratchAccelerationStructureData = scratchResource->GetGPUVirtualAddress();
+                bottomLevelBuildDesc.DestAccelerationStructureData = m_globalBottomLevelAccelerationStructures[blasIndex]->GetGPUVirtualAddress();
+            }
 
-        // Build acceleration structure.
-        BuildAccelerationStructure(DIRECTX.CurrentFrameResources().m_dxrCommandList[DrawContext_Final].Get());
 
-        // Kick off acceleration structure construction.
-        DIRECTX.SubmitCommandList(DrawContext_Final);
+            auto BuildAccelerationStructure = [&](auto* raytracingCommandList)
+                {
+                    raytracingCommandList->BuildRaytracingAccelerationStructure(&bottomLevelBuildDesc, 0, nullptr);
+                    CD3DX12_RESOURCE_BARRIER barrier = CD3DX12_RESOURCE_BARRIER::UAV(m_globalBottomLevelAccelerationStructures[blasIndex]);
+                    DIRECTX.CurrentFrameResources().CommandLists[DrawContext_Final]->ResourceBarrier(1, &barrier);
+                };
 
-        // Wait for GPU to finish as the locally created temporary GPU resources will get released once we go out of scope.
-        DIRECTX.WaitForGpu();
-        scratchResource->Release();
+            // Build acceleration structure.
+            BuildAccelerationStructure(DIRECTX.CurrentFrameResources().m_dxrCommandList[DrawContext_Final].Get());
+
+            // Kick off acceleration structure construction.
+            DIRECTX.SubmitCommandList(DrawContext_Final);
+
+            // Wait for GPU to finish as the locally created temporary GPU resources will get released once we go out of scope.
+            DIRECTX.WaitForGpu();
+            scratchResource->Release();
+        }
     }
 
     std::pair<UINT, UINT> AddGlobalObj(const std::string& filename)
@@ -2486,46 +2953,13 @@ struct VertexBuffer
 
 		std::vector<Vertex> vertices;
 
-		// Create a hash function for the Vertex
-		struct VertexHash {
-			std::size_t operator()(const Vertex& vertex) const {
-				return ((std::hash<float>()(vertex.position.x) ^ (std::hash<float>()(vertex.position.y) << 1)) >> 1) ^
-					((std::hash<float>()(vertex.position.z) ^ (std::hash<float>()(vertex.normal.x) << 1)) >> 1) ^
-					((std::hash<float>()(vertex.normal.y) ^ (std::hash<float>()(vertex.normal.z) << 1)) >> 1) ^
-					((std::hash<float>()(vertex.uv.x) ^ (std::hash<float>()(vertex.uv.y) << 1)) >> 1);
-			}
-		};
-
-		std::unordered_map<Vertex, unsigned int, VertexHash> uniqueVertices;
+		ObjVertexIndexer<Vertex> indexer;
 
 		// Loop over shapes
 		for (const auto& shape : shapes) {
 			// Loop over faces (polygons)
 			for (const auto& index : shape.mesh.indices) {
-				Vertex vertex = { 0,0,0,0,0,0,0,0 };
-
-				vertex.position.x = attrib.vertices[3 * index.vertex_index + 0];
-				vertex.position.y = attrib.vertices[3 * index.vertex_index + 1];
-				vertex.position.z = attrib.vertices[3 * index.vertex_index + 2];
-
-				if (index.normal_index >= 0) {
-					vertex.normal.x = attrib.normals[3 * index.normal_index + 0];
-					vertex.normal.y = attrib.normals[3 * index.normal_index + 1];
-					vertex.normal.z = attrib.normals[3 * index.normal_index + 2];
-				}
-
-				if (index.texcoord_index >= 0) {
-					vertex.uv.x = attrib.texcoords[2 * index.texcoord_index + 0];
-					vertex.uv.y = attrib.texcoords[2 * index.texcoord_index + 1];
-				}
-
-				// Check if the vertex is unique
-				if (uniqueVertices.count(vertex) == 0) {
-					uniqueVertices[vertex] = static_cast<unsigned int>(vertices.size());
-					vertices.push_back(vertex);
-				}
-
-				indices.push_back(uniqueVertices[vertex]);
+				indexer.Add(ObjCornerVertex<Vertex>(attrib, index), vertices, indices);
 			}
 		}
 
@@ -2556,17 +2990,32 @@ struct VertexBuffer
 	}
 };
 //-----------------------------------------------------
+// Refers to one bottom level acceleration structure owned by a VertexBuffer.
+struct BlasHandle
+{
+    VertexBuffer* pVertexBuffer;
+    UINT index;
+
+    BlasHandle() : pVertexBuffer(nullptr), index(0) {}
+    BlasHandle(VertexBuffer* pVertexBuffer, UINT index) : pVertexBuffer(pVertexBuffer), index(index) {}
+
+    D3D12_GPU_VIRTUAL_ADDRESS GetGPUVirtualAddress() const
+    {
+        return pVertexBuffer->m_globalBottomLevelAccelerationStructures[index]->GetGPUVirtualAddress();
+    }
+};
+
+//-----------------------------------------------------
+// Describes one instance of a model. The scene copies it into its instance
+// arrays when the model is added, so it is only read at registration time.
 struct ModelComponent
 {
     XMMATRIX transform;
     XMFLOAT4 color;
-    UINT instanceIndex;
     UINT vbIndex;
     VertexBuffer* pVertexBuffer;
     Material material;
-    static UINT numInstances;
     bool scaleUvs = false;
-    UINT hitShaderIndex;
     UINT layerMask;
 
     void SetIdentity()
@@ -2579,21 +3028,17 @@ struct ModelComponent
         SetIdentity();
         GetNormalizedRGB(0xffffffff);
         pVertexBuffer = nullptr;
-        instanceIndex = numInstances++;
         vbIndex = 0;
-        hitShaderIndex = 0;
         layerMask = ~0;
     }
 
-    ModelComponent(Material mat, XMMATRIX transform, VertexBuffer* pVertexBuffer, UINT vbIndex, UINT hitShaderIndex, UINT layerMask)
+    ModelComponent(Material mat, XMMATRIX transform, VertexBuffer* pVertexBuffer, UINT vbIndex, UINT layerMask)
     {
         SetIdentity();
         GetNormalizedRGB(0xffffffff);
-        instanceIndex = numInstances++;
         material = mat;
         this->pVertexBuffer = pVertexBuffer;
         this->vbIndex = vbIndex;
-        this->hitShaderIndex = hitShaderIndex;
         this->layerMask = layerMask;
         this->transform = transform;
     }
@@ -2631,21 +3076,23 @@ struct ModelComponent
         GetNormalizedRGB(color);
         this->pVertexBuffer = pVertexBuffer;
         vbIndex = 0;
-        instanceIndex = numInstances++;
         scaleUvs = true;
-        hitShaderIndex = 0;
         layerMask = ~0;
     }
 
 };
 
-UINT ModelComponent::numInstances = 0;
+// Dense index into a Scene's instance arrays. Handles are assigned per scene
+// in registration order and double as the TLAS InstanceID.
+typedef UINT InstanceHandle;
 
 //-----------------------------------------------------
 struct Model
 {
     std::vector<ModelComponent> components;
+    std::vector<InstanceHandle> instances;
     XMMATRIX transform;
+    OpacityStats opacityStats;  // Triangles of an obj by opacity class, see InitFromObj
 
 
     Model() 
@@ -2724,22 +3171,80 @@ struct Model
             if (materials[i].diffuse_texname.size() > 0)
             {
                 std::string textPath = texturesDir + "/" + materials[i].diffuse_texname;
-                materialTextures.push_back(new Texture(textPath.c_str()));
+                std::string maskPath = texturesDir + "/" + materials[i].alpha_texname;
+                materialTextures.push_back(new Texture(textPath.c_str(), materials[i].alpha_texname.size() > 0 ? maskPath.c_str() : nullptr));
                 materialToTextureIndex[i] = materialTextures.size() - 1 + textureOffset; // Map material ID to texture index
             }
         }
 
-        // Create a hash function for the Vertex
-        struct VertexHash {
-            std::size_t operator()(const Vertex& vertex) const {
-                return ((std::hash<float>()(vertex.position.x) ^ (std::hash<float>()(vertex.position.y) << 1)) >> 1) ^
-                    ((std::hash<float>()(vertex.position.z) ^ (std::hash<float>()(vertex.normal.x) << 1)) >> 1) ^
-                    ((std::hash<float>()(vertex.normal.y) ^ (std::hash<float>()(vertex.normal.z) << 1)) >> 1) ^
-                    ((std::hash<float>()(vertex.uv.x) ^ (std::hash<float>()(vertex.uv.y) << 1)) >> 1);
-            }
-        };
+        ObjVertexIndexer<Vertex> indexer;
+
+        // Adds one material run as a component, with only the vertices its indices use.
+        auto AddComponent = [&](const std::vector<Vertex>& vertices, const std::vector<UINT>& indices, Material material)
+            {
+                std::vector<Vertex> rangeVertices;
+                std::vector<UINT> rangeIndices(indices.size());
+                std::unordered_map<UINT, UINT> remap;
+                for (size_t i = 0; i < indices.size(); i++)
+                {
+                    auto it = remap.find(indices[i]);
+                    if (it == remap.end())
+                    {
+                        it = remap.emplace(indices[i], (UINT)rangeVertices.size()).first;
+                        rangeVertices.push_back(vertices[indices[i]]);
+                    }
+                    rangeIndices[i] = it->second;
+                }
+
+                ModelComponent component;
+                component.pVertexBuffer = &vertexBuffer;
+                component.layerMask = ~0;
+                component.vbIndex = vertexBuffer.globalStartVBIndices.size();
+                component.material = material;
+                if (material.materialClass == MaterialClass_AlphaTested)
+                    vertexBuffer.SetAlphaTested(component.vbIndex);
+                vertexBuffer.AddVerticeAndIndicesToGlobal(rangeVertices, rangeIndices);
+                model.components.push_back(component);
+            };
+
+        // Splits a material run by the opacity of its triangles against the texture's coverage:
+        // opaque ones stay in an opaque component, fully cut out ones are dropped and the mixed
+        // rest goes into a non-opaque component of the alpha tested class.
+        auto AddComponents = [&](int materialId, const std::vector<Vertex>& vertices, const std::vector<UINT>& indices)
+            {
+                UINT texIndex = -1; // No texture
+                const AlphaMask* mask = nullptr;
+                if (materialToTextureIndex.find(materialId) != materialToTextureIndex.end()) {
+                    texIndex = materialToTextureIndex[materialId];
+                    mask = &materialTextures[texIndex - textureOffset]->alphaMask;
+                }
+
+                std::vector<UINT> opaqueIndices, mixedIndices;
+                for (size_t t = 0; t + 2 < indices.size(); t += 3)
+                {
+                    TriangleOpacity opacity = TriangleOpacity_Opaque;
+                    if (mask)
+                    {
+                        float uvs[6];
+                        for (int v = 0; v < 3; v++)
+                        {
+                            uvs[2 * v] = vertices[indices[t + v]].uv.x;
+                            uvs[2 * v + 1] = vertices[indices[t + v]].uv.y;
+                        }
+                        opacity = ClassifyTriangleOpacity(*mask, uvs);
+                    }
+                    model.opacityStats.Add(opacity);
+                    if (opacity == TriangleOpacity_Opaque)
+                        opaqueIndices.insert(opaqueIndices.end(), indices.begin() + t, indices.begin() + t + 3);
+                    else if (opacity == TriangleOpacity_Mixed)
+                        mixedIndices.insert(mixedIndices.end(), indices.begin() + t, indices.begin() + t + 3);
+                }
 
-        std::unordered_map<Vertex, unsigned int, VertexHash> uniqueVertices;
+                if (!opaqueIndices.empty())
+                    AddComponent(vertices, opaqueIndices, Material(texIndex));
+                if (!mixedIndices.empty())
+                    AddComponent(vertices, mixedIndices, Material(texIndex, MaterialClass_AlphaTested));
+            };
 
         // Loop over shapes
         for (const auto& shape : shapes) {
@@ -2755,23 +3260,11 @@ struct Model
                 // Check if the material has changed
                 if (materialId != currentMaterialId) {
                     if (!indices.empty()) {
-                        ModelComponent component;
-                        component.pVertexBuffer = &vertexBuffer;
-                        component.layerMask = ~0;
-                        component.hitShaderIndex = 0;
-                        component.vbIndex = vertexBuffer.globalStartVBIndices.size();
-                        if (materialToTextureIndex.find(currentMaterialId) != materialToTextureIndex.end()) {
-                            component.material.TexIndex = materialToTextureIndex[currentMaterialId];
-                        }
-                        else {
-                            component.material.TexIndex = -1; // No texture
-                        }
-                        vertexBuffer.AddVerticeAndIndicesToGlobal(vertices, indices);
-                        model.components.push_back(component);
+                        AddComponents(currentMaterialId, vertices, indices);
 
                         indices.clear();
                         vertices.clear();
-                        uniqueVertices.clear();
+                        indexer.Clear();
                     }
                     currentMaterialId = materialId;
                 }
@@ -2779,49 +3272,14 @@ struct Model
                 // Loop over vertices in the face
                 for (size_t v = 0; v < fv; v++) {
                     tinyobj::index_t idx = shape.mesh.indices[index_offset + v];
-                    Vertex vertex = { 0, 0, 0, 0, 0, 0, 0, 0 };
-
-                    vertex.position.x = attrib.vertices[3 * idx.vertex_index + 0];
-                    vertex.position.y = attrib.vertices[3 * idx.vertex_index + 1];
-                    vertex.position.z = attrib.vertices[3 * idx.vertex_index + 2];
-
-                    if (idx.normal_index >= 0) {
-                        vertex.normal.x = attrib.normals[3 * idx.normal_index + 0];
-                        vertex.normal.y = attrib.normals[3 * idx.normal_index + 1];
-                        vertex.normal.z = attrib.normals[3 * idx.normal_index + 2];
-                    }
-
-                    if (idx.texcoord_index >= 0) {
-                        vertex.uv.x = attrib.texcoords[2 * idx.texcoord_index + 0];
-                        vertex.uv.y = attrib.texcoords[2 * idx.texcoord_index + 1];
-                    }
-
-                    // Check if the vertex is unique
-                    if (uniqueVertices.count(vertex) == 0) {
-                        uniqueVertices[vertex] = static_cast<unsigned int>(vertices.size());
-                        vertices.push_back(vertex);
-                    }
-
-                    indices.push_back(uniqueVertices[vertex]);
+                    indexer.Add(ObjCornerVertex<Vertex>(attrib, idx), vertices, indices);
                 }
                 index_offset += fv;
             }
 
             // Add the remaining vertices and indices to the model
             if (!indices.empty()) {
-                ModelComponent component;
-                component.pVertexBuffer = &vertexBuffer;
-                component.layerMask = ~0;
-                component.hitShaderIndex = 0;
-                component.vbIndex = vertexBuffer.globalStartVBIndices.size();
-                if (materialToTextureIndex.find(currentMaterialId) != materialToTextureIndex.end()) {
-                    component.material.TexIndex = materialToTextureIndex[currentMaterialId];
-                }
-                else {
-                    component.material.TexIndex = -1; // No texture
-                }
-                vertexBuffer.AddVerticeAndIndicesToGlobal(vertices, indices);
-                model.components.push_back(component);
+                AddComponents(currentMaterialId, vertices, indices);
             }
         }
 
@@ -2835,32 +3293,229 @@ struct Model
     
 };
 
-#define MAX_INSTANCES 400
+#define MAX_INSTANCES 1024
 #define MAX_VBS 400
 #define MAX_TEXTURES 60
+
+// Instance mask bits, matching the LAYER_ defines in Raytracing.hlsl
+#define LAYER_HIT 1
+#define LAYER_SHADOW 2
+#define LAYER_REFLECT 4
+
 //-------------------------------------------------------------------------
-struct Scene
+// Side planes of one eye's view frustum in world space, built straight from the
+// FovPort tangents. The planes pass through the eye and face inwards; there is no
+// near or far plane since rays start at the eye and run to the end of the scene.
+struct EyeFrustum
 {
-    struct TextureData
-    {
-        UINT width;
-        UINT height;
-        XMFLOAT2 padding;
-    };
+    XMFLOAT4 planes[4];
 
-    struct InstanceData
+    EyeFrustum() {}
+    EyeFrustum(XMVECTOR position, XMVECTOR orientation, float upTan, float downTan, float leftTan, float rightTan)
     {
-        UINT textureId;
-        UINT vertexBufferId;
-        XMFLOAT2 uv;
-        XMFLOAT4 color;
+        // View space looks down -Z with +Y up, like Camera
+        XMVECTOR normals[4] =
+        {
+            XMVectorSet(1.0f, 0.0f, -leftTan, 0.0f),
+            XMVectorSet(-1.0f, 0.0f, -rightTan, 0.0f),
+            XMVectorSet(0.0f, -1.0f, -upTan, 0.0f),
+            XMVectorSet(0.0f, 1.0f, -downTan, 0.0f),
+        };
+        for (int i = 0; i < 4; i++)
+        {
+            XMVECTOR n = XMVector3Rotate(XMVector3Normalize(normals[i]), orientation);
+            float d = -XMVectorGetX(XMVector3Dot(n, position));
+            XMStoreFloat4(&planes[i], XMVectorSetW(n, d));
+        }
+    }
+
+    bool IntersectsBox(const XMFLOAT3& center, const XMFLOAT3& extents) const
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            const XMFLOAT4& p = planes[i];
+            float distance = p.x * center.x + p.y * center.y + p.z * center.z + p.w;
+            float radius = fabsf(p.x) * extents.x + fabsf(p.y) * extents.y + fabsf(p.z) * extents.z;
+            if (distance < -radius)
+                return false;
+        }
+        return true;
+    }
+};
+
+//-------------------------------------------------------------------------
+// Per-instance scene data kept as parallel arrays indexed by InstanceHandle,
+// so each per-frame pass only walks the fields it actually reads.
+struct SceneInstances
+{
+    std::vector<XMFLOAT4X4> localTransforms;    // Relative to the owning model
+    std::vector<XMFLOAT3X4> worldTransforms;    // Row major 3x4, the layout of D3D12_RAYTRACING_INSTANCE_DESC::Transform
+    std::vector<BlasHandle> blas;
+    std::vector<D3D12_GPU_VIRTUAL_ADDRESS> blasAddresses;
+    std::vector<UINT> masks;
+    std::vector<UINT> hitGroups;
+    std::vector<UINT> textureIds;
+    std::vector<UINT> vertexBufferIds;
+    std::vector<UINT> geometryOffsets;  // Set by Scene::ResolveInstance, see InstanceData in Raytracing.hlsl
+    std::vector<UINT> vertexOffsets;
+    std::vector<XMFLOAT2> uvScales;
+    std::vector<XMFLOAT4> colors;
+    std::vector<UINT> modelIndices;
+    std::vector<D3D12_RAYTRACING_AABB> localBounds;
+    std::vector<UINT> queryMeshIds;     // Mesh of the BLAS in Scene::query
+    std::vector<UINT8> outsideView;     // Set by the stereo frustum cull, drops LAYER_HIT when packing
+    std::vector<UINT8> alive;
+
+    // Despawned slots are reused before the arrays grow, so handles stay dense.
+    std::vector<InstanceHandle> freeSlots;
+    UINT liveCount = 0;
+
+    enum : UINT { NoModel = 0xffffffff };
+
+    // Number of slots handed out so far, including dead ones waiting for reuse.
+    UINT Count() const { return (UINT)alive.size(); }
+    UINT LiveCount() const { return liveCount; }
+    bool IsAlive(InstanceHandle handle) const { return handle < alive.size() && alive[handle]; }
+
+    InstanceHandle Add(const ModelComponent& component, UINT modelIndex)
+    {
+        InstanceHandle handle;
+        if (!freeSlots.empty())
+        {
+            handle = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else
+        {
+            handle = Count();
+            Resize(handle + 1);
+        }
+
+        XMStoreFloat4x4(&localTransforms[handle], component.transform);
+        blas[handle] = BlasHandle(component.pVertexBuffer, component.vbIndex);
+        blasAddresses[handle] = 0;
+        masks[handle] = component.layerMask;
+        hitGroups[handle] = component.material.materialClass;
+        textureIds[handle] = component.material.TexIndex;
+        vertexBufferIds[handle] = component.vbIndex;
+        geometryOffsets[handle] = 0;
+        vertexOffsets[handle] = 0;
+        uvScales[handle] = component.scaleUvs ? BoxUvScale(localTransforms[handle]) : XMFLOAT2(1.0f, 1.0f);
+        colors[handle] = component.color;
+        modelIndices[handle] = modelIndex;
+        localBounds[handle] = D3D12_RAYTRACING_AABB();
+        queryMeshIds[handle] = 0;
+        outsideView[handle] = 0;
+        alive[handle] = 1;
+        liveCount++;
+        return handle;
+    }
+
+    void Remove(InstanceHandle handle)
+    {
+        alive[handle] = 0;
+        freeSlots.push_back(handle);
+        liveCount--;
+    }
+
+    void Resize(UINT count)
+    {
+        localTransforms.resize(count);
+        worldTransforms.resize(count);
+        blas.resize(count);
+        blasAddresses.resize(count);
+        masks.resize(count);
+        hitGroups.resize(count);
+        textureIds.resize(count);
+        vertexBufferIds.resize(count);
+        geometryOffsets.resize(count);
+        vertexOffsets.resize(count);
+        uvScales.resize(count);
+        colors.resize(count);
+        modelIndices.resize(count);
+        localBounds.resize(count);
+        queryMeshIds.resize(count);
+        outsideView.resize(count);
+        alive.resize(count);
+    }
+
+    void SetWorldTransform(InstanceHandle handle, XMMATRIX transform)
+    {
+        transform = XMMatrixTranspose(transform);
+        for (int i = 0; i < 3; i++)
+        {
+            memcpy(worldTransforms[handle].m[i], transform.r[i].m128_f32, 4 * sizeof(float));
+        }
+    }
+
+    // The BLAS exists once this is called, so its address and bounds can be cached.
+    void ResolveBlas(InstanceHandle handle)
+    {
+        blasAddresses[handle] = blas[handle].GetGPUVirtualAddress();
+        localBounds[handle] = blas[handle].pVertexBuffer->blasBounds[blas[handle].index];
+    }
+
+    // Axis aligned world bounds of the local bounds moved by the world transform.
+    void GetWorldBounds(InstanceHandle handle, XMFLOAT3& center, XMFLOAT3& extents) const
+    {
+        const D3D12_RAYTRACING_AABB& b = localBounds[handle];
+        const XMFLOAT3X4& m = worldTransforms[handle];
+        float c[3] = { (b.MinX + b.MaxX) * 0.5f, (b.MinY + b.MaxY) * 0.5f, (b.MinZ + b.MaxZ) * 0.5f };
+        float e[3] = { (b.MaxX - b.MinX) * 0.5f, (b.MaxY - b.MinY) * 0.5f, (b.MaxZ - b.MinZ) * 0.5f };
+        float wc[3];
+        float we[3];
+        for (int r = 0; r < 3; r++)
+        {
+            wc[r] = m.m[r][0] * c[0] + m.m[r][1] * c[1] + m.m[r][2] * c[2] + m.m[r][3];
+            we[r] = fabsf(m.m[r][0]) * e[0] + fabsf(m.m[r][1]) * e[1] + fabsf(m.m[r][2]) * e[2];
+        }
+        center = XMFLOAT3(wc[0], wc[1], wc[2]);
+        extents = XMFLOAT3(we[0], we[1], we[2]);
+    }
+
+    Aabb GetWorldAabb(InstanceHandle handle) const
+    {
+        XMFLOAT3 center, extents;
+        GetWorldBounds(handle, center, extents);
+        return Aabb(Float3(center.x - extents.x, center.y - extents.y, center.z - extents.z),
+                    Float3(center.x + extents.x, center.y + extents.y, center.z + extents.z));
+    }
+
+    // Boxes are scaled unit cubes, so the texture is tiled along the two largest extents.
+    static XMFLOAT2 BoxUvScale(const XMFLOAT4X4& local)
+    {
+        float x = local._11;
+        float y = local._22;
+        float z = local._33;
+        if (x >= z && y >= z)
+            return XMFLOAT2(x, y);
+        else if (y >= x && z >= x)
+            return XMFLOAT2(z, y);
+        return XMFLOAT2(x, z);
+    }
+};
+
+//-------------------------------------------------------------------------
+struct Scene
+{
+    struct TextureData
+    {
+        UINT width;
+        UINT height;
+        UINT mipLevels;     // Levels of the slice holding this texture's own chain
+        float padding;
     };
 
-    struct Light
+    // Everything a hit reads of its instance, so the shaders resolve no further tables per hit.
+    struct InstanceData
     {
-        XMVECTOR position;
-        XMFLOAT3 color;
-        float intensity;
+        UINT geometryOffset;
+        UINT vertexOffset;
+        UINT textureId;
+        UINT textureSize;       // Width in the low 16 bits, height in the high
+        XMFLOAT2 uvScale;
+        UINT tint;              // RGBA8
+        UINT textureMipLevels;
     };
 
     struct VertexBufferData
@@ -2870,24 +3525,114 @@ struct Scene
         XMFLOAT2 padding;
     };
 
+    // HLSL starts every array element on a 16 byte boundary
+    struct MaterialData
+    {
+        MaterialConstants constants;
+        UINT padding[2];
+    };
+
     struct alignas(256) SceneConstantBuffer
     {
-        XMMATRIX projectionToWorld;
+        XMFLOAT4 cameraCorner;
+        XMFLOAT4 cameraStepX;
+        XMFLOAT4 cameraStepY;
         XMVECTOR eyePosition;
+        XMMATRIX previousWorldToProjection;
+        XMVECTOR previousEyePosition;
+        UINT maxBounces;
+        UINT inlineSecondary;
+        float pixelSpreadAngle;
+        UINT lightCount;
+        UINT lightSamples;
+        UINT frameIndex;
+        UINT secondaryScale;
+        UINT denoise;
+        XMFLOAT4 probeOrigin;
+        XMFLOAT4 probeSpacing;
+        UINT probeCounts[4];
+        XMFLOAT4 probeRayRotation;
+        UINT probeUpdateOffset;
+        UINT probeUpdateCount;
+        UINT probeFreshCount;
+        float probeHysteresis;
+        float shadowCacheCellSize;
+        UINT shadowInvalidationCount;
+        UINT shadowCacheClear;
+        UINT rayBudgetTilesX;      // 0 when every tile traces at the full settings
+        MaterialData materials[MaterialClass_Count];
         InstanceData instanceData[MAX_INSTANCES];
-        Light lights[4];
-        VertexBufferData vertexBufferDatas[MAX_VBS];
-        TextureData textureResources[MAX_TEXTURES];
     };
 
     SceneConstantBuffer* m_mappedConstantData[2];
     ComPtr<ID3D12Resource>       m_perFrameConstants[2];
     SceneConstantBuffer m_sceneCB[2][DIRECTX.SwapChainNumFrames];
-    InstanceData instanceData[MAX_INSTANCES];
-    UINT numInstances;
-    Light lights[4];
+    SceneInstances instances;
+    // Lights are rebuilt into lightBVH on the next RecordRaytracing after they change and uploaded
+    // to a slice of m_lightBuffers per frame, lights first and the nodes after MAX_LIGHTS of them.
+    std::vector<LightSource> lights;
+    LightBVH lightBVH;
+    bool lightsDirty = true;
+    ComPtr<ID3D12Resource> m_lightBuffers[2];
+    UINT8* m_mappedLightData[2];
+    // The shadow cache invalidations of the frame follow the nodes.
+    static const UINT64 lightBufferFrameSize = MAX_LIGHTS * sizeof(LightSource) + 2 * MAX_LIGHTS * sizeof(LightNode)
+        + SHADOW_CACHE_MAX_INVALIDATIONS * sizeof(ShadowCacheInvalidation);
+    // Lights DirectLighting picks per hit, each costing one shadow ray, up to LIGHT_MAX_SAMPLES.
+    UINT lightSamples = 1;
+    // Seeds the light samples, advanced every DoRaytracing.
+    UINT frameIndex = 0;
     VertexBufferData vertexBufferDatas[MAX_VBS];
     TextureData textureResources[MAX_TEXTURES];
+    // Mirror reflections the raygen shader follows after the primary hit, can change every frame.
+    UINT maxBounces = 1;
+    // 1, 2 or 4: the inline pass traces shadow and reflection rays for one pixel in secondaryScale
+    // by secondaryScale and SecondaryUpsample.hlsl fills in the rest. The DispatchRays path ignores it.
+    UINT secondaryScale = 1;
+    // Runs Denoise.hlsl over the lighting and reflection of the inline pass. Each eye keeps the
+    // camera of its last frame for the reprojection, and counts the frames its history spans.
+    bool denoise = false;
+    XMMATRIX previousWorldToProjection[2] = { XMMatrixIdentity(), XMMatrixIdentity() };
+    XMVECTOR previousEyePosition[2] = { XMVectorZero(), XMVectorZero() };
+    UINT denoisedFrames[2] = {};
+    // Irradiance probes fitted to the scene bounds by BuildAccelerationStructures, with at most
+    // maxProbes of them, replace the flat ambient term. The left eye's RecordRaytracing updates
+    // probeUpdateBudget of them in turn every frame, and a budget of 0 freezes them. The grid
+    // stays empty, and the ambient term flat, without inline raytracing to update it.
+    bool irradianceProbes = true;
+    UINT maxProbes = 1024;
+    UINT probeUpdateBudget = 32;
+    float probeHysteresis = 0.85f;
+    ProbeGrid probeGrid;
+    UINT probeUpdateOffset = 0;
+    UINT probesUpdated = 0;     // Stops at the probe count, probes from here on have never been updated
+    // Shadow rays of cells whose visibility has settled are answered from a world space cache of
+    // shadowCacheCellSize cells instead, see ShadowCache.h. Instances that move, spawn or despawn
+    // and lights that move queue the cache entries they affect, and the left eye's RecordRaytracing
+    // resets them before anything is traced. Needs inline raytracing for the reset pass.
+    bool shadowCache = true;
+    float shadowCacheCellSize = 0.05f;
+    float shadowCacheBuiltCellSize = 0.0f;     // Entries of another cell size are cleared out
+    std::vector<ShadowCacheInvalidation> shadowInvalidations;
+    bool shadowCacheOverflow = false;           // Too many invalidations this frame, clear it all
+    // Spreads rayBudget secondary rays per pixel over the screen tiles of each frame, by what the
+    // tiles showed when the eye last rendered into the same frame slot, see RayBudget.h. 0 traces
+    // every ray the settings ask for. Statistics come back through a readback slice per eye and
+    // frame, the tile budgets go up through an upload slice. Needs inline raytracing for the
+    // statistics pass.
+    float rayBudget = 0.0f;
+    RayBudgetSettings rayBudgetSettings;        // The target and limits are filled in every frame
+    UINT rayBudgetTilesX = 0;
+    UINT rayBudgetTilesY = 0;
+    ComPtr<ID3D12Resource> m_rayBudgetReadbacks[2];
+    RayBudgetTileStats* m_mappedRayBudgetStats[2];
+    ComPtr<ID3D12Resource> m_rayBudgetTileBuffers[2];
+    UINT* m_mappedRayBudgetTiles[2];
+    bool rayBudgetStatsValid[2][DIRECTX.SwapChainNumFrames] = {};
+
+    // Created on the first BenchmarkSecondaryPaths so the timed passes run alone
+    ComPtr<ID3D12CommandAllocator> benchmarkAllocator;
+    ComPtr<ID3D12GraphicsCommandList4> benchmarkCommandList;
 
     VertexBuffer globalVertexBuffer;
     VertexBuffer aabbVertexBuffer;
@@ -2896,7 +3641,8 @@ struct Scene
     std::vector<Model> models;
 
     ID3D12Resource* instanceDescs;
-    D3D12_RAYTRACING_INSTANCE_DESC* instanceDescsArray;
+    D3D12_RAYTRACING_INSTANCE_DESC* instanceDescsArray = nullptr;
+    UINT numPackedInstances = 0;
     ID3D12Resource* ScratchAccelerationStructureData;
 
     // Acceleration structure
@@ -2905,27 +3651,249 @@ struct Scene
     // Textures
     std::vector<Texture*> textures;
 
+    // CPU copy of the traced geometry for gameplay queries. Its instances are only rebuilt when
+    // something changed since the last query, so read it through Query().
+    SceneQuery query;
+    bool queryInstancesDirty = true;
+    std::map<std::pair<VertexBuffer*, UINT>, UINT> queryMeshes;
 
 
-    void UpdateInstancePosition(UINT instanceIndex, XMFLOAT3 position)
+    // Registers every component of the model as a scene instance and returns the model index.
+    UINT AddModel(const Model& model)
     {
-        instanceDescsArray[instanceIndex].Transform[0][3] = position.x;
-        instanceDescsArray[instanceIndex].Transform[1][3] = position.y;
-        instanceDescsArray[instanceIndex].Transform[2][3] = position.z;
+        UINT modelIndex = (UINT)models.size();
+        models.push_back(model);
+        Model& added = models.back();
+        added.instances.clear();
+        for (int i = 0; i < added.components.size(); i++)
+        {
+            added.instances.push_back(RegisterInstance(added.components[i], modelIndex));
+        }
+        UpdateModelInstances(modelIndex);
+        return modelIndex;
     }
 
+    // Adds a single instance of an already built BLAS, placed by the component transform.
+    // Can be called at any point while the scene is running; it shows up on the next UpdateInstanceDescs.
+    InstanceHandle SpawnInstance(const ModelComponent& component)
+    {
+        InstanceHandle instance = RegisterInstance(component, SceneInstances::NoModel);
+        instances.SetWorldTransform(instance, component.transform);
+        InvalidateShadows(instance);
+        return instance;
+    }
+
+    void DespawnInstance(InstanceHandle instance)
+    {
+        if (!instances.IsAlive(instance))
+            return;
+
+        UINT modelIndex = instances.modelIndices[instance];
+        if (modelIndex != SceneInstances::NoModel)
+        {
+            std::vector<InstanceHandle>& modelInstances = models[modelIndex].instances;
+            modelInstances.erase(std::find(modelInstances.begin(), modelInstances.end(), instance));
+        }
+        InvalidateShadows(instance);
+        instances.Remove(instance);
+        queryInstancesDirty = true;
+    }
+
+    InstanceHandle RegisterInstance(const ModelComponent& component, UINT modelIndex)
+    {
+        VALIDATE(instances.LiveCount() < MAX_INSTANCES, "Scene instance limit reached");
+        InstanceHandle instance = instances.Add(component, modelIndex);
+        queryInstancesDirty = true;
+
+        // Instances added before BuildAccelerationStructures are resolved there, once the BLASes exist.
+        if (instanceDescsArray)
+            ResolveInstance(instance);
+        return instance;
+    }
+
+    void ResolveInstance(InstanceHandle instance)
+    {
+        instances.ResolveBlas(instance);
+        queryInstancesDirty = true;
+        instances.queryMeshIds[instance] = GetQueryMesh(instances.blas[instance]);
+
+        // The hit shaders read the mesh's index and vertex offsets straight from the instance.
+        // Procedural instances have no vertex range, their geometry starts at the first sphere
+        // of the BLAS in the sphere buffer instead.
+        const BlasHandle& blas = instances.blas[instance];
+        if (blas.index < blas.pVertexBuffer->sphereRanges.size())
+        {
+            instances.geometryOffsets[instance] = blas.pVertexBuffer->sphereRanges[blas.index].first;
+            instances.vertexOffsets[instance] = 0;
+        }
+        else
+        {
+            instances.geometryOffsets[instance] = vertexBufferDatas[instances.vertexBufferIds[instance]].indexOffset;
+            instances.vertexOffsets[instance] = vertexBufferDatas[instances.vertexBufferIds[instance]].vertexOffset;
+        }
+    }
+
+    // Query meshes are built once per BLAS and shared by every instance of it.
+    UINT GetQueryMesh(const BlasHandle& handle)
+    {
+        std::pair<VertexBuffer*, UINT> key(handle.pVertexBuffer, handle.index);
+        std::map<std::pair<VertexBuffer*, UINT>, UINT>::iterator found = queryMeshes.find(key);
+        if (found != queryMeshes.end())
+            return found->second;
+
+        const VertexBuffer& vb = *handle.pVertexBuffer;
+        UINT meshId;
+        if (handle.index < vb.sphereRanges.size())
+        {
+            // Procedural BLAS, one sphere per AABB. Procedural buffers hold nothing else.
+            const std::pair<UINT, UINT>& range = vb.sphereRanges[handle.index];
+            std::vector<QuerySphere> querySpheres(range.second);
+            for (UINT i = 0; i < range.second; i++)
+            {
+                querySpheres[i].center = vb.spheres[range.first + i].center;
+                querySpheres[i].radius = vb.spheres[range.first + i].radius;
+            }
+            meshId = query.AddSphereMesh(querySpheres.data(), querySpheres.size());
+        }
+        else if (handle.index < vb.globalStartIBIndices.size())
+        {
+            // One range of the global buffers, indices are relative to the first vertex of the range.
+            const std::pair<UINT, UINT>& vbRange = vb.globalStartVBIndices[handle.index];
+            const std::pair<UINT, UINT>& ibRange = vb.globalStartIBIndices[handle.index];
+            meshId = query.AddTriangleMesh(&vb.globalVertices[vbRange.first].position.x, sizeof(Vertex), vbRange.second,
+                                           &vb.globalIndices[ibRange.first], ibRange.second);
+        }
+        else
+        {
+            meshId = query.AddTriangleMesh(&vb.globalVertices[0].position.x, sizeof(Vertex), vb.globalVertices.size(),
+                                           vb.globalIndices.data(), vb.globalIndices.size());
+        }
+        queryMeshes[key] = meshId;
+        return meshId;
+    }
+
+    // The query structure with the live instances as they are now.
+    const SceneQuery& Query()
+    {
+        if (queryInstancesDirty)
+            UpdateQueryInstances();
+        return query;
+    }
+
+    // Mirrors the live instances into the query structure. Uses the unculled masks, since
+    // the frustum cull only concerns primary rays.
+    void UpdateQueryInstances()
+    {
+        PROFILE_ZONE("UpdateQueryInstances");
+        queryInstancesDirty = false;
+        query.ClearInstances();
+        UINT numSlots = instances.Count();
+        for (UINT i = 0; i < numSlots; i++)
+        {
+            if (!instances.alive[i] || instances.blasAddresses[i] == 0)
+                continue;
+
+            Transform3x4 objectToWorld;
+            memcpy(objectToWorld.m, &instances.worldTransforms[i], sizeof(objectToWorld.m));
+            query.AddInstance(instances.queryMeshIds[i], objectToWorld, instances.masks[i], i);
+        }
+        query.CommitInstances();
+    }
+
+    // Clears LAYER_HIT on every instance whose world bounds miss all of the given eye frusta.
+    // Shadow and reflection layers are left alone, so off-screen geometry still casts shadows
+    // and shows up in reflections.
+    void CullPrimaryLayer(const EyeFrustum* frusta, UINT numFrusta)
+    {
+        PROFILE_ZONE("CullPrimaryLayer");
+        UINT numSlots = instances.Count();
+        for (UINT i = 0; i < numSlots; i++)
+        {
+            if (!instances.alive[i])
+                continue;
+
+            XMFLOAT3 center, extents;
+            instances.GetWorldBounds(i, center, extents);
+            bool visible = false;
+            for (UINT f = 0; f < numFrusta && !visible; f++)
+            {
+                visible = frusta[f].IntersectsBox(center, extents);
+            }
+            instances.outsideView[i] = !visible;
+        }
+    }
+
+    // Queues the shadow cache invalidation of the instance's current world bounds. Before
+    // BuildAccelerationStructures nothing has been traced and the bounds are not known yet.
+    void InvalidateShadows(InstanceHandle instance)
+    {
+        if (instanceDescsArray)
+            QueueShadowInvalidation(ShadowCacheInvalidation(instances.GetWorldAabb(instance)));
+    }
+
+    void QueueShadowInvalidation(const ShadowCacheInvalidation& invalidation)
+    {
+        if (shadowInvalidations.size() < SHADOW_CACHE_MAX_INVALIDATIONS)
+            shadowInvalidations.push_back(invalidation);
+        else
+            shadowCacheOverflow = true;
+    }
+
+    // SetWorldTransform for instances that may already have been traced: when the transform
+    // changes, the shadows of the bounds the instance leaves and enters are invalidated.
+    void MoveInstance(InstanceHandle instance, XMMATRIX transform)
+    {
+        XMFLOAT3X4 previous = instances.worldTransforms[instance];
+        instances.SetWorldTransform(instance, transform);
+        XMFLOAT3X4 moved = instances.worldTransforms[instance];
+        instances.worldTransforms[instance] = previous;
+        MoveInstance(instance, moved);
+    }
+
+    void MoveInstance(InstanceHandle instance, const XMFLOAT3X4& world)
+    {
+        if (memcmp(&instances.worldTransforms[instance], &world, sizeof(world)) == 0)
+            return;
+        InvalidateShadows(instance);
+        instances.worldTransforms[instance] = world;
+        InvalidateShadows(instance);
+        queryInstancesDirty = true;
+    }
+
+    void UpdateInstancePosition(InstanceHandle instance, XMFLOAT3 position)
+    {
+        XMFLOAT3X4& transform = instances.worldTransforms[instance];
+        if (transform.m[0][3] == position.x && transform.m[1][3] == position.y && transform.m[2][3] == position.z)
+            return;
+        InvalidateShadows(instance);
+        transform.m[0][3] = position.x;
+        transform.m[1][3] = position.y;
+        transform.m[2][3] = position.z;
+        InvalidateShadows(instance);
+        queryInstancesDirty = true;
+    }
+
+    // Each instance is placed by its local transform followed by the model transform.
+    void UpdateModelInstances(UINT modelIndex)
+    {
+        const Model& model = models[modelIndex];
+        XMFLOAT4X4 modelTransform;
+        XMStoreFloat4x4(&modelTransform, model.transform);
+        for (int i = 0; i < model.instances.size(); i++)
+        {
+            InstanceHandle instance = model.instances[i];
+            XMFLOAT3X4 world;
+            ComposeInstanceTransform(instances.localTransforms[instance].m, modelTransform.m, world.m);
+            MoveInstance(instance, world);
+        }
+    }
 
     void UpdateModelPosition(UINT modelIndex, XMFLOAT3 position)
     {
         if (modelIndex < models.size())
         {
             models[modelIndex].SetPosition(position);
-            XMMATRIX transform;
-            for (int i = 0; i < models[modelIndex].components.size(); i++)
-            {
-                transform = XMMatrixMultiply(models[modelIndex].transform, models[modelIndex].components[i].transform);
-                UpdateInstanceTransform(models[modelIndex].components[i].instanceIndex, transform);
-            }
+            UpdateModelInstances(modelIndex);
         }
     }
 
@@ -2934,12 +3902,7 @@ struct Scene
         if (modelIndex < models.size())
         {
             models[modelIndex].transform = XMMatrixMultiply(transformation, models[modelIndex].transform);
-            XMMATRIX transform;
-            for (int i = 0; i < models[modelIndex].components.size(); i++)
-            {
-                transform = XMMatrixMultiply(models[modelIndex].transform, models[modelIndex].components[i].transform);
-                UpdateInstanceTransform(models[modelIndex].components[i].instanceIndex, transform);
-            }
+            UpdateModelInstances(modelIndex);
         }
     }
 
@@ -2948,35 +3911,77 @@ struct Scene
         if (modelIndex < models.size())
         {
             models[modelIndex].transform = transform;
-            XMMATRIX overallTransform;
-            for (int i = 0; i < models[modelIndex].components.size(); i++)
-            {
-                overallTransform = XMMatrixMultiply(models[modelIndex].components[i].transform, models[modelIndex].transform);
-                UpdateInstanceTransform(models[modelIndex].components[i].instanceIndex, overallTransform);
-            }
+            UpdateModelInstances(modelIndex);
         }
     }
 
-    void UpdateInstanceTransform(UINT instanceIndex, XMMATRIX transformMatrix)
+    void UpdateInstanceTransform(InstanceHandle instance, XMMATRIX transformMatrix)
     {
-        transformMatrix = XMMatrixTranspose(transformMatrix);
-        for (int i = 0; i < 3; i++)
-        {
-            memcpy(instanceDescsArray[instanceIndex].Transform[i], transformMatrix.r[i].m128_f32, 4 * sizeof(float));
-        }
+        MoveInstance(instance, transformMatrix);
+    }
+
+    void SetInstanceMask(InstanceHandle instance, UINT mask)
+    {
+        // Starting or stopping to cast shadows changes them as much as moving does
+        if ((instances.masks[instance] ^ mask) & LAYER_SHADOW)
+            InvalidateShadows(instance);
+        if (instances.masks[instance] != mask)
+            queryInstancesDirty = true;
+        instances.masks[instance] = mask;
+    }
+
+    // Moves one instance to another hit group record, for when it differs from the rest of its model.
+    void SetInstanceMaterialClass(InstanceHandle instance, MaterialClass materialClass)
+    {
+        instances.hitGroups[instance] = materialClass;
+    }
+
+    // Point light, or spherical area light with a radius. intensity is the irradiance it gives at unit distance.
+    UINT AddLight(XMVECTOR position, XMFLOAT3 color, float intensity, float radius = 0.0f)
+    {
+        VALIDATE(lights.size() < MAX_LIGHTS, "Scene light limit reached");
+        lights.push_back(LightSource(Float3(XMVectorGetX(position), XMVectorGetY(position), XMVectorGetZ(position)),
+            Float3(color.x, color.y, color.z), intensity, radius));
+        lightsDirty = true;
+        return UINT(lights.size() - 1);
+    }
+
+    void SetLightPosition(UINT light, XMVECTOR position)
+    {
+        Float3 moved(XMVectorGetX(position), XMVectorGetY(position), XMVectorGetZ(position));
+        if (moved.x == lights[light].position.x && moved.y == lights[light].position.y && moved.z == lights[light].position.z)
+            return;
+        lights[light].position = moved;
+        lightsDirty = true;
+        QueueShadowInvalidation(ShadowCacheInvalidation::Light(light));
+    }
+
+    // Compacts the live instances to the front of instanceDescsArray, see ::PackInstanceDescs.
+    void PackInstanceDescs()
+    {
+        numPackedInstances = ::PackInstanceDescs(instances, instanceDescsArray, LAYER_HIT, RAY_TYPE_COUNT);
+    }
+
+    void PackInstanceConstants(InstanceData* pInstanceData)
+    {
+        ::PackInstanceConstants(instances, textureResources, pInstanceData);
     }
 
     void UpdateInstanceDescs()
     {
-        DIRECTX.UpdateUploadBuffer(DIRECTX.Device, instanceDescsArray, numInstances * sizeof(D3D12_RAYTRACING_INSTANCE_DESC), &instanceDescs);
+        PROFILE_ZONE("UpdateInstanceDescs");
+        PackInstanceDescs();
+        DIRECTX.UpdateUploadBuffer(DIRECTX.Device, instanceDescsArray, numPackedInstances * sizeof(D3D12_RAYTRACING_INSTANCE_DESC), &instanceDescs);
     }
 
     void UpdateTLAS()
     {
+        PROFILE_ZONE("UpdateTLAS");
+        D3D12GpuTimer::Scope gpuZone(DIRECTX.gpuTimer, DIRECTX.CurrentFrameResources().CommandLists[DrawContext_Final], "UpdateTLAS");
         D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS topLevelInputs = {};
         topLevelInputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
         topLevelInputs.Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE;
-        topLevelInputs.NumDescs = numInstances;
+        topLevelInputs.NumDescs = numPackedInstances;
         topLevelInputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
 
         // Top Level Acceleration Structure desc
@@ -2997,6 +4002,125 @@ struct Scene
 
     }
 
+    // Fits the probe grid to the traced geometry and sizes the atlases for it.
+    void BuildProbeGrid()
+    {
+        static_assert(PROBE_MAX_ATLAS_TEXELS <= D3D12_REQ_TEXTURE2D_U_OR_V_DIMENSION, "Probe atlases must fit in a texture");
+        UINT probeLimit = maxProbes < PROBE_MAX_COUNT ? maxProbes : PROBE_MAX_COUNT;
+        probeGrid = DIRECTX.m_probeTracePipeline ? ProbeGrid::Fit(Query().Bounds(), probeLimit) : ProbeGrid();
+        probeUpdateOffset = 0;
+        probesUpdated = 0;
+        if (probeGrid.Empty())
+            DIRECTX.CreateProbeResources(1, 1, 1, 1, 1, 1);
+        else
+            DIRECTX.CreateProbeResources(probeGrid.AtlasWidth(PROBE_IRRADIANCE_TEXELS), probeGrid.AtlasHeight(PROBE_IRRADIANCE_TEXELS),
+                probeGrid.AtlasWidth(PROBE_VISIBILITY_TEXELS), probeGrid.AtlasHeight(PROBE_VISIBILITY_TEXELS), PROBE_RAYS, probeGrid.Count());
+    }
+
+    // Copies the probe grid into the constants and, for the left eye, picks the probes this
+    // frame updates. Returns how many that is.
+    UINT PackProbeConstants(SceneConstantBuffer& constants)
+    {
+        bool enabled = irradianceProbes && !probeGrid.Empty();
+        constants.probeOrigin = XMFLOAT4(probeGrid.origin.x, probeGrid.origin.y, probeGrid.origin.z, probeGrid.NormalBias());
+        constants.probeSpacing = XMFLOAT4(probeGrid.spacing.x, probeGrid.spacing.y, probeGrid.spacing.z, probeGrid.maxDistance);
+        for (int axis = 0; axis < 3; axis++)
+            constants.probeCounts[axis] = enabled ? probeGrid.counts[axis] : 0;
+        constants.probeCounts[3] = 0;
+
+        UINT probeCount = probeGrid.Count();
+        UINT updateCount = 0;
+        if (enabled && DIRECTX.ActiveContext == DrawContext_EyeRenderLeft)
+            updateCount = probeUpdateBudget < probeCount ? probeUpdateBudget : probeCount;
+        UINT freshCount = probeCount - probesUpdated;
+        Quat rotation = ProbeRayRotation(frameIndex);
+        constants.probeRayRotation = XMFLOAT4(rotation.x, rotation.y, rotation.z, rotation.w);
+        constants.probeUpdateOffset = probeUpdateOffset;
+        constants.probeUpdateCount = updateCount;
+        constants.probeFreshCount = freshCount < updateCount ? freshCount : updateCount;
+        constants.probeHysteresis = probeHysteresis;
+        if (updateCount > 0)
+        {
+            probeUpdateOffset = (probeUpdateOffset + updateCount) % probeCount;
+            probesUpdated = freshCount < updateCount ? probeCount : probesUpdated + updateCount;
+        }
+        return updateCount;
+    }
+
+    // Copies the shadow cache settings into the constants and, for the left eye, the queued
+    // invalidations after the lights and their nodes. Returns whether the reset pass has work.
+    bool PackShadowCacheConstants(SceneConstantBuffer& constants, UINT8* lightData)
+    {
+        bool enabled = shadowCache && shadowCacheCellSize > 0.0f && DIRECTX.m_shadowCacheInvalidatePipeline;
+        constants.shadowCacheCellSize = enabled ? shadowCacheCellSize : 0.0f;
+        constants.shadowInvalidationCount = 0;
+        constants.shadowCacheClear = 0;
+        if (DIRECTX.ActiveContext != DrawContext_EyeRenderLeft || !DIRECTX.m_shadowCacheInvalidatePipeline)
+            return false;
+
+        // Entries keyed by cells of another size would answer for the wrong cells
+        if (enabled && shadowCacheCellSize != shadowCacheBuiltCellSize)
+        {
+            shadowCacheOverflow = true;
+            shadowCacheBuiltCellSize = shadowCacheCellSize;
+        }
+        if (shadowCacheOverflow)
+            constants.shadowCacheClear = 1;
+        else if (!shadowInvalidations.empty())
+        {
+            memcpy(lightData + MAX_LIGHTS * sizeof(LightSource) + 2 * MAX_LIGHTS * sizeof(LightNode), shadowInvalidations.data(),
+                shadowInvalidations.size() * sizeof(ShadowCacheInvalidation));
+            constants.shadowInvalidationCount = UINT(shadowInvalidations.size());
+        }
+        bool work = constants.shadowCacheClear || constants.shadowInvalidationCount > 0;
+        shadowInvalidations.clear();
+        shadowCacheOverflow = false;
+        return work;
+    }
+
+    // rayBudgetSettings for a frame of the active eye at the scene's settings.
+    RayBudgetSettings FrameRayBudgetSettings(float raysPerPixel, UINT scale)
+    {
+        RayBudgetSettings settings = rayBudgetSettings;
+        settings.rayTarget = double(raysPerPixel) * DIRECTX.eyeWidth * DIRECTX.eyeHeight;
+        settings.maxLightSamples = lightSamples < LIGHT_MAX_SAMPLES ? lightSamples : LIGHT_MAX_SAMPLES;
+        settings.maxBounces = maxBounces;
+        settings.raysPerPixel = 1.0f / (scale * scale);
+        return settings;
+    }
+
+    // Fills the frame slot's tile budgets from the statistics it read back, or lets every tile
+    // trace at the full settings until it has some. Returns whether the statistics pass runs.
+    bool PackRayBudgetConstants(SceneConstantBuffer& constants, UINT scale)
+    {
+        DrawContext context = DIRECTX.ActiveContext;
+        constants.rayBudgetTilesX = 0;
+        if (rayBudget <= 0.0f || !DIRECTX.m_rayBudgetStatsPipeline)
+        {
+            // Statistics of frames traced without a budget would be stale once it is back
+            for (bool& valid : rayBudgetStatsValid[context])
+                valid = false;
+            return false;
+        }
+
+        UINT tileCount = rayBudgetTilesX * rayBudgetTilesY;
+        UINT* tiles = m_mappedRayBudgetTiles[context] + DIRECTX.SwapChainFrameIndex * tileCount;
+        if (rayBudgetStatsValid[context][DIRECTX.SwapChainFrameIndex])
+        {
+            RayBudgetAllocation allocation = AllocateRayBudget(rayBudgetTilesX, rayBudgetTilesY,
+                m_mappedRayBudgetStats[context] + DIRECTX.SwapChainFrameIndex * tileCount, FrameRayBudgetSettings(rayBudget, scale));
+            memcpy(tiles, allocation.tiles.data(), tileCount * sizeof(UINT));
+        }
+        else
+        {
+            for (UINT i = 0; i < tileCount; i++)
+                tiles[i] = PackRayBudget(0xff, 0xff);
+        }
+        constants.rayBudgetTilesX = rayBudgetTilesX;
+        rayBudgetStatsValid[context][DIRECTX.SwapChainFrameIndex] = true;
+        return true;
+    }
+
     // Build acceleration structures needed for raytracing.
     void BuildAccelerationStructures()
     {
@@ -3004,61 +4128,21 @@ struct Scene
         // Reset the command list for the acceleration structure construction.
         DIRECTX.CurrentFrameResources().CommandLists[DrawContext_Final]->Reset(DIRECTX.CurrentFrameResources().CommandAllocators[DrawContext_Final], nullptr);
 
-        //numInstances++;
-        instanceDescsArray = new D3D12_RAYTRACING_INSTANCE_DESC[numInstances];
-        UINT index = 0;
-        for (int i = 0; i < models.size(); ++i) {
-            for (int j = 0; j < models[i].components.size(); j++)
-            {
-                instanceDescsArray[index] = D3D12_RAYTRACING_INSTANCE_DESC();
-                float x = models[i].components[j].transform.r[0].m128_f32[0];
-                float y = models[i].components[j].transform.r[1].m128_f32[1];
-                float z = models[i].components[j].transform.r[2].m128_f32[2];
-                //for (int x = 0; x < 3; x++)
-                //{
-                //    for (int y = 0; y < 4; y++)
-                //    {
-                //        instanceDescsArray[index].Transform[x][y] = models[i].components[j].transform.r[x].m128_f32[y];
-                //    }
-                //}
-                XMMATRIX transform = XMMatrixMultiply(models[i].transform, models[i].components[j].transform);
-                UpdateInstanceTransform(index, transform);
-                instanceDescsArray[index].InstanceMask = models[i].components[j].layerMask;
-                instanceDescsArray[index].InstanceID = index; // Assign unique instance IDs
-                instanceDescsArray[index].AccelerationStructure = models[i].components[j].pVertexBuffer->m_globalBottomLevelAccelerationStructures[models[i].components[j].vbIndex]->GetGPUVirtualAddress();
-                instanceDescsArray[index].InstanceContributionToHitGroupIndex = models[i].components[j].hitShaderIndex;
-                instanceData[index].vertexBufferId = models[i].components[j].vbIndex;
-                instanceData[index].textureId = models[i].components[j].material.TexIndex;
-
-                if (models[i].components[j].scaleUvs)
-                {
-                    if (x >= z && y >= z)
-                    {
-                        instanceData[index].uv.x = x;
-                        instanceData[index].uv.y = y;
-                    }
-                    else if (y >= x && z >= x)
-                    {
-                        instanceData[index].uv.x = z;
-                        instanceData[index].uv.y = y;
-                    }
-                    else
-                    {
-                        instanceData[index].uv.x = x;
-                        instanceData[index].uv.y = z;
-                    }
-                }
-                else
-                {
-                    instanceData[index].uv.x = 1.0f;
-                    instanceData[index].uv.y = 1.0f;
-                }
-                instanceData[index].color = models[i].components[j].color;
-                index++;
-            }
+        // The instance descs, their upload buffer and the TLAS are sized for MAX_INSTANCES up front
+        // so instances can be spawned later without reallocating anything.
+        instanceDescsArray = new D3D12_RAYTRACING_INSTANCE_DESC[MAX_INSTANCES]();
+
+        // The bottom level structures exist by now, so resolve their addresses once instead of on every pack.
+        UINT numSlots = instances.Count();
+        for (UINT i = 0; i < numSlots; i++)
+        {
+            if (instances.alive[i])
+                ResolveInstance(i);
         }
+        PackInstanceDescs();
+        BuildProbeGrid();
 
-        DIRECTX.AllocateUploadBuffer(DIRECTX.Device, instanceDescsArray, numInstances*sizeof(D3D12_RAYTRACING_INSTANCE_DESC), &instanceDescs, L"InstanceDescs");
+        DIRECTX.AllocateUploadBuffer(DIRECTX.Device, instanceDescsArray, MAX_INSTANCES*sizeof(D3D12_RAYTRACING_INSTANCE_DESC), &instanceDescs, L"InstanceDescs");
 
 
 
@@ -3067,7 +4151,7 @@ struct Scene
         D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS topLevelInputs = {};
         topLevelInputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
         topLevelInputs.Flags = buildFlags;
-        topLevelInputs.NumDescs = numInstances;
+        topLevelInputs.NumDescs = MAX_INSTANCES;
         topLevelInputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
 
         D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO topLevelPrebuildInfo = {};
@@ -3096,6 +4180,7 @@ struct Scene
         D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC topLevelBuildDesc = {};
         {
             topLevelInputs.InstanceDescs = instanceDescs->GetGPUVirtualAddress();
+            topLevelInputs.NumDescs = numPackedInstances;
             topLevelBuildDesc.Inputs = topLevelInputs;
             topLevelBuildDesc.DestAccelerationStructureData = m_topLevelAccelerationStructure->GetGPUVirtualAddress();
             topLevelBuildDesc.ScratchAccelerationStructureData = ScratchAccelerationStructureData->GetGPUVirtualAddress();
@@ -3120,18 +4205,33 @@ struct Scene
 
 
 
-    void DoRaytracing(XMMATRIX projectionToWorld, XMVECTOR eyePos)
+    // worldToProjection only serves the reprojection of the next frame, the rays themselves are laid
+    // out from the eye's rotation and field of view, see CameraRays.h.
+    void DoRaytracing(XMMATRIX worldToProjection, XMVECTOR eyePos, XMVECTOR eyeRot, const FovTangents& fov)
     {
+        PROFILE_ZONE("DoRaytracing");
         DirectX12::SwapChainFrameResources& currFrameRes = DIRECTX.CurrentFrameResources();
         //FrameResources& currConstantRes = PerFrameRes[DIRECTX.SwapChainFrameIndex][DIRECTX.ActiveEyeIndex];
+        // Not in RecordRaytracing, which the benchmark calls outside of any frame
+        D3D12GpuTimer::Scope gpuZone(DIRECTX.gpuTimer, currFrameRes.CommandLists[DIRECTX.ActiveContext],
+            DIRECTX.ActiveEyeIndex == 0 ? "Raytracing left eye" : "Raytracing right eye");
+        RecordRaytracing(currFrameRes.m_dxrCommandList[DIRECTX.ActiveContext].Get(), worldToProjection, eyePos, eyeRot, fov, DIRECTX.inlineRaytracing);
+        frameIndex++;
+    }
+
+    // Records the rays of the active eye. With inlineSecondary the raygen shader only finds the
+    // primary surfaces and MyInlineShadingShader traces everything after them with RayQuery.
+    void RecordRaytracing(ID3D12GraphicsCommandList4* commandList, XMMATRIX worldToProjection, XMVECTOR eyePos, XMVECTOR eyeRot, const FovTangents& fov, bool inlineSecondary)
+    {
+        inlineSecondary = inlineSecondary && DIRECTX.m_inlineShadingPipeline;
 
         auto DispatchRays = [&](auto* commandList, auto* stateObject, auto* dispatchDesc)
             {
                 // Since each shader table has only one shader record, the stride is same as the size.
                 dispatchDesc->HitGroupTable.StartAddress = DIRECTX.m_hitGroupShaderTable->GetGPUVirtualAddress();
                 dispatchDesc->HitGroupTable.SizeInBytes = DIRECTX.m_hitGroupShaderTable->GetDesc().Width;
-                // We don't have any root signiture so the stride is just the identifier size
-                dispatchDesc->HitGroupTable.StrideInBytes = D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES;
+                // Hit group records carry their material constants after the identifier
+                dispatchDesc->HitGroupTable.StrideInBytes = DIRECTX.m_hitGroupShaderRecordSize;
                 dispatchDesc->MissShaderTable.StartAddress = DIRECTX.m_missShaderTable->GetGPUVirtualAddress();
                 dispatchDesc->MissShaderTable.SizeInBytes = DIRECTX.m_missShaderTable->GetDesc().Width;
                 // We don't have any root signiture so the stride is just the identifier size
@@ -3145,63 +4245,357 @@ struct Scene
                 commandList->DispatchRays(dispatchDesc);
             };
 
-        currFrameRes.CommandLists[DIRECTX.ActiveContext]->SetComputeRootSignature(DIRECTX.m_raytracingGlobalRootSignature.Get());
+        commandList->SetComputeRootSignature(DIRECTX.m_raytracingGlobalRootSignature.Get());
 
-        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].projectionToWorld = projectionToWorld;
+        CameraRayFrustum frustum = MakeCameraRayFrustum(fov,
+            Quat(XMVectorGetX(eyeRot), XMVectorGetY(eyeRot), XMVectorGetZ(eyeRot), XMVectorGetW(eyeRot)), DIRECTX.eyeWidth, DIRECTX.eyeHeight);
+        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].cameraCorner = XMFLOAT4(frustum.corner.x, frustum.corner.y, frustum.corner.z, 0.0f);
+        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].cameraStepX = XMFLOAT4(frustum.stepX.x, frustum.stepX.y, frustum.stepX.z, 0.0f);
+        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].cameraStepY = XMFLOAT4(frustum.stepY.x, frustum.stepY.y, frustum.stepY.z, 0.0f);
         m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].eyePosition = eyePos;
-        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].textureResources[0].width = 256;
-        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].textureResources[0].height = 256;
-        memcpy(&m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].instanceData[0], &instanceData[0], numInstances * sizeof(InstanceData));
-        memcpy(&m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].lights[0], &lights[0], 4 * sizeof(Light));
-        memcpy(&m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].vertexBufferDatas[0], &vertexBufferDatas[0], MAX_VBS * sizeof(VertexBufferData));
-        memcpy(&m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].textureResources[0], &textureResources[0], MAX_TEXTURES * sizeof(TextureData));
+        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].maxBounces = maxBounces;
+        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].inlineSecondary = inlineSecondary ? 1 : 0;
+        UINT scale = inlineSecondary && DIRECTX.m_secondaryUpsamplePipeline && secondaryScale > 1 ? secondaryScale : 1;
+        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].secondaryScale = scale;
+        bool denoiseFrame = inlineSecondary && denoise && DIRECTX.m_denoisePipeline;
+        if (!denoiseFrame)
+            denoisedFrames[DIRECTX.ActiveContext] = 0;
+        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].denoise = denoiseFrame ? 1 : 0;
+        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].previousWorldToProjection = previousWorldToProjection[DIRECTX.ActiveContext];
+        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].previousEyePosition = previousEyePosition[DIRECTX.ActiveContext];
+        previousWorldToProjection[DIRECTX.ActiveContext] = worldToProjection;
+        previousEyePosition[DIRECTX.ActiveContext] = eyePos;
+        for (UINT materialClass = 0; materialClass < MaterialClass_Count; materialClass++)
+            m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].materials[materialClass].constants = c_materialClasses[materialClass];
+        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].pixelSpreadAngle = PixelSpreadAngle(frustum, DIRECTX.eyeWidth, DIRECTX.eyeHeight);
+        PackInstanceConstants(m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].instanceData);
+        if (lightsDirty)
+        {
+            PROFILE_ZONE("LightBVH::Build");
+            lightBVH.Build(lights);
+            lightsDirty = false;
+        }
+        UINT8* lightData = m_mappedLightData[DIRECTX.ActiveContext] + DIRECTX.SwapChainFrameIndex * lightBufferFrameSize;
+        if (!lightBVH.lights.empty())
+        {
+            memcpy(lightData, lightBVH.lights.data(), lightBVH.lights.size() * sizeof(LightSource));
+            memcpy(lightData + MAX_LIGHTS * sizeof(LightSource), lightBVH.nodes.data(), lightBVH.nodes.size() * sizeof(LightNode));
+        }
+        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].lightCount = UINT(lightBVH.lights.size());
+        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].lightSamples = lightSamples;
+        m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex].frameIndex = frameIndex;
+        UINT probeUpdates = PackProbeConstants(m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex]);
+        bool resetShadowCache = PackShadowCacheConstants(m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex], lightData);
+        bool rayBudgetStats = PackRayBudgetConstants(m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex], scale);
 
         // Copy the updated scene constant buffer to GPU.
         memcpy(&m_mappedConstantData[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex], &m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex], 
             sizeof(m_sceneCB[DIRECTX.ActiveContext][DIRECTX.SwapChainFrameIndex]));
         auto cbGpuAddress = m_perFrameConstants[DIRECTX.ActiveContext]->GetGPUVirtualAddress() + DIRECTX.SwapChainFrameIndex * sizeof(m_mappedConstantData[0][0]);
-        currFrameRes.CommandLists[DIRECTX.ActiveContext]->SetComputeRootConstantBufferView(DirectX12::GlobalRootSignatureParams::SceneConstantSlot, cbGpuAddress);
+        commandList->SetComputeRootConstantBufferView(DirectX12::GlobalRootSignatureParams::SceneConstantSlot, cbGpuAddress);
 
         // Bind the heaps, acceleration structure and dispatch rays.    
         D3D12_DISPATCH_RAYS_DESC dispatchDesc = {};
-        currFrameRes.CommandLists[DIRECTX.ActiveContext]->SetDescriptorHeaps(1, &DIRECTX.CbvSrvHeap);
-        currFrameRes.CommandLists[DIRECTX.ActiveContext]->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::OutputViewSlot, DIRECTX.m_raytracingOutputResourceUAVGpuDescriptors[DIRECTX.ActiveContext]);
-        currFrameRes.CommandLists[DIRECTX.ActiveContext]->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::OutputDepthSlot, DIRECTX.m_raytracingDepthOutputResourceUAVGpuDescriptors[DIRECTX.ActiveContext]);
-        currFrameRes.CommandLists[DIRECTX.ActiveContext]->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::VertexBufferSlot, globalVertexBuffer.indexBuffer.gpuDescriptorHandle);
-        currFrameRes.CommandLists[DIRECTX.ActiveContext]->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::TextureSlot, DIRECTX.texArrayGpuHandle);
-        currFrameRes.CommandLists[DIRECTX.ActiveContext]->SetComputeRootShaderResourceView(DirectX12::GlobalRootSignatureParams::AccelerationStructureSlot, m_topLevelAccelerationStructure->GetGPUVirtualAddress());
-       DispatchRays(currFrameRes.m_dxrCommandList[DIRECTX.ActiveContext].Get(), DIRECTX.m_dxrStateObject.Get(), &dispatchDesc);
+        commandList->SetDescriptorHeaps(1, &DIRECTX.CbvSrvHeap);
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::OutputViewSlot, DIRECTX.m_raytracingOutputResourceUAVGpuDescriptors[DIRECTX.ActiveContext]);
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::OutputDepthSlot, DIRECTX.m_raytracingDepthOutputResourceUAVGpuDescriptors[DIRECTX.ActiveContext]);
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::VertexBufferSlot, globalVertexBuffer.indexBuffer.gpuDescriptorHandle);
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::TextureSlot, DIRECTX.texArrayGpuHandle);
+        commandList->SetComputeRootShaderResourceView(DirectX12::GlobalRootSignatureParams::AccelerationStructureSlot, m_topLevelAccelerationStructure->GetGPUVirtualAddress());
+        // Scenes without procedural geometry never run the sphere shaders; any valid buffer keeps the slot bound.
+        ID3D12Resource* sphereBuffer = aabbVertexBuffer.sphereBuffer.resource ? aabbVertexBuffer.sphereBuffer.resource.Get() : globalVertexBuffer.vertexBuffer.resource.Get();
+        commandList->SetComputeRootShaderResourceView(DirectX12::GlobalRootSignatureParams::SphereBufferSlot, sphereBuffer->GetGPUVirtualAddress());
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::GBufferSlot, DIRECTX.m_gBufferUAVGpuDescriptors[DIRECTX.ActiveContext]);
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::SecondaryRaysSlot, DIRECTX.m_secondaryRayOutputUAVGpuDescriptors[DIRECTX.ActiveContext]);
+        auto lightGpuAddress = m_lightBuffers[DIRECTX.ActiveContext]->GetGPUVirtualAddress() + DIRECTX.SwapChainFrameIndex * lightBufferFrameSize;
+        commandList->SetComputeRootShaderResourceView(DirectX12::GlobalRootSignatureParams::LightBufferSlot, lightGpuAddress);
+        commandList->SetComputeRootShaderResourceView(DirectX12::GlobalRootSignatureParams::LightNodeBufferSlot, lightGpuAddress + MAX_LIGHTS * sizeof(LightSource));
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::LowResLightingSlot, DIRECTX.m_lowResLightingUAVGpuDescriptors[DIRECTX.ActiveContext]);
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::LowResReflectionSlot, DIRECTX.m_lowResReflectionUAVGpuDescriptors[DIRECTX.ActiveContext]);
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::DenoiseSignalsSlot, DIRECTX.m_denoiseSignalsUAVGpuDescriptors[DIRECTX.ActiveContext]);
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::DenoiseHistorySlot, DIRECTX.m_denoiseHistoryUAVGpuDescriptors[DIRECTX.ActiveContext]);
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::DenoiseSurfacesSlot, DIRECTX.m_denoiseSurfacesUAVGpuDescriptors[DIRECTX.ActiveContext]);
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::ProbeIrradianceSlot, DIRECTX.m_probeIrradianceUAVGpuDescriptor);
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::ProbeVisibilitySlot, DIRECTX.m_probeVisibilityUAVGpuDescriptor);
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::ProbeRaysSlot, DIRECTX.m_probeRaysUAVGpuDescriptor);
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::ShadowCacheSlot, DIRECTX.m_shadowCacheUAVGpuDescriptor);
+        commandList->SetComputeRootShaderResourceView(DirectX12::GlobalRootSignatureParams::ShadowInvalidationSlot,
+            lightGpuAddress + MAX_LIGHTS * sizeof(LightSource) + 2 * MAX_LIGHTS * sizeof(LightNode));
+        UINT rayBudgetTileCount = rayBudgetTilesX * rayBudgetTilesY;
+        commandList->SetComputeRootDescriptorTable(DirectX12::GlobalRootSignatureParams::RayBudgetStatsSlot, DIRECTX.m_rayBudgetStatsUAVGpuDescriptors[DIRECTX.ActiveContext]);
+        commandList->SetComputeRootShaderResourceView(DirectX12::GlobalRootSignatureParams::RayBudgetTilesSlot,
+            m_rayBudgetTileBuffers[DIRECTX.ActiveContext]->GetGPUVirtualAddress() + DIRECTX.SwapChainFrameIndex * rayBudgetTileCount * sizeof(UINT));
+
+        if (resetShadowCache)
+        {
+            // Probe rays look shadows up too, so the stale entries go first
+            commandList->SetPipelineState(DIRECTX.m_shadowCacheInvalidatePipeline.Get());
+            commandList->Dispatch(SHADOW_CACHE_CAPACITY / 64, 1, 1);
+            CD3DX12_RESOURCE_BARRIER shadowCacheBarrier = CD3DX12_RESOURCE_BARRIER::UAV(DIRECTX.m_shadowCache.Get());
+            commandList->ResourceBarrier(1, &shadowCacheBarrier);
+        }
+
+        if (probeUpdates > 0)
+        {
+            // Trace this frame's probe rays, then blend them into the atlases before anything is shaded with them
+            commandList->SetPipelineState(DIRECTX.m_probeTracePipeline.Get());
+            commandList->Dispatch(1, probeUpdates, 1);
+            CD3DX12_RESOURCE_BARRIER probeRaysBarrier = CD3DX12_RESOURCE_BARRIER::UAV(DIRECTX.m_probeRays.Get());
+            commandList->ResourceBarrier(1, &probeRaysBarrier);
+            commandList->SetPipelineState(DIRECTX.m_probeBlendPipeline.Get());
+            commandList->Dispatch((PROBE_VISIBILITY_TEXELS + 2) / 8, probeUpdates * (PROBE_VISIBILITY_TEXELS + 2) / 8, 1);
+            CD3DX12_RESOURCE_BARRIER probeBarriers[] =
+            {
+                CD3DX12_RESOURCE_BARRIER::UAV(DIRECTX.m_probeIrradiance.Get()),
+                CD3DX12_RESOURCE_BARRIER::UAV(DIRECTX.m_probeVisibility.Get())
+            };
+            commandList->ResourceBarrier(ARRAYSIZE(probeBarriers), probeBarriers);
+        }
+
+        DispatchRays(commandList, DIRECTX.m_dxrStateObject.Get(), &dispatchDesc);
+
+        if (inlineSecondary)
+        {
+            // The compute pass reads the G-buffer the rays just wrote
+            CD3DX12_RESOURCE_BARRIER gBufferBarrier = CD3DX12_RESOURCE_BARRIER::UAV(DIRECTX.m_gBuffers[DIRECTX.ActiveContext].Get());
+            commandList->ResourceBarrier(1, &gBufferBarrier);
+            commandList->SetPipelineState(DIRECTX.m_inlineShadingPipeline.Get());
+            UINT width = (DIRECTX.eyeWidth + scale - 1) / scale, height = (DIRECTX.eyeHeight + scale - 1) / scale;
+            commandList->Dispatch((width + 7) / 8, (height + 7) / 8, 1);
+        }
+
+        if (scale > 1)
+        {
+            CD3DX12_RESOURCE_BARRIER lowResBarriers[] =
+            {
+                CD3DX12_RESOURCE_BARRIER::UAV(DIRECTX.m_lowResLightingOutputs[DIRECTX.ActiveContext].Get()),
+                CD3DX12_RESOURCE_BARRIER::UAV(DIRECTX.m_lowResReflectionOutputs[DIRECTX.ActiveContext].Get())
+            };
+            commandList->ResourceBarrier(ARRAYSIZE(lowResBarriers), lowResBarriers);
+            commandList->SetPipelineState(DIRECTX.m_secondaryUpsamplePipeline.Get());
+            commandList->Dispatch((DIRECTX.eyeWidth + 7) / 8, (DIRECTX.eyeHeight + 7) / 8, 1);
+        }
+
+        if (denoiseFrame)
+        {
+            // One accumulation pass, then the a-trous passes, each reading what the last one wrote
+            UINT denoiseConstants[3] = { 0, denoisedFrames[DIRECTX.ActiveContext] & 1, denoisedFrames[DIRECTX.ActiveContext] > 0 ? 1u : 0u };
+            commandList->SetPipelineState(DIRECTX.m_denoisePipeline.Get());
+            for (UINT pass = 0; pass <= DENOISE_ITERATIONS; pass++)
+            {
+                CD3DX12_RESOURCE_BARRIER denoiseBarriers[] =
+                {
+                    CD3DX12_RESOURCE_BARRIER::UAV(DIRECTX.m_denoiseSignals[DIRECTX.ActiveContext].Get()),
+                    CD3DX12_RESOURCE_BARRIER::UAV(DIRECTX.m_denoiseHistory[DIRECTX.ActiveContext].Get()),
+                    CD3DX12_RESOURCE_BARRIER::UAV(DIRECTX.m_denoiseSurfaces[DIRECTX.ActiveContext].Get())
+                };
+                commandList->ResourceBarrier(pass == 0 ? ARRAYSIZE(denoiseBarriers) : 1, denoiseBarriers);
+                denoiseConstants[0] = pass;
+                commandList->SetComputeRoot32BitConstants(DirectX12::GlobalRootSignatureParams::DenoiseConstantSlot, ARRAYSIZE(denoiseConstants), denoiseConstants, 0);
+                commandList->Dispatch((DIRECTX.eyeWidth + 7) / 8, (DIRECTX.eyeHeight + 7) / 8, 1);
+            }
+            denoisedFrames[DIRECTX.ActiveContext]++;
+        }
+
+        if (rayBudgetStats)
+        {
+            // Sum up the finished frame per tile and read it back into the frame slot's slice, for
+            // when the slot comes round again
+            CD3DX12_RESOURCE_BARRIER frameBarrier = CD3DX12_RESOURCE_BARRIER::UAV(nullptr);
+            commandList->ResourceBarrier(1, &frameBarrier);
+            commandList->SetPipelineState(DIRECTX.m_rayBudgetStatsPipeline.Get());
+            commandList->Dispatch(rayBudgetTilesX, rayBudgetTilesY, 1);
+            ID3D12Resource* stats = DIRECTX.m_rayBudgetStats[DIRECTX.ActiveContext].Get();
+            CD3DX12_RESOURCE_BARRIER toCopy = CD3DX12_RESOURCE_BARRIER::Transition(stats, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_COPY_SOURCE);
+            commandList->ResourceBarrier(1, &toCopy);
+            UINT64 statsSize = rayBudgetTileCount * sizeof(RayBudgetTileStats);
+            commandList->CopyBufferRegion(m_rayBudgetReadbacks[DIRECTX.ActiveContext].Get(), DIRECTX.SwapChainFrameIndex * statsSize, stats, 0, statsSize);
+            CD3DX12_RESOURCE_BARRIER toUAV = CD3DX12_RESOURCE_BARRIER::Transition(stats, D3D12_RESOURCE_STATE_COPY_SOURCE, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+            commandList->ResourceBarrier(1, &toUAV);
+        }
+    }
+
+    struct SecondaryPathBenchmark
+    {
+        double dispatchRaysMilliseconds = 0.0;  // One eye, every ray through DispatchRays
+        double inlineMilliseconds = 0.0;        // One eye, primary rays plus the inline compute pass
+        double halfResolutionMilliseconds = 0.0; // As inlineMilliseconds with a secondaryScale of 2 and the upsample
+        double shadowCacheMilliseconds = 0.0;   // As inlineMilliseconds through the shadow cache, from an empty one
+        SecondaryRayDiff diff;                  // Last inline pass against the CPU reference
+        DenoiserQuality denoiser;               // Denoiser.h run on the CPU over the same G-buffer
+        ShadowCacheStats shadowCache;           // ShadowCache.h run on the CPU over the same G-buffer
+        RayBudgetReport rayBudget;              // RayBudget.h on the same G-buffer and its image, at the scene's budget or 1 ray per pixel
+        CameraRayDiff cameraRays;               // The eye's rays against the ones unprojected through the inverted projection
+    };
+
+    // Times the paths on the left eye: each gets a command list of its own holding repetitions
+    // passes, submitted on an idle queue and waited for. The G-buffer and secondary ray results
+    // of the full resolution inline path, timed last, are then read back and diffed with SecondaryRays.h,
+    // and the G-buffer lit and denoised on the CPU to measure what the denoiser gains. Only the
+    // shadow cache path uses the cache, so the diff and the other timings trace every shadow ray,
+    // and no path runs under the ray budget. The CPU references still unproject through the
+    // inverted projection, which the camera ray diff shows to match the eye's rays.
+    SecondaryPathBenchmark BenchmarkSecondaryPaths(XMMATRIX worldToProjection, XMVECTOR eyePos, XMVECTOR eyeRot, const FovTangents& fov, int repetitions)
+    {
+        SecondaryPathBenchmark benchmark;
+        if (!DIRECTX.m_inlineShadingPipeline || repetitions <= 0)
+            return benchmark;
+
+        if (!benchmarkCommandList)
+        {
+            ThrowIfFailed(DIRECTX.Device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT, IID_PPV_ARGS(&benchmarkAllocator)));
+            ThrowIfFailed(DIRECTX.Device->CreateCommandList(0, D3D12_COMMAND_LIST_TYPE_DIRECT, benchmarkAllocator.Get(), nullptr, IID_PPV_ARGS(&benchmarkCommandList)));
+            ThrowIfFailed(benchmarkCommandList->Close());
+        }
+
+        DrawContext previousContext = DIRECTX.ActiveContext;
+        DIRECTX.SetActiveContext(DrawContext_EyeRenderLeft);
+        DIRECTX.WaitForGpu();
+
+        auto Submit = [&]()
+            {
+                ThrowIfFailed(benchmarkCommandList->Close());
+                ID3D12CommandList* commandLists[] = { benchmarkCommandList.Get() };
+                DIRECTX.CommandQueue->ExecuteCommandLists(1, commandLists);
+                DIRECTX.WaitForGpu();
+            };
+
+        UINT previousScale = secondaryScale;
+        bool previousShadowCache = shadowCache;
+        float previousRayBudget = rayBudget;
+        rayBudget = 0.0f;
+        // All passes of a path pack into the same constant and light slices, so the GPU only sees
+        // what the last one packed. Each pass therefore starts from the same probe offsets and
+        // neither applies nor consumes the queued invalidations, which the next frame still gets.
+        std::vector<ShadowCacheInvalidation> queuedInvalidations = shadowInvalidations;
+        bool queuedOverflow = shadowCacheOverflow;
+        UINT queuedProbeUpdateOffset = probeUpdateOffset;
+        UINT queuedProbesUpdated = probesUpdated;
+        struct { bool inlineSecondary; UINT scale; bool shadowCache; double* milliseconds; } paths[] =
+        {
+            { false, 1, false, &benchmark.dispatchRaysMilliseconds },
+            { true, 2, false, &benchmark.halfResolutionMilliseconds },
+            { true, 1, true, &benchmark.shadowCacheMilliseconds },
+            { true, 1, false, &benchmark.inlineMilliseconds },
+        };
+        for (auto& path : paths)
+        {
+            secondaryScale = path.scale;
+            shadowCache = path.shadowCache;
+            ThrowIfFailed(benchmarkAllocator->Reset());
+            ThrowIfFailed(benchmarkCommandList->Reset(benchmarkAllocator.Get(), nullptr));
+            for (int i = 0; i < repetitions; i++)
+            {
+                probeUpdateOffset = queuedProbeUpdateOffset;
+                probesUpdated = queuedProbesUpdated;
+                shadowInvalidations.clear();
+                // Every pass of the cached path clears it, so each is timed from an empty cache
+                shadowCacheOverflow = path.shadowCache;
+                RecordRaytracing(benchmarkCommandList.Get(), worldToProjection, eyePos, eyeRot, fov, path.inlineSecondary);
+                CD3DX12_RESOURCE_BARRIER passBarrier = CD3DX12_RESOURCE_BARRIER::UAV(nullptr);
+                benchmarkCommandList->ResourceBarrier(1, &passBarrier);
+            }
+            auto start = std::chrono::high_resolution_clock::now();
+            Submit();
+            *path.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / repetitions;
+        }
+        secondaryScale = previousScale;
+        shadowCache = previousShadowCache;
+        rayBudget = previousRayBudget;
+        shadowInvalidations = queuedInvalidations;
+        shadowCacheOverflow = queuedOverflow;
+        probeUpdateOffset = queuedProbeUpdateOffset;
+        probesUpdated = queuedProbesUpdated;
+
+        // Read back what the last inline pass left in the G-buffer, the secondary ray target and the image
+        ID3D12Resource* sources[3] = { DIRECTX.m_gBuffers[DIRECTX.ActiveContext].Get(), DIRECTX.m_secondaryRayOutputs[DIRECTX.ActiveContext].Get(),
+            DIRECTX.m_raytracingOutputs[DIRECTX.ActiveContext].Get() };
+        D3D12_PLACED_SUBRESOURCE_FOOTPRINT footprints[3];
+        ComPtr<ID3D12Resource> readbacks[3];
+        ThrowIfFailed(benchmarkAllocator->Reset());
+        ThrowIfFailed(benchmarkCommandList->Reset(benchmarkAllocator.Get(), nullptr));
+        for (int i = 0; i < 3; i++)
+        {
+            D3D12_RESOURCE_DESC sourceDesc = sources[i]->GetDesc();
+            UINT64 totalBytes = 0;
+            DIRECTX.Device->GetCopyableFootprints(&sourceDesc, 0, 1, 0, &footprints[i], nullptr, nullptr, &totalBytes);
+            auto readbackHeapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK);
+            auto readbackDesc = CD3DX12_RESOURCE_DESC::Buffer(totalBytes);
+            ThrowIfFailed(DIRECTX.Device->CreateCommittedResource(&readbackHeapProperties, D3D12_HEAP_FLAG_NONE, &readbackDesc,
+                D3D12_RESOURCE_STATE_COPY_DEST, nullptr, IID_PPV_ARGS(&readbacks[i])));
+
+            CD3DX12_RESOURCE_BARRIER toCopy = CD3DX12_RESOURCE_BARRIER::Transition(sources[i], D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_COPY_SOURCE);
+            benchmarkCommandList->ResourceBarrier(1, &toCopy);
+            CD3DX12_TEXTURE_COPY_LOCATION dst(readbacks[i].Get(), footprints[i]);
+            CD3DX12_TEXTURE_COPY_LOCATION src(sources[i], 0);
+            benchmarkCommandList->CopyTextureRegion(&dst, 0, 0, 0, &src, nullptr);
+            CD3DX12_RESOURCE_BARRIER toUAV = CD3DX12_RESOURCE_BARRIER::Transition(sources[i], D3D12_RESOURCE_STATE_COPY_SOURCE, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+            benchmarkCommandList->ResourceBarrier(1, &toUAV);
+        }
+        Submit();
+
+        UINT width = DIRECTX.eyeWidth, height = DIRECTX.eyeHeight;
+        std::vector<GBufferTexel> gbuffer(size_t(width) * height);
+        std::vector<SecondaryRayResult> secondary(size_t(width) * height);
+        std::vector<uint32_t> color(size_t(width) * height);
+        auto ReadRows = [&](int i, void* destination, size_t texelSize)
+            {
+                UINT8* mapped = nullptr;
+                ThrowIfFailed(readbacks[i]->Map(0, nullptr, reinterpret_cast<void**>(&mapped)));
+                for (UINT y = 0; y < height; y++)
+                    memcpy((UINT8*)destination + y * width * texelSize, mapped + footprints[i].Offset + y * footprints[i].Footprint.RowPitch, width * texelSize);
+                D3D12_RANGE noWrites = { 0, 0 };
+                readbacks[i]->Unmap(0, &noWrites);
+            };
+        ReadRows(0, gbuffer.data(), sizeof(GBufferTexel));
+        ReadRows(1, secondary.data(), sizeof(SecondaryRayResult));
+        ReadRows(2, color.data(), sizeof(uint32_t));
+
+        XMFLOAT4X4 projectionToWorldFloats;
+        XMStoreFloat4x4(&projectionToWorldFloats, XMMatrixInverse(nullptr, worldToProjection));
+        Float3 eye(XMVectorGetX(eyePos), XMVectorGetY(eyePos), XMVectorGetZ(eyePos));
+        benchmark.cameraRays = DiffCameraRays(&projectionToWorldFloats._11, eye, MakeCameraRayFrustum(fov,
+            Quat(XMVectorGetX(eyeRot), XMVectorGetY(eyeRot), XMVectorGetZ(eyeRot), XMVectorGetW(eyeRot)), width, height), width, height);
+        benchmark.diff = DiffSecondaryRays(Query(), &projectionToWorldFloats._11, eye, lightBVH, frameIndex, maxBounces, width, height, gbuffer.data(), secondary.data());
+        benchmark.denoiser = MeasureDenoiser(Query(), &projectionToWorldFloats._11, eye, lightBVH, lightSamples, width, height, gbuffer.data());
+        benchmark.shadowCache = MeasureShadowCache(Query(), &projectionToWorldFloats._11, eye, lightBVH, width, height, gbuffer.data(), shadowCacheCellSize);
+        std::vector<RayBudgetTileStats> tileStats = GatherRayBudgetStats(width, height, gbuffer.data(), color.data());
+        benchmark.rayBudget = MeasureRayBudget(RayBudgetTiles(width), RayBudgetTiles(height), tileStats.data(), FrameRayBudgetSettings(rayBudget > 0.0f ? rayBudget : 1.0f, 1));
+
+        DIRECTX.SetActiveContext(previousContext);
+        return benchmark;
     }
 
     virtual void Init(bool includeIntensiveGPUobject)
     {
         std::vector<ModelComponent> transforms;
-        numInstances = 0;
 
         transforms.push_back(ModelComponent(0.5f, -0.5f, 0.5f, -0.5f, 0.5f, -0.5f, 0xff404040, &globalVertexBuffer));
-        models.push_back(Model(transforms, Material(Texture::AUTO_CEILING - 1)));
+        AddModel(Model(transforms, Material(Texture::AUTO_CEILING - 1)));
         
         transforms.clear();
         transforms.push_back(ModelComponent(0.05f, -0.01f, 0.1f, -0.05f, +0.01f, -0.1f, 0xffff0000, &globalVertexBuffer));
         transforms.push_back(ModelComponent(0.05f, -0.01f, 0.1f, -0.05f, +0.01f, -0.1f, 0xffff0000, &globalVertexBuffer));
-        models.push_back(Model(transforms, Material(Texture::AUTO_WHITE - 1)));
+        AddModel(Model(transforms, Material(Texture::AUTO_WHITE - 1)));
 
 
         transforms.clear();
         transforms.push_back(ModelComponent(10.1f, 0.0f, 20.0f, 10.0f, 4.0f, -20.0f, 0xff808080, &globalVertexBuffer));
         transforms.push_back(ModelComponent(10.0f, -0.1f, 20.1f, -10.0f, 4.0f, 20.0f, 0xff808080, &globalVertexBuffer));
         transforms.push_back(ModelComponent(-10.0f, -0.1f, 20.0f, -10.1f, 4.0f, -20.0f, 0xff808080, &globalVertexBuffer));
-        models.push_back(Model(transforms, Material((UINT)Texture::AUTO_WALL - 1)));
+        AddModel(Model(transforms, Material((UINT)Texture::AUTO_WALL - 1)));
 
         transforms.clear();
         transforms.push_back(ModelComponent(10.0f, -0.1f, 20.0f, -10.0f, 0.0f, -20.1f, 0xff808080, &globalVertexBuffer));
         transforms.push_back(ModelComponent(15.0f, -6.1f, -18.0f, -15.0f, -6.0f, -30.0f, 0xff808080, &globalVertexBuffer));
-        models.push_back(Model(transforms, Material(Texture::AUTO_FLOOR - 1)));
+        UINT floor = AddModel(Model(transforms, Material(Texture::AUTO_FLOOR - 1)));
+        // The floor of the room is a mirror
+        SetInstanceMaterialClass(models[floor].instances[0], MaterialClass_Reflective);
 
 
         transforms.clear();
         transforms.push_back(ModelComponent(10.0f, 4.0f, 20.0f, -10.0f, 4.1f, -20.1f, 0xff808080, &globalVertexBuffer));
-        models.push_back(Model(transforms, Material(Texture::AUTO_CEILING - 1)));
+        AddModel(Model(transforms, Material(Texture::AUTO_CEILING - 1)));
 
         transforms.clear();
         //TriangleSet furniture;
@@ -3229,8 +4623,7 @@ struct Scene
         for (float f = 3.0f; f <= 6.6f; f += 0.4f)
             transforms.push_back(ModelComponent(3, 0.0f, -f, 2.9f, 1.3f, -f - 0.1f, 0xff404040, &globalVertexBuffer)); // Posts
 
-        models.push_back(Model(transforms, Material(Texture::AUTO_WHITE - 1)));
-        numInstances = ModelComponent::numInstances;
+        AddModel(Model(transforms, Material(Texture::AUTO_WHITE - 1)));
 
         globalVertexBuffer.InitGlobalVertexBuffers();
         globalVertexBuffer.InitGlobalBottomLevelAccelerationObject();
@@ -3278,12 +4671,53 @@ struct Scene
         // We don't unmap this until the app closes. Keeping buffer mapped for the lifetime of the resource is okay.
         readRange = CD3DX12_RANGE(0, 0);        // We do not intend to read from this resource on the CPU.
         ThrowIfFailed(m_perFrameConstants[1]->Map(0, nullptr, reinterpret_cast<void**>(&m_mappedConstantData[1])));
+
+        // Lights and their BVH nodes, also one slice per frame since they can move every frame.
+        const D3D12_RESOURCE_DESC lightBufferDesc = CD3DX12_RESOURCE_DESC::Buffer(frameCount * lightBufferFrameSize);
+        for (int context = 0; context < 2; context++)
+        {
+            ThrowIfFailed(DIRECTX.Device->CreateCommittedResource(
+                &uploadHeapProperties,
+                D3D12_HEAP_FLAG_NONE,
+                &lightBufferDesc,
+                D3D12_RESOURCE_STATE_GENERIC_READ,
+                nullptr,
+                IID_PPV_ARGS(&m_lightBuffers[context])));
+            ThrowIfFailed(m_lightBuffers[context]->Map(0, &readRange, reinterpret_cast<void**>(&m_mappedLightData[context])));
+        }
+    }
+
+    // Tile statistics and budgets of each eye, one slice per frame. Both stay mapped, a frame slot's
+    // readback slice is only read once WaitForPreviousFrame has seen the slot's last copy land.
+    void CreateRayBudgetBuffers()
+    {
+        auto frameCount = DIRECTX.SwapChainNumFrames;
+        rayBudgetTilesX = RayBudgetTiles(DIRECTX.eyeWidth);
+        rayBudgetTilesY = RayBudgetTiles(DIRECTX.eyeHeight);
+        UINT tileCount = rayBudgetTilesX * rayBudgetTilesY;
+        DIRECTX.CreateRayBudgetStats(tileCount, sizeof(RayBudgetTileStats));
+
+        const D3D12_HEAP_PROPERTIES readbackHeapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK);
+        const D3D12_HEAP_PROPERTIES uploadHeapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD);
+        const D3D12_RESOURCE_DESC readbackDesc = CD3DX12_RESOURCE_DESC::Buffer(UINT64(frameCount) * tileCount * sizeof(RayBudgetTileStats));
+        const D3D12_RESOURCE_DESC tileBufferDesc = CD3DX12_RESOURCE_DESC::Buffer(UINT64(frameCount) * tileCount * sizeof(UINT));
+        CD3DX12_RANGE readRange(0, 0);
+        for (int context = 0; context < 2; context++)
+        {
+            ThrowIfFailed(DIRECTX.Device->CreateCommittedResource(&readbackHeapProperties, D3D12_HEAP_FLAG_NONE, &readbackDesc,
+                D3D12_RESOURCE_STATE_COPY_DEST, nullptr, IID_PPV_ARGS(&m_rayBudgetReadbacks[context])));
+            ThrowIfFailed(m_rayBudgetReadbacks[context]->Map(0, nullptr, reinterpret_cast<void**>(&m_mappedRayBudgetStats[context])));
+            ThrowIfFailed(DIRECTX.Device->CreateCommittedResource(&uploadHeapProperties, D3D12_HEAP_FLAG_NONE, &tileBufferDesc,
+                D3D12_RESOURCE_STATE_GENERIC_READ, nullptr, IID_PPV_ARGS(&m_rayBudgetTileBuffers[context])));
+            ThrowIfFailed(m_rayBudgetTileBuffers[context]->Map(0, &readRange, reinterpret_cast<void**>(&m_mappedRayBudgetTiles[context])));
+        }
     }
 
     void PushBackTexture(Texture* pTexture)
     {
         textureResources[textures.size()].width = pTexture->SizeW;
         textureResources[textures.size()].height = pTexture->SizeH;
+        textureResources[textures.size()].mipLevels = pTexture->MipLevels;
         textures.push_back(pTexture);
     }
 
@@ -3297,7 +4731,7 @@ struct Scene
 
     void InitTexturesToTexArray()
     {
-        DIRECTX.CreateTextureArray(Texture::maxWidth, Texture::maxHeight, textures.size());
+        DIRECTX.CreateTextureArray(Texture::maxWidth, Texture::maxHeight, textures.size(), Texture::MipChainLength(Texture::maxWidth, Texture::maxHeight));
         for (int i = 0; i < textures.size(); i++)
         {
             DIRECTX.CopyTextureSubresource(DIRECTX.CurrentFrameResources().CommandLists[0], i, textures[i]->TextureRes);
@@ -3308,6 +4742,7 @@ struct Scene
     {
         UINT numModels = globalVertexBuffer.numVertexBuffers;
         std::pair<Model, std::vector<Texture*>> modelAndTextures = Model::InitFromObj(fileName, texturesDir, globalVertexBuffer, textures.size());
+        VALIDATE(globalVertexBuffer.numVertexBuffers <= MAX_VBS, "Scene vertex buffer limit reached");
         for (int i = numModels; i < globalVertexBuffer.numVertexBuffers; i++)
         {
             vertexBufferDatas[i].vertexOffset = globalVertexBuffer.globalStartVBIndices[i].first;
@@ -3320,15 +4755,18 @@ struct Scene
         return modelAndTextures.first;
     }
 
-    Scene() : numInstances(0) {}
-    Scene(bool includeIntensiveGPUobject) :
-        numInstances(0)
+    Scene() {}
+    Scene(bool includeIntensiveGPUobject)
     {
         CreateDefaultTextures();
         CreateConstantBuffers();
+        DIRECTX.CreateShadowCache(SHADOW_CACHE_CAPACITY, SHADOW_CACHE_ENTRY_SIZE);
+        CreateRayBudgetBuffers();
         std::pair<UINT, UINT> indexData = globalVertexBuffer.AddBoxToGlobal();
         vertexBufferDatas[globalVertexBuffer.numVertexBuffers - 1].vertexOffset = indexData.first;
         vertexBufferDatas[globalVertexBuffer.numVertexBuffers - 1].indexOffset = indexData.second;
+        // The samples move light 0 around; white, and as bright as the old unattenuated light three units away.
+        AddLight(XMVectorSet(0, 3, 0, 0), XMFLOAT3(1, 1, 1), 9.0f);
     }
     void Release()
     {
@@ -3380,4 +4818,32 @@ struct Utility
     }
 } static Util;
 
+static void OutputZoneSummaries(const char* title, const std::vector<ZoneSummary>& zones)
+{
+    Util.Output("%-34s %6s %6s %8s %8s %8s %8s\n", title, "Frames", "Calls", "p50 ms", "p95 ms", "p99 ms", "max ms");
+    for (const ZoneSummary& zone : zones)
+        Util.Output("%-34s %6u %6.1f %8.3f %8.3f %8.3f %8.3f\n", zone.name.c_str(), zone.frames, zone.callsPerFrame,
+            zone.p50Milliseconds, zone.p95Milliseconds, zone.p99Milliseconds, zone.maxMilliseconds);
+}
+
+// Prints each GPU zone's time per frame over the rolling window, slowest first. With the CPU
+// profiler compiled in, also writes its last frames to tracePath for chrome://tracing and
+// prints its zones the same way.
+inline void ReportFrameProfile(const char* tracePath)
+{
+#if FRAME_PROFILER
+    FrameProfiler& profiler = FrameProfiler::Get();
+    if (profiler.WriteChromeTrace(tracePath))
+        Util.Output("Frame profile written to %s\n", tracePath);
+    else
+        Util.Output("Could not write the frame profile to %s\n", tracePath);
+    OutputZoneSummaries("CPU zone", profiler.SummarizeZones());
+#else
+    (void)tracePath;
+#endif
+    OutputZoneSummaries("GPU zone", DIRECTX.gpuTimer.SummarizeZones());
+    if (DIRECTX.gpuTimer.droppedZones || DIRECTX.gpuTimer.invalidZones)
+        Util.Output("GPU zones dropped %llu, invalid %llu\n", DIRECTX.gpuTimer.droppedZones, DIRECTX.gpuTimer.invalidZones);
+}
+
 #endif // OVR_Win32_DirectX12AppUtil_h
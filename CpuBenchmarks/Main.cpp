@@ -0,0 +1,407 @@
+/************************************************************************************
+Filename    :   Main.cpp
+Content     :   Microbenchmarks of the CPU hot paths shared with the samples
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// Runs the code the samples run on the CPU, from the portable headers in Common, on
+// synthetic inputs of a realistic size, with no D3D12, DirectXMath or Windows headers:
+//
+//   g++ -std=c++14 -O2 -I Common CpuBenchmarks/Main.cpp -o cpu_benchmarks
+//   cl /std:c++14 /O2 /EHsc /I Common CpuBenchmarks\Main.cpp
+//
+// Options, from the repository root:
+//   --json path          results as JSON, cpu_benchmarks.json by default
+//   --warmups n          untimed runs of each benchmark first, 3 by default
+//   --repetitions n      timed runs of each benchmark, 20 by default
+//   --image path         texture to decode, a Charizard texture of the ModelLoading sample by default
+//   --obj path           OBJ to parse and index instead of a generated grid, e.g. Sponza's
+//   --grid n             quads per side of the generated OBJ grid, 256 by default
+//
+// The scene benchmarks fill lookalikes of SceneInstances and the D3D12 instance desc, whose
+// member names are all the templates in InstancePacking.h rely on.
+
+#define STB_IMAGE_IMPLEMENTATION
+#define TINYOBJLOADER_IMPLEMENTATION
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "stb_image.h"
+#include "tiny_obj_loader.h"
+#include "VectorMath.h"
+#include "TexturePixels.h"
+#include "ObjMesh.h"
+#include "InstancePacking.h"
+#include "MicroBenchmark.h"
+
+// As in Win32_DirectX12AppUtil.h
+#define MAX_INSTANCES 1024
+#define RAY_TYPE_COUNT 2
+#define LAYER_HIT 1
+
+//-----------------------------------------------------------
+// Vertex of Win32_DirectX12AppUtil.h, on VectorMath.h types
+struct BenchVertex
+{
+    Float3 position;
+    Float3 normal;
+    Float2 uv;
+
+    BenchVertex(float x, float y, float z, float nx, float ny, float nz, float u, float v)
+        : position(x, y, z), normal(nx, ny, nz), uv(u, v) {}
+
+    bool operator==(const BenchVertex& other) const
+    {
+        return position.x == other.position.x && position.y == other.position.y && position.z == other.position.z &&
+            normal.x == other.normal.x && normal.y == other.normal.y && normal.z == other.normal.z &&
+            uv.x == other.uv.x && uv.y == other.uv.y;
+    }
+};
+
+struct BenchFloat4
+{
+    float x, y, z, w;
+};
+
+struct BenchMatrix
+{
+    float m[4][4];
+};
+
+// D3D12_RAYTRACING_INSTANCE_DESC
+struct BenchInstanceDesc
+{
+    float Transform[3][4];
+    uint32_t InstanceID : 24;
+    uint32_t InstanceMask : 8;
+    uint32_t InstanceContributionToHitGroupIndex : 24;
+    uint32_t Flags : 8;
+    uint64_t AccelerationStructure;
+};
+static_assert(sizeof(BenchInstanceDesc) == 64, "D3D12_RAYTRACING_INSTANCE_DESC is 64 bytes");
+
+// Scene::TextureData and Scene::InstanceData
+struct BenchTextureData
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t mipLevels;
+    float padding;
+};
+
+struct BenchInstanceData
+{
+    uint32_t geometryOffset;
+    uint32_t vertexOffset;
+    uint32_t textureId;
+    uint32_t textureSize;
+    Float2 uvScale;
+    uint32_t tint;
+    uint32_t textureMipLevels;
+};
+
+// Scene::SceneConstantBuffer ends in the instance table; its other fields come to under 1KB.
+struct alignas(256) BenchSceneConstants
+{
+    uint8_t fields[1024];
+    BenchInstanceData instanceData[MAX_INSTANCES];
+};
+
+// The SceneInstances arrays the packing reads.
+struct BenchInstances
+{
+    std::vector<BenchMatrix> localTransforms;
+    std::vector<Transform3x4> worldTransforms;
+    std::vector<uint64_t> blasAddresses;
+    std::vector<uint32_t> masks;
+    std::vector<uint32_t> hitGroups;
+    std::vector<uint32_t> textureIds;
+    std::vector<uint32_t> geometryOffsets;
+    std::vector<uint32_t> vertexOffsets;
+    std::vector<Float2> uvScales;
+    std::vector<BenchFloat4> colors;
+    std::vector<uint8_t> outsideView;
+    std::vector<uint8_t> alive;
+
+    uint32_t Count() const { return (uint32_t)alive.size(); }
+};
+
+//-----------------------------------------------------------
+static uint32_t s_random = 1;
+
+static float Random()
+{
+    s_random = s_random * 1664525u + 1013904223u;
+    return (s_random >> 8) * (1.0f / 16777216.0f);
+}
+
+// A wavy n x n quad grid with positions, normals and uvs shared between neighbouring faces,
+// so about one corner in six is a new vertex, as in a smooth mesh.
+static std::string GenerateObjGrid(int n)
+{
+    std::ostringstream obj;
+    obj.precision(6);
+    for (int j = 0; j <= n; j++)
+    {
+        for (int i = 0; i <= n; i++)
+        {
+            float x = float(i) / n, z = float(j) / n;
+            float y = 0.1f * sinf(x * 12.0f) * cosf(z * 9.0f);
+            obj << "v " << x * 10.0f << ' ' << y << ' ' << z * 10.0f << '\n';
+            obj << "vt " << x << ' ' << z << '\n';
+            Float3 normal = Normalize(Float3(-1.2f * cosf(x * 12.0f) * cosf(z * 9.0f), 10.0f, 0.9f * sinf(x * 12.0f) * sinf(z * 9.0f)));
+            obj << "vn " << normal.x << ' ' << normal.y << ' ' << normal.z << '\n';
+        }
+    }
+    for (int j = 0; j < n; j++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            int a = j * (n + 1) + i + 1, b = a + 1, c = a + n + 1, d = c + 1;
+            obj << "f " << a << '/' << a << '/' << a << ' ' << c << '/' << c << '/' << c << ' ' << b << '/' << b << '/' << b << '\n';
+            obj << "f " << b << '/' << b << '/' << b << ' ' << c << '/' << c << '/' << c << ' ' << d << '/' << d << '/' << d << '\n';
+        }
+    }
+    return obj.str();
+}
+
+static bool ReadFile(const char* path, std::string& text)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    std::stringstream contents;
+    contents << file.rdbuf();
+    text = contents.str();
+    return true;
+}
+
+//-----------------------------------------------------------
+static void BenchmarkObj(MicroBenchmark& bench, const std::string& objText)
+{
+    tinyobj::ObjReaderConfig config;
+    config.mtl_search_path = "";
+    tinyobj::ObjReader reader;
+    if (!reader.ParseFromString(objText, "", config))
+    {
+        fprintf(stderr, "OBJ parse failed: %s\n", reader.Error().c_str());
+        return;
+    }
+    const tinyobj::attrib_t& attrib = reader.GetAttrib();
+    const std::vector<tinyobj::shape_t>& shapes = reader.GetShapes();
+    uint64_t corners = 0;
+    for (const auto& shape : shapes)
+        corners += shape.mesh.indices.size();
+
+    bench.Measure("OBJ parse", corners, [&]() {
+        tinyobj::ObjReader parser;
+        parser.ParseFromString(objText, "", config);
+    });
+
+    // As VertexBuffer::AddGlobalObj builds them
+    size_t uniqueVertices = 0;
+    bench.Measure("OBJ vertex dedup", corners, [&]() {
+        ObjVertexIndexer<BenchVertex> indexer;
+        std::vector<BenchVertex> vertices;
+        std::vector<unsigned int> indices;
+        for (const auto& shape : shapes)
+        {
+            for (const auto& index : shape.mesh.indices)
+                indexer.Add(ObjCornerVertex<BenchVertex>(attrib, index), vertices, indices);
+        }
+        uniqueVertices = vertices.size();
+    });
+    printf("OBJ: %llu corners, %llu unique vertices\n", (unsigned long long)corners, (unsigned long long)uniqueVertices);
+}
+
+static void BenchmarkTextures(MicroBenchmark& bench, const char* imagePath)
+{
+    int width = 0, height = 0, channels = 0;
+    uint8_t* rgba = stbi_load(imagePath, &width, &height, &channels, 4);
+    if (rgba)
+    {
+        uint64_t pixels = uint64_t(width) * height;
+        printf("Texture: %s, %dx%d\n", imagePath, width, height);
+        bench.Measure("Texture decode and repack", pixels, [&]() {
+            int w, h;
+            free(TexturePixels::Decode(imagePath, nullptr, w, h));
+        });
+        std::vector<uint32_t> packed(pixels);
+        bench.Measure("Texture repack", pixels, [&]() { TexturePixels::PackRgba8(rgba, int(pixels), packed.data()); });
+        stbi_image_free(rgba);
+    }
+    else
+    {
+        fprintf(stderr, "Skipping the texture decode, could not load %s\n", imagePath);
+    }
+
+    // The wall texture of the samples at a typical material size
+    const int size = 2048;
+    std::vector<uint32_t> source(size * size), work(size * size);
+    TexturePixels::FillPattern(TexturePixels::AUTO_WALL, size, size, source.data());
+    unsigned int levels = TexturePixels::MipChainLength(size, size);
+    bench.Measure("FillTexture mip downsample", uint64_t(size) * size,
+        [&]() { memcpy(work.data(), source.data(), source.size() * sizeof(uint32_t)); },
+        [&]() {
+            int w = size, h = size;
+            for (unsigned int level = 0; level + 1 < levels; level++, w >>= 1, h >>= 1)
+                TexturePixels::DownsampleMip(work.data(), w, h);
+        });
+
+    for (size_t i = 0; i < source.size(); i++)
+        source[i] = 0xff000000 | (uint32_t(Random() * 16777216.0f) & 0xffffff);
+    bench.Measure("ConvertToSRGB", uint64_t(size) * size,
+        [&]() { memcpy(work.data(), source.data(), source.size() * sizeof(uint32_t)); },
+        [&]() {
+            for (uint32_t& pixel : work)
+                TexturePixels::ConvertToSRGB(&pixel);
+        });
+
+    // Each of the patterns at the 256 x 256 Scene creates them at, as AutoFillTexture does before the upload
+    const int fillSize = 256;
+    const TexturePixels::AutoFill patterns[] = { TexturePixels::AUTO_WHITE, TexturePixels::AUTO_WALL, TexturePixels::AUTO_FLOOR,
+        TexturePixels::AUTO_CEILING, TexturePixels::AUTO_GRID, TexturePixels::AUTO_GRADE_256 };
+    const int patternCount = int(sizeof(patterns) / sizeof(patterns[0]));
+    bench.Measure("AutoFillTexture", uint64_t(fillSize) * fillSize * patternCount, [&]() {
+        for (int p = 0; p < patternCount; p++)
+        {
+            TexturePixels::FillPattern(patterns[p], fillSize, fillSize, work.data());
+            int w = fillSize, h = fillSize;
+            for (unsigned int level = 0; level + 1 < TexturePixels::MipChainLength(fillSize, fillSize); level++, w >>= 1, h >>= 1)
+                TexturePixels::DownsampleMip(work.data(), w, h);
+        }
+    });
+}
+
+static void BenchmarkScene(MicroBenchmark& bench)
+{
+    // A full instance table with some despawned slots and about a third culled from the view
+    BenchInstances instances;
+    const uint32_t count = MAX_INSTANCES;
+    instances.localTransforms.resize(count);
+    instances.worldTransforms.resize(count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        BenchMatrix local = {};
+        for (int d = 0; d < 4; d++)
+            local.m[d][d] = 0.5f + Random();
+        local.m[3][0] = Random() * 20.0f - 10.0f;
+        local.m[3][1] = Random() * 4.0f;
+        local.m[3][2] = Random() * 20.0f - 10.0f;
+        instances.localTransforms[i] = local;
+        instances.blasAddresses.push_back(0x100000000ull + i * 0x10000ull);
+        instances.masks.push_back(7);
+        instances.hitGroups.push_back(i % 4);
+        instances.textureIds.push_back(i % 60);
+        instances.geometryOffsets.push_back(i * 3);
+        instances.vertexOffsets.push_back(i * 24);
+        instances.uvScales.push_back(Float2(1.0f, 1.0f));
+        BenchFloat4 color = { Random(), Random(), Random(), 1.0f };
+        instances.colors.push_back(color);
+        instances.outsideView.push_back(Random() < 0.3f);
+        instances.alive.push_back(Random() < 0.9f);
+    }
+
+    // Scene::UpdateModelInstances and MoveInstance, with the whole table as one moving model
+    float angle = 0.0f;
+    BenchMatrix model = {};
+    bench.Measure("Instance transform update", count,
+        [&]() {
+            angle += 0.01f;
+            float c = cosf(angle), s = sinf(angle);
+            model = BenchMatrix{ { { c, 0, -s, 0 }, { 0, 1, 0, 0 }, { s, 0, c, 0 }, { 0.1f, 0, 0.2f, 1 } } };
+        },
+        [&]() {
+            for (uint32_t i = 0; i < count; i++)
+            {
+                Transform3x4 world;
+                ComposeInstanceTransform(instances.localTransforms[i].m, model.m, world.m);
+                if (memcmp(&instances.worldTransforms[i], &world, sizeof(world)) != 0)
+                    instances.worldTransforms[i] = world;
+            }
+        });
+
+    std::vector<BenchInstanceDesc> descs(count);
+    uint32_t packed = 0;
+    bench.Measure("TLAS instance desc packing", count,
+        [&]() { packed = PackInstanceDescs(instances, descs.data(), LAYER_HIT, RAY_TYPE_COUNT); });
+    printf("Instances: %u slots, %u packed\n", count, packed);
+
+    // Scene::DoRaytracing packs the table per eye and copies the whole buffer to the mapped upload heap
+    std::vector<BenchTextureData> textures(60);
+    for (size_t t = 0; t < textures.size(); t++)
+        textures[t] = BenchTextureData{ 1024u >> (t % 3), 1024u >> (t % 3), 11u - uint32_t(t % 3), 0.0f };
+    std::vector<BenchSceneConstants> constants(2);
+    bench.Measure("SceneConstantBuffer packing", count, [&]() {
+        PackInstanceConstants(instances, textures.data(), constants[0].instanceData);
+        memcpy(&constants[1], &constants[0], sizeof(BenchSceneConstants));
+    });
+}
+
+//-----------------------------------------------------------
+int main(int argc, char** argv)
+{
+    const char* jsonPath = "cpu_benchmarks.json";
+    const char* imagePath = "OculusTinyRoomDXR _ModelLoading/Charizard/images/pm0006_00_BodyA1.png";
+    const char* objPath = nullptr;
+    int grid = 256;
+    MicroBenchmark bench;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (!strcmp(argv[i], "--json"))               jsonPath = argv[i + 1];
+        else if (!strcmp(argv[i], "--warmups"))       bench.warmups = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--repetitions"))   bench.repetitions = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--image"))         imagePath = argv[i + 1];
+        else if (!strcmp(argv[i], "--obj"))           objPath = argv[i + 1];
+        else if (!strcmp(argv[i], "--grid"))          grid = atoi(argv[i + 1]);
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    std::string objText;
+    if (objPath)
+    {
+        if (!ReadFile(objPath, objText))
+        {
+            fprintf(stderr, "Could not read %s\n", objPath);
+            return 1;
+        }
+    }
+    else
+    {
+        objText = GenerateObjGrid(grid);
+    }
+
+    BenchmarkObj(bench, objText);
+    BenchmarkTextures(bench, imagePath);
+    BenchmarkScene(bench);
+
+    bench.Print(stdout);
+    if (!bench.WriteJson(jsonPath))
+    {
+        fprintf(stderr, "Could not write %s\n", jsonPath);
+        return 1;
+    }
+    printf("Results written to %s\n", jsonPath);
+    return 0;
+}
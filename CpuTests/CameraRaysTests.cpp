@@ -0,0 +1,186 @@
+/************************************************************************************
+Filename    :   CameraRaysTests.cpp
+Content     :   The FovPort camera rays against the ones unprojected through the inverse projection
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// The samples build the projection with ovrMatrix4f_Projection(fov, 0.2, 1000, ovrProjection_None)
+// and the view with Camera::GetViewMatrix, multiply them, and used to upload the inverse as
+// projectionToWorld. The same matrices are built here without LibOVR or DirectXMath, and
+// DiffCameraRays compares every pixel of the old rays with MakeCameraRayFrustum's.
+
+#include <utility>
+#include "CameraRays.h"
+#include "CpuTest.h"
+
+// Largest angle allowed between the two rays of a pixel, as a share of the angle between
+// neighbouring pixels. The unprojected rays lose the most to the float inverse with a narrow
+// field of view far from the origin, about a fortieth of a pixel in the cases below.
+static const float MaxPixelShare = 0.05f;
+
+struct Matrix4
+{
+    double m[4][4];     // Row major, for column vectors
+};
+
+static Matrix4 Multiply(const Matrix4& a, const Matrix4& b)
+{
+    Matrix4 product = {};
+    for (int r = 0; r < 4; r++)
+        for (int c = 0; c < 4; c++)
+            for (int k = 0; k < 4; k++)
+                product.m[r][c] += a.m[r][k] * b.m[k][c];
+    return product;
+}
+
+// Gauss-Jordan with partial pivoting.
+static Matrix4 Inverse(Matrix4 a)
+{
+    Matrix4 inverse = {};
+    for (int i = 0; i < 4; i++)
+        inverse.m[i][i] = 1.0;
+    for (int c = 0; c < 4; c++)
+    {
+        int pivot = c;
+        for (int r = c + 1; r < 4; r++)
+            if (fabs(a.m[r][c]) > fabs(a.m[pivot][c]))
+                pivot = r;
+        for (int k = 0; k < 4; k++)
+        {
+            std::swap(a.m[c][k], a.m[pivot][k]);
+            std::swap(inverse.m[c][k], inverse.m[pivot][k]);
+        }
+        double scale = 1.0 / a.m[c][c];
+        for (int k = 0; k < 4; k++)
+        {
+            a.m[c][k] *= scale;
+            inverse.m[c][k] *= scale;
+        }
+        for (int r = 0; r < 4; r++)
+        {
+            if (r == c)
+                continue;
+            double factor = a.m[r][c];
+            for (int k = 0; k < 4; k++)
+            {
+                a.m[r][k] -= factor * a.m[c][k];
+                inverse.m[r][k] -= factor * inverse.m[c][k];
+            }
+        }
+    }
+    return inverse;
+}
+
+// ovrMatrix4f_Projection with ovrProjection_None: right handed, depth from 0 to 1.
+static Matrix4 OvrProjection(const FovTangents& fov, double zNear, double zFar)
+{
+    double xScale = 2.0 / (fov.leftTan + fov.rightTan);
+    double xOffset = (fov.leftTan - fov.rightTan) * xScale * 0.5;
+    double yScale = 2.0 / (fov.upTan + fov.downTan);
+    double yOffset = (fov.upTan - fov.downTan) * yScale * 0.5;
+    Matrix4 projection = {};
+    projection.m[0][0] = xScale;
+    projection.m[0][2] = -xOffset;
+    projection.m[1][1] = yScale;
+    projection.m[1][2] = yOffset;
+    projection.m[2][2] = zFar / (zNear - zFar);
+    projection.m[2][3] = zFar * zNear / (zNear - zFar);
+    projection.m[3][2] = -1.0;
+    return projection;
+}
+
+// Camera::GetViewMatrix: the camera looks down its -z with y up.
+static Matrix4 ViewMatrix(const Float3& eye, const Quat& rotation)
+{
+    Float3 axes[3] = { rotation.Rotate(Float3(1, 0, 0)), rotation.Rotate(Float3(0, 1, 0)), rotation.Rotate(Float3(0, 0, 1)) };
+    Matrix4 view = {};
+    for (int r = 0; r < 3; r++)
+    {
+        view.m[r][0] = axes[r].x;
+        view.m[r][1] = axes[r].y;
+        view.m[r][2] = axes[r].z;
+        view.m[r][3] = -(double(axes[r].x) * eye.x + double(axes[r].y) * eye.y + double(axes[r].z) * eye.z);
+    }
+    view.m[3][3] = 1.0;
+    return view;
+}
+
+static CameraRayDiff Diff(const FovTangents& fov, const Float3& eye, const Quat& rotation, uint32_t width, uint32_t height)
+{
+    // Uploaded as floats, as the XMFLOAT4X4 of the inverse was
+    Matrix4 projectionToWorld = Inverse(Multiply(OvrProjection(fov, 0.2, 1000.0), ViewMatrix(eye, rotation)));
+    float uploaded[16];
+    for (int i = 0; i < 16; i++)
+        uploaded[i] = float(projectionToWorld.m[i / 4][i % 4]);
+    return DiffCameraRays(uploaded, eye, MakeCameraRayFrustum(fov, rotation, width, height), width, height);
+}
+
+static void TestFovPorts()
+{
+    const FovTangents fovs[] = {
+        { 1.0f, 1.0f, 1.0f, 1.0f },                 // 90 degrees each way
+        { 1.3292f, 1.3292f, 1.0586f, 1.0923f },     // A Rift CV1 left eye, wider outwards
+        { 1.3292f, 1.3292f, 1.0923f, 1.0586f },     // and its right eye
+        { 0.9657f, 1.2349f, 1.0355f, 0.8391f },     // Lower and inner halves wider
+        { 0.25f, 0.3f, 0.2f, 0.35f },               // Narrow and off centre
+        { 2.4f, 2.4f, 2.1f, 2.1f },                 // Wide
+    };
+    struct { uint32_t width, height; } resolutions[] = { { 64, 64 }, { 333, 217 }, { 1344, 1600 } };
+    struct { Float3 eye; Quat rotation; } poses[] = {
+        { Float3(0.0f, 0.0f, 0.0f), Quat() },
+        { Float3(1.5f, 1.7f, -3.0f), Quat::AxisAngle(Float3(0.0f, 1.0f, 0.0f), 2.3f) },
+        { Float3(-12.0f, 0.4f, 25.0f), Quat::AxisAngle(Float3(0.3f, 1.0f, -0.2f), -0.9f) },
+    };
+
+    for (const FovTangents& fov : fovs)
+    {
+        for (const auto& resolution : resolutions)
+        {
+            for (const auto& pose : poses)
+            {
+                CameraRayDiff diff = Diff(fov, pose.eye, pose.rotation, resolution.width, resolution.height);
+                CHECK(diff.pixels == resolution.width * resolution.height);
+                if (!CHECK(diff.maxRadians <= MaxPixelShare * diff.pixelSpreadAngle))
+                    printf("    fov %g %g %g %g at %ux%u: %g radians, pixels %g apart\n", fov.upTan, fov.downTan, fov.leftTan, fov.rightTan,
+                        resolution.width, resolution.height, diff.maxRadians, diff.pixelSpreadAngle);
+                CHECK(diff.meanRadians <= diff.maxRadians);
+            }
+        }
+    }
+}
+
+// The frustum's rays themselves: the corner pixels sit half a pixel inside the tangents of
+// the FovPort.
+static void TestFrustumEdges()
+{
+    FovTangents fov = { 1.3292f, 1.3292f, 1.0586f, 1.0923f };
+    const uint32_t width = 1344, height = 1600;
+    CameraRayFrustum frustum = MakeCameraRayFrustum(fov, Quat(), width, height);
+    Float3 topLeft = FrustumRayDirection(frustum, 0, 0);
+    CHECK_NEAR(-topLeft.x / -topLeft.z, fov.leftTan - 0.5f * (fov.leftTan + fov.rightTan) / width, 1e-5f);
+    CHECK_NEAR(topLeft.y / -topLeft.z, fov.upTan - 0.5f * (fov.upTan + fov.downTan) / height, 1e-5f);
+    Float3 bottomRight = FrustumRayDirection(frustum, width - 1, height - 1);
+    CHECK_NEAR(bottomRight.x / -bottomRight.z, fov.rightTan - 0.5f * (fov.leftTan + fov.rightTan) / width, 1e-5f);
+    CHECK_NEAR(-bottomRight.y / -bottomRight.z, fov.downTan - 0.5f * (fov.upTan + fov.downTan) / height, 1e-5f);
+    CHECK_NEAR(Length(topLeft), 1.0f, 1e-6f);
+}
+
+int main()
+{
+    TestFovPorts();
+    TestFrustumEdges();
+    return CpuTestResult("CameraRaysTests");
+}
@@ -0,0 +1,80 @@
+/************************************************************************************
+Filename    :   CpuTest.h
+Content     :   The checks shared by the CPU test executables
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// Each test in CpuTests is one executable over the portable headers in Common, built like
+// CpuBenchmarks with no D3D12 or Windows headers, e.g.
+//
+//   g++ -std=c++14 -O2 -pthread -I Common CpuTests/RayConeTests.cpp -o ray_cone_tests
+//   cl /std:c++14 /O2 /EHsc /I Common CpuTests\RayConeTests.cpp
+//
+// A failed check prints where it is and the test keeps going; main returns CpuTestResult(),
+// which is nonzero if anything failed.
+
+#ifndef CpuTest_h
+#define CpuTest_h
+
+#include <cmath>
+#include <cstdio>
+
+struct CpuTestCounts
+{
+    int checks = 0;
+    int failures = 0;
+};
+
+inline CpuTestCounts& CpuTestTotals()
+{
+    static CpuTestCounts totals;
+    return totals;
+}
+
+inline bool CpuTestCheck(bool passed, const char* expression, const char* file, int line)
+{
+    CpuTestTotals().checks++;
+    if (!passed)
+    {
+        CpuTestTotals().failures++;
+        printf("%s(%d): failed: %s\n", file, line, expression);
+    }
+    return passed;
+}
+
+inline bool CpuTestCheckNear(double actual, double expected, double tolerance, const char* expression, const char* file, int line)
+{
+    CpuTestTotals().checks++;
+    if (!(fabs(actual - expected) <= tolerance))
+    {
+        CpuTestTotals().failures++;
+        printf("%s(%d): failed: %s is %.9g, expected %.9g within %.3g\n", file, line, expression, actual, expected, tolerance);
+        return false;
+    }
+    return true;
+}
+
+#define CHECK(condition) CpuTestCheck((condition), #condition, __FILE__, __LINE__)
+#define CHECK_NEAR(actual, expected, tolerance) CpuTestCheckNear((actual), (expected), (tolerance), #actual, __FILE__, __LINE__)
+
+inline int CpuTestResult(const char* name)
+{
+    const CpuTestCounts& totals = CpuTestTotals();
+    printf("%s: %d checks, %d failed\n", name, totals.checks, totals.failures);
+    return totals.failures ? 1 : 0;
+}
+
+#endif // CpuTest_h
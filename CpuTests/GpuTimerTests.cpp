@@ -0,0 +1,262 @@
+/************************************************************************************
+Filename    :   GpuTimerTests.cpp
+Content     :   GpuTimer on MockTimestampBackend: readback lag, slots, bad zones and percentiles
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// Frames are driven the way the scene drives them: BeginFrame on the frame's swap chain
+// slot, zones written into command lists, EndFrame. The mock's command lists are clocks at
+// the default frequency of 1e9 ticks per second, advanced by whole milliseconds of work.
+
+#include "GpuTimer.h"
+#include "CpuTest.h"
+
+typedef GpuTimer<MockTimestampBackend> MockGpuTimer;
+
+static const uint32_t FrameSlots = 3;
+static const uint64_t Millisecond = 1000000;
+
+static void Init(MockGpuTimer& timer, uint32_t maxZonesPerFrame)
+{
+    timer.Init(FrameSlots, maxZonesPerFrame);
+    timer.backend.Create(timer.QueryCount());
+}
+
+// The last total a zone was given.
+static double LastMilliseconds(const MockGpuTimer& timer, const char* name)
+{
+    auto found = timer.zones.find(name);
+    if (found == timer.zones.end() || found->second.count == 0)
+        return -1.0;
+    const ZoneWindow& window = found->second;
+    return window.milliseconds[(window.next + FRAME_PROFILER_HISTORY - 1) % FRAME_PROFILER_HISTORY];
+}
+
+// Frame f takes f + 1 milliseconds, so what is read back says which frame it came from.
+static void TestReadbackLag()
+{
+    MockGpuTimer timer;
+    Init(timer, 4);
+    MockTimestampBackend::CommandList commandList;
+    for (uint32_t frame = 0; frame < 10; frame++)
+    {
+        timer.BeginFrame(frame % FrameSlots);
+        // Nothing comes back until every slot has been through a frame
+        CHECK(timer.frameCount == (frame < FrameSlots ? 0 : frame - FrameSlots + 1));
+        if (frame >= FrameSlots)
+        {
+            CHECK_NEAR(LastMilliseconds(timer, "Frame work"), double(frame - FrameSlots + 1), 0.0);
+            CHECK_NEAR(LastMilliseconds(timer, GPU_TIMER_FRAME_ZONE), double(frame - FrameSlots + 1), 0.0);
+        }
+        else
+        {
+            CHECK(timer.zones.empty());
+        }
+        {
+            MockGpuTimer::Scope zone(timer, &commandList, "Frame work");
+            commandList.Advance((frame + 1) * Millisecond);
+        }
+        commandList.Advance(Millisecond);     // Between frames, outside every zone
+        timer.EndFrame(&commandList);
+    }
+    CHECK(timer.invalidZones == 0 && timer.droppedZones == 0);
+}
+
+// Each slot keeps its own queries and zone names: frames with different zones in flight at
+// once come back with their own, and a slot's old zones are gone once it is read.
+static void TestSlotReuse()
+{
+    MockGpuTimer timer;
+    Init(timer, 4);
+    CHECK(timer.QueryCount() == FrameSlots * 4 * 2);
+    CHECK(timer.FirstQuery(1) == 8 && timer.FirstQuery(2) == 16);
+
+    const char* names[FrameSlots] = { "Slot 0", "Slot 1", "Slot 2" };
+    MockTimestampBackend::CommandList commandList;
+    for (uint32_t frame = 0; frame < 2 * FrameSlots; frame++)
+    {
+        uint32_t slot = frame % FrameSlots;
+        timer.BeginFrame(slot);
+        CHECK(timer.slots[slot].names.empty() && !timer.slots[slot].resolved);
+        // Slot s times s + 1 zones of s + 1 milliseconds each, the second time round twice as long
+        uint32_t scale = frame < FrameSlots ? 1 : 2;
+        for (uint32_t zone = 0; zone <= slot; zone++)
+        {
+            MockGpuTimer::Scope scope(timer, &commandList, names[slot]);
+            commandList.Advance((slot + 1) * scale * Millisecond);
+        }
+        timer.EndFrame(&commandList);
+    }
+    for (uint32_t slot = 0; slot < FrameSlots; slot++)
+    {
+        const ZoneWindow& window = timer.zones[names[slot]];
+        CHECK(window.count == 1);
+        CHECK(window.calls[0] == slot + 1);
+        CHECK_NEAR(window.milliseconds[0], double((slot + 1) * (slot + 1)), 0.0);
+    }
+    // The second round comes back through the same slots
+    for (uint32_t slot = 0; slot < FrameSlots; slot++)
+        timer.BeginFrame(slot);
+    for (uint32_t slot = 0; slot < FrameSlots; slot++)
+    {
+        const ZoneWindow& window = timer.zones[names[slot]];
+        CHECK(window.count == 2);
+        CHECK_NEAR(LastMilliseconds(timer, names[slot]), double(2 * (slot + 1) * (slot + 1)), 0.0);
+    }
+    CHECK(timer.frameCount == 2 * FrameSlots);
+
+    // A discarded frame never comes back, and leaves its slot free for the next
+    timer.BeginFrame(0);
+    {
+        MockGpuTimer::Scope scope(timer, &commandList, "Discarded");
+        commandList.Advance(Millisecond);
+    }
+    timer.DiscardFrame();
+    timer.BeginFrame(0);
+    CHECK(timer.zones.find("Discarded") == timer.zones.end());
+    CHECK(timer.frameCount == 2 * FrameSlots);
+}
+
+// Zones left open or ending before they began are counted and left out, zones past the
+// frame's queries are dropped, and the rest of their frame still comes back.
+static void TestInvalidAndOverflowingZones()
+{
+    MockGpuTimer timer;
+    Init(timer, 3);
+    MockTimestampBackend::CommandList early, late;
+    late.Advance(10 * Millisecond);
+
+    timer.BeginFrame(0);
+    uint32_t open = timer.Begin(&early, "Never ended");
+    CHECK(open != GPU_TIMER_INVALID_ZONE);
+    // Begun on a list that runs after the one it ends on
+    uint32_t backwards = timer.Begin(&late, "Backwards");
+    timer.End(&early, backwards);
+    uint32_t good = timer.Begin(&early, "Good");
+    early.Advance(2 * Millisecond);
+    timer.End(&early, good);
+    // The frame's three zones are used up
+    uint32_t overflow = timer.Begin(&early, "Overflow");
+    CHECK(overflow == GPU_TIMER_INVALID_ZONE);
+    CHECK(timer.droppedZones == 1);
+    timer.End(&early, overflow);
+    {
+        MockGpuTimer::Scope scope(timer, &early, "Overflow");
+        early.Advance(Millisecond);
+    }
+    CHECK(timer.droppedZones == 2);
+    timer.EndFrame(&early);
+
+    for (uint32_t slot = 1; slot <= FrameSlots; slot++)
+        timer.BeginFrame(slot % FrameSlots);
+    CHECK(timer.frameCount == 1);
+    CHECK(timer.invalidZones == 2);
+    CHECK(timer.zones.find("Never ended") == timer.zones.end());
+    CHECK(timer.zones.find("Backwards") == timer.zones.end());
+    CHECK(timer.zones.find("Overflow") == timer.zones.end());
+    CHECK_NEAR(LastMilliseconds(timer, "Good"), 2.0, 0.0);
+    CHECK_NEAR(LastMilliseconds(timer, GPU_TIMER_FRAME_ZONE), 2.0, 0.0);
+
+    // A timer that was never initialized ignores everything
+    MockGpuTimer idle;
+    CHECK(idle.Begin(&early, "Idle") == GPU_TIMER_INVALID_ZONE);
+    idle.EndFrame(&early);
+    idle.DiscardFrame();
+    CHECK(idle.droppedZones == 0 && idle.zones.empty());
+}
+
+// 100 frames of a zone taking 1 to 100 milliseconds, in a shuffled order, run twice a frame
+// under one name as the two eyes are. Percentiles round to the nearest of the sorted totals.
+static void TestPercentiles()
+{
+    MockGpuTimer timer;
+    Init(timer, 4);
+    const uint32_t frames = 100;
+    std::vector<uint32_t> order(frames);
+    for (uint32_t i = 0; i < frames; i++)
+        order[i] = (i * 37) % frames + 1;   // 37 is prime to 100, so every total appears once
+
+    MockTimestampBackend::CommandList commandList;
+    for (uint32_t frame = 0; frame < frames + FrameSlots; frame++)
+    {
+        timer.BeginFrame(frame % FrameSlots);
+        if (frame >= frames)
+            continue;
+        for (int eye = 0; eye < 2; eye++)
+        {
+            MockGpuTimer::Scope scope(timer, &commandList, "Eye");
+            commandList.Advance(order[frame] * Millisecond / 2);
+        }
+        {
+            MockGpuTimer::Scope scope(timer, &commandList, "Composite");
+            commandList.Advance(Millisecond / 4);
+        }
+        timer.EndFrame(&commandList);
+    }
+    CHECK(timer.frameCount == frames);
+
+    std::vector<ZoneSummary> summaries = timer.SummarizeZones();
+    CHECK(summaries.size() == 3);
+    if (summaries.size() != 3)
+        return;
+    // Slowest median first: the whole frame, the eyes, then compositing
+    CHECK(summaries[0].name == GPU_TIMER_FRAME_ZONE);
+    CHECK(summaries[1].name == "Eye");
+    CHECK(summaries[2].name == "Composite");
+
+    const ZoneSummary& eye = summaries[1];
+    CHECK(eye.frames == frames);
+    CHECK_NEAR(eye.callsPerFrame, 2.0, 0.0);
+    CHECK_NEAR(eye.p50Milliseconds, 51.0, 1e-4);      // sorted[round(0.5 * 99)]
+    CHECK_NEAR(eye.p95Milliseconds, 95.0, 1e-4);      // sorted[round(0.95 * 99)]
+    CHECK_NEAR(eye.p99Milliseconds, 99.0, 1e-4);      // sorted[round(0.99 * 99)]
+    CHECK_NEAR(eye.maxMilliseconds, 100.0, 1e-4);
+
+    const ZoneSummary& composite = summaries[2];
+    CHECK_NEAR(composite.p50Milliseconds, 0.25, 1e-6);
+    CHECK_NEAR(composite.maxMilliseconds, 0.25, 1e-6);
+    CHECK_NEAR(composite.callsPerFrame, 1.0, 0.0);
+
+    const ZoneSummary& frame = summaries[0];
+    CHECK_NEAR(frame.p50Milliseconds, 51.25, 1e-4);
+    CHECK_NEAR(frame.maxMilliseconds, 100.25, 1e-4);
+
+    // Zones that stop running drop out once a whole window has gone by without them
+    for (uint32_t frame = 0; frame < FRAME_PROFILER_HISTORY + FrameSlots; frame++)
+    {
+        timer.BeginFrame(frame % FrameSlots);
+        if (frame >= FRAME_PROFILER_HISTORY)
+            continue;
+        {
+            MockGpuTimer::Scope scope(timer, &commandList, "Composite");
+            commandList.Advance(Millisecond / 4);
+        }
+        timer.EndFrame(&commandList);
+    }
+    summaries = timer.SummarizeZones();
+    CHECK(summaries.size() == 2);
+    for (const ZoneSummary& summary : summaries)
+        CHECK(summary.name != "Eye");
+}
+
+int main()
+{
+    TestReadbackLag();
+    TestSlotReuse();
+    TestInvalidAndOverflowingZones();
+    TestPercentiles();
+    return CpuTestResult("GpuTimerTests");
+}
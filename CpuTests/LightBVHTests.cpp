@@ -0,0 +1,184 @@
+/************************************************************************************
+Filename    :   LightBVHTests.cpp
+Content     :   Light BVH selection probabilities against the walk DirectLighting takes
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// The samples only ever add one light, so the many-light walk is run here instead: a few
+// hundred point and sphere lights scattered through a box, shaded from points inside and
+// around it.
+//
+// Under a normal along an axis a node is above the horizon exactly when one of its children
+// is, so the walk always ends at a light. Under any other normal the corner of a node's
+// bounds can be above it while those of both children are below, and the walk stops there
+// with no light. Every light above the horizon can still be picked, with the pdf it is
+// divided by, so the estimate stays unbiased and only the stopped samples are wasted.
+
+#include "LightBVH.h"
+#include "CpuTest.h"
+
+static const uint32_t LightCount = 300;
+static const float BoxHalfSize = 20.0f;
+
+static LightBVH MakeLights(uint32_t seed)
+{
+    uint32_t state = seed;
+    std::vector<LightSource> lights;
+    for (uint32_t i = 0; i < LightCount; i++)
+    {
+        Float3 position((RandomUnorm(state) * 2.0f - 1.0f) * BoxHalfSize, (RandomUnorm(state) * 2.0f - 1.0f) * BoxHalfSize,
+                        (RandomUnorm(state) * 2.0f - 1.0f) * BoxHalfSize);
+        Float3 color(0.2f + RandomUnorm(state), 0.2f + RandomUnorm(state), 0.2f + RandomUnorm(state));
+        float intensity = 0.1f + 10.0f * RandomUnorm(state);
+        // Every third light is a sphere
+        float radius = i % 3 == 0 ? 0.1f + RandomUnorm(state) : 0.0f;
+        lights.push_back(LightSource(position, color, intensity, radius));
+    }
+    LightBVH bvh;
+    bvh.Build(lights);
+    return bvh;
+}
+
+struct ShadingPoint
+{
+    Float3 p, n;
+};
+
+static const ShadingPoint ShadingPoints[] = {
+    { Float3(0.0f, -BoxHalfSize - 1.0f, 0.0f), Float3(0.0f, 1.0f, 0.0f) },     // Under the box facing into it
+    { Float3(0.0f, 0.0f, 0.0f), Float3(0.0f, 1.0f, 0.0f) },                    // In the middle, half below the horizon
+    { Float3(5.0f, -3.0f, 12.0f), Normalize(Float3(-1.0f, 0.5f, 2.0f)) },
+    { Float3(-19.0f, 18.0f, -2.0f), Normalize(Float3(1.0f, -1.0f, 0.0f)) },    // In a corner facing out of it
+    { Float3(60.0f, 0.0f, 0.0f), Float3(-1.0f, 0.0f, 0.0f) },                  // Far off, where the tree is all one cluster
+};
+
+// Whether any of a light's bounds is above the horizon of p, as LightNodeImportance decides it.
+static bool AlongAnAxis(const Float3& n)
+{
+    return (n.x != 0.0f) + (n.y != 0.0f) + (n.z != 0.0f) == 1;
+}
+
+static bool AboveHorizon(const LightSource& light, const Float3& p, const Float3& n)
+{
+    Aabb bounds = light.Bounds();
+    Float3 furthest(n.x > 0.0f ? bounds.hi.x : bounds.lo.x, n.y > 0.0f ? bounds.hi.y : bounds.lo.y, n.z > 0.0f ? bounds.hi.z : bounds.lo.z);
+    return Dot(furthest - p, n) > 0.0f;
+}
+
+static void TestTree()
+{
+    LightBVH bvh = MakeLights(1);
+    CHECK(bvh.nodes.size() == 2 * LightCount - 1);
+    double power = 0.0;
+    for (const LightSource& light : bvh.lights)
+        power += light.Power();
+    CHECK_NEAR(bvh.nodes[0].power, power, 1e-6 * power);
+    // Every light is in exactly one leaf
+    std::vector<uint32_t> leaves(LightCount, 0);
+    for (const LightNode& node : bvh.nodes)
+        if (node.child & LIGHT_LEAF)
+            leaves[node.child & ~LIGHT_LEAF]++;
+    CHECK(std::count(leaves.begin(), leaves.end(), 1u) == (long)LightCount);
+}
+
+static void TestProbabilities()
+{
+    LightBVH bvh = MakeLights(2);
+    for (const ShadingPoint& point : ShadingPoints)
+    {
+        std::vector<float> probabilities = LightSelectionProbabilities(bvh, point.p, point.n);
+        double sum = 0.0;
+        uint32_t belowWithProbability = 0, aboveWithout = 0;
+        for (uint32_t i = 0; i < LightCount; i++)
+        {
+            sum += probabilities[i];
+            bool above = AboveHorizon(bvh.lights[i], point.p, point.n);
+            if (!above && probabilities[i] != 0.0f)
+                belowWithProbability++;
+            if (above && probabilities[i] <= 0.0f)
+                aboveWithout++;
+        }
+        if (AlongAnAxis(point.n))
+            CHECK_NEAR(sum, 1.0, 1e-5);
+        else
+            CHECK(sum > 0.0 && sum <= 1.0 + 1e-5);
+        CHECK(belowWithProbability == 0);
+        // Lights above the horizon can always be picked, as every node holding one is too
+        CHECK(aboveWithout == 0);
+    }
+
+    // With every light below the horizon nothing is picked
+    Float3 top(0.0f, BoxHalfSize + 2.0f, 0.0f), up(0.0f, 1.0f, 0.0f);
+    std::vector<float> none = LightSelectionProbabilities(bvh, top, up);
+    CHECK(std::count(none.begin(), none.end(), 0.0f) == (long)LightCount);
+    LightSample sample = SampleLightBVH(bvh.nodes.data(), (uint32_t)bvh.nodes.size(), top, up, 0.5f);
+    CHECK(sample.light == LIGHT_NONE && sample.pdf == 0.0f);
+
+    // No lights at all, and a single one that is always picked
+    LightBVH empty;
+    empty.Build(std::vector<LightSource>());
+    CHECK(SampleLightBVH(empty.nodes.data(), 0, top, up, 0.5f).light == LIGHT_NONE);
+    LightBVH single;
+    single.Build(std::vector<LightSource>(1, LightSource(Float3(0.0f, 1.0f, 0.0f), Float3(1.0f), 1.0f)));
+    sample = SampleLightBVH(single.nodes.data(), (uint32_t)single.nodes.size(), Float3(), up, 0.75f);
+    CHECK(sample.light == 0 && sample.pdf == 1.0f);
+}
+
+// Evenly spaced u over [0, 1) land on each light in proportion to its probability, the rest
+// on no light at all, and the pdf SampleLightBVH returns is that probability.
+static void TestHistogram()
+{
+    const uint32_t samples = 1 << 20;
+    LightBVH bvh = MakeLights(3);
+    for (const ShadingPoint& point : ShadingPoints)
+    {
+        std::vector<float> probabilities = LightSelectionProbabilities(bvh, point.p, point.n);
+        double sum = 0.0;
+        for (float probability : probabilities)
+            sum += probability;
+        std::vector<uint32_t> histogram(LightCount, 0);
+        uint32_t missed = 0;
+        double maxPdfError = 0.0;
+        for (uint32_t i = 0; i < samples; i++)
+        {
+            LightSample sample = SampleLightBVH(bvh.nodes.data(), (uint32_t)bvh.nodes.size(), point.p, point.n, (i + 0.5f) / samples);
+            if (sample.light == LIGHT_NONE)
+            {
+                missed++;
+                continue;
+            }
+            histogram[sample.light]++;
+            maxPdfError = (std::max)(maxPdfError, fabs(double(sample.pdf) - probabilities[sample.light]) / probabilities[sample.light]);
+        }
+        CHECK_NEAR(double(missed) / samples, 1.0 - sum, 1e-5);
+        if (AlongAnAxis(point.n))
+            CHECK(missed == 0);
+        CHECK_NEAR(maxPdfError, 0.0, 1e-5);
+
+        double maxError = 0.0;
+        for (uint32_t light = 0; light < LightCount; light++)
+            maxError = (std::max)(maxError, fabs(double(histogram[light]) / samples - probabilities[light]));
+        CHECK_NEAR(maxError, 0.0, 1e-5);
+    }
+}
+
+int main()
+{
+    TestTree();
+    TestProbabilities();
+    TestHistogram();
+    return CpuTestResult("LightBVHTests");
+}
@@ -0,0 +1,110 @@
+/************************************************************************************
+Filename    :   ProceduralSpheresTests.cpp
+Content     :   The reference sphere intersection against hand worked rays and the scene query's
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// ReferenceRaySphereIntersection follows the intersection shader, so a broken root choice or
+// a sphere that pokes out of the AABB given to the BLAS shows up here first.
+
+#include "ProceduralSpheres.h"
+#include "CpuTest.h"
+
+// Rays along -z at a unit sphere at the origin.
+static void TestRoots()
+{
+    Float3 center(0.0f, 0.0f, 0.0f);
+    Float3 down(0.0f, 0.0f, -1.0f);
+    // From outside the near root, from inside the far one
+    CHECK_NEAR(ReferenceRaySphereIntersection(Float3(0.0f, 0.0f, 5.0f), down, 0.0f, FLT_MAX, center, 1.0f), 4.0f, 1e-6f);
+    CHECK_NEAR(ReferenceRaySphereIntersection(Float3(0.0f, 0.0f, 0.5f), down, 0.0f, FLT_MAX, center, 1.0f), 1.5f, 1e-6f);
+    // tMin past the near root and tMax short of it
+    CHECK_NEAR(ReferenceRaySphereIntersection(Float3(0.0f, 0.0f, 5.0f), down, 4.5f, FLT_MAX, center, 1.0f), 6.0f, 1e-6f);
+    CHECK(ReferenceRaySphereIntersection(Float3(0.0f, 0.0f, 5.0f), down, 0.0f, 3.9f, center, 1.0f) == FLT_MAX);
+    // Behind the origin, beside the sphere, and just grazing it
+    CHECK(ReferenceRaySphereIntersection(Float3(0.0f, 0.0f, -5.0f), down, 0.0f, FLT_MAX, center, 1.0f) == FLT_MAX);
+    CHECK(ReferenceRaySphereIntersection(Float3(1.01f, 0.0f, 5.0f), down, 0.0f, FLT_MAX, center, 1.0f) == FLT_MAX);
+    CHECK_NEAR(ReferenceRaySphereIntersection(Float3(0.0f, 1.0f, 5.0f), down, 0.0f, FLT_MAX, center, 1.0f), 5.0f, 1e-3f);
+    // Directions need not be normalized: t is in units of the direction
+    CHECK_NEAR(ReferenceRaySphereIntersection(Float3(0.0f, 0.0f, 5.0f), down * 2.0f, 0.0f, FLT_MAX, center, 1.0f), 2.0f, 1e-6f);
+}
+
+// Rays from a shell at three radii aimed near each centre: the reference agrees with the scene
+// query sphere test on hit or miss and on t, and every hit is on the sphere and inside the AABB
+// the BLAS is built from.
+static void TestAgainstSceneQuery()
+{
+    const SpherePrimitive spheres[] = {
+        SpherePrimitive(Float3(0.0f, 0.0f, 0.0f), 0.5f, Float3(1.0f), 0.0f),
+        SpherePrimitive(Float3(3.0f, -2.0f, 7.5f), 2.0f, Float3(1.0f), 0.0f),
+        SpherePrimitive(Float3(-40.0f, 12.0f, 25.0f), 0.05f, Float3(1.0f), 0.0f),
+        SpherePrimitive(Float3(150.0f, 0.0f, -300.0f), 30.0f, Float3(1.0f), 0.0f),
+        SpherePrimitive(Float3(0.001f, 0.002f, -0.003f), 0.001f, Float3(1.0f), 0.0f),
+    };
+    const uint32_t seeds[] = { 1, 7, 12345 };
+    const uint32_t raysPerSphere = 512;
+
+    for (uint32_t seed : seeds)
+    {
+        uint32_t state = seed;
+        auto random = [&]() {
+            state = state * 1664525u + 1013904223u;
+            return (state >> 8) * (1.0f / 16777216.0f);
+        };
+        uint32_t hits = 0, disagreements = 0, offSurface = 0, outside = 0;
+        for (const SpherePrimitive& sphere : spheres)
+        {
+            Aabb bounds = sphere.Bounds();
+            float tolerance = 1e-3f * (sphere.radius + Length(sphere.center));
+            for (uint32_t r = 0; r < raysPerSphere; r++)
+            {
+                Float3 offset = Normalize(Float3(random() - 0.5f, random() - 0.5f, random() - 0.5f));
+                Float3 origin = sphere.center + offset * (sphere.radius * 3.0f);
+                Float3 target = sphere.center + Float3(random() - 0.5f, random() - 0.5f, random() - 0.5f) * (sphere.radius * 2.5f);
+                Float3 direction = Normalize(target - origin);
+
+                float t = ReferenceRaySphereIntersection(origin, direction, 0.0f, FLT_MAX, sphere.center, sphere.radius);
+                float expected = QueryGeometry::RaySphere(origin, direction, sphere.center, sphere.radius, 0.0f, FLT_MAX);
+                if ((t == FLT_MAX) != (expected == FLT_MAX))
+                {
+                    disagreements++;
+                    continue;
+                }
+                if (t == FLT_MAX)
+                    continue;
+                hits++;
+                Float3 hit = origin + direction * t;
+                if (fabsf(t - expected) > tolerance)
+                    disagreements++;
+                if (fabsf(Length(hit - sphere.center) - sphere.radius) > tolerance)
+                    offSurface++;
+                if (!bounds.Expanded(tolerance).Contains(hit))
+                    outside++;
+            }
+        }
+        if (!CHECK(disagreements == 0 && offSurface == 0 && outside == 0))
+            printf("    seed %u: %u disagreements, %u off the surface, %u outside the bounds\n", seed, disagreements, offSurface, outside);
+        // Most of the rays are aimed inside the sphere, so a test that never hits fails too
+        CHECK(hits > raysPerSphere * 5 / 4);
+    }
+}
+
+int main()
+{
+    TestRoots();
+    TestAgainstSceneQuery();
+    return CpuTestResult("ProceduralSpheresTests");
+}
@@ -0,0 +1,241 @@
+/************************************************************************************
+Filename    :   RayBudgetTests.cpp
+Content     :   AllocateRayBudget on synthetic frames of tile statistics
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// Frames are made up directly as RayBudgetTileStats, at the tile count of a 1440 x 1600 eye,
+// rather than gathered from a G-buffer.
+
+#include "RayBudget.h"
+#include "CpuTest.h"
+
+static const uint32_t TilesX = 90;
+static const uint32_t TilesY = 100;
+static const uint32_t TilePixels = RAY_BUDGET_TILE_SIZE * RAY_BUDGET_TILE_SIZE;
+
+static uint32_t s_random = 1;
+
+static float Random()
+{
+    s_random = s_random * 1664525u + 1013904223u;
+    return (s_random >> 8) * (1.0f / 16777216.0f);
+}
+
+// Some sky, some matte surfaces and some mirrors, of any brightness.
+static std::vector<RayBudgetTileStats> RandomFrame()
+{
+    std::vector<RayBudgetTileStats> stats(TilesX * TilesY);
+    for (RayBudgetTileStats& tile : stats)
+    {
+        tile.litPixels = Random() < 0.2f ? 0 : uint32_t(Random() * TilePixels);
+        tile.reflectivePixels = Random() < 0.5f ? 0 : uint32_t(Random() * tile.litPixels);
+        tile.reflectivitySum = uint32_t(tile.reflectivePixels * Random() * RAY_BUDGET_UNIT);
+        tile.luminanceSum = uint32_t(tile.litPixels * Random() * RAY_BUDGET_UNIT);
+    }
+    return stats;
+}
+
+static RayBudgetSettings Settings(double rayTarget)
+{
+    RayBudgetSettings settings;
+    settings.rayTarget = rayTarget;
+    settings.maxLightSamples = 4;
+    settings.maxBounces = 2;
+    return settings;
+}
+
+// What the tiles of an allocation trace at most, summed up again from the tiles themselves.
+static double TracedRays(const RayBudgetAllocation& allocation, const RayBudgetTileStats* stats, const RayBudgetSettings& settings)
+{
+    double rays = 0.0;
+    for (size_t i = 0; i < allocation.tiles.size(); i++)
+        rays += RayBudgetTileRays(stats[i], RayBudgetLightSamples(allocation.tiles[i]), RayBudgetBounces(allocation.tiles[i]), settings.raysPerPixel);
+    return rays;
+}
+
+// The rays spent add up to the tiles' allocations and stay within the target, and what is
+// left is too little for any further increment that would buy something.
+static void TestBudgetConservation()
+{
+    std::vector<RayBudgetTileStats> stats = RandomFrame();
+    const float raysPerPixel[] = { 0.5f, 1.0f, 2.0f, 4.0f };
+    const float scales[] = { 1.0f, 0.25f };
+    for (float target : raysPerPixel)
+    {
+        for (float scale : scales)
+        {
+            RayBudgetSettings settings = Settings(double(target) * TilesX * TilesY * TilePixels * scale);
+            settings.raysPerPixel = scale;
+            RayBudgetAllocation allocation = AllocateRayBudget(TilesX, TilesY, stats.data(), settings);
+            CHECK(allocation.tiles.size() == stats.size());
+            CHECK_NEAR(allocation.rays, TracedRays(allocation, stats.data(), settings), allocation.rays * 1e-9);
+            CHECK(allocation.rays <= (std::max)(settings.rayTarget, allocation.mandatoryRays) * (1.0 + 1e-9));
+
+            bool maximal = true, withinSettings = true;
+            for (size_t i = 0; i < stats.size(); i++)
+            {
+                uint32_t samples = RayBudgetLightSamples(allocation.tiles[i]), bounces = RayBudgetBounces(allocation.tiles[i]);
+                withinSettings &= samples >= 1 && samples <= settings.maxLightSamples && bounces <= settings.maxBounces;
+                withinSettings &= bounces == 0 || stats[i].reflectivitySum > 0;
+                double current = RayBudgetTileRays(stats[i], samples, bounces, scale);
+                if (samples < settings.maxLightSamples && stats[i].litPixels > 0)
+                    maximal &= allocation.rays + RayBudgetTileRays(stats[i], samples + 1, bounces, scale) - current > settings.rayTarget;
+                if (bounces < settings.maxBounces && stats[i].reflectivitySum > 0)
+                    maximal &= allocation.rays + RayBudgetTileRays(stats[i], samples, bounces + 1, scale) - current > settings.rayTarget;
+            }
+            CHECK(withinSettings);
+            CHECK(maximal);
+        }
+    }
+
+    // With more than the full settings take, every tile gets all of them
+    RayBudgetSettings settings = Settings(1e12);
+    RayBudgetAllocation allocation = AllocateRayBudget(TilesX, TilesY, stats.data(), settings);
+    RayBudgetReport report = MeasureRayBudget(TilesX, TilesY, stats.data(), settings);
+    bool full = true;
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        if (stats[i].litPixels > 0)
+            full &= RayBudgetLightSamples(allocation.tiles[i]) == settings.maxLightSamples;
+        if (stats[i].reflectivitySum > 0)
+            full &= RayBudgetBounces(allocation.tiles[i]) == settings.maxBounces;
+    }
+    CHECK(full);
+    CHECK(allocation.rays <= report.unbudgetedRays * (1.0 + 1e-9));
+}
+
+// Every tile keeps its first light sample, even when that alone is over budget.
+static void TestTileMinimum()
+{
+    std::vector<RayBudgetTileStats> stats = RandomFrame();
+    double lit = 0.0;
+    for (const RayBudgetTileStats& tile : stats)
+        lit += tile.litPixels;
+
+    RayBudgetSettings settings = Settings(0.0);
+    RayBudgetAllocation allocation = AllocateRayBudget(TilesX, TilesY, stats.data(), settings);
+    CHECK_NEAR(allocation.mandatoryRays, lit, 0.0);
+    CHECK_NEAR(allocation.rays, allocation.mandatoryRays, 0.0);
+    bool minimum = true;
+    for (uint32_t packed : allocation.tiles)
+        minimum &= packed == PackRayBudget(1, 0);
+    CHECK(minimum);
+
+    // Half of what the first samples need still gets them all and nothing more
+    settings = Settings(lit * 0.5);
+    allocation = AllocateRayBudget(TilesX, TilesY, stats.data(), settings);
+    CHECK_NEAR(allocation.rays, lit, 0.0);
+    minimum = true;
+    for (uint32_t packed : allocation.tiles)
+        minimum &= packed == PackRayBudget(1, 0);
+    CHECK(minimum);
+
+    // Tiles that showed nothing keep their sample for what they may show next frame, at no cost
+    std::vector<RayBudgetTileStats> empty(stats.size(), RayBudgetTileStats{ 0, 0, 0, 0 });
+    allocation = AllocateRayBudget(TilesX, TilesY, empty.data(), Settings(1e6));
+    CHECK(allocation.tiles[0] == PackRayBudget(1, 0) && allocation.tiles.back() == PackRayBudget(1, 0));
+    CHECK_NEAR(allocation.mandatoryRays, 0.0, 0.0);
+
+    // Unless the scene traces no light samples at all
+    settings = Settings(1e6);
+    settings.maxLightSamples = 0;
+    allocation = AllocateRayBudget(TilesX, TilesY, stats.data(), settings);
+    bool none = true;
+    for (uint32_t packed : allocation.tiles)
+        none &= RayBudgetLightSamples(packed) == 0;
+    CHECK(none);
+    CHECK_NEAR(allocation.mandatoryRays, 0.0, 0.0);
+}
+
+// A frame without variance: every tile shows the same thing and the fovea covers the whole
+// image, so no tile is worth more than another and the budget spreads evenly, each tile
+// within one increment of every other.
+static void TestZeroVariance()
+{
+    RayBudgetTileStats same = { TilePixels, TilePixels / 2, uint32_t(TilePixels / 2 * 0.6f * RAY_BUDGET_UNIT), uint32_t(TilePixels * 0.5f * RAY_BUDGET_UNIT) };
+    std::vector<RayBudgetTileStats> stats(TilesX * TilesY, same);
+    const float raysPerPixel[] = { 1.0f, 1.7f, 2.5f, 100.0f };
+    for (float target : raysPerPixel)
+    {
+        RayBudgetSettings settings = Settings(double(target) * TilesX * TilesY * TilePixels);
+        settings.foveaRadius = 1e6f;
+        RayBudgetAllocation allocation = AllocateRayBudget(TilesX, TilesY, stats.data(), settings);
+        uint32_t minSamples = 255, maxSamples = 0, minBounces = 255, maxBounces = 0;
+        for (uint32_t packed : allocation.tiles)
+        {
+            minSamples = (std::min)(minSamples, RayBudgetLightSamples(packed));
+            maxSamples = (std::max)(maxSamples, RayBudgetLightSamples(packed));
+            minBounces = (std::min)(minBounces, RayBudgetBounces(packed));
+            maxBounces = (std::max)(maxBounces, RayBudgetBounces(packed));
+        }
+        CHECK(maxSamples - minSamples <= 1);
+        CHECK(maxBounces - minBounces <= 1);
+        CHECK(allocation.rays <= (std::max)(settings.rayTarget, allocation.mandatoryRays) * (1.0 + 1e-9));
+        CHECK_NEAR(allocation.rays, TracedRays(allocation, stats.data(), settings), allocation.rays * 1e-9);
+    }
+
+    // All black and matte: only the luminance floor is left to weigh samples by, and it
+    // weighs every tile the same
+    RayBudgetTileStats black = { TilePixels, 0, 0, 0 };
+    std::vector<RayBudgetTileStats> dark(TilesX * TilesY, black);
+    RayBudgetSettings settings = Settings(2.0 * TilesX * TilesY * TilePixels);
+    settings.foveaRadius = 1e6f;
+    RayBudgetAllocation allocation = AllocateRayBudget(TilesX, TilesY, dark.data(), settings);
+    bool even = true;
+    for (uint32_t packed : allocation.tiles)
+        even &= packed == PackRayBudget(2, 0);
+    CHECK(even);
+    CHECK_NEAR(allocation.rays, settings.rayTarget, 0.0);
+}
+
+// Of two tiles the same distance from the fovea, the brighter and the more reflective one
+// come first, and of two equal tiles the one nearer the fovea does.
+static void TestImportance()
+{
+    RayBudgetTileStats bright = { TilePixels, 0, 0, uint32_t(TilePixels * 0.9f * RAY_BUDGET_UNIT) };
+    RayBudgetTileStats dim = { TilePixels, 0, 0, uint32_t(TilePixels * 0.1f * RAY_BUDGET_UNIT) };
+    RayBudgetTileStats pair[2] = { dim, bright };
+    RayBudgetSettings settings = Settings(3.0 * TilePixels);
+    RayBudgetAllocation allocation = AllocateRayBudget(2, 1, pair, settings);
+    CHECK(RayBudgetLightSamples(allocation.tiles[1]) > RayBudgetLightSamples(allocation.tiles[0]));
+
+    RayBudgetTileStats mirror = { TilePixels, TilePixels, uint32_t(TilePixels * 0.9f * RAY_BUDGET_UNIT), uint32_t(TilePixels * 0.5f * RAY_BUDGET_UNIT) };
+    RayBudgetTileStats glossy = { TilePixels, TilePixels, uint32_t(TilePixels * 0.2f * RAY_BUDGET_UNIT), uint32_t(TilePixels * 0.5f * RAY_BUDGET_UNIT) };
+    RayBudgetTileStats reflective[2] = { mirror, glossy };
+    settings = Settings(4.0 * TilePixels);
+    settings.maxLightSamples = 1;
+    allocation = AllocateRayBudget(2, 1, reflective, settings);
+    CHECK(RayBudgetBounces(allocation.tiles[0]) > RayBudgetBounces(allocation.tiles[1]));
+
+    // Three equal tiles in a row with the fovea over the first
+    RayBudgetTileStats row[3] = { dim, dim, dim };
+    settings = Settings(5.0 * TilePixels);
+    settings.foveaX = 1.0f / 6.0f;
+    allocation = AllocateRayBudget(3, 1, row, settings);
+    CHECK(RayBudgetLightSamples(allocation.tiles[0]) >= RayBudgetLightSamples(allocation.tiles[1]));
+    CHECK(RayBudgetLightSamples(allocation.tiles[1]) >= RayBudgetLightSamples(allocation.tiles[2]));
+    CHECK(RayBudgetLightSamples(allocation.tiles[0]) > RayBudgetLightSamples(allocation.tiles[2]));
+}
+
+int main()
+{
+    TestBudgetConservation();
+    TestTileMinimum();
+    TestZeroVariance();
+    TestImportance();
+    return CpuTestResult("RayBudgetTests");
+}
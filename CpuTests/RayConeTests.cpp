@@ -0,0 +1,139 @@
+/************************************************************************************
+Filename    :   RayConeTests.cpp
+Content     :   Ray cone footprints and mip selection against values worked out by hand
+Created     :   2024
+
+Copyright   :   Copyright (c) Xavier Knoll 2024 All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*************************************************************************************/
+// Most cases put a 1024 x 1024 texture once over a world space unit square, so a cone
+// 1/1024 wide covers one texel head on and each doubling of its width is one mip.
+
+#include "RayCone.h"
+#include "CpuTest.h"
+
+static const FovTangents SquareFov = { 1.0f, 1.0f, 1.0f, 1.0f };
+
+// The projectionToWorld of a camera at the origin looking down -z with all four tangents 1:
+// screen (sx, sy) unprojects to (sx, sy, -1).
+static const float SquareProjectionToWorld[16] = {
+    1, 0, 0, 0,
+    0, 1, 0, 0,
+    0, 0, 0, -1,
+    0, 0, 0, 1 };
+
+static void TestPropagate()
+{
+    RayCone cone(0.1f, 0.01f);
+    RayCone far = cone.Propagate(10.0f);
+    CHECK_NEAR(far.width, 0.2f, 1e-6f);
+    CHECK_NEAR(far.spreadAngle, 0.01f, 0.0f);
+    CHECK_NEAR(RayCone(0.0f, 0.002f).Propagate(0.0f).width, 0.0f, 0.0f);
+}
+
+// With unit tangents and an even square image, the centre pixel is half a pixel right of and
+// below the axis and the next row a pixel and a half below, at tangents of 1/h and 3/h.
+static double ExpectedSpreadAngle(uint32_t height)
+{
+    double x = 1.0 / height, y0 = 1.0 / height, y1 = 3.0 / height;
+    double dot = x * x + y0 * y1 + 1.0;
+    double cross = sqrt((y1 - y0) * (y1 - y0) * (1.0 + x * x));
+    return atan2(cross, dot);
+}
+
+static void TestPixelSpreadAngle()
+{
+    const uint32_t heights[] = { 2, 480, 1000, 1600 };
+    for (uint32_t height : heights)
+    {
+        double expected = ExpectedSpreadAngle(height);
+        CameraRayFrustum frustum = MakeCameraRayFrustum(SquareFov, Quat(), height, height);
+        CHECK_NEAR(PixelSpreadAngle(frustum, height, height), expected, expected * 1e-4);
+        CHECK_NEAR(PixelSpreadAngle(SquareProjectionToWorld, Float3(), height, height), expected, expected * 1e-4);
+    }
+}
+
+static void TestTriangleTexelArea()
+{
+    TexCoord t0 = { 0.0f, 0.0f }, t1 = { 1.0f, 0.0f }, t2 = { 0.0f, 1.0f };
+    CHECK_NEAR(TriangleTexelArea(t0, t1, t2, 256, 128), 256.0f * 128.0f, 0.0f);
+    // Winding does not change the area
+    CHECK_NEAR(TriangleTexelArea(t0, t2, t1, 256, 128), 256.0f * 128.0f, 0.0f);
+    // A UV scale of 4 repeats the texture 4 times each way
+    TexCoord s1 = { 4.0f, 0.0f }, s2 = { 0.0f, 4.0f };
+    CHECK_NEAR(TriangleTexelArea(t0, s1, s2, 64, 64), 64.0f * 64.0f * 16.0f, 0.0f);
+    CHECK_NEAR(TriangleTexelArea(t0, t1, t1, 64, 64), 0.0f, 0.0f);
+}
+
+static void TestRayConeTextureLod()
+{
+    float texelArea = 1024.0f * 1024.0f;
+    Float3 worldCross(0.0f, 0.0f, 1.0f);
+    Float3 headOn(0.0f, 0.0f, -1.0f);
+    // One texel wide, then 4 and 1/4
+    CHECK_NEAR(RayConeTextureLod(texelArea, worldCross, 1.0f / 1024.0f, headOn), 0.0f, 1e-5f);
+    CHECK_NEAR(RayConeTextureLod(texelArea, worldCross, 4.0f / 1024.0f, headOn), 2.0f, 1e-5f);
+    CHECK_NEAR(RayConeTextureLod(texelArea, worldCross, 0.25f / 1024.0f, headOn), -2.0f, 1e-5f);
+    // At 60 degrees the footprint is twice as long, one mip more
+    Float3 oblique(sinf(3.14159265f / 3.0f), 0.0f, -0.5f);
+    CHECK_NEAR(RayConeTextureLod(texelArea, worldCross, 4.0f / 1024.0f, oblique), 3.0f, 1e-4f);
+    // Only the area of the triangle matters, not its size or which side it faces
+    CHECK_NEAR(RayConeTextureLod(texelArea * 9.0f, Float3(0.0f, 0.0f, -9.0f), 4.0f / 1024.0f, headOn), 2.0f, 1e-5f);
+    // A texture at a quarter of the resolution is two mips closer to the top
+    CHECK_NEAR(RayConeTextureLod(256.0f * 256.0f, worldCross, 4.0f / 1024.0f, headOn), 0.0f, 1e-5f);
+}
+
+static void TestClampTextureLod()
+{
+    CHECK_NEAR(ClampTextureLod(5.0f, 0.0f, 11), 0.0f, 0.0f);
+    CHECK_NEAR(ClampTextureLod(-3.0f, 0.01f, 11), 0.0f, 0.0f);
+    CHECK_NEAR(ClampTextureLod(2.5f, 0.01f, 11), 2.5f, 0.0f);
+    CHECK_NEAR(ClampTextureLod(20.0f, 0.01f, 11), 10.0f, 0.0f);
+    CHECK_NEAR(ClampTextureLod(20.0f, 0.01f, 1), 0.0f, 0.0f);
+}
+
+// A primary ray straight at the textured square from distance d: the footprint is the
+// spread angle times d, so the level is the log2 of that width in texels.
+static void TestPrimaryRayMip()
+{
+    const uint32_t height = 1024;
+    CameraRayFrustum frustum = MakeCameraRayFrustum(SquareFov, Quat(), height, height);
+    float spread = PixelSpreadAngle(frustum, height, height);
+    const float distances[] = { 0.25f, 1.0f, 8.0f, 512.0f };
+    for (float distance : distances)
+    {
+        RayCone cone = RayCone(0.0f, spread).Propagate(distance);
+        float expected = log2f(spread * distance * 1024.0f);
+        float lod = RayConeTextureLod(1024.0f * 1024.0f, Float3(0.0f, 0.0f, 1.0f), cone.width, Float3(0.0f, 0.0f, -1.0f));
+        CHECK_NEAR(lod, expected, 1e-4f);
+        CHECK_NEAR(ClampTextureLod(lod, cone.width, 11), ClampF(expected, 0.0f, 10.0f), 1e-4f);
+    }
+    // Close up the texture is magnified and stays on the top mip; a pixel 2/1024 radians wide
+    // covers all 1024 texels at 512 units, the last level of the chain.
+    RayCone close = RayCone(0.0f, spread).Propagate(0.25f);
+    CHECK(ClampTextureLod(RayConeTextureLod(1024.0f * 1024.0f, Float3(0.0f, 0.0f, 1.0f), close.width, Float3(0.0f, 0.0f, -1.0f)), close.width, 11) == 0.0f);
+    RayCone far = RayCone(0.0f, spread).Propagate(512.0f);
+    CHECK_NEAR(ClampTextureLod(RayConeTextureLod(1024.0f * 1024.0f, Float3(0.0f, 0.0f, 1.0f), far.width, Float3(0.0f, 0.0f, -1.0f)), far.width, 11), 10.0f, 0.01f);
+}
+
+int main()
+{
+    TestPropagate();
+    TestPixelSpreadAngle();
+    TestTriangleTexelArea();
+    TestRayConeTextureLod();
+    TestClampTextureLod();
+    TestPrimaryRayMip();
+    return CpuTestResult("RayConeTests");
+}
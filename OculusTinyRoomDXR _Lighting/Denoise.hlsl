@@ -0,0 +1,276 @@
+//*********************************************************
+//
+// Spatiotemporal variance-guided filtering of the lighting and the reflection the inline
+// pass leaves in DenoiseSignals when g_sceneCB.denoise is set. Pass 0 reprojects every
+// pixel into the previous frame and accumulates its history and luminance moments;
+// passes 1 to DENOISE_ITERATIONS run the a-trous wavelet filter with growing steps, and
+// the last of them composes the result into RenderTarget. Denoiser.h holds the CPU
+// reference of every step.
+//
+// DenoiseSignals slices 0 and 1 hold the noisy lighting and reflection, the a-trous passes
+// then ping-pong between slices 2 and 3 and slices 0 and 1 with the variance in alpha.
+//
+//*********************************************************
+
+#include "InlineRaytracing.hlsl"
+
+// Must match Denoiser.h
+#define DENOISE_ITERATIONS 4
+#define DENOISE_MAX_HISTORY 32.0f
+#define DENOISE_COLOR_ALPHA 0.2f
+#define DENOISE_MOMENTS_ALPHA 0.2f
+#define DENOISE_PHI_DEPTH 0.1f
+#define DENOISE_PHI_NORMAL 128.0f
+#define DENOISE_PHI_LUMINANCE 4.0f
+
+#define DENOISE_SIGNALS 2       // Lighting and reflection
+
+// Root constants, set per dispatch
+cbuffer DenoiseConstants : register(b2)
+{
+    uint denoisePass;           // 0 accumulates, 1 to DENOISE_ITERATIONS filter
+    uint historyParity;         // Set of DenoiseHistory and DenoiseSurfaces this frame writes, it reads the other
+    uint historyValid;          // 0 on the first denoised frame of an eye
+};
+
+static const float c_aTrousKernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+float Luminance(float3 color)
+{
+    return dot(color, float3(0.2126f, 0.7152f, 0.0722f));
+}
+
+SurfacePayload LoadSurface(uint4 texel)
+{
+    SurfacePayload surface = { texel.x, texel.y, asfloat(texel.z), texel.w };
+    return surface;
+}
+
+uint SurfaceInstance(SurfacePayload surface)
+{
+    return surface.material >> SURFACE_INSTANCE_SHIFT;
+}
+
+// Pixel position of a world space point in this eye's previous frame, with pixel centres on
+// integers. previousHitT receives its distance from the previous eye, or -1 behind it.
+float2 ReprojectSurface(float3 world, uint2 dimensions, out float previousHitT)
+{
+    float4 clip = mul(float4(world, 1.0f), g_sceneCB.previousWorldToProjection);
+    previousHitT = -1.0f;
+    if (clip.w <= 0.0f)
+        return float2(0, 0);
+    previousHitT = length(world - g_sceneCB.previousEyePosition.xyz);
+    float2 ndc = clip.xy / clip.w;
+    return float2(ndc.x * 0.5f + 0.5f, -ndc.y * 0.5f + 0.5f) * dimensions - 0.5f;
+}
+
+bool SurfacesMatch(SurfacePayload current, float3 currentNormal, SurfacePayload previous, float expectedHitT)
+{
+    return previous.hitT >= 0.0f && SurfaceInstance(previous) == SurfaceInstance(current) &&
+        dot(UnpackNormalOctahedral(previous.packedNormal), currentNormal) >= 0.9f &&
+        abs(previous.hitT - expectedHitT) <= DENOISE_PHI_DEPTH * expectedHitT;
+}
+
+// Depth, normal and instance part of the edge stopping weight of a neighbour separation pixels away.
+float GeometryWeight(SurfacePayload p, float3 pNormal, SurfacePayload q, float separation)
+{
+    if (q.hitT < 0.0f || SurfaceInstance(q) != SurfaceInstance(p))
+        return 0.0f;
+    float depth = abs(p.hitT - q.hitT) / (DENOISE_PHI_DEPTH * p.hitT * separation + 1e-4f);
+    return exp(-depth) * pow(saturate(dot(pNormal, UnpackNormalOctahedral(q.packedNormal))), DENOISE_PHI_NORMAL);
+}
+
+void TemporalPass(uint2 index, uint2 dimensions, SurfacePayload surface, float3 normal)
+{
+    uint current = historyParity * 3;
+    uint previous = (1 - historyParity) * 3;
+    DenoiseSurfaces[uint3(index, historyParity)] = uint4(surface.packedAlbedo, surface.packedNormal, asuint(surface.hitT), surface.material);
+    if (surface.hitT < 0.0f)
+    {
+        for (uint s = 0; s < DENOISE_SIGNALS; s++)
+        {
+            DenoiseHistory[uint3(index, current + s)] = float4(0, 0, 0, 0);
+            DenoiseSignals[uint3(index, 2 + s)] = float4(0, 0, 0, 0);
+        }
+        DenoiseHistory[uint3(index, current + 2)] = float4(0, 0, 0, 0);
+        return;
+    }
+
+    float3 origin;
+    float3 direction;
+    GenerateCameraRay(index, origin, direction);
+    float previousHitT;
+    float2 previousPixel = ReprojectSurface(origin + direction * surface.hitT, dimensions, previousHitT);
+
+    // Bilinear taps around the previous position, keeping those on the same surface
+    float3 previousColor[DENOISE_SIGNALS] = { float3(0, 0, 0), float3(0, 0, 0) };
+    float4 previousMoments = float4(0, 0, 0, 0);    // First and second moment of each signal's luminance
+    float previousLength = 0.0f;
+    float weightSum = 0.0f;
+    if (historyValid && previousHitT >= 0.0f)
+    {
+        int2 base = int2(floor(previousPixel));
+        float2 f = previousPixel - base;
+        for (uint tap = 0; tap < 4; tap++)
+        {
+            int2 offset = int2(tap & 1, tap >> 1);
+            int2 tapPixel = base + offset;
+            if (any(tapPixel < 0) || any(tapPixel >= int2(dimensions)))
+                continue;
+            float2 bilinear = lerp(1.0f - f, f, float2(offset));
+            float w = bilinear.x * bilinear.y;
+            float4 lightingHistory = DenoiseHistory[uint3(tapPixel, previous)];
+            if (w <= 0.0f || lightingHistory.a <= 0.0f ||
+                !SurfacesMatch(surface, normal, LoadSurface(DenoiseSurfaces[uint3(tapPixel, 1 - historyParity)]), previousHitT))
+                continue;
+            previousColor[0] += w * lightingHistory.rgb;
+            previousColor[1] += w * DenoiseHistory[uint3(tapPixel, previous + 1)].rgb;
+            previousMoments += w * DenoiseHistory[uint3(tapPixel, previous + 2)];
+            previousLength += w * lightingHistory.a;
+            weightSum += w;
+        }
+    }
+
+    bool valid = weightSum > 0.01f;
+    if (valid)
+    {
+        previousColor[0] /= weightSum;
+        previousColor[1] /= weightSum;
+        previousMoments /= weightSum;
+        previousLength /= weightSum;
+    }
+    float historyLength = valid ? min(previousLength + 1.0f, DENOISE_MAX_HISTORY) : 1.0f;
+    float colorAlpha = valid ? max(1.0f / historyLength, DENOISE_COLOR_ALPHA) : 1.0f;
+    float momentsAlpha = valid ? max(1.0f / historyLength, DENOISE_MOMENTS_ALPHA) : 1.0f;
+
+    float4 moments = float4(0, 0, 0, 0);
+    float3 color[DENOISE_SIGNALS];
+    for (uint s = 0; s < DENOISE_SIGNALS; s++)
+    {
+        float3 noisy = DenoiseSignals[uint3(index, s)].rgb;
+        float luminance = Luminance(noisy);
+        float2 signalMoments = lerp(float2(previousMoments[2 * s], previousMoments[2 * s + 1]), float2(luminance, luminance * luminance), momentsAlpha);
+        moments[2 * s] = signalMoments.x;
+        moments[2 * s + 1] = signalMoments.y;
+        color[s] = lerp(previousColor[s], noisy, colorAlpha);
+        DenoiseHistory[uint3(index, current + s)] = float4(color[s], historyLength);
+    }
+    DenoiseHistory[uint3(index, current + 2)] = moments;
+
+    float2 variance = max(float2(moments.y - moments.x * moments.x, moments.w - moments.z * moments.z), 0.0f);
+    if (historyLength < 4.0f)
+    {
+        // Too little history: take the moments of the noisy neighbourhood on the same surface
+        // and boost them, since they are missing the variance between frames
+        float2 m1 = float2(0, 0);
+        float2 m2 = float2(0, 0);
+        float neighbourWeights = 0.0f;
+        for (int dy = -2; dy <= 2; dy++)
+        {
+            for (int dx = -2; dx <= 2; dx++)
+            {
+                int2 q = int2(index) + int2(dx, dy);
+                if (any(q < 0) || any(q >= int2(dimensions)))
+                    continue;
+                float w = (dx == 0 && dy == 0) ? 1.0f : GeometryWeight(surface, normal, LoadSurface(GBuffer[q]), length(float2(dx, dy)));
+                float2 l = float2(Luminance(DenoiseSignals[uint3(q, 0)].rgb), Luminance(DenoiseSignals[uint3(q, 1)].rgb));
+                m1 += l * w;
+                m2 += l * l * w;
+                neighbourWeights += w;
+            }
+        }
+        m1 /= neighbourWeights;
+        m2 /= neighbourWeights;
+        variance = max(m2 - m1 * m1, 0.0f) * (4.0f / historyLength);
+    }
+
+    DenoiseSignals[uint3(index, 2)] = float4(color[0], variance.x);
+    DenoiseSignals[uint3(index, 3)] = float4(color[1], variance.y);
+}
+
+// A 5x5 B3 spline kernel with 2^(denoisePass - 1) pixels between its taps.
+void ATrousPass(uint2 index, uint2 dimensions, SurfacePayload surface, float3 normal)
+{
+    uint source = (denoisePass & 1) ? 2 : 0;
+    uint target = 2 - source;
+    int step = 1 << (denoisePass - 1);
+    bool last = denoisePass == DENOISE_ITERATIONS;
+    if (surface.hitT < 0.0f)
+    {
+        if (last)
+            RenderTarget[index] = float4(0, 0, 0, 1);
+        else
+        {
+            DenoiseSignals[uint3(index, target)] = float4(0, 0, 0, 0);
+            DenoiseSignals[uint3(index, target + 1)] = float4(0, 0, 0, 0);
+        }
+        return;
+    }
+
+    // The variance steering the luminance weight is blurred over 3x3 first
+    float2 blurredVariance = float2(0, 0);
+    for (int vy = -1; vy <= 1; vy++)
+    {
+        for (int vx = -1; vx <= 1; vx++)
+        {
+            uint2 q = uint2(clamp(int2(index) + int2(vx, vy), int2(0, 0), int2(dimensions) - 1));
+            float w = (vx == 0 ? 0.5f : 0.25f) * (vy == 0 ? 0.5f : 0.25f);
+            blurredVariance += w * float2(DenoiseSignals[uint3(q, source)].a, DenoiseSignals[uint3(q, source + 1)].a);
+        }
+    }
+    float2 luminanceScale = DENOISE_PHI_LUMINANCE * sqrt(max(blurredVariance, 0.0f)) + 1e-10f;
+    float4 centre[DENOISE_SIGNALS] = { DenoiseSignals[uint3(index, source)], DenoiseSignals[uint3(index, source + 1)] };
+    float2 luminance = float2(Luminance(centre[0].rgb), Luminance(centre[1].rgb));
+
+    float3 sum[DENOISE_SIGNALS] = { float3(0, 0, 0), float3(0, 0, 0) };
+    float2 varianceSum = float2(0, 0);
+    float2 weightSum = float2(0, 0);
+    for (int dy = -2; dy <= 2; dy++)
+    {
+        for (int dx = -2; dx <= 2; dx++)
+        {
+            int2 q = int2(index) + int2(dx, dy) * step;
+            if (any(q < 0) || any(q >= int2(dimensions)))
+                continue;
+            float4 tap[DENOISE_SIGNALS] = { DenoiseSignals[uint3(q, source)], DenoiseSignals[uint3(q, source + 1)] };
+            float2 w = c_aTrousKernel[abs(dx)] * c_aTrousKernel[abs(dy)];
+            if (dx != 0 || dy != 0)
+            {
+                w *= GeometryWeight(surface, normal, LoadSurface(GBuffer[q]), step * length(float2(dx, dy)));
+                w *= exp(-abs(luminance - float2(Luminance(tap[0].rgb), Luminance(tap[1].rgb))) / luminanceScale);
+            }
+            sum[0] += w.x * tap[0].rgb;
+            sum[1] += w.y * tap[1].rgb;
+            varianceSum += w * w * float2(tap[0].a, tap[1].a);
+            weightSum += w;
+        }
+    }
+    float3 lighting = sum[0] / weightSum.x;
+    float3 reflected = sum[1] / weightSum.y;
+    float2 variance = varianceSum / (weightSum * weightSum);
+
+    if (last)
+        RenderTarget[index] = float4(ComposeSurface(surface, lighting, reflected), 1.0f);
+    else
+    {
+        DenoiseSignals[uint3(index, target)] = float4(lighting, variance.x);
+        DenoiseSignals[uint3(index, target + 1)] = float4(reflected, variance.y);
+    }
+}
+
+[numthreads(8, 8, 1)]
+void MyDenoiseShader(uint3 dispatchThreadId : SV_DispatchThreadID)
+{
+    uint2 dimensions;
+    GBuffer.GetDimensions(dimensions.x, dimensions.y);
+    uint2 index = dispatchThreadId.xy;
+    if (index.x >= dimensions.x || index.y >= dimensions.y)
+        return;
+
+    SurfacePayload surface = LoadSurface(GBuffer[index]);
+    float3 normal = UnpackNormalOctahedral(surface.packedNormal);
+    if (denoisePass == 0)
+        TemporalPass(index, dimensions, surface, normal);
+    else
+        ATrousPass(index, dimensions, surface, normal);
+}
@@ -0,0 +1,88 @@
+//*********************************************************
+//
+// Joint bilateral upsample of the reduced resolution secondary rays: with a
+// secondaryScale above 1 MyInlineShadingShader traces the shadow and reflection rays
+// of one G-buffer pixel per block and leaves the lighting and reflection it found in
+// LowResLighting and LowResReflection. Every full resolution pixel then blends the
+// four nearest of those, weighting the bilinear weights by how close their source
+// pixel's ray traced depth and normal are to its own, and composes its own albedo
+// and reflectivity over the result, or hands it to Denoise.hlsl.
+//
+//*********************************************************
+
+#include "InlineRaytracing.hlsl"
+
+#define UPSAMPLE_DEPTH_SIGMA 0.05f      // Depth difference, relative to the pixel's own, over which a sample's weight falls by 1 / e
+#define UPSAMPLE_NORMAL_POWER 32.0f
+
+float UpsampleWeight(SurfacePayload surface, float3 normal, SurfacePayload source)
+{
+    if (source.hitT < 0.0f || (source.material & SURFACE_UNLIT) != (surface.material & SURFACE_UNLIT))
+        return 0.0f;
+    float depthWeight = exp(-abs(source.hitT - surface.hitT) / (UPSAMPLE_DEPTH_SIGMA * surface.hitT + 1e-4f));
+    float normalWeight = pow(saturate(dot(normal, UnpackNormalOctahedral(source.packedNormal))), UPSAMPLE_NORMAL_POWER);
+    return depthWeight * normalWeight;
+}
+
+[numthreads(8, 8, 1)]
+void MySecondaryUpsampleShader(uint3 dispatchThreadId : SV_DispatchThreadID)
+{
+    uint2 dimensions;
+    GBuffer.GetDimensions(dimensions.x, dimensions.y);
+    uint2 index = dispatchThreadId.xy;
+    if (index.x >= dimensions.x || index.y >= dimensions.y)
+        return;
+
+    uint4 texel = GBuffer[index];
+    SurfacePayload surface = { texel.x, texel.y, asfloat(texel.z), texel.w };
+    if (surface.hitT < 0.0f)
+    {
+        OutputSecondary(index, surface, float3(0, 0, 0), float3(0, 0, 0));
+        return;
+    }
+    float3 normal = UnpackNormalOctahedral(surface.packedNormal);
+
+    uint scale = g_sceneCB.secondaryScale;
+    uint2 lowResDimensions = (dimensions + scale - 1) / scale;
+    // Position among the low resolution samples, whose source pixels sit at the centre of their blocks
+    float2 lowResPosition = (float2(index) - float(scale / 2)) / scale;
+    int2 base = int2(floor(lowResPosition));
+    float2 f = lowResPosition - base;
+
+    float3 lighting = float3(0, 0, 0);
+    float3 reflected = float3(0, 0, 0);
+    float totalWeight = 0.0f;
+    float bestWeight = -1.0f;
+    uint2 bestSample = uint2(0, 0);
+    for (uint i = 0; i < 4; i++)
+    {
+        int2 offset = int2(i & 1, i >> 1);
+        uint2 lowResIndex = uint2(clamp(base + offset, int2(0, 0), int2(lowResDimensions) - 1));
+        uint4 sourceTexel = GBuffer[LowResSourcePixel(lowResIndex, dimensions)];
+        SurfacePayload source = { sourceTexel.x, sourceTexel.y, asfloat(sourceTexel.z), sourceTexel.w };
+        float similarity = UpsampleWeight(surface, normal, source);
+        float2 bilinear = lerp(1.0f - f, f, float2(offset));
+        float weight = bilinear.x * bilinear.y * similarity;
+        lighting += weight * LowResLighting[lowResIndex].rgb;
+        reflected += weight * LowResReflection[lowResIndex].rgb;
+        totalWeight += weight;
+        if (similarity > bestWeight)
+        {
+            bestWeight = similarity;
+            bestSample = lowResIndex;
+        }
+    }
+
+    // No neighbour shares the surface, as on thin geometry: take the one closest to it rather than bleed
+    if (totalWeight > 1e-4f)
+    {
+        lighting /= totalWeight;
+        reflected /= totalWeight;
+    }
+    else
+    {
+        lighting = LowResLighting[bestSample].rgb;
+        reflected = LowResReflection[bestSample].rgb;
+    }
+    OutputSecondary(index, surface, lighting, reflected);
+}
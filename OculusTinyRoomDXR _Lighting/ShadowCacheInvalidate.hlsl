@@ -0,0 +1,75 @@
+//*********************************************************
+//
+// Applies the shadow cache invalidations of this frame, see ShadowCache.h. One thread
+// per entry resets the counts of an entry any of them reaches, so it fills up again
+// from fresh shadow rays; its key stays, which keeps the probing chains through it
+// intact. With shadowCacheClear set every entry is freed instead.
+//
+//*********************************************************
+
+#include "InlineRaytracing.hlsl"
+
+// Slab test of the segment from a to b against a box.
+bool SegmentOverlapsAabb(float3 a, float3 b, float3 lo, float3 hi)
+{
+    float t0 = 0.0f, t1 = 1.0f;
+    float3 d = b - a;
+    for (uint axis = 0; axis < 3; axis++)
+    {
+        if (abs(d[axis]) < 1e-8f)
+        {
+            if (a[axis] < lo[axis] || a[axis] > hi[axis])
+                return false;
+            continue;
+        }
+        float inv = 1.0f / d[axis];
+        float tNear = (lo[axis] - a[axis]) * inv, tFar = (hi[axis] - a[axis]) * inv;
+        t0 = max(t0, min(tNear, tFar));
+        t1 = min(t1, max(tNear, tFar));
+        if (t0 > t1)
+            return false;
+    }
+    return true;
+}
+
+bool ShadowCacheInvalidates(ShadowCacheInvalidation invalidation, ShadowCacheEntry entry)
+{
+    uint light = entry.lightFace >> 3;
+    if (invalidation.light != SHADOW_CACHE_ANY_LIGHT)
+        return light == invalidation.light;
+    if (light >= g_sceneCB.lightCount)
+        return true;
+    float cellSize = g_sceneCB.shadowCacheCellSize;
+    float3 centre = (float3(entry.cell) + 0.5f) * cellSize;
+    float grow = 0.866025f * cellSize + Lights[light].radius;
+    return SegmentOverlapsAabb(centre, Lights[light].position, invalidation.lo - grow, invalidation.hi + grow);
+}
+
+[numthreads(64, 1, 1)]
+void MyShadowCacheInvalidateShader(uint3 dispatchThreadId : SV_DispatchThreadID)
+{
+    uint index = dispatchThreadId.x;
+    if (index >= SHADOW_CACHE_CAPACITY)
+        return;
+
+    if (g_sceneCB.shadowCacheClear)
+    {
+        ShadowCache[index].key = 0;
+        ShadowCache[index].visible = 0;
+        ShadowCache[index].samples = 0;
+        return;
+    }
+
+    ShadowCacheEntry entry = ShadowCache[index];
+    if (entry.key == 0 || entry.samples == 0)
+        return;
+    for (uint i = 0; i < g_sceneCB.shadowInvalidationCount; i++)
+    {
+        if (ShadowCacheInvalidates(ShadowInvalidations[i], entry))
+        {
+            ShadowCache[index].visible = 0;
+            ShadowCache[index].samples = 0;
+            return;
+        }
+    }
+}
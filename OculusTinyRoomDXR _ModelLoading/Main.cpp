@@ -30,6 +30,7 @@ limitations under the License.
 #include "OVR_CAPI_D3D.h"
 #include "Win32_d3dx12.h"
 #include "Win32_DirectX12AppUtil.h"
+#include "HmdSession.h"
 
 
 //------------------------------------------------------------
@@ -37,7 +38,7 @@ limitations under the License.
 // needed for D3D12 rendering.
 struct OculusEyeTexture
 {
-    ovrSession               Session;
+    HmdSession*              Session;
     ovrTextureSwapChain      TextureChain;
     ovrTextureSwapChain      DepthTextureChain;
 
@@ -54,7 +55,7 @@ struct OculusEyeTexture
     {
     }
 
-    bool Init(ovrSession session, int sizeW, int sizeH, bool createDepth)
+    bool Init(HmdSession* session, int sizeW, int sizeH, bool createDepth)
     {
         Session = session;
 
@@ -70,17 +71,17 @@ struct OculusEyeTexture
         desc.StaticImage = ovrFalse;
         desc.BindFlags = ovrTextureBind_DX_RenderTarget;
 
-        ovrResult result = ovr_CreateTextureSwapChainDX(session, DIRECTX.CommandQueue, &desc, &TextureChain);
+        ovrResult result = session->CreateTextureSwapChainDX(DIRECTX.CommandQueue, &desc, &TextureChain);
         if (!OVR_SUCCESS(result))
             return false;
 
         int textureCount = 0;
-        ovr_GetTextureSwapChainLength(Session, TextureChain, &textureCount);
+        Session->GetTextureSwapChainLength(TextureChain, &textureCount);
         TexRtv.resize(textureCount);
         TexResource.resize(textureCount);
         for (int i = 0; i < textureCount; ++i)
         {
-            result = ovr_GetTextureSwapChainBufferDX(Session, TextureChain, i, IID_PPV_ARGS(&TexResource[i]));
+            result = Session->GetTextureSwapChainBufferDX(TextureChain, i, IID_PPV_ARGS(&TexResource[i]));
             if (!OVR_SUCCESS(result))
                 return false;
             TexResource[i]->SetName(L"EyeColorRes");
@@ -114,7 +115,7 @@ struct OculusEyeTexture
             depthDesc.StaticImage = ovrFalse;
             depthDesc.BindFlags = ovrTextureBind_DX_DepthStencil;
 
-            result = ovr_CreateTextureSwapChainDX(session, DIRECTX.CommandQueue, &depthDesc, &DepthTextureChain);
+            result = session->CreateTextureSwapChainDX(DIRECTX.CommandQueue, &depthDesc, &DepthTextureChain);
             if (!OVR_SUCCESS(result))
                 return false;
 
@@ -122,7 +123,7 @@ struct OculusEyeTexture
             DepthTexDsv.resize(textureCount);
             for (int i = 0; i < textureCount; i++)
             {
-                result = ovr_GetTextureSwapChainBufferDX(Session, DepthTextureChain, i, IID_PPV_ARGS(&DepthTex[i]));
+                result = Session->GetTextureSwapChainBufferDX(DepthTextureChain, i, IID_PPV_ARGS(&DepthTex[i]));
                 if (!OVR_SUCCESS(result))
                     return false;
                 DepthTex[i]->SetName(L"EyeDepthRes");
@@ -155,7 +156,7 @@ struct OculusEyeTexture
                 Release(TexResource[i]);
             }
 
-            ovr_DestroyTextureSwapChain(Session, TextureChain);
+            Session->DestroyTextureSwapChain(TextureChain);
         }
 
         if (DepthTextureChain)
@@ -170,14 +171,14 @@ struct OculusEyeTexture
                 Release(DepthTex[i]);
             }
 
-            ovr_DestroyTextureSwapChain(Session, DepthTextureChain);
+            Session->DestroyTextureSwapChain(DepthTextureChain);
         }
     }
 
     D3D12_CPU_DESCRIPTOR_HANDLE GetRtv()
     {
         int index = 0;
-        ovr_GetTextureSwapChainCurrentIndex(Session, TextureChain, &index);
+        Session->GetTextureSwapChainCurrentIndex(TextureChain, &index);
         return TexRtv[index];
     }
 
@@ -186,11 +187,11 @@ struct OculusEyeTexture
         int index = 0;
         if (DepthTextureChain)
         {
-            ovr_GetTextureSwapChainCurrentIndex(Session, DepthTextureChain, &index);
+            Session->GetTextureSwapChainCurrentIndex(DepthTextureChain, &index);
         }
         else
         {
-            ovr_GetTextureSwapChainCurrentIndex(Session, TextureChain, &index);
+            Session->GetTextureSwapChainCurrentIndex(TextureChain, &index);
         }
         return DepthTexDsv[index];
     }
@@ -198,7 +199,7 @@ struct OculusEyeTexture
     ID3D12Resource* GetD3DColorResource()
     {
         int index = 0;
-        ovr_GetTextureSwapChainCurrentIndex(Session, TextureChain, &index);
+        Session->GetTextureSwapChainCurrentIndex(TextureChain, &index);
         return TexResource[index];
     }
 
@@ -207,7 +208,7 @@ struct OculusEyeTexture
         if (DepthTex.size() > 0)
         {
             int index = 0;
-            ovr_GetTextureSwapChainCurrentIndex(Session, TextureChain, &index);
+            Session->GetTextureSwapChainCurrentIndex(TextureChain, &index);
             return DepthTex[index];
         }
         else
@@ -219,11 +220,11 @@ struct OculusEyeTexture
     // Commit changes
     void Commit()
     {
-        ovr_CommitTextureSwapChain(Session, TextureChain);
+        Session->CommitTextureSwapChain(TextureChain);
 
         if (DepthTextureChain)
         {
-            ovr_CommitTextureSwapChain(Session, DepthTextureChain);
+            Session->CommitTextureSwapChain(DepthTextureChain);
         }
     }
 };
@@ -239,27 +240,31 @@ struct SceneModel : Scene
     {
         std::vector<ModelComponent> components;
         components.push_back(ModelComponent(0.05f, -0.01f, 0.1f, -0.05f, +0.01f, -0.1f, 0xffff0000, &globalVertexBuffer));
-        models.push_back(Model(components, Material(Texture::AUTO_WHITE - 1)));
+        AddModel(Model(components, Material(Texture::AUTO_WHITE - 1)));
 
         components.clear();
         components.push_back(ModelComponent(-0.02f, -0.1f, -0.02f, 0.02f, +0.1f, 0.02f, 0xFFFFFFFF, &globalVertexBuffer));
         components.push_back(ModelComponent(-0.04f, 0.1f, -0.04f, 0.04f, +0.16f, 0.04f, 0xFFFFFFFF, &globalVertexBuffer));
-        models.push_back(Model(components, Material(Texture::AUTO_WHITE - 1)));
-        models[1].components[1].layerMask = 1;
-        models[1].components[0].layerMask = 1;
+        UINT lightModel = AddModel(Model(components, Material(Texture::AUTO_WHITE - 1)));
+        SetInstanceMask(models[lightModel].instances[1], 1);
+        SetInstanceMask(models[lightModel].instances[0], 1);
 
         Model model = AddObjModelToScene("Sponza/sponza.obj", "Sponza");
+        Util.Output("Sponza: %.2f%% of %u triangles need the any hit alpha test, %u culled as fully transparent\n",
+            100.0f * model.opacityStats.MixedFraction(), model.opacityStats.Total(), model.opacityStats.transparent);
         XMMATRIX scaleAdjust = XMMatrixScaling(0.01, 0.01, 0.01);
         model.transform = scaleAdjust;
-        models.push_back(model);
+        AddModel(model);
 
-        numInstances = ModelComponent::numInstances;
         globalVertexBuffer.InitGlobalVertexBuffers();
         globalVertexBuffer.InitGlobalBottomLevelAccelerationObject();
         BuildAccelerationStructures();
     }
 };
 
+// LibOVR, or the simulator standing in for it; MainLoop is rerun after a lost display
+static HmdSession* Hmd = nullptr;
+
 // return true to retry later (e.g. after display lost)
 static bool MainLoop(bool retryCreate)
 {
@@ -270,6 +275,9 @@ static bool MainLoop(bool retryCreate)
     Camera* mainCam = nullptr;
     ovrMirrorTextureDesc        mirrorDesc = {};
     ovrInputState inputState;
+    std::vector<InstanceHandle> props;    // Handles into modelScene, so they go with it when the display is lost
+    bool spawnHeld = false;
+    bool despawnHeld = false;
 
     int eyeMsaaRate = 4;
     DXGI_FORMAT depthFormat = DXGI_FORMAT_D32_FLOAT;
@@ -277,20 +285,19 @@ static bool MainLoop(bool retryCreate)
     long long frameIndex = 0;
     bool drawMirror = true;
 
-    ovrSession session;
     ovrGraphicsLuid luid;
-    ovrResult result = ovr_Create(&session, &luid);
+    ovrResult result = Hmd->Create(&luid);
     if (!OVR_SUCCESS(result))
         return retryCreate;
 
-    ovrHmdDesc hmdDesc = ovr_GetHmdDesc(session);
+    ovrHmdDesc hmdDesc = Hmd->GetHmdDesc();
 
     ovrTrackingOrigin origin = ovrTrackingOrigin_FloorLevel;
-    ovr_SetTrackingOriginType(session, origin);
+    Hmd->SetTrackingOriginType(origin);
 
     // Setup Device and Graphics
     // Note: the mirror window can be any size, for this sample we use 1/2 the HMD resolution
-    ovrSizei idealSize = ovr_GetFovTextureSize(session, (ovrEyeType)0, hmdDesc.DefaultEyeFov[0], 1.0f);
+    ovrSizei idealSize = Hmd->GetFovTextureSize((ovrEyeType)0, hmdDesc.DefaultEyeFov[0], 1.0f);
     if (!DIRECTX.InitDevice(hmdDesc.Resolution.w / 2, hmdDesc.Resolution.h / 2, reinterpret_cast<LUID*>(&luid),
         depthFormat, eyeMsaaRate, true, idealSize.w, idealSize.h))
     {
@@ -300,8 +307,8 @@ static bool MainLoop(bool retryCreate)
     {
         // Get the eye render descriptions
         ovrEyeRenderDesc eyeRenderDesc[2];
-        eyeRenderDesc[0] = ovr_GetRenderDesc(session, ovrEye_Left, hmdDesc.DefaultEyeFov[0]);
-        eyeRenderDesc[1] = ovr_GetRenderDesc(session, ovrEye_Right, hmdDesc.DefaultEyeFov[1]);
+        eyeRenderDesc[0] = Hmd->GetRenderDesc(ovrEye_Left, hmdDesc.DefaultEyeFov[0]);
+        eyeRenderDesc[1] = Hmd->GetRenderDesc(ovrEye_Right, hmdDesc.DefaultEyeFov[1]);
 
         idp = fabsf(eyeRenderDesc[0].HmdToEyePose.Position.x);
     }
@@ -310,9 +317,9 @@ static bool MainLoop(bool retryCreate)
 
     for (int eye = 0; eye < 2; ++eye)
     {
-        ovrSizei idealSize = ovr_GetFovTextureSize(session, (ovrEyeType)eye, hmdDesc.DefaultEyeFov[eye], 1.0f);
+        ovrSizei idealSize = Hmd->GetFovTextureSize((ovrEyeType)eye, hmdDesc.DefaultEyeFov[eye], 1.0f);
         pEyeRenderTexture[eye] = new OculusEyeTexture();
-        if (!pEyeRenderTexture[eye]->Init(session, idealSize.w, idealSize.h, true))
+        if (!pEyeRenderTexture[eye]->Init(Hmd, idealSize.w, idealSize.h, true))
         {
             if (retryCreate) goto Done;
             FATALERROR("Failed to create eye texture.");
@@ -335,7 +342,7 @@ static bool MainLoop(bool retryCreate)
     mirrorDesc.Height = DIRECTX.WinSizeH;
     mirrorDesc.MiscFlags = ovrTextureMisc_None;
     mirrorDesc.MirrorOptions = ovrMirrorOption_Default;
-    result = ovr_CreateMirrorTextureWithOptionsDX(session, DIRECTX.CommandQueue, &mirrorDesc, &mirrorTexture);
+    result = Hmd->CreateMirrorTextureWithOptionsDX(DIRECTX.CommandQueue, &mirrorDesc, &mirrorTexture);
 
     if (!OVR_SUCCESS(result))
     {
@@ -357,11 +364,14 @@ static bool MainLoop(bool retryCreate)
     modelScene->InitTexturesToTexArray();
 
 
+    bool traceKeyDown = false;
+    bool benchmarkHeld = false;
+
     // Main loop
     while (DIRECTX.HandleMessages())
     {
         ovrSessionStatus sessionStatus;
-        ovr_GetSessionStatus(session, &sessionStatus);
+        Hmd->GetSessionStatus(&sessionStatus);
         if (sessionStatus.ShouldQuit)
         {
             // Because the application is requested to quit, should not request retry
@@ -369,12 +379,15 @@ static bool MainLoop(bool retryCreate)
             break;
         }
         if (sessionStatus.ShouldRecenter)
-            ovr_RecenterTrackingOrigin(session);
+            Hmd->RecenterTrackingOrigin();
 
         if (sessionStatus.IsVisible)
         {
-            result = ovr_WaitToBeginFrame(session, frameIndex);
-            result = ovr_BeginFrame(session, frameIndex);
+            {
+                PROFILE_ZONE("ovr_WaitToBeginFrame");
+                result = Hmd->WaitToBeginFrame(frameIndex);
+            }
+            result = Hmd->BeginFrame(frameIndex);
 
             XMVECTOR forward = XMVector3Rotate(XMVectorSet(0, 0, -0.05f, 0), mainCam->GetRotVec());
             XMVECTOR right = XMVector3Rotate(XMVectorSet(0.05f, 0, 0, 0), mainCam->GetRotVec());
@@ -386,7 +399,10 @@ static bool MainLoop(bool retryCreate)
             if (DIRECTX.Key['A'])                            mainCamPos = XMVectorSubtract(mainCamPos, right);
 
             
-            result = ovr_GetInputState(session, ovrControllerType_Touch, &inputState);
+            {
+                PROFILE_ZONE("ovr_GetInputState");
+                result = Hmd->GetInputState(ovrControllerType_Touch, &inputState);
+            }
             float thumbstickX = inputState.Thumbstick[ovrHand_Left].x;
             float thumbstickY = inputState.Thumbstick[ovrHand_Left].y;
             XMVECTOR horMovement = XMVectorAdd(XMVectorScale(forward, thumbstickY), XMVectorScale(right, thumbstickX));
@@ -417,19 +433,23 @@ static bool MainLoop(bool retryCreate)
 
             // Call ovr_GetRenderDesc each frame to get the ovrEyeRenderDesc, as the returned values (e.g. HmdToEyePose) may change at runtime.
             ovrEyeRenderDesc eyeRenderDesc[2];
-            eyeRenderDesc[0] = ovr_GetRenderDesc(session, ovrEye_Left, hmdDesc.DefaultEyeFov[0]);
-            eyeRenderDesc[1] = ovr_GetRenderDesc(session, ovrEye_Right, hmdDesc.DefaultEyeFov[1]);
+            eyeRenderDesc[0] = Hmd->GetRenderDesc(ovrEye_Left, hmdDesc.DefaultEyeFov[0]);
+            eyeRenderDesc[1] = Hmd->GetRenderDesc(ovrEye_Right, hmdDesc.DefaultEyeFov[1]);
 
             // Get both eye poses simultaneously, with IPD offset already included.
             ovrPosef EyeRenderPose[2];
             ovrPosef HmdToEyePose[2] = { eyeRenderDesc[0].HmdToEyePose, eyeRenderDesc[1].HmdToEyePose };
 
             double sensorSampleTime;    // sensorSampleTime is fed into the layer later
-            ovr_GetEyePoses(session, frameIndex, ovrTrue, HmdToEyePose, EyeRenderPose, &sensorSampleTime);
+            {
+                PROFILE_ZONE("ovr_GetEyePoses");
+                Hmd->GetEyePoses(frameIndex, ovrTrue, HmdToEyePose, EyeRenderPose, &sensorSampleTime);
+            }
 
-            ovrTrackingState ts = ovr_GetTrackingState(session, ovr_GetTimeInSeconds(), ovrTrue);
+            ovrTrackingState ts = Hmd->GetTrackingState(Hmd->GetTimeInSeconds(), ovrTrue);
 
             if (ts.StatusFlags & (ovrStatus_OrientationTracked | ovrStatus_PositionTracked)) {
+                PROFILE_ZONE("Controller poses");
                 ovrPosef leftControllerPose = ts.HandPoses[ovrHand_Left].ThePose;
                 ovrPosef rightControllerPose = ts.HandPoses[ovrHand_Right].ThePose;
 
@@ -470,17 +490,59 @@ static bool MainLoop(bool retryCreate)
 
                 //modelScene->UpdateInstanceTransform(1, transformationMatrix);
                 modelScene->UpdateModelTransformation(1, transformationMatrix);
-                modelScene->lights[0].position = posVec;
+                modelScene->SetLightPosition(0, posVec);
+
+                // Drop a prop at the right hand with A (or P), remove the most recent one with B (or O)
+                bool spawnDown = (inputState.Buttons & ovrButton_A) || DIRECTX.Key['P'];
+                bool despawnDown = (inputState.Buttons & ovrButton_B) || DIRECTX.Key['O'];
+                if (spawnDown && !spawnHeld && modelScene->instances.LiveCount() < MAX_INSTANCES)
+                {
+                    ModelComponent prop(-0.05f, -0.05f, -0.05f, 0.05f, 0.05f, 0.05f, 0xff40a040, &modelScene->globalVertexBuffer);
+                    prop.material = Material(Texture::AUTO_WHITE - 1);
+                    prop.transform = XMMatrixMultiply(prop.transform, XMMatrixTranslationFromVector(posVec));
+                    props.push_back(modelScene->SpawnInstance(prop));
+                }
+                if (despawnDown && !despawnHeld && !props.empty())
+                {
+                    modelScene->DespawnInstance(props.back());
+                    props.pop_back();
+                }
+                spawnHeld = spawnDown;
+                despawnHeld = despawnDown;
             }
 
             ovrTimewarpProjectionDesc PosTimewarpProjectionDesc = {};
 
+            // Primary rays only need instances inside one of the eye frusta; the TLAS is shared by both eyes
+            EyeFrustum eyeFrusta[2];
+            for (int eye = 0; eye < 2; ++eye)
+            {
+                XMVECTOR eyeQuat = XMVectorSet(EyeRenderPose[eye].Orientation.x, EyeRenderPose[eye].Orientation.y,
+                    EyeRenderPose[eye].Orientation.z, EyeRenderPose[eye].Orientation.w);
+                XMVECTOR eyePos = XMVectorSet(EyeRenderPose[eye].Position.x, EyeRenderPose[eye].Position.y, EyeRenderPose[eye].Position.z, 0);
+                ovrFovPort fov = eyeRenderDesc[eye].Fov;
+                eyeFrusta[eye] = EyeFrustum(XMVectorAdd(mainCamPos, XMVector3Rotate(eyePos, mainCamRot)), XMQuaternionMultiply(eyeQuat, mainCamRot),
+                    fov.UpTan, fov.DownTan, fov.LeftTan, fov.RightTan);
+            }
+            modelScene->CullPrimaryLayer(eyeFrusta, 2);
+
             modelScene->UpdateInstanceDescs();
             modelScene->UpdateTLAS();
-            
+
+            // Measure the CPU scene query throughput against the current instances with Q
+            if (DIRECTX.Key['Q'] && !benchmarkHeld)
+            {
+                SceneQueryBenchmarkResult bench = BenchmarkSceneQuery(modelScene->Query(), 4096, 8);
+                Util.Output("Scene query: %.0f closest hit rays/s, %.0f any hit rays/s, %.0f sweeps/s, %.0f overlaps/s (%u threads)\n",
+                    bench.closestHitRaysPerSecond, bench.anyHitRaysPerSecond, bench.sweepsPerSecond, bench.overlapsPerSecond,
+                    modelScene->Query().threadCount);
+            }
+            benchmarkHeld = DIRECTX.Key['Q'];
+
             // Render Scene to Eye Buffers
             for (int eye = 0; eye < 2; ++eye)
             {
+                PROFILE_ZONE(eye == 0 ? "Render left eye" : "Render right eye");
                 DIRECTX.SetActiveContext(eye == 0 ? DrawContext_EyeRenderLeft : DrawContext_EyeRenderRight);
 
                 DIRECTX.SetActiveEye(eye);
@@ -514,8 +576,9 @@ static bool MainLoop(bool retryCreate)
                     p.M[0][2], p.M[1][2], p.M[2][2], p.M[3][2],
                     p.M[0][3], p.M[1][3], p.M[2][3], p.M[3][3]);
                 XMMATRIX prod = XMMatrixMultiply(view, proj);
+                FovTangents eyeFov = { eyeRenderDesc[eye].Fov.UpTan, eyeRenderDesc[eye].Fov.DownTan, eyeRenderDesc[eye].Fov.LeftTan, eyeRenderDesc[eye].Fov.RightTan };
 
-                modelScene->DoRaytracing(XMMatrixInverse(nullptr, XMMatrixTranspose(prod)), finalCam.GetPosVec());
+                modelScene->DoRaytracing(XMMatrixTranspose(prod), finalCam.GetPosVec(), finalCam.GetRotVec(), eyeFov);
                 DIRECTX.CopyRaytracingOutputToBackbuffer(pEyeRenderTexture[eye]->GetD3DColorResource(), pEyeRenderTexture[eye]->GetD3DDepthResource());
 
                 resBar = CD3DX12_RESOURCE_BARRIER::Transition(pEyeRenderTexture[eye]->GetD3DColorResource(),
@@ -558,7 +621,10 @@ static bool MainLoop(bool retryCreate)
             }
 
             ovrLayerHeader* layers = &ld.Header;
-            result = ovr_EndFrame(session, frameIndex, nullptr, &layers, 1);
+            {
+                PROFILE_ZONE("ovr_EndFrame");
+                result = Hmd->EndFrame(frameIndex, nullptr, &layers, 1);
+            }
             // exit the rendering loop if submit returns an error, will retry on ovrError_DisplayLost
             if (!OVR_SUCCESS(result))
                 goto Done;
@@ -568,13 +634,15 @@ static bool MainLoop(bool retryCreate)
 
         if (drawMirror)
         {
+            PROFILE_ZONE("Mirror blit");
             DIRECTX.SetActiveContext(DrawContext_Final);
+            D3D12GpuTimer::Scope mirrorGpuZone(DIRECTX.gpuTimer, DIRECTX.CurrentFrameResources().CommandLists[DIRECTX.ActiveContext], "Mirror copy");
 
             DIRECTX.SetViewport(0.0f, 0.0f, (float)hmdDesc.Resolution.w / 2, (float)hmdDesc.Resolution.h / 2);
 
             // Render mirror
             ID3D12Resource* mirrorTexRes = nullptr;
-            ovr_GetMirrorTextureBufferDX(session, mirrorTexture, IID_PPV_ARGS(&mirrorTexRes));
+            Hmd->GetMirrorTextureBufferDX(mirrorTexture, IID_PPV_ARGS(&mirrorTexRes));
 
             //DIRECTX.SetAndClearRenderTarget(DIRECTX.CurrentFrameResources().SwapChainRtvHandle, nullptr, 1.0f, 0.5f, 0.0f, 1.0f);
 
@@ -609,6 +677,13 @@ static bool MainLoop(bool retryCreate)
         }
 
         DIRECTX.SubmitCommandListAndPresent(drawMirror);
+        PROFILE_FRAME_END();
+
+        // T prints the GPU zones, and with the CPU profiler compiled in writes its last few seconds to
+        // frame_trace.json for chrome://tracing
+        if (DIRECTX.Key['T'] && !traceKeyDown)
+            ReportFrameProfile("frame_trace.json");
+        traceKeyDown = DIRECTX.Key['T'];
     }
 
     // Release resources
@@ -616,31 +691,31 @@ Done:
     delete mainCam;
     delete modelScene;
     if (mirrorTexture)
-        ovr_DestroyMirrorTexture(session, mirrorTexture);
+        Hmd->DestroyMirrorTexture(mirrorTexture);
 
     for (int eye = 0; eye < 2; ++eye)
     {
         delete pEyeRenderTexture[eye];
     }
     DIRECTX.ReleaseDevice();
-    ovr_Destroy(session);
+    Hmd->Destroy();
 
     // Retry on ovrError_DisplayLost
     return retryCreate || (result == ovrError_DisplayLost);
 }
 
 //-------------------------------------------------------------------------------------
-int WINAPI WinMain(HINSTANCE hinst, HINSTANCE, LPSTR, int)
+int WINAPI WinMain(HINSTANCE hinst, HINSTANCE, LPSTR cmdLine, int)
 {
-    // Initializes LibOVR, and the Rift
-    ovrInitParams initParams = { ovrInit_RequestVersion | ovrInit_FocusAware, OVR_MINOR_VERSION, NULL, 0, 0 };
-    ovrResult result = ovr_Initialize(&initParams);
-    VALIDATE(OVR_SUCCESS(result), "Failed to initialize libOVR.");
+    // Initializes LibOVR and the Rift, or with -simulate[=script] a headless stand-in for them
+    Hmd = CreateHmdSession(cmdLine);
+    VALIDATE(Hmd->Initialize(), "Failed to initialize libOVR.");
 
     VALIDATE(DIRECTX.InitWindow(hinst, L"Oculus Room Tiny (DX12)"), "Failed to open window.");
 
     DIRECTX.Run(MainLoop);
 
-    ovr_Shutdown();
+    Hmd->Shutdown();
+    delete Hmd;
     return(0);
 }
@@ -0,0 +1,78 @@
+//*********************************************************
+//
+// Second half of an irradiance probe update, see IrradianceProbes.h. One thread per
+// texel of an updated probe's visibility tile, and of its smaller irradiance tile,
+// weighs this frame's rays by how closely they point along the texel's direction and
+// blends the result into the atlas. Border texels work out the value of the interior
+// texel they mirror instead of copying it, so no thread waits on another.
+//
+//*********************************************************
+
+#include "InlineRaytracing.hlsl"
+
+#define PROBE_TILE_SIZE (PROBE_VISIBILITY_TEXELS + 2)
+
+// Interior texel a texel of a tile stands for, see ProbeBorderSource in IrradianceProbes.h.
+uint2 ProbeBorderSource(uint2 texel, uint interiorTexels)
+{
+    uint last = interiorTexels + 1;
+    bool borderX = texel.x == 0 || texel.x == last;
+    bool borderY = texel.y == 0 || texel.y == last;
+    if (borderX && borderY)
+        return uint2(texel.x == 0 ? interiorTexels : 1, texel.y == 0 ? interiorTexels : 1);
+    if (borderY)
+        return uint2(last - texel.x, texel.y == 0 ? 1 : interiorTexels);
+    if (borderX)
+        return uint2(texel.x == 0 ? 1 : interiorTexels, last - texel.y);
+    return texel;
+}
+
+float3 ProbeTexelDirection(uint2 texel, uint interiorTexels)
+{
+    float2 source = float2(ProbeBorderSource(texel, interiorTexels));
+    return OctahedralDecode((source - 0.5f) / interiorTexels * 2.0f - 1.0f);
+}
+
+[numthreads(8, 8, 1)]
+void MyProbeBlendShader(uint3 dispatchThreadId : SV_DispatchThreadID)
+{
+    uint2 tileTexel = uint2(dispatchThreadId.x, dispatchThreadId.y % PROBE_TILE_SIZE);
+    uint slot = dispatchThreadId.y / PROBE_TILE_SIZE;
+    if (slot >= g_sceneCB.probeUpdateCount)
+        return;
+    uint3 coords = ProbeCoords((g_sceneCB.probeUpdateOffset + slot) % ProbeCount());
+    float hysteresis = slot < g_sceneCB.probeFreshCount ? 0.0f : g_sceneCB.probeHysteresis;
+
+    bool irradianceTexel = tileTexel.x < PROBE_IRRADIANCE_TEXELS + 2 && tileTexel.y < PROBE_IRRADIANCE_TEXELS + 2;
+    float3 irradianceDirection = ProbeTexelDirection(tileTexel, PROBE_IRRADIANCE_TEXELS);
+    float3 visibilityDirection = ProbeTexelDirection(tileTexel, PROBE_VISIBILITY_TEXELS);
+    float3 irradiance = float3(0, 0, 0);
+    float irradianceWeight = 0.0f;
+    float2 moments = float2(0, 0);
+    float visibilityWeight = 0.0f;
+    for (uint ray = 0; ray < PROBE_RAYS; ray++)
+    {
+        float4 rayResult = ProbeRays[uint2(ray, slot)];
+        float3 direction = ProbeRayDirection(ray);
+        float cosine = max(0.0f, dot(irradianceDirection, direction));
+        irradiance += rayResult.rgb * cosine;
+        irradianceWeight += cosine;
+        float lobe = pow(max(0.0f, dot(visibilityDirection, direction)), PROBE_VISIBILITY_SHARPNESS);
+        float rayDistance = min(rayResult.w, g_sceneCB.probeSpacing.w);
+        moments += float2(rayDistance, rayDistance * rayDistance) * lobe;
+        visibilityWeight += lobe;
+    }
+
+    if (irradianceTexel)
+    {
+        uint2 texel = ProbeTileOrigin(coords, PROBE_IRRADIANCE_TEXELS) + tileTexel;
+        float3 previous = ProbeIrradiance[texel].rgb;
+        float3 blended = irradianceWeight > 1e-4f ? lerp(irradiance / irradianceWeight, previous, hysteresis) : previous;
+        ProbeIrradiance[texel] = float4(blended, 1.0f);
+    }
+    if (visibilityWeight > 1e-4f)
+    {
+        uint2 texel = ProbeTileOrigin(coords, PROBE_VISIBILITY_TEXELS) + tileTexel;
+        ProbeVisibility[texel] = lerp(moments / visibilityWeight, ProbeVisibility[texel], hysteresis);
+    }
+}
@@ -0,0 +1,47 @@
+//*********************************************************
+//
+// First half of an irradiance probe update, see IrradianceProbes.h. Each of the
+// probeUpdateCount probes from probeUpdateOffset on shoots PROBE_RAYS rays and shades
+// what they hit as a reflection would, with DirectLighting. That samples the probes in
+// turn, so every update carries the light a bounce further. ProbeBlend.hlsl then folds
+// the rays into the probes' tiles.
+//
+//*********************************************************
+
+#include "InlineRaytracing.hlsl"
+
+[numthreads(PROBE_RAYS, 1, 1)]
+void MyProbeTraceShader(uint3 dispatchThreadId : SV_DispatchThreadID)
+{
+    uint ray = dispatchThreadId.x;
+    uint slot = dispatchThreadId.y;
+    if (slot >= g_sceneCB.probeUpdateCount)
+        return;
+    uint probe = (g_sceneCB.probeUpdateOffset + slot) % ProbeCount();
+
+    RayDesc probeRay;
+    probeRay.Origin = ProbePosition(ProbeCoords(probe));
+    probeRay.Direction = ProbeRayDirection(ray);
+    probeRay.TMin = 0.0f;
+    probeRay.TMax = g_sceneCB.probeSpacing.w;
+    // Each ray stands for a 1 / PROBE_RAYS share of the sphere, so its cone is that wide
+    RayCone cone = { 0.0f, sqrt(4.0f * 3.14159265f / PROBE_RAYS) };
+    SurfacePayload surface = TraceSurface(probeRay, LAYER_REFLECT, cone);
+
+    float3 radiance = float3(0, 0, 0);
+    float hitT = probeRay.TMax;
+    if (surface.hitT >= 0.0f)
+    {
+        hitT = surface.hitT;
+        float3 lighting = float3(1.0f, 1.0f, 1.0f);
+        if (!(surface.material & SURFACE_UNLIT))
+        {
+            float visibility;
+            float3 hitPoint = probeRay.Origin + probeRay.Direction * surface.hitT;
+            lighting = DirectLighting(hitPoint, UnpackNormalOctahedral(surface.packedNormal), uint2(ray, probe), 0,
+                min(g_sceneCB.lightSamples, LIGHT_MAX_SAMPLES), visibility);
+        }
+        radiance = UnpackColorR11G11B10(surface.packedAlbedo) * lighting;
+    }
+    ProbeRays[uint2(ray, slot)] = float4(radiance, hitT);
+}
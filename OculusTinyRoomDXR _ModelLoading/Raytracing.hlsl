@@ -20,47 +20,68 @@ struct Viewport
     float bottom;
 };
 
-struct Texture
+// Everything a hit needs of its instance in one record, so it costs a single lookup by InstanceID.
+struct InstanceData
 {
-    uint width;
-    uint height;
+    uint geometryOffset;    // First index of the instance's mesh in Indices, or its first sphere in Spheres
+    uint vertexOffset;      // Added to the mesh's indices
+    uint textureId;         // Slice of g_texture
+    uint textureSize;       // Width and height of the texture in the slice, 16 bits each
+    float2 uvScale;
+    uint tint;              // RGBA8 color the texture is multiplied with
+    uint textureMipLevels;  // Levels of the slice holding the texture's own chain
 };
 
-struct VertexBufferData
-{
-    uint vertexOffset;
-    uint indexOffset;
-};
+// Material classes, one hit group record each, matching MaterialClass in Win32_DirectX12AppUtil.h.
+// An instance picks its record through InstanceContributionToHitGroupIndex.
+#define MATERIAL_CLASS_DIFFUSE 0
+#define MATERIAL_CLASS_REFLECTIVE 1
+#define MATERIAL_CLASS_ALPHA_TESTED 2
+#define MATERIAL_CLASS_PROCEDURAL 3
+#define MATERIAL_CLASS_COUNT 4
 
-struct InstanceData
-{
-    uint textureId;
-    uint vertexBufferId;
-    float u;
-    float v;
-    float3 color;
-};
+#define MATERIAL_FLAG_REFLECTIVE 1
+#define MATERIAL_FLAG_ALPHA_TESTED 2
 
-struct Light
+// Local root constants of every hit group record.
+struct MaterialConstants
 {
-    float3 position;
-    float3 color;
-    float intensity;
+    uint materialClass;
+    uint flags;
 };
 
-#define MAX_INSTANCES 400
-#define MAX_MODELS 400
-#define MAX_LIGHTS 4
-#define NUM_TEXTURES 60
+#define MAX_INSTANCES 1024
 
 struct SceneConstantBuffer
 {
-    float4x4 projectionToWorld;
+    float4 cameraCorner;        // Ray through the top left corner of the image and the step per pixel across
+    float4 cameraStepX;         // and down, see CameraRays.h
+    float4 cameraStepY;
     float4 eyePosition;
+    float4x4 previousWorldToProjection;     // Of this eye's last frame, for the reprojection in Denoise.hlsl
+    float4 previousEyePosition;
+    uint maxBounces;            // Reflection bounces after the primary hit
+    uint inlineSecondary;       // Primary rays only fill the G-buffer, InlineRaytracing.hlsl does the rest
+    float pixelSpreadAngle;     // Angle between the primary rays of neighbouring pixels
+    uint lightCount;            // Entries of Lights, LightNodes holds twice as many minus one
+    uint lightSamples;          // Lights picked per hit, each with one shadow ray, up to LIGHT_MAX_SAMPLES
+    uint frameIndex;            // Varies the light samples between frames
+    uint secondaryScale;        // 1, or 2 and 4 when the inline pass traces secondary rays at reduced resolution
+    uint denoise;               // The inline pass leaves lighting and reflection to Denoise.hlsl instead of composing them
+    float4 probeOrigin;         // Position of the first irradiance probe, see IrradianceProbes.h; w is the normal bias
+    float4 probeSpacing;        // w is the distance probe rays stop at
+    uint4 probeCounts;          // Probes along each axis, all zero without a probe grid
+    float4 probeRayRotation;    // Quaternion turning this frame's probe rays
+    uint probeUpdateOffset;     // First probe ProbeTrace.hlsl updates this frame, the rest follow round the grid
+    uint probeUpdateCount;      // Probes updated this frame
+    uint probeFreshCount;       // Leading ones of those that have never been updated before
+    float probeHysteresis;      // Weight of a probe's previous value in an update
+    float shadowCacheCellSize;  // Of the shadow cache cells, see ShadowCache.h; 0 traces every shadow ray
+    uint shadowInvalidationCount;   // Entries of ShadowInvalidations ShadowCacheInvalidate.hlsl applies this frame
+    uint shadowCacheClear;      // ShadowCacheInvalidate.hlsl empties the whole cache instead
+    uint rayBudgetTilesX;       // Tiles across of RayBudgetTiles, see RayBudget.h; 0 without a ray budget
+    MaterialConstants materials[MATERIAL_CLASS_COUNT];  // Copy of the hit group constants for the inline path
     InstanceData instanceData[MAX_INSTANCES];
-    Light lights[MAX_LIGHTS];
-    VertexBufferData vertexBufferDatas[MAX_MODELS];
-    Texture texture[NUM_TEXTURES];
 };
 
 struct Vertex
@@ -75,46 +96,195 @@ struct Vertex
 RaytracingAccelerationStructure Scene : register(t0, space0);
 RWTexture2D<float4> RenderTarget : register(u0);
 RWTexture2D<float> DepthTarget : register(u1);
+RWTexture2D<uint4> GBuffer : register(u2);          // SurfacePayload of the primary hit
+RWTexture2D<float2> SecondaryRays : register(u3);   // What the first shadow and reflection rays found, see SecondaryRays.h
+RWTexture2D<float4> LowResLighting : register(u4);  // ShadeSecondary results at 1 / secondaryScale, see SecondaryUpsample.hlsl
+RWTexture2D<float4> LowResReflection : register(u5);
+RWTexture2DArray<float4> DenoiseSignals : register(u6);     // Noisy lighting and reflection, then the a-trous ping-pong, see Denoise.hlsl
+RWTexture2DArray<float4> DenoiseHistory : register(u7);     // Accumulated signals and moments, a set per frame parity
+RWTexture2DArray<uint4> DenoiseSurfaces : register(u8);     // G-buffer the history belongs to, per frame parity
+RWTexture2D<float4> ProbeIrradiance : register(u9);     // Octahedral tile of every probe, alpha is 1 once it has been updated
+RWTexture2D<float2> ProbeVisibility : register(u10);    // Mean and mean squared distance to geometry, in the same layout
+RWTexture2D<float4> ProbeRays : register(u11);          // Radiance and distance of this frame's probe rays, a row per probe
 ConstantBuffer<SceneConstantBuffer> g_sceneCB : register(b0);
+ConstantBuffer<MaterialConstants> l_material : register(b1);     // From the hit group record
 //ConstantBuffer<RayGenConstantBuffer> g_rayGenCB : register(b0);
 
 StructuredBuffer<uint> Indices : register(t1, space0);
 StructuredBuffer<Vertex> Vertices : register(t2, space0);
 
 Texture2DArray<float4> g_texture : register(t3);
+SamplerState g_sampler : register(s0);      // Trilinear, clamped
+
+// One entry per AABB of the procedural BLASes, layout matches SpherePrimitive in ProceduralSpheres.h.
+struct SpherePrimitive
+{
+    float3 center;      // Object space
+    float radius;
+    float3 albedo;
+    float reflectivity;
+};
+
+StructuredBuffer<SpherePrimitive> Spheres : register(t0, space1);
+
+// Lights and the BVH DirectLighting picks them through, layouts match LightSource and LightNode in LightBVH.h.
+struct SceneLight
+{
+    float3 position;
+    float radius;       // Spherical area light when above zero
+    float3 color;
+    float intensity;
+};
+
+struct LightNode
+{
+    float3 boundsLo;
+    float power;
+    float3 boundsHi;
+    uint child;         // Second child of an inner node, the first follows it. LIGHT_LEAF and the light on a leaf.
+};
+
+#define LIGHT_LEAF 0x80000000
+#define LIGHT_MAX_SAMPLES 2
+
+StructuredBuffer<SceneLight> Lights : register(t1, space1);
+StructuredBuffer<LightNode> LightNodes : register(t2, space1);
 
 typedef BuiltInTriangleIntersectionAttributes MyAttributes;
-struct RayPayload
+
+// Closest hit shaders only describe the surface that was hit; the raygen shader does the
+// lighting, shadow queries and bounces from that, so no shader traces from inside a hit
+// and the pipeline gets away with a recursion depth of 1.
+// The albedo is packed as R11G11B10 floats and the world space normal as an octahedral 16:16.
+struct SurfacePayload
 {
-    float4 color;
-    float depth;
-    float3 origin;
-    float3 direction;
-    uint recursionDepth;
+    uint packedAlbedo;
+    uint packedNormal;
+    float hitT;         // Negative on a miss
+    uint material;      // Reflectivity as a half in the low 16 bits, SURFACE_ flags and the instance above
+};
+
+#define SURFACE_UNLIT 0x10000   // Shown with its albedo as is, no lighting or shadow ray
+#define SURFACE_INSTANCE_SHIFT 20   // InstanceID of the hit above this bit, to find surface edges when denoising
+
+// Ray cone from "Texture Level of Detail Strategies for Real-Time Ray Tracing" (Akenine-Moller et al.):
+// the width of the footprint where a ray starts and how fast it grows with distance.
+// RayCone.h has the CPU reference of the math below.
+struct RayCone
+{
+    float width;
+    float spreadAngle;
 };
 
+RayCone PrimaryRayCone()
+{
+    RayCone cone = { 0.0f, g_sceneCB.pixelSpreadAngle };
+    return cone;
+}
+
+// Triangles are flat, so a mirror passes the cone on with the spread it came in with.
+RayCone PropagateRayCone(RayCone cone, float t)
+{
+    cone.width += cone.spreadAngle * t;
+    return cone;
+}
+
+// Surface rays carry their cone to the hit in the payload fields the hit overwrites.
+SurfacePayload SurfaceRayPayload(RayCone cone)
+{
+    SurfacePayload payload = { asuint(cone.width), asuint(cone.spreadAngle), -1.0f, 0 };
+    return payload;
+}
+
+RayCone IncomingRayCone(SurfacePayload payload)
+{
+    RayCone cone = { asfloat(payload.packedAlbedo), asfloat(payload.packedNormal) };
+    return cone;
+}
+
+// Shadow rays only need to know whether anything is in the way, so they carry 4 bytes
+// and never run a closest hit shader.
+struct ShadowPayload
+{
+    float visibility;   // 0 when occluded, set to 1 by the shadow miss shader
+};
+
+// Hit groups are laid out per material class, [diffuse, reflective, alpha tested, procedural], with
+// one record per ray type. Primary and bounce rays both fetch surfaces. Shadow rays skip closest hit
+// shaders, so their records only differ where an any hit has to write the smaller payload.
+#define RAY_TYPE_SURFACE 0
+#define RAY_TYPE_SHADOW 1
+#define RAY_TYPE_COUNT 2
+
+#define MISS_SURFACE 0
+#define MISS_SHADOW 1
+
 struct Ray
 {
     float3 origin;
     float3 direction;
 };
 
+// 6e5 for red and green, 5e5 for blue: the half precision bits with the sign and low mantissa bits dropped.
+uint PackColorR11G11B10(float3 color)
+{
+    uint3 h = f32tof16(clamp(color, 0.0f, 65000.0f));
+    return ((h.r >> 4) & 0x7ff) | (((h.g >> 4) & 0x7ff) << 11) | (((h.b >> 5) & 0x3ff) << 22);
+}
 
-// Generate a ray in world space for a camera pixel corresponding to an index from the dispatched 2D grid.
-inline void GenerateCameraRay(uint2 index, out float3 origin, out float3 direction)
+float3 UnpackColorR11G11B10(uint packedColor)
 {
-    float2 xy = index + 0.5f; // center in the middle of the pixel.
-    float2 screenPos = xy / DispatchRaysDimensions().xy * 2.0 - 1.0;
+    return f16tof32(uint3((packedColor << 4) & 0x7ff0, (packedColor >> 7) & 0x7ff0, (packedColor >> 17) & 0x7fe0));
+}
 
-    // Invert Y for DirectX-style coordinates.
-    screenPos.y = -screenPos.y;
+// Octahedral mapping of a unit vector onto the [-1, 1] square.
+float2 OctahedralEncode(float3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    float2 signs = float2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+    return n.z >= 0.0f ? n.xy : (1.0f - abs(n.yx)) * signs;
+}
 
-    // Unproject the pixel coordinate into a ray.
-    float4 world = mul(float4(screenPos, 0, 1), g_sceneCB.projectionToWorld);
+float3 OctahedralDecode(float2 e)
+{
+    float3 n = float3(e, 1.0f - abs(e.x) - abs(e.y));
+    float t = saturate(-n.z);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return normalize(n);
+}
 
-    world.xyz /= world.w;
+// 16 bits per axis of the octahedral square.
+uint PackNormalOctahedral(float3 n)
+{
+    float2 e = OctahedralEncode(n);
+    uint2 q = uint2(round(saturate(e * 0.5f + 0.5f) * 65535.0f));
+    return q.x | (q.y << 16);
+}
+
+float3 UnpackNormalOctahedral(uint packedNormal)
+{
+    return OctahedralDecode(float2(packedNormal & 0xffff, packedNormal >> 16) / 65535.0f * 2.0f - 1.0f);
+}
+
+SurfacePayload MakeSurface(float3 albedo, float3 worldNormal, float hitT, float reflectivity, uint flags, uint instanceId)
+{
+    SurfacePayload surface;
+    surface.packedAlbedo = PackColorR11G11B10(albedo);
+    surface.packedNormal = PackNormalOctahedral(worldNormal);
+    surface.hitT = hitT;
+    surface.material = f32tof16(reflectivity) | flags | (instanceId << SURFACE_INSTANCE_SHIFT);
+    return surface;
+}
+
+
+// Generate a ray in world space for a camera pixel corresponding to an index from the dispatched 2D grid.
+// The scene lays the eye's field of view out as a corner ray and per pixel steps, see CameraRays.h.
+inline void GenerateCameraRay(uint2 index, out float3 origin, out float3 direction)
+{
+    float2 xy = index + 0.5f; // center in the middle of the pixel.
     origin = g_sceneCB.eyePosition.xyz;
-    direction = normalize(world.xyz - origin);
+    direction = normalize(g_sceneCB.cameraCorner.xyz + xy.x * g_sceneCB.cameraStepX.xyz + xy.y * g_sceneCB.cameraStepY.xyz);
 }
 
 #define LAYER_HIT 1
@@ -122,6 +292,482 @@ inline void GenerateCameraRay(uint2 index, out float3 origin, out float3 directi
 #define LAYER_REFLECT 4
 
 
+// TraceRay versions for the DXR pipeline; InlineRaytracing.hlsl defines INLINE_RAYTRACING
+// and supplies RayQuery versions of both.
+SurfacePayload TraceSurface(RayDesc ray, uint instanceMask, RayCone cone);
+bool IsInShadow(float3 lightDir, float3 hitPoint, float maxDist);
+
+#ifndef INLINE_RAYTRACING
+SurfacePayload TraceSurface(RayDesc ray, uint instanceMask, RayCone cone)
+{
+    SurfacePayload surface = SurfaceRayPayload(cone);
+    TraceRay(Scene, RAY_FLAG_CULL_BACK_FACING_TRIANGLES, instanceMask, RAY_TYPE_SURFACE, RAY_TYPE_COUNT, MISS_SURFACE, ray, surface);
+    return surface;
+}
+
+bool IsInShadow(float3 lightDir, float3 hitPoint, float maxDist)
+{
+    RayDesc shadowRay;
+    shadowRay.Origin = hitPoint;
+    shadowRay.Direction = lightDir;
+    shadowRay.TMin = 0.001f;
+    shadowRay.TMax = maxDist;
+
+    ShadowPayload payload = { 0.0f };
+
+    // Any hit is enough to know the point is shadowed, so stop at the first one and skip shading it.
+    TraceRay(Scene, RAY_FLAG_CULL_BACK_FACING_TRIANGLES | RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH | RAY_FLAG_SKIP_CLOSEST_HIT_SHADER,
+        LAYER_SHADOW, RAY_TYPE_SHADOW, RAY_TYPE_COUNT, MISS_SHADOW, shadowRay, payload);
+
+    return payload.visibility == 0.0f;
+}
+#endif
+
+// Light selection, see LightBVH.h for the reference these follow step by step.
+float LightNodeImportance(LightNode node, float3 p, float3 n)
+{
+    float3 furthest = float3(n.x > 0.0f ? node.boundsHi.x : node.boundsLo.x,
+                             n.y > 0.0f ? node.boundsHi.y : node.boundsLo.y,
+                             n.z > 0.0f ? node.boundsHi.z : node.boundsLo.z);
+    if (node.power <= 0.0f || dot(furthest - p, n) <= 0.0f)
+        return 0.0f;
+    float3 toCentre = (node.boundsLo + node.boundsHi) * 0.5f - p;
+    float3 diagonal = node.boundsHi - node.boundsLo;
+    return node.power / max(dot(toCentre, toCentre), max(dot(diagonal, diagonal) * 0.25f, 1e-4f));
+}
+
+struct LightSample
+{
+    uint light;
+    float pdf;      // Probability of having picked this light
+};
+
+LightSample SampleLightBVH(float3 p, float3 n, float u)
+{
+    LightSample lightSample = { 0xffffffff, 0.0f };
+    if (g_sceneCB.lightCount == 0)
+        return lightSample;
+
+    uint index = 0;
+    float pdf = 1.0f;
+    while (!(LightNodes[index].child & LIGHT_LEAF))
+    {
+        uint left = index + 1;
+        uint right = LightNodes[index].child;
+        float leftImportance = LightNodeImportance(LightNodes[left], p, n);
+        float rightImportance = LightNodeImportance(LightNodes[right], p, n);
+        if (leftImportance + rightImportance <= 0.0f)
+            return lightSample;
+        float leftProbability = leftImportance / (leftImportance + rightImportance);
+        if (u < leftProbability)
+        {
+            u = u / leftProbability;
+            pdf *= leftProbability;
+            index = left;
+        }
+        else
+        {
+            u = (u - leftProbability) / (1.0f - leftProbability);
+            pdf *= 1.0f - leftProbability;
+            index = right;
+        }
+        u = min(u, 0.99999994f);
+    }
+    lightSample.light = LightNodes[index].child & ~LIGHT_LEAF;
+    lightSample.pdf = pdf;
+    return lightSample;
+}
+
+uint PcgHash(uint v)
+{
+    uint state = v * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+float RandomUnorm(inout uint state)
+{
+    state = PcgHash(state);
+    return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+uint LightSampleSeed(uint2 pixel, uint sampleIndex)
+{
+    return PcgHash(pixel.x + PcgHash(pixel.y + PcgHash(g_sceneCB.frameIndex * 64u + sampleIndex)));
+}
+
+float3 SampleLightPoint(SceneLight light, float3 p, float u1, float u2)
+{
+    if (light.radius <= 0.0f)
+        return light.position;
+    float3 w = normalize(p - light.position);
+    float flip = w.z >= 0.0f ? 1.0f : -1.0f;
+    float a = -1.0f / (flip + w.z);
+    float b = w.x * w.y * a;
+    float3 t = float3(1.0f + flip * w.x * w.x * a, flip * b, -flip * w.x);
+    float3 s = float3(b, flip + w.y * w.y * a, -w.y);
+    float z = u1;
+    float r = sqrt(max(0.0f, 1.0f - z * z));
+    float phi = 6.28318530718f * u2;
+    return light.position + (t * (r * cos(phi)) + s * (r * sin(phi)) + w * z) * light.radius;
+}
+
+bool SampleSceneLight(float3 p, float3 n, uint seed, out LightSample lightSample, out float3 target)
+{
+    uint state = seed;
+    lightSample = SampleLightBVH(p, n, RandomUnorm(state));
+    target = p;
+    if (lightSample.pdf <= 0.0f)
+        return false;
+    float u1 = RandomUnorm(state);
+    float u2 = RandomUnorm(state);
+    target = SampleLightPoint(Lights[lightSample.light], p, u1, u2);
+    return true;
+}
+
+// Irradiance probes, see IrradianceProbes.h for the reference these follow step by step.
+#define PROBE_IRRADIANCE_TEXELS 6
+#define PROBE_VISIBILITY_TEXELS 14
+#define PROBE_RAYS 64
+#define PROBE_VISIBILITY_SHARPNESS 50.0f
+#define PROBE_AMBIENT 0.05f
+
+uint ProbeCount()
+{
+    return g_sceneCB.probeCounts.x * g_sceneCB.probeCounts.y * g_sceneCB.probeCounts.z;
+}
+
+uint3 ProbeCoords(uint probe)
+{
+    uint3 counts = g_sceneCB.probeCounts.xyz;
+    return uint3(probe % counts.x, (probe / counts.x) % counts.y, probe / (counts.x * counts.y));
+}
+
+float3 ProbePosition(uint3 coords)
+{
+    return g_sceneCB.probeOrigin.xyz + g_sceneCB.probeSpacing.xyz * float3(coords);
+}
+
+// Top left texel of a probe's tile, border included.
+uint2 ProbeTileOrigin(uint3 coords, uint interiorTexels)
+{
+    return uint2(coords.x, coords.y + g_sceneCB.probeCounts.y * coords.z) * (interiorTexels + 2);
+}
+
+// Tile coordinate of a direction with texel centres on integers.
+float2 ProbeTileCoordinate(float3 direction, uint interiorTexels)
+{
+    return (OctahedralEncode(direction) * 0.5f + 0.5f) * interiorTexels + 0.5f;
+}
+
+// Direction of an update's ray: a spherical Fibonacci set turned by this frame's rotation.
+float3 ProbeRayDirection(uint ray)
+{
+    const float goldenFraction = 0.61803398875f;
+    float phi = 6.28318530718f * frac(ray * goldenFraction);
+    float cosTheta = 1.0f - (2.0f * ray + 1.0f) / PROBE_RAYS;
+    float sinTheta = sqrt(saturate(1.0f - cosTheta * cosTheta));
+    float3 v = float3(cos(phi) * sinTheta, sin(phi) * sinTheta, cosTheta);
+    float4 q = g_sceneCB.probeRayRotation;
+    float3 t = cross(q.xyz, v) * 2.0f;
+    return v + t * q.w + cross(q.xyz, t);
+}
+
+// The atlases are UAVs, so they are filtered by hand.
+float4 LoadProbeIrradiance(uint3 coords, float3 direction)
+{
+    float2 c = ProbeTileCoordinate(direction, PROBE_IRRADIANCE_TEXELS);
+    uint2 texel = ProbeTileOrigin(coords, PROBE_IRRADIANCE_TEXELS) + uint2(floor(c));
+    float2 f = c - floor(c);
+    float4 top = lerp(ProbeIrradiance[texel], ProbeIrradiance[texel + uint2(1, 0)], f.x);
+    float4 bottom = lerp(ProbeIrradiance[texel + uint2(0, 1)], ProbeIrradiance[texel + uint2(1, 1)], f.x);
+    return lerp(top, bottom, f.y);
+}
+
+float2 LoadProbeVisibility(uint3 coords, float3 direction)
+{
+    float2 c = ProbeTileCoordinate(direction, PROBE_VISIBILITY_TEXELS);
+    uint2 texel = ProbeTileOrigin(coords, PROBE_VISIBILITY_TEXELS) + uint2(floor(c));
+    float2 f = c - floor(c);
+    float2 top = lerp(ProbeVisibility[texel], ProbeVisibility[texel + uint2(1, 0)], f.x);
+    float2 bottom = lerp(ProbeVisibility[texel + uint2(0, 1)], ProbeVisibility[texel + uint2(1, 1)], f.x);
+    return lerp(top, bottom, f.y);
+}
+
+// Irradiance at p with normal n from the eight probes around it: trilinear weights, less for
+// probes behind the surface and for probes the visibility maps say cannot see p.
+float3 IndirectLighting(float3 p, float3 n)
+{
+    float3 ambient = float3(PROBE_AMBIENT, PROBE_AMBIENT, PROBE_AMBIENT);
+    if (g_sceneCB.probeCounts.x == 0)
+        return ambient;
+
+    uint3 counts = g_sceneCB.probeCounts.xyz;
+    float3 biased = p + n * g_sceneCB.probeOrigin.w;
+    float3 cell = (biased - g_sceneCB.probeOrigin.xyz) / g_sceneCB.probeSpacing.xyz;
+    float3 baseCell = clamp(floor(cell), 0.0f, float3(counts - 1));
+    uint3 base = uint3(baseCell);
+    float3 alpha = saturate(cell - baseCell);
+
+    float3 sum = float3(0, 0, 0);
+    float weightSum = 0.0f;
+    for (uint corner = 0; corner < 8; corner++)
+    {
+        uint3 offset = uint3(corner, corner >> 1, corner >> 2) & 1;
+        uint3 coords = min(base + offset, counts - 1);
+        float4 irradiance = LoadProbeIrradiance(coords, n);
+        if (irradiance.a <= 0.0f)
+            continue;
+        float3 probePosition = ProbePosition(coords);
+
+        float facing = (dot(normalize(probePosition - p), n) + 1.0f) * 0.5f;
+        float weight = facing * facing + 0.2f;
+
+        float3 toPoint = biased - probePosition;
+        float probeDistance = length(toPoint);
+        if (probeDistance > 1e-4f)
+        {
+            float2 moments = LoadProbeVisibility(coords, toPoint / probeDistance);
+            if (probeDistance > moments.x)
+            {
+                float variance = abs(moments.x * moments.x - moments.y);
+                float d = probeDistance - moments.x;
+                float chebyshev = variance / (variance + d * d);
+                weight *= max(0.05f, chebyshev * chebyshev * chebyshev);
+            }
+        }
+
+        // Crush tiny weights so that probes seen through a wall fade out completely
+        weight = max(weight, 1e-6f);
+        if (weight < 0.2f)
+            weight *= weight * weight / (0.2f * 0.2f);
+        float3 trilinear = lerp(1.0f - alpha, alpha, float3(offset));
+        weight *= trilinear.x * trilinear.y * trilinear.z;
+
+        sum += irradiance.rgb * weight;
+        weightSum += weight;
+    }
+    return weightSum > 1e-4f ? sum / weightSum : ambient;
+}
+
+// Shadow visibility cache, see ShadowCache.h for the reference these follow step by step.
+#define SHADOW_CACHE_CAPACITY (1u << 18)
+#define SHADOW_CACHE_PROBES 8
+#define SHADOW_CACHE_MIN_SAMPLES 16
+#define SHADOW_CACHE_NONE 0xffffffff
+#define SHADOW_CACHE_ANY_LIGHT 0xffffffff
+
+struct ShadowCacheEntry
+{
+    int3 cell;
+    uint key;           // ShadowCacheChecksum of the cell, 0 while the entry is free
+    uint lightFace;     // Light above the three bits of the normal's dominant face
+    uint visible;       // Shadow rays from the cell that reached the light
+    uint samples;       // Shadow rays traced from the cell since it was last invalidated
+    uint padding;
+};
+
+struct ShadowCacheInvalidation
+{
+    float3 lo;
+    uint light;         // SHADOW_CACHE_ANY_LIGHT for the box an instance moved out of or into
+    float3 hi;
+    uint padding;
+};
+
+RWStructuredBuffer<ShadowCacheEntry> ShadowCache : register(u12);
+StructuredBuffer<ShadowCacheInvalidation> ShadowInvalidations : register(t3, space1);
+
+struct ShadowCacheCell
+{
+    int3 cell;
+    uint lightFace;
+};
+
+ShadowCacheCell MakeShadowCacheCell(float3 p, float3 n, uint light)
+{
+    ShadowCacheCell c;
+    c.cell = int3(floor(p / g_sceneCB.shadowCacheCellSize));
+    float3 a = abs(n);
+    uint axis = a.x >= a.y && a.x >= a.z ? 0 : (a.y >= a.z ? 1 : 2);
+    c.lightFace = (light << 3) | (axis * 2 + (n[axis] < 0.0f ? 1 : 0));
+    return c;
+}
+
+uint ShadowCacheHash(ShadowCacheCell c)
+{
+    return PcgHash(uint(c.cell.x) + PcgHash(uint(c.cell.y) + PcgHash(uint(c.cell.z) + PcgHash(c.lightFace))));
+}
+
+uint ShadowCacheChecksum(ShadowCacheCell c)
+{
+    return PcgHash(c.lightFace + PcgHash(uint(c.cell.z) + PcgHash(uint(c.cell.y) + PcgHash(uint(c.cell.x))))) | 1u;
+}
+
+// Entry of the cell, claimed if need be; SHADOW_CACHE_NONE when the probing window is full.
+uint FindShadowCacheEntry(ShadowCacheCell c)
+{
+    uint key = ShadowCacheChecksum(c);
+    uint slot = ShadowCacheHash(c);
+    for (uint i = 0; i < SHADOW_CACHE_PROBES; i++)
+    {
+        uint index = (slot + i) & (SHADOW_CACHE_CAPACITY - 1);
+        uint previous;
+        InterlockedCompareExchange(ShadowCache[index].key, 0, key, previous);
+        if (previous == 0)
+        {
+            ShadowCache[index].cell = c.cell;
+            ShadowCache[index].lightFace = c.lightFace;
+            return index;
+        }
+        if (previous == key)
+            return index;
+    }
+    return SHADOW_CACHE_NONE;
+}
+
+// IsInShadow through the cache, as 1 or 0. A cell answers without a ray once at least
+// SHADOW_CACHE_MIN_SAMPLES rays from it all agreed, the others trace and count the result.
+float ShadowVisibility(float3 hitPoint, float3 normal, uint light, float3 lightDir, float maxDist)
+{
+    uint entry = SHADOW_CACHE_NONE;
+    if (g_sceneCB.shadowCacheCellSize > 0.0f)
+    {
+        entry = FindShadowCacheEntry(MakeShadowCacheCell(hitPoint, normal, light));
+        if (entry != SHADOW_CACHE_NONE)
+        {
+            // Samples are counted before visible rays, so a count caught halfway never looks unanimous
+            uint sampleCount = ShadowCache[entry].samples;
+            uint visibleCount = ShadowCache[entry].visible;
+            if (sampleCount >= SHADOW_CACHE_MIN_SAMPLES && (visibleCount == 0 || visibleCount == sampleCount))
+                return visibleCount == 0 ? 0.0f : 1.0f;
+        }
+    }
+
+    float visibility = IsInShadow(lightDir, hitPoint, maxDist) ? 0.0f : 1.0f;
+    if (entry != SHADOW_CACHE_NONE)
+    {
+        InterlockedAdd(ShadowCache[entry].samples, 1);
+        InterlockedAdd(ShadowCache[entry].visible, uint(visibility));
+    }
+    return visibility;
+}
+
+// Ray budget, see RayBudget.h. RayBudgetStats.hlsl sums up every tile of a frame into
+// RayBudgetStats, and the scene hands back light samples and bounces for each in RayBudgetTiles.
+#define RAY_BUDGET_TILE_SIZE 16
+#define RAY_BUDGET_UNIT 255.0f
+
+RWStructuredBuffer<uint4> RayBudgetStats : register(u13);
+StructuredBuffer<uint> RayBudgetTiles : register(t4, space1);
+
+// Light samples and reflection bounces the secondary rays of a pixel may spend: the scene's
+// settings, cut down to the budget of the pixel's tile when there is one.
+uint2 PixelRayBudget(uint2 pixel)
+{
+    uint2 budget = uint2(min(g_sceneCB.lightSamples, LIGHT_MAX_SAMPLES), g_sceneCB.maxBounces);
+    if (g_sceneCB.rayBudgetTilesX > 0)
+    {
+        uint2 tile = pixel / RAY_BUDGET_TILE_SIZE;
+        uint packed = RayBudgetTiles[tile.y * g_sceneCB.rayBudgetTilesX + tile.x];
+        budget = min(budget, uint2(packed & 0xff, (packed >> 8) & 0xff));
+    }
+    return budget;
+}
+
+// Diffuse lighting from sampleCount lights picked through the light BVH, each with a shadow test,
+// on top of the indirect light the probe grid holds. firstSample numbers the light samples of the
+// hit for their seeds.
+float3 DirectLighting(float3 hitPoint, float3 normal, uint2 pixel, uint firstSample, uint sampleCount, out float visibility)
+{
+    float3 lighting = IndirectLighting(hitPoint, normal);
+    visibility = 1.0f;
+    for (uint i = 0; i < sampleCount; i++)
+    {
+        LightSample lightSample;
+        float3 target;
+        if (!SampleSceneLight(hitPoint, normal, LightSampleSeed(pixel, firstSample + i), lightSample, target))
+            continue;
+
+        float3 toLight = target - hitPoint;
+        float maxDist = length(toLight);
+        float3 lightDir = toLight / maxDist;
+        float sampleVisibility = ShadowVisibility(hitPoint, normal, lightSample.light, lightDir, maxDist);
+        if (i == 0)
+            visibility = sampleVisibility;
+
+        SceneLight light = Lights[lightSample.light];
+        float NdotL = max(dot(normal, lightDir), 0.0);
+        lighting += sampleVisibility * light.color * light.intensity * NdotL / (maxDist * maxDist * lightSample.pdf * sampleCount);
+    }
+    return lighting;
+}
+
+// Everything the secondary rays of the surface a ray found contribute: the lighting of that
+// surface, and the color its mirror reflections show for up to maxBounces more hits, before
+// the surface's own albedo and reflectivity weigh them in ComposeSurface. A reflection is
+// weighted by the lighting of the surface it is seen in. A ray budget may lower the light
+// samples and bounces, see PixelRayBudget.
+// secondary receives the light visibility at the first surface and how far its reflection
+// travelled (negative when there is none), which SecondaryRays.h reproduces on the CPU.
+void ShadeSecondary(RayDesc ray, SurfacePayload surface, uint2 pixel, out float3 lighting, out float3 reflected, out float2 secondary)
+{
+    float3 throughput = float3(1, 1, 1);
+    RayCone cone = PrimaryRayCone();
+    lighting = float3(1.0f, 1.0f, 1.0f);
+    reflected = float3(0, 0, 0);
+    secondary = float2(1.0f, -1.0f);
+    uint2 budget = PixelRayBudget(pixel);
+
+    for (uint bounce = 0; surface.hitT >= 0.0f; bounce++)
+    {
+        float3 hitPoint = ray.Origin + ray.Direction * surface.hitT;
+        float3 normal = UnpackNormalOctahedral(surface.packedNormal);
+        float3 surfaceLighting = float3(1.0f, 1.0f, 1.0f);
+        if (!(surface.material & SURFACE_UNLIT))
+        {
+            float visibility;
+            surfaceLighting = DirectLighting(hitPoint, normal, pixel, bounce * LIGHT_MAX_SAMPLES, budget.x, visibility);
+            if (bounce == 0)
+                secondary.x = visibility;
+        }
+        if (bounce == 0)
+            lighting = surfaceLighting;
+        else
+            reflected += throughput * UnpackColorR11G11B10(surface.packedAlbedo) * surfaceLighting;
+
+        float reflectivity = f16tof32(surface.material & 0xffff);
+        if (reflectivity <= 0.0f || bounce >= budget.y)
+            break;
+        // ComposeSurface applies the first surface's own weight
+        if (bounce > 0)
+            throughput *= reflectivity * surfaceLighting;
+        ray.Origin = hitPoint;
+        ray.Direction = reflect(ray.Direction, normal);
+        cone = PropagateRayCone(cone, surface.hitT);
+        surface = TraceSurface(ray, LAYER_REFLECT, cone);
+        if (bounce == 0)
+            secondary.y = surface.hitT;
+    }
+}
+
+float3 ComposeSurface(SurfacePayload surface, float3 lighting, float3 reflected)
+{
+    if (surface.hitT < 0.0f)
+        return float3(0, 0, 0);
+    float reflectivity = f16tof32(surface.material & 0xffff);
+    return UnpackColorR11G11B10(surface.packedAlbedo) * lighting + reflectivity * lighting * reflected;
+}
+
+// Lights the surface a ray found and follows its mirror reflections, see ShadeSecondary.
+float3 ShadeSurface(RayDesc ray, SurfacePayload surface, uint2 pixel, out float2 secondary)
+{
+    float3 lighting;
+    float3 reflected;
+    ShadeSecondary(ray, surface, pixel, lighting, reflected, secondary);
+    return ComposeSurface(surface, lighting, reflected);
+}
+
 [shader("raygeneration")]
 void MyRaygenShader()
 {
@@ -140,14 +786,20 @@ void MyRaygenShader()
     // TMin should be kept small to prevent missing geometry at close contact areas.
     ray.TMin = 0.001;
     ray.TMax = 10000.0;
-    RayPayload payload = { float4(0, 0, 0, 0), 0, ray.Origin, ray.Direction, 0 };
-    TraceRay(Scene, RAY_FLAG_CULL_BACK_FACING_TRIANGLES, LAYER_HIT, 0, 1, 0, ray, payload);
+    SurfacePayload surface = TraceSurface(ray, LAYER_HIT, PrimaryRayCone());
+
+    // Write the depth to the depth texture.
+    DepthTarget[DispatchRaysIndex().xy] = surface.hitT < 0.0f ? 10000.0f : surface.hitT;
+
+    // RayBudgetStats.hlsl reads the primary surfaces of either path
+    if (g_sceneCB.inlineSecondary || g_sceneCB.rayBudgetTilesX > 0)
+        GBuffer[DispatchRaysIndex().xy] = uint4(surface.packedAlbedo, surface.packedNormal, asuint(surface.hitT), surface.material);
+    if (g_sceneCB.inlineSecondary)
+        return;
 
     // Write the raytraced color to the output texture.
-    RenderTarget[DispatchRaysIndex().xy] = payload.color;
-    
-        // Write the depth to the depth texture.
-    DepthTarget[DispatchRaysIndex().xy] = payload.depth;
+    float2 secondary;
+    RenderTarget[DispatchRaysIndex().xy] = float4(ShadeSurface(ray, surface, DispatchRaysIndex().xy, secondary), 1.0f);
 }
 
 // Retrieve attribute at a hit position interpolated from vertex attributes using the hit's barycentrics.
@@ -158,142 +810,148 @@ float3 HitAttribute(float3 vertexAttribute[3], BuiltInTriangleIntersectionAttrib
         attr.barycentrics.y * (vertexAttribute[2] - vertexAttribute[0]);
 }
 
-bool IsInShadow(float3 lightDir, float3 hitPoint, float maxDist)
+// Mip level for a ray cone of width coneWidth meeting a triangle along rayDirection (eq. 34 of the paper).
+// texelArea and worldArea are twice the triangle's area in texels and in world units.
+float RayConeTextureLod(float texelArea, float worldArea, float coneWidth, float3 rayDirection, float3 worldNormal)
 {
-    RayDesc shadowRay;
-    shadowRay.Origin = hitPoint;
-    shadowRay.Direction = lightDir;
-    shadowRay.TMin = 0.001f;
-    shadowRay.TMax = maxDist;
+    float lod = 0.5f * log2(texelArea / max(worldArea, 1e-12f));
+    lod += log2(coneWidth);
+    lod -= log2(abs(dot(rayDirection, worldNormal)));
+    return lod;
+}
 
-    RayPayload payload = { float4(0, 0, 0, 0), 0, shadowRay.Origin, shadowRay.Direction, 1 };
+// Textured and tinted color of a triangle of an instance, along with its interpolated object space normal.
+// The mip comes from the ray cone footprint; a coneWidth of 0 samples the top level.
+float4 TriangleSurface(uint instanceId, uint primitiveIndex, float2 hitBarycentrics, float3x4 objectToWorld, float3 rayDirection,
+    float coneWidth, out float3 triangleNormal)
+{
+    MyAttributes attr;
+    attr.barycentrics = hitBarycentrics;
+    float3 barycentrics = float3(1 - attr.barycentrics.x - attr.barycentrics.y, attr.barycentrics.x, attr.barycentrics.y);
 
-    TraceRay(Scene, RAY_FLAG_CULL_BACK_FACING_TRIANGLES, LAYER_SHADOW, 0, 1, 0, shadowRay, payload);
+    InstanceData instance = g_sceneCB.instanceData[instanceId];
 
-    return payload.depth < shadowRay.TMax;
-}
+    uint indicesPerTriangle = 3;
+    uint baseIndex = instance.geometryOffset + primitiveIndex * indicesPerTriangle;
 
-float4 ReflectRay(float3 rayDir, float3 normal, float3 hitPosition, float reflectanceFactor = 2.0f)
-{
-    
-    float3 reflectDir = reflect(rayDir, normal);
-    RayDesc reflectRay;
-    reflectRay.Origin = hitPosition;
-    reflectRay.Direction = reflectDir;
-    reflectRay.TMin = 0.001f;
-    reflectRay.TMax = 10000.0f;
+    uint3 indices;
+    indices.x = Indices[baseIndex] + instance.vertexOffset;
+    indices.y = Indices[baseIndex + 1] + instance.vertexOffset;
+    indices.z = Indices[baseIndex + 2] + instance.vertexOffset;
 
-            // Increase recursion depth
-    RayPayload reflectPayload = { float4(0, 0, 0, 0), 0, reflectRay.Origin, reflectRay.Direction, 2 };
 
-            // Trace reflection ray
-    TraceRay(Scene, RAY_FLAG_CULL_BACK_FACING_TRIANGLES, LAYER_REFLECT, 0, 1, 0, reflectRay, reflectPayload);
-            
-    return reflectPayload.color * reflectanceFactor;
-}
+    float3 vertexNormals[3] =
+    {
+        Vertices[indices.x].normal,
+        Vertices[indices.y].normal,
+        Vertices[indices.z].normal 
+    };
+    
+    float2 vertexTexcoords[3] =
+    {
+        Vertices[indices.x].texcoord * instance.uvScale,
+        Vertices[indices.y].texcoord * instance.uvScale,
+        Vertices[indices.z].texcoord * instance.uvScale
+    };
 
+    triangleNormal = HitAttribute(vertexNormals, attr);
+    float2 interpolatedTexcoord = vertexTexcoords[0] * barycentrics.x + vertexTexcoords[1] * barycentrics.y + vertexTexcoords[2] * barycentrics.z;
+    // Perform wrap manually
+    float2 texcoord = frac(interpolatedTexcoord); // Keep the fractional part only, effectively wrapping the texture
 
-[shader("closesthit")]
-void MyClosestHitShader(inout RayPayload payload, in MyAttributes attr)
-{
-    uint instanceId = InstanceID();
-    if (payload.recursionDepth == 1 && instanceId != 6)
+    float2 textureSize = float2(instance.textureSize & 0xffff, instance.textureSize >> 16);
+    float lod = 0.0f;
+    if (coneWidth > 0.0f)
     {
-        payload.depth = RayTCurrent();
+        float3 edge1 = mul(objectToWorld, float4(Vertices[indices.y].position - Vertices[indices.x].position, 0.0f));
+        float3 edge2 = mul(objectToWorld, float4(Vertices[indices.z].position - Vertices[indices.x].position, 0.0f));
+        float3 worldCross = cross(edge1, edge2);
+        float2 uvEdge1 = (vertexTexcoords[1] - vertexTexcoords[0]) * textureSize;
+        float2 uvEdge2 = (vertexTexcoords[2] - vertexTexcoords[0]) * textureSize;
+        float texelArea = abs(uvEdge1.x * uvEdge2.y - uvEdge2.x * uvEdge1.y);
+        float worldArea = length(worldCross);
+        lod = RayConeTextureLod(texelArea, worldArea, coneWidth, rayDirection, worldCross / max(worldArea, 1e-12f));
+        // Slices of smaller textures only have their own mip chain
+        lod = clamp(lod, 0.0f, instance.textureMipLevels - 1.0f);
     }
-    else
-    {
-        float3 barycentrics = float3(1 - attr.barycentrics.x - attr.barycentrics.y, attr.barycentrics.x, attr.barycentrics.y);
 
-        uint startIndexOffset = g_sceneCB.vertexBufferDatas[g_sceneCB.instanceData[instanceId].vertexBufferId].indexOffset;
-        uint startVertexOffset = g_sceneCB.vertexBufferDatas[g_sceneCB.instanceData[instanceId].vertexBufferId].vertexOffset;
+    // Every slice is sized for the largest texture, smaller ones sit in its top left corner on every mip
+    float arrayWidth, arrayHeight, arraySlices;
+    g_texture.GetDimensions(arrayWidth, arrayHeight, arraySlices);
+    float2 sliceScale = textureSize / float2(arrayWidth, arrayHeight);
+    float4 sampledColor = g_texture.SampleLevel(g_sampler, float3(texcoord * sliceScale, instance.textureId), lod);
+    
+    float4 instanceColor = float4(instance.tint & 0xff, (instance.tint >> 8) & 0xff, (instance.tint >> 16) & 0xff, instance.tint >> 24) / 255.0f;
+    return sampledColor * instanceColor;
+}
 
-        uint indicesPerTriangle = 3;
-        uint primitiveIndex = PrimitiveIndex();
-        uint baseIndex = startIndexOffset + primitiveIndex * indicesPerTriangle;
+// Rotates an object space normal into world space with the instance transform.
+float3 ObjectToWorldNormal(float3x4 instanceTransform, float3 normal)
+{
+    // Extract the 3x3 rotation matrix from the 3x4 transformation matrix and transpose it
+    float3x3 rotationMatrix;
+    rotationMatrix[0] = float3(instanceTransform[0].x, instanceTransform[1].x, instanceTransform[2].x);
+    rotationMatrix[1] = float3(instanceTransform[0].y, instanceTransform[1].y, instanceTransform[2].y);
+    rotationMatrix[2] = float3(instanceTransform[0].z, instanceTransform[1].z, instanceTransform[2].z);
 
-        uint3 indices;
-        indices.x = Indices[baseIndex] + startVertexOffset;
-        indices.y = Indices[baseIndex + 1] + startVertexOffset;
-        indices.z = Indices[baseIndex + 2] + startVertexOffset;
+    return normalize(mul(normal, rotationMatrix));
+}
 
+// Surface of a triangle hit, shared by the closest hit shader and the inline path.
+SurfacePayload DescribeTriangle(uint instanceId, uint primitiveIndex, float2 barycentrics, float3x4 objectToWorld, float3 rayDirection,
+    float hitT, float coneWidth, uint materialFlags)
+{
+    float3 triangleNormal;
+    float4 color = TriangleSurface(instanceId, primitiveIndex, barycentrics, objectToWorld, rayDirection, coneWidth, triangleNormal);
+    float reflectivity = (materialFlags & MATERIAL_FLAG_REFLECTIVE) ? 1.0f : 0.0f;
+    return MakeSurface(color.rgb, ObjectToWorldNormal(objectToWorld, triangleNormal), hitT, reflectivity, 0, instanceId);
+}
 
-        float3 vertexNormals[3] =
-        {
-            Vertices[indices.x].normal,
-        Vertices[indices.y].normal,
-        Vertices[indices.z].normal 
-        };
-    
-        float2 vertexTexcoords[3] =
-        {
-            Vertices[indices.x].texcoord,
-        Vertices[indices.y].texcoord,
-        Vertices[indices.z].texcoord
-        };
+[shader("closesthit")]
+void MyClosestHitShader(inout SurfacePayload payload, in MyAttributes attr)
+{
+    RayCone cone = PropagateRayCone(IncomingRayCone(payload), RayTCurrent());
+    payload = DescribeTriangle(InstanceID(), PrimitiveIndex(), attr.barycentrics, ObjectToWorld3x4(), WorldRayDirection(),
+        RayTCurrent(), cone.width, l_material.flags);
+}
 
-        float3 triangleNormal = HitAttribute(vertexNormals, attr);
-        float2 interpolatedTexcoord = vertexTexcoords[0] * barycentrics.x + vertexTexcoords[1] * barycentrics.y + vertexTexcoords[2] * barycentrics.z;
-    // Assuming interpolatedTexcoord ranges from (0,0) to (1,1)
-        float2 texcoord = interpolatedTexcoord.xy;
-        texcoord.x *= g_sceneCB.instanceData[instanceId].u;
-        texcoord.y *= g_sceneCB.instanceData[instanceId].v;
-    // Perform wrap manually
-        texcoord = frac(texcoord); // Keep the fractional part only, effectively wrapping the texture
-   
-    
-    // Sample the texture
-        uint textureDataId = g_sceneCB.instanceData[instanceId].textureId;
-        float4 sampledColor = g_texture.Load(int4(texcoord.x * g_sceneCB.texture[textureDataId].width, texcoord.y * g_sceneCB.texture[textureDataId].height, textureDataId, 0));
-    
-        float4 instanceColor = saturate(float4(g_sceneCB.instanceData[instanceId].color, 1.0f) * 2.0f);
-        float4 color = sampledColor * instanceColor;
-    
+// Material of a hit found without shader records, from its instance's hit group offset.
+MaterialConstants InstanceMaterial(uint instanceContributionToHitGroupIndex)
+{
+    return g_sceneCB.materials[instanceContributionToHitGroupIndex / RAY_TYPE_COUNT];
+}
 
-    //float3 diffuse = 0.5 * NdotL;
-    
-     // Calculate depth as the distance from the eye position to the hit point
-        payload.depth = RayTCurrent();
-    
-        float3 hitPoint = payload.origin + payload.direction * payload.depth;
-        float3 lightDir = normalize(g_sceneCB.lights[0].position - hitPoint);
-        float maxDist = length(g_sceneCB.lights[0].position - hitPoint);
-    
-        float lighting = 0.05f;
-        if ((payload.recursionDepth == 0) &&
-            !IsInShadow(lightDir, hitPoint, maxDist))
-        {
-    // Access the instance transformation matrix
-            float3x4 instanceTransform = ObjectToWorld3x4();
+// Texels with less than half coverage let the ray through. Coverage is tested on the top mip.
+bool PassesAlphaTest(uint instanceId, uint primitiveIndex, float2 barycentrics, float3x4 objectToWorld)
+{
+    float3 triangleNormal;
+    return TriangleSurface(instanceId, primitiveIndex, barycentrics, objectToWorld, float3(0, 0, 1), 0.0f, triangleNormal).a >= 0.5f;
+}
 
-    // Extract the 3x3 rotation matrix from the 3x4 transformation matrix and transpose it
-            float3x3 rotationMatrix;
-            rotationMatrix[0] = float3(instanceTransform[0].x, instanceTransform[1].x, instanceTransform[2].x);
-            rotationMatrix[1] = float3(instanceTransform[0].y, instanceTransform[1].y, instanceTransform[2].y);
-            rotationMatrix[2] = float3(instanceTransform[0].z, instanceTransform[1].z, instanceTransform[2].z);
-    
-            triangleNormal = normalize(mul(triangleNormal, rotationMatrix));
-    
-    // Diffuse
-            float NdotL = max(dot(triangleNormal, lightDir), 0.0);
-            lighting += NdotL;
-        }
-        
-        float4 reflectColor = float4(0, 0, 0, 0);
-        if ((payload.recursionDepth == 0) && instanceId == 6)
-        {
-            reflectColor = ReflectRay(payload.direction, triangleNormal, hitPoint);
-        }
-    
-        payload.color = (sampledColor * instanceColor + reflectColor) * lighting;
-    }
+[shader("anyhit")]
+void MyAlphaTestAnyHitShader(inout SurfacePayload payload, in MyAttributes attr)
+{
+    if (!PassesAlphaTest(InstanceID(), PrimitiveIndex(), attr.barycentrics, ObjectToWorld3x4()))
+        IgnoreHit();
+}
+
+[shader("anyhit")]
+void MyShadowAlphaTestAnyHitShader(inout ShadowPayload payload, in MyAttributes attr)
+{
+    if (!PassesAlphaTest(InstanceID(), PrimitiveIndex(), attr.barycentrics, ObjectToWorld3x4()))
+        IgnoreHit();
+}
+
+[shader("miss")]
+void MyMissShader(inout SurfacePayload payload)
+{
+    payload.hitT = -1.0f;
 }
 
 [shader("miss")]
-void MyMissShader(inout RayPayload payload)
+void MyShadowMissShader(inout ShadowPayload payload)
 {
-    payload.color = float4(0, 0, 0, 1);
-    payload.depth = 10000.0f;
+    payload.visibility = 1.0f;
 }
 
 struct ProceduralAttributes
@@ -350,7 +1008,6 @@ bool RayAABBIntersectionTest(float3 rayOrigin, float3 rayDir, float3 aabb[2], ou
     // TODO: handle cases where ray origin is within a slab 
     //  that a ray direction is parallel to. In that case
     //  0 * INF => NaN
-    const float FLT_INFINITY = 1.#INF;
     float3 invRayDirection = 1.0f / rayDir;
 
     tmin3.x = (aabb[1 - sign3.x].x - rayOrigin.x) * invRayDirection.x;
@@ -494,6 +1151,40 @@ void AABBCollisionTest()
     }
 }
 
+// World space center and radius of a sphere of a procedural instance.
+void WorldSphere(uint instanceId, uint primitiveIndex, float3x4 instanceTransform, out float3 position, out float radius)
+{
+    SpherePrimitive sphere = Spheres[g_sceneCB.instanceData[instanceId].geometryOffset + primitiveIndex];
+    position = mul(instanceTransform, float4(sphere.center, 1));
+    // Assume the instance is scaled uniformly to get the world radius
+    radius = sphere.radius * length(float3(instanceTransform[0][0], instanceTransform[1][0], instanceTransform[2][0]));
+}
+
+// The root selection of RaySphereIntersectionTest for a ray that is not in an intersection shader.
+// Only back face culling is honored, which is all the inline path asks for.
+bool RaySphereHit(in Ray ray, float tMin, float tMax, bool cullBackFacing, float3 center, float radius, out float thit, out float3 normal)
+{
+    float t0, t1;
+    thit = 0.0f;
+    normal = float3(0, 0, 0);
+    if (!SolveRaySphereIntersectionEquation(ray, t0, t1, center, radius))
+        return false;
+
+    float candidates[2] = { t0, t1 };
+    for (uint i = 0; i < 2; i++)
+    {
+        float3 n = CalculateNormalForARaySphereHit(ray, candidates[i], center);
+        bool culled = cullBackFacing && dot(ray.direction, n) > 0;
+        if (IsInRange(candidates[i], tMin, tMax) && !culled)
+        {
+            thit = candidates[i];
+            normal = n;
+            return true;
+        }
+    }
+    return false;
+}
+
 [shader("intersection")]
 void MySimpleIntersectionShader()
 {
@@ -503,10 +1194,10 @@ void MySimpleIntersectionShader()
     Ray ray;
     ray.origin = WorldRayOrigin();
     ray.direction = WorldRayDirection();
-    float3x4 instanceTransform = ObjectToWorld3x4();
-    float3 position = float3(instanceTransform[0][3], instanceTransform[1][3], instanceTransform[2][3]);
-    // Now assume that it has been scaled uniformly to extract the radius
-    float radius = 0.5f * instanceTransform[0][0];
+
+    float3 position;
+    float radius;
+    WorldSphere(InstanceID(), PrimitiveIndex(), ObjectToWorld3x4(), position, radius);
     if (RaySphereIntersectionTest(ray, tHit, tmax, attr, position, radius))
     {
         ReportHit(tHit, /*hitKind*/0, attr);
@@ -515,28 +1206,16 @@ void MySimpleIntersectionShader()
 
 
 
+SurfacePayload DescribeSphere(uint instanceId, uint primitiveIndex, float3 worldNormal, float hitT)
+{
+    SpherePrimitive sphere = Spheres[g_sceneCB.instanceData[instanceId].geometryOffset + primitiveIndex];
+    return MakeSurface(sphere.albedo, worldNormal, hitT, sphere.reflectivity, 0, instanceId);
+}
+
 [shader("closesthit")]
-void MySphereClosestHitShader(inout RayPayload payload, in ProceduralAttributes attrs)
+void MySphereClosestHitShader(inout SurfacePayload payload, in ProceduralAttributes attrs)
 {
-    // PERFORMANCE TIP: it is recommended to minimize values carry over across TraceRay() calls. 
-    // Therefore, in cases like retrieving HitWorldPosition(), it is recomputed every time.=
-    float3 lightDir = normalize(g_sceneCB.lights[0].position - attrs.hitPosition);
-    //float3 lightDir = normalize(float3(0, 0, -1));
-    float maxDist = length(g_sceneCB.lights[0].position - attrs.hitPosition);
-    
-    float lighting = 0.05f;
-    if (!IsInShadow(lightDir, attrs.hitPosition, maxDist))
-    {
-        float NdotL = max(dot(attrs.normal, lightDir), 0.0);
-        lighting += NdotL;
-    }
-    float4 reflectColor = float4(0, 0, 0, 0);
-    if (payload.recursionDepth == 0)
-    {
-        reflectColor = ReflectRay(payload.direction, attrs.normal, attrs.hitPosition);
-    }
-    payload.color = (float4(0, 0.7, 0.7, 1) + reflectColor) * lighting;
-    
+    payload = DescribeSphere(InstanceID(), PrimitiveIndex(), attrs.normal, RayTCurrent());
 }
 
 #endif // RAYTRACING_HLSL
\ No newline at end of file
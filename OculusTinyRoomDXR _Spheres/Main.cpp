@@ -30,6 +30,7 @@ limitations under the License.
 #include "OVR_CAPI_D3D.h"
 #include "Win32_d3dx12.h"
 #include "Win32_DirectX12AppUtil.h"
+#include "HmdSession.h"
 
 
 //------------------------------------------------------------
@@ -37,7 +38,7 @@ limitations under the License.
 // needed for D3D12 rendering.
 struct OculusEyeTexture
 {
-    ovrSession               Session;
+    HmdSession*              Session;
     ovrTextureSwapChain      TextureChain;
     ovrTextureSwapChain      DepthTextureChain;
 
@@ -54,7 +55,7 @@ struct OculusEyeTexture
     {
     }
 
-    bool Init(ovrSession session, int sizeW, int sizeH, bool createDepth)
+    bool Init(HmdSession* session, int sizeW, int sizeH, bool createDepth)
     {
         Session = session;
 
@@ -70,17 +71,17 @@ struct OculusEyeTexture
         desc.StaticImage = ovrFalse;
         desc.BindFlags = ovrTextureBind_DX_RenderTarget;
 
-        ovrResult result = ovr_CreateTextureSwapChainDX(session, DIRECTX.CommandQueue, &desc, &TextureChain);
+        ovrResult result = session->CreateTextureSwapChainDX(DIRECTX.CommandQueue, &desc, &TextureChain);
         if (!OVR_SUCCESS(result))
             return false;
 
         int textureCount = 0;
-        ovr_GetTextureSwapChainLength(Session, TextureChain, &textureCount);
+        Session->GetTextureSwapChainLength(TextureChain, &textureCount);
         TexRtv.resize(textureCount);
         TexResource.resize(textureCount);
         for (int i = 0; i < textureCount; ++i)
         {
-            result = ovr_GetTextureSwapChainBufferDX(Session, TextureChain, i, IID_PPV_ARGS(&TexResource[i]));
+            result = Session->GetTextureSwapChainBufferDX(TextureChain, i, IID_PPV_ARGS(&TexResource[i]));
             if (!OVR_SUCCESS(result))
                 return false;
             TexResource[i]->SetName(L"EyeColorRes");
@@ -114,7 +115,7 @@ struct OculusEyeTexture
             depthDesc.StaticImage = ovrFalse;
             depthDesc.BindFlags = ovrTextureBind_DX_DepthStencil;
 
-            result = ovr_CreateTextureSwapChainDX(session, DIRECTX.CommandQueue, &depthDesc, &DepthTextureChain);
+            result = session->CreateTextureSwapChainDX(DIRECTX.CommandQueue, &depthDesc, &DepthTextureChain);
             if (!OVR_SUCCESS(result))
                 return false;
 
@@ -122,7 +123,7 @@ struct OculusEyeTexture
             DepthTexDsv.resize(textureCount);
             for (int i = 0; i < textureCount; i++)
             {
-                result = ovr_GetTextureSwapChainBufferDX(Session, DepthTextureChain, i, IID_PPV_ARGS(&DepthTex[i]));
+                result = Session->GetTextureSwapChainBufferDX(DepthTextureChain, i, IID_PPV_ARGS(&DepthTex[i]));
                 if (!OVR_SUCCESS(result))
                     return false;
                 DepthTex[i]->SetName(L"EyeDepthRes");
@@ -155,7 +156,7 @@ struct OculusEyeTexture
                 Release(TexResource[i]);
             }
 
-            ovr_DestroyTextureSwapChain(Session, TextureChain);
+            Session->DestroyTextureSwapChain(TextureChain);
         }
 
         if (DepthTextureChain)
@@ -170,14 +171,14 @@ struct OculusEyeTexture
                 Release(DepthTex[i]);
             }
 
-            ovr_DestroyTextureSwapChain(Session, DepthTextureChain);
+            Session->DestroyTextureSwapChain(DepthTextureChain);
         }
     }
 
     D3D12_CPU_DESCRIPTOR_HANDLE GetRtv()
     {
         int index = 0;
-        ovr_GetTextureSwapChainCurrentIndex(Session, TextureChain, &index);
+        Session->GetTextureSwapChainCurrentIndex(TextureChain, &index);
         return TexRtv[index];
     }
 
@@ -186,11 +187,11 @@ struct OculusEyeTexture
         int index = 0;
         if (DepthTextureChain)
         {
-            ovr_GetTextureSwapChainCurrentIndex(Session, DepthTextureChain, &index);
+            Session->GetTextureSwapChainCurrentIndex(DepthTextureChain, &index);
         }
         else
         {
-            ovr_GetTextureSwapChainCurrentIndex(Session, TextureChain, &index);
+            Session->GetTextureSwapChainCurrentIndex(TextureChain, &index);
         }
         return DepthTexDsv[index];
     }
@@ -198,7 +199,7 @@ struct OculusEyeTexture
     ID3D12Resource* GetD3DColorResource()
     {
         int index = 0;
-        ovr_GetTextureSwapChainCurrentIndex(Session, TextureChain, &index);
+        Session->GetTextureSwapChainCurrentIndex(TextureChain, &index);
         return TexResource[index];
     }
 
@@ -207,7 +208,7 @@ struct OculusEyeTexture
         if (DepthTex.size() > 0)
         {
             int index = 0;
-            ovr_GetTextureSwapChainCurrentIndex(Session, TextureChain, &index);
+            Session->GetTextureSwapChainCurrentIndex(TextureChain, &index);
             return DepthTex[index];
         }
         else
@@ -219,11 +220,11 @@ struct OculusEyeTexture
     // Commit changes
     void Commit()
     {
-        ovr_CommitTextureSwapChain(Session, TextureChain);
+        Session->CommitTextureSwapChain(TextureChain);
 
         if (DepthTextureChain)
         {
-            ovr_CommitTextureSwapChain(Session, DepthTextureChain);
+            Session->CommitTextureSwapChain(DepthTextureChain);
         }
     }
 };
@@ -237,38 +238,40 @@ struct SceneSphere : Scene
     void Init(bool includeIntensiveGPUobject) override
     {
         std::vector<ModelComponent> transforms;
-        numInstances = 0;
 
         //transforms.push_back(ModelComponent(0.5f, -0.5f, 0.5f, -0.5f, 0.5f, -0.5f, 0xff404040));
         //models.push_back(Model(transforms, Material(Texture::AUTO_CEILING - 1), &globalVertexBuffer, 0));
-        Material sphereMat;
-        ModelComponent sphereComp(sphereMat, XMMatrixIdentity(), &aabbVertexBuffer, 0, 1, ~0);
+        Material sphereMat(0, MaterialClass_Procedural);
+        UINT movingSphere = aabbVertexBuffer.AddSpheres(std::vector<SpherePrimitive>(1));
+        ModelComponent sphereComp(sphereMat, XMMatrixIdentity(), &aabbVertexBuffer, movingSphere, ~0);
         transforms.push_back(sphereComp);
-        models.push_back(Model(transforms, sphereMat));
+        AddModel(Model(transforms, sphereMat));
    
 
 
         transforms.clear();
         transforms.push_back(ModelComponent(0.05f, -0.01f, 0.1f, -0.05f, +0.01f, -0.1f, 0xffff0000, &globalVertexBuffer));
         transforms.push_back(ModelComponent(0.05f, -0.01f, 0.1f, -0.05f, +0.01f, -0.1f, 0xffff0000, &globalVertexBuffer));
-        models.push_back(Model(transforms, Material(Texture::AUTO_WHITE - 1)));
+        AddModel(Model(transforms, Material(Texture::AUTO_WHITE - 1)));
 
 
         transforms.clear();
         transforms.push_back(ModelComponent(10.1f, 0.0f, 20.0f, 10.0f, 4.0f, -20.0f, 0xff808080, &globalVertexBuffer));
         transforms.push_back(ModelComponent(10.0f, -0.1f, 20.1f, -10.0f, 4.0f, 20.0f, 0xff808080, &globalVertexBuffer));
         transforms.push_back(ModelComponent(-10.0f, -0.1f, 20.0f, -10.1f, 4.0f, -20.0f, 0xff808080, &globalVertexBuffer));
-        models.push_back(Model(transforms, Material((UINT)Texture::AUTO_WALL - 1)));
+        AddModel(Model(transforms, Material((UINT)Texture::AUTO_WALL - 1)));
 
         transforms.clear();
         transforms.push_back(ModelComponent(10.0f, -0.1f, 20.0f, -10.0f, 0.0f, -20.1f, 0xff808080, &globalVertexBuffer));
         transforms.push_back(ModelComponent(15.0f, -6.1f, -18.0f, -15.0f, -6.0f, -30.0f, 0xff808080, &globalVertexBuffer));
-        models.push_back(Model(transforms, Material(Texture::AUTO_FLOOR - 1)));
+        UINT floor = AddModel(Model(transforms, Material(Texture::AUTO_FLOOR - 1)));
+        // The floor of the room is a mirror
+        SetInstanceMaterialClass(models[floor].instances[0], MaterialClass_Reflective);
 
 
         transforms.clear();
         transforms.push_back(ModelComponent(10.0f, 4.0f, 20.0f, -10.0f, 4.1f, -20.1f, 0xff808080, &globalVertexBuffer));
-        models.push_back(Model(transforms, Material(Texture::AUTO_CEILING - 1)));
+        AddModel(Model(transforms, Material(Texture::AUTO_CEILING - 1)));
 
         transforms.clear();
         //TriangleSet furniture;
@@ -296,8 +299,24 @@ struct SceneSphere : Scene
         for (float f = 3.0f; f <= 6.6f; f += 0.4f)
             transforms.push_back(ModelComponent(3, 0.0f, -f, 2.9f, 1.3f, -f - 0.1f, 0xff404040, &globalVertexBuffer)); // Posts
 
-        models.push_back(Model(transforms, Material(Texture::AUTO_WHITE - 1)));
-        numInstances = ModelComponent::numInstances;
+        AddModel(Model(transforms, Material(Texture::AUTO_WHITE - 1)));
+
+        // A spiral of small spheres that all share one procedural BLAS, so the whole cloud is one TLAS instance
+        std::vector<SpherePrimitive> particles;
+        const int numParticles = 4096;
+        for (int i = 0; i < numParticles; i++)
+        {
+            float f = (float)i / numParticles;
+            float angle = f * 40.0f * XM_PI;
+            float swirl = 0.4f + 0.6f * sinf(f * 9.0f * XM_PI) * sinf(f * 9.0f * XM_PI);
+            Float3 center(swirl * cosf(angle), f * 3.5f, swirl * sinf(angle));
+            Float3 albedo(0.5f + 0.5f * cosf(angle), 0.5f + 0.5f * cosf(angle + 2.1f), 0.5f + 0.5f * cosf(angle + 4.2f));
+            particles.push_back(SpherePrimitive(center, 0.03f + 0.02f * swirl, albedo, (i % 64 == 0) ? 0.5f : 0.0f));
+        }
+        UINT particleSpheres = aabbVertexBuffer.AddSpheres(particles);
+        transforms.clear();
+        transforms.push_back(ModelComponent(sphereMat, XMMatrixTranslation(-4.0f, 0.0f, -8.0f), &aabbVertexBuffer, particleSpheres, ~0));
+        AddModel(Model(transforms, sphereMat));
 
         globalVertexBuffer.InitGlobalVertexBuffers();
         globalVertexBuffer.InitGlobalBottomLevelAccelerationObject();
@@ -308,6 +327,9 @@ struct SceneSphere : Scene
     }
 };
 
+// LibOVR, or the simulator standing in for it; MainLoop is rerun after a lost display
+static HmdSession* Hmd = nullptr;
+
 // return true to retry later (e.g. after display lost)
 static bool MainLoop(bool retryCreate)
 {
@@ -325,20 +347,19 @@ static bool MainLoop(bool retryCreate)
     long long frameIndex = 0;
     bool drawMirror = true;
 
-    ovrSession session;
     ovrGraphicsLuid luid;
-    ovrResult result = ovr_Create(&session, &luid);
+    ovrResult result = Hmd->Create(&luid);
     if (!OVR_SUCCESS(result))
         return retryCreate;
 
-    ovrHmdDesc hmdDesc = ovr_GetHmdDesc(session);
+    ovrHmdDesc hmdDesc = Hmd->GetHmdDesc();
 
     ovrTrackingOrigin origin = ovrTrackingOrigin_FloorLevel;
-    ovr_SetTrackingOriginType(session, origin);
+    Hmd->SetTrackingOriginType(origin);
 
     // Setup Device and Graphics
     // Note: the mirror window can be any size, for this sample we use 1/2 the HMD resolution
-    ovrSizei idealSize = ovr_GetFovTextureSize(session, (ovrEyeType)0, hmdDesc.DefaultEyeFov[0], 1.0f);
+    ovrSizei idealSize = Hmd->GetFovTextureSize((ovrEyeType)0, hmdDesc.DefaultEyeFov[0], 1.0f);
     if (!DIRECTX.InitDevice(hmdDesc.Resolution.w / 2, hmdDesc.Resolution.h / 2, reinterpret_cast<LUID*>(&luid),
         depthFormat, eyeMsaaRate, true, idealSize.w, idealSize.h))
     {
@@ -348,8 +369,8 @@ static bool MainLoop(bool retryCreate)
     {
         // Get the eye render descriptions
         ovrEyeRenderDesc eyeRenderDesc[2];
-        eyeRenderDesc[0] = ovr_GetRenderDesc(session, ovrEye_Left, hmdDesc.DefaultEyeFov[0]);
-        eyeRenderDesc[1] = ovr_GetRenderDesc(session, ovrEye_Right, hmdDesc.DefaultEyeFov[1]);
+        eyeRenderDesc[0] = Hmd->GetRenderDesc(ovrEye_Left, hmdDesc.DefaultEyeFov[0]);
+        eyeRenderDesc[1] = Hmd->GetRenderDesc(ovrEye_Right, hmdDesc.DefaultEyeFov[1]);
 
         idp = fabsf(eyeRenderDesc[0].HmdToEyePose.Position.x);
     }
@@ -358,9 +379,9 @@ static bool MainLoop(bool retryCreate)
 
     for (int eye = 0; eye < 2; ++eye)
     {
-        ovrSizei idealSize = ovr_GetFovTextureSize(session, (ovrEyeType)eye, hmdDesc.DefaultEyeFov[eye], 1.0f);
+        ovrSizei idealSize = Hmd->GetFovTextureSize((ovrEyeType)eye, hmdDesc.DefaultEyeFov[eye], 1.0f);
         pEyeRenderTexture[eye] = new OculusEyeTexture();
-        if (!pEyeRenderTexture[eye]->Init(session, idealSize.w, idealSize.h, true))
+        if (!pEyeRenderTexture[eye]->Init(Hmd, idealSize.w, idealSize.h, true))
         {
             if (retryCreate) goto Done;
             FATALERROR("Failed to create eye texture.");
@@ -383,7 +404,7 @@ static bool MainLoop(bool retryCreate)
     mirrorDesc.Height = DIRECTX.WinSizeH;
     mirrorDesc.MiscFlags = ovrTextureMisc_None;
     mirrorDesc.MirrorOptions = ovrMirrorOption_Default;
-    result = ovr_CreateMirrorTextureWithOptionsDX(session, DIRECTX.CommandQueue, &mirrorDesc, &mirrorTexture);
+    result = Hmd->CreateMirrorTextureWithOptionsDX(DIRECTX.CommandQueue, &mirrorDesc, &mirrorTexture);
 
     if (!OVR_SUCCESS(result))
     {
@@ -398,6 +419,13 @@ static bool MainLoop(bool retryCreate)
     
     // Create camera
     static float Yaw = XM_PI;
+    bool benchmarkKeyDown = false;
+    bool scaleKeyDown = false;
+    bool denoiseKeyDown = false;
+    bool probesKeyDown = false;
+    bool probeBudgetKeyDown = false;
+    bool shadowCacheKeyDown = false;
+    bool rayBudgetKeyDown = false;
     mainCam = new Camera(XMVectorSet(0.0f, 0.0f, 0.0f, 0), XMQuaternionRotationRollPitchYaw(0, Yaw, 0));
 
     DIRECTX.InitFrame(drawMirror);
@@ -405,11 +433,13 @@ static bool MainLoop(bool retryCreate)
     scene->InitTexturesToTexArray();
 
 
+    bool traceKeyDown = false;
+
     // Main loop
     while (DIRECTX.HandleMessages())
     {
         ovrSessionStatus sessionStatus;
-        ovr_GetSessionStatus(session, &sessionStatus);
+        Hmd->GetSessionStatus(&sessionStatus);
         if (sessionStatus.ShouldQuit)
         {
             // Because the application is requested to quit, should not request retry
@@ -417,12 +447,15 @@ static bool MainLoop(bool retryCreate)
             break;
         }
         if (sessionStatus.ShouldRecenter)
-            ovr_RecenterTrackingOrigin(session);
+            Hmd->RecenterTrackingOrigin();
 
         if (sessionStatus.IsVisible)
         {
-            result = ovr_WaitToBeginFrame(session, frameIndex);
-            result = ovr_BeginFrame(session, frameIndex);
+            {
+                PROFILE_ZONE("ovr_WaitToBeginFrame");
+                result = Hmd->WaitToBeginFrame(frameIndex);
+            }
+            result = Hmd->BeginFrame(frameIndex);
 
             XMVECTOR forward = XMVector3Rotate(XMVectorSet(0, 0, -0.05f, 0), mainCam->GetRotVec());
             XMVECTOR right = XMVector3Rotate(XMVectorSet(0.05f, 0, 0, 0), mainCam->GetRotVec());
@@ -433,8 +466,68 @@ static bool MainLoop(bool retryCreate)
             if (DIRECTX.Key['D'])                            mainCamPos = XMVectorAdd(mainCamPos, right);
             if (DIRECTX.Key['A'])                            mainCamPos = XMVectorSubtract(mainCamPos, right);
 
-            
-            result = ovr_GetInputState(session, ovrControllerType_Touch, &inputState);
+            // Number keys pick how many mirror bounces the raygen shader follows
+            for (UINT bounces = 0; bounces <= 4; bounces++)
+                if (DIRECTX.Key['0' + bounces]) scene->maxBounces = bounces;
+
+            // B times the DispatchRays and inline paths once per press
+            bool runBenchmark = DIRECTX.Key['B'] && !benchmarkKeyDown;
+            benchmarkKeyDown = DIRECTX.Key['B'];
+
+            // H steps the inline pass's secondary rays through full, half and quarter resolution
+            if (DIRECTX.Key['H'] && !scaleKeyDown)
+            {
+                scene->secondaryScale = scene->secondaryScale >= 4 ? 1 : scene->secondaryScale * 2;
+                Util.Output("Secondary rays at 1/%u resolution\n", scene->secondaryScale);
+            }
+            scaleKeyDown = DIRECTX.Key['H'];
+
+            // N toggles the denoiser of the inline pass
+            if (DIRECTX.Key['N'] && !denoiseKeyDown)
+            {
+                scene->denoise = !scene->denoise;
+                Util.Output("Denoiser %s\n", scene->denoise ? "on" : "off");
+            }
+            denoiseKeyDown = DIRECTX.Key['N'];
+
+            // I toggles the irradiance probes, U steps how many of them are updated per frame
+            if (DIRECTX.Key['I'] && !probesKeyDown)
+            {
+                scene->irradianceProbes = !scene->irradianceProbes;
+                Util.Output("Irradiance probes %s\n", scene->irradianceProbes ? "on" : "off");
+            }
+            probesKeyDown = DIRECTX.Key['I'];
+            if (DIRECTX.Key['U'] && !probeBudgetKeyDown)
+            {
+                scene->probeUpdateBudget = scene->probeUpdateBudget >= 128 ? 0 : (scene->probeUpdateBudget == 0 ? 8 : scene->probeUpdateBudget * 4);
+                Util.Output("Updating %u of %u probes per frame\n", scene->probeUpdateBudget, scene->probeGrid.Count());
+            }
+            probeBudgetKeyDown = DIRECTX.Key['U'];
+
+            // C toggles the shadow visibility cache
+            if (DIRECTX.Key['C'] && !shadowCacheKeyDown)
+            {
+                scene->shadowCache = !scene->shadowCache;
+                Util.Output("Shadow cache %s\n", scene->shadowCache ? "on" : "off");
+            }
+            shadowCacheKeyDown = DIRECTX.Key['C'];
+
+            // R steps the secondary ray budget through 0.5, 1 and 2 rays per pixel and back off
+            if (DIRECTX.Key['R'] && !rayBudgetKeyDown)
+            {
+                scene->rayBudget = scene->rayBudget <= 0.0f ? 0.5f : scene->rayBudget >= 2.0f ? 0.0f : scene->rayBudget * 2.0f;
+                if (scene->rayBudget > 0.0f)
+                    Util.Output("Ray budget %.1f secondary rays per pixel\n", scene->rayBudget);
+                else
+                    Util.Output("Ray budget off\n");
+            }
+            rayBudgetKeyDown = DIRECTX.Key['R'];
+
+
+            {
+                PROFILE_ZONE("ovr_GetInputState");
+                result = Hmd->GetInputState(ovrControllerType_Touch, &inputState);
+            }
             float thumbstickX = inputState.Thumbstick[ovrHand_Left].x;
             float thumbstickY = inputState.Thumbstick[ovrHand_Left].y;
             XMVECTOR horMovement = XMVectorAdd(XMVectorScale(forward, thumbstickY), XMVectorScale(right, thumbstickX));
@@ -453,7 +546,7 @@ static bool MainLoop(bool retryCreate)
             mainCam->SetPosVec(mainCamPos);
             mainCam->SetRotVec(mainCamRot);
 
-            scene->lights[0].position = { 0,3,0,0 };
+            scene->SetLightPosition(0, XMVectorSet(0, 3, 0, 0));
 
             // Animate the cube
             static float cubeClock = 0;
@@ -467,19 +560,23 @@ static bool MainLoop(bool retryCreate)
 
             // Call ovr_GetRenderDesc each frame to get the ovrEyeRenderDesc, as the returned values (e.g. HmdToEyePose) may change at runtime.
             ovrEyeRenderDesc eyeRenderDesc[2];
-            eyeRenderDesc[0] = ovr_GetRenderDesc(session, ovrEye_Left, hmdDesc.DefaultEyeFov[0]);
-            eyeRenderDesc[1] = ovr_GetRenderDesc(session, ovrEye_Right, hmdDesc.DefaultEyeFov[1]);
+            eyeRenderDesc[0] = Hmd->GetRenderDesc(ovrEye_Left, hmdDesc.DefaultEyeFov[0]);
+            eyeRenderDesc[1] = Hmd->GetRenderDesc(ovrEye_Right, hmdDesc.DefaultEyeFov[1]);
 
             // Get both eye poses simultaneously, with IPD offset already included.
             ovrPosef EyeRenderPose[2];
             ovrPosef HmdToEyePose[2] = { eyeRenderDesc[0].HmdToEyePose, eyeRenderDesc[1].HmdToEyePose };
 
             double sensorSampleTime;    // sensorSampleTime is fed into the layer later
-            ovr_GetEyePoses(session, frameIndex, ovrTrue, HmdToEyePose, EyeRenderPose, &sensorSampleTime);
+            {
+                PROFILE_ZONE("ovr_GetEyePoses");
+                Hmd->GetEyePoses(frameIndex, ovrTrue, HmdToEyePose, EyeRenderPose, &sensorSampleTime);
+            }
 
-            ovrTrackingState ts = ovr_GetTrackingState(session, ovr_GetTimeInSeconds(), ovrTrue);
+            ovrTrackingState ts = Hmd->GetTrackingState(Hmd->GetTimeInSeconds(), ovrTrue);
 
             if (ts.StatusFlags & (ovrStatus_OrientationTracked | ovrStatus_PositionTracked)) {
+                PROFILE_ZONE("Controller poses");
                 ovrPosef leftControllerPose = ts.HandPoses[ovrHand_Left].ThePose;
                 ovrPosef rightControllerPose = ts.HandPoses[ovrHand_Right].ThePose;
 
@@ -525,12 +622,26 @@ static bool MainLoop(bool retryCreate)
 
             ovrTimewarpProjectionDesc PosTimewarpProjectionDesc = {};
 
+            // Primary rays only need instances inside one of the eye frusta; the TLAS is shared by both eyes
+            EyeFrustum eyeFrusta[2];
+            for (int eye = 0; eye < 2; ++eye)
+            {
+                XMVECTOR eyeQuat = XMVectorSet(EyeRenderPose[eye].Orientation.x, EyeRenderPose[eye].Orientation.y,
+                    EyeRenderPose[eye].Orientation.z, EyeRenderPose[eye].Orientation.w);
+                XMVECTOR eyePos = XMVectorSet(EyeRenderPose[eye].Position.x, EyeRenderPose[eye].Position.y, EyeRenderPose[eye].Position.z, 0);
+                ovrFovPort fov = eyeRenderDesc[eye].Fov;
+                eyeFrusta[eye] = EyeFrustum(XMVectorAdd(mainCamPos, XMVector3Rotate(eyePos, mainCamRot)), XMQuaternionMultiply(eyeQuat, mainCamRot),
+                    fov.UpTan, fov.DownTan, fov.LeftTan, fov.RightTan);
+            }
+            scene->CullPrimaryLayer(eyeFrusta, 2);
+
             scene->UpdateInstanceDescs();
             scene->UpdateTLAS();
             
             // Render Scene to Eye Buffers
             for (int eye = 0; eye < 2; ++eye)
             {
+                PROFILE_ZONE(eye == 0 ? "Render left eye" : "Render right eye");
                 DIRECTX.SetActiveContext(eye == 0 ? DrawContext_EyeRenderLeft : DrawContext_EyeRenderRight);
 
                 DIRECTX.SetActiveEye(eye);
@@ -564,8 +675,33 @@ static bool MainLoop(bool retryCreate)
                     p.M[0][2], p.M[1][2], p.M[2][2], p.M[3][2],
                     p.M[0][3], p.M[1][3], p.M[2][3], p.M[3][3]);
                 XMMATRIX prod = XMMatrixMultiply(view, proj);
+                FovTangents eyeFov = { eyeRenderDesc[eye].Fov.UpTan, eyeRenderDesc[eye].Fov.DownTan, eyeRenderDesc[eye].Fov.LeftTan, eyeRenderDesc[eye].Fov.RightTan };
 
-                scene->DoRaytracing(XMMatrixInverse(nullptr, XMMatrixTranspose(prod)), finalCam.GetPosVec());
+                if (eye == 0 && runBenchmark)
+                {
+                    if (DIRECTX.inlineRaytracingSupported)
+                    {
+                        Scene::SecondaryPathBenchmark benchmark = scene->BenchmarkSecondaryPaths(XMMatrixTranspose(prod), finalCam.GetPosVec(), finalCam.GetRotVec(), eyeFov, 32);
+                        Util.Output("DispatchRays %.3f ms, inline %.3f ms, inline at half resolution %.3f ms per eye; %u surface pixels, %u visibility and %u reflection mismatches against the CPU\n",
+                            benchmark.dispatchRaysMilliseconds, benchmark.inlineMilliseconds, benchmark.halfResolutionMilliseconds, benchmark.diff.surfacePixels,
+                            benchmark.diff.visibilityMismatches, benchmark.diff.reflectionMismatches);
+                        Util.Output("CPU denoiser over %u frames: relMSE %.4f noisy, %.4f denoised against %u pixels of reference\n",
+                            benchmark.denoiser.frames, benchmark.denoiser.noisy.relMse, benchmark.denoiser.denoised.relMse, benchmark.denoiser.denoised.pixels);
+                        const ShadowCacheStats& cache = benchmark.shadowCache;
+                        Util.Output("Shadow cache %.3f ms per eye; CPU over %u frames: %.1f%% of shadow rays cached, %llu wrong, %u entries, %.3f ms traced against %.3f ms cached, %u entries invalidated in %.3f ms\n",
+                            benchmark.shadowCacheMilliseconds, cache.frames, 100.0 * cache.HitRate(), (unsigned long long)cache.mismatches, cache.entries,
+                            cache.uncachedMilliseconds, cache.cachedMilliseconds, cache.invalidated, cache.invalidateMilliseconds);
+                        const RayBudgetReport& budget = benchmark.rayBudget;
+                        Util.Output("Ray budget over %u tiles: %.0f of %.0f secondary rays, %.0f of them mandatory, allocated in %.3f ms\n",
+                            budget.tiles, budget.rays, budget.unbudgetedRays, budget.mandatoryRays, budget.milliseconds);
+                        Util.Output("Camera rays from the field of view against the inverted projection: %.3g rad apart at most, %.3g on average, %.3g rad between pixels\n",
+                            benchmark.cameraRays.maxRadians, benchmark.cameraRays.meanRadians, benchmark.cameraRays.pixelSpreadAngle);
+                    }
+                    else
+                        Util.Output("Inline raytracing needs raytracing tier 1.1\n");
+                }
+
+                scene->DoRaytracing(XMMatrixTranspose(prod), finalCam.GetPosVec(), finalCam.GetRotVec(), eyeFov);
                 DIRECTX.CopyRaytracingOutputToBackbuffer(pEyeRenderTexture[eye]->GetD3DColorResource(), pEyeRenderTexture[eye]->GetD3DDepthResource());
 
                 resBar = CD3DX12_RESOURCE_BARRIER::Transition(pEyeRenderTexture[eye]->GetD3DColorResource(),
@@ -608,7 +744,10 @@ static bool MainLoop(bool retryCreate)
             }
 
             ovrLayerHeader* layers = &ld.Header;
-            result = ovr_EndFrame(session, frameIndex, nullptr, &layers, 1);
+            {
+                PROFILE_ZONE("ovr_EndFrame");
+                result = Hmd->EndFrame(frameIndex, nullptr, &layers, 1);
+            }
             // exit the rendering loop if submit returns an error, will retry on ovrError_DisplayLost
             if (!OVR_SUCCESS(result))
                 goto Done;
@@ -618,13 +757,15 @@ static bool MainLoop(bool retryCreate)
 
         if (drawMirror)
         {
+            PROFILE_ZONE("Mirror blit");
             DIRECTX.SetActiveContext(DrawContext_Final);
+            D3D12GpuTimer::Scope mirrorGpuZone(DIRECTX.gpuTimer, DIRECTX.CurrentFrameResources().CommandLists[DIRECTX.ActiveContext], "Mirror copy");
 
             DIRECTX.SetViewport(0.0f, 0.0f, (float)hmdDesc.Resolution.w / 2, (float)hmdDesc.Resolution.h / 2);
 
             // Render mirror
             ID3D12Resource* mirrorTexRes = nullptr;
-            ovr_GetMirrorTextureBufferDX(session, mirrorTexture, IID_PPV_ARGS(&mirrorTexRes));
+            Hmd->GetMirrorTextureBufferDX(mirrorTexture, IID_PPV_ARGS(&mirrorTexRes));
 
             //DIRECTX.SetAndClearRenderTarget(DIRECTX.CurrentFrameResources().SwapChainRtvHandle, nullptr, 1.0f, 0.5f, 0.0f, 1.0f);
 
@@ -659,6 +800,13 @@ static bool MainLoop(bool retryCreate)
         }
 
         DIRECTX.SubmitCommandListAndPresent(drawMirror);
+        PROFILE_FRAME_END();
+
+        // T prints the GPU zones, and with the CPU profiler compiled in writes its last few seconds to
+        // frame_trace.json for chrome://tracing
+        if (DIRECTX.Key['T'] && !traceKeyDown)
+            ReportFrameProfile("frame_trace.json");
+        traceKeyDown = DIRECTX.Key['T'];
     }
 
     // Release resources
@@ -666,31 +814,34 @@ Done:
     delete mainCam;
     delete scene;
     if (mirrorTexture)
-        ovr_DestroyMirrorTexture(session, mirrorTexture);
+        Hmd->DestroyMirrorTexture(mirrorTexture);
 
     for (int eye = 0; eye < 2; ++eye)
     {
         delete pEyeRenderTexture[eye];
     }
     DIRECTX.ReleaseDevice();
-    ovr_Destroy(session);
+    Hmd->Destroy();
 
     // Retry on ovrError_DisplayLost
     return retryCreate || (result == ovrError_DisplayLost);
 }
 
 //-------------------------------------------------------------------------------------
-int WINAPI WinMain(HINSTANCE hinst, HINSTANCE, LPSTR, int)
+int WINAPI WinMain(HINSTANCE hinst, HINSTANCE, LPSTR cmdLine, int)
 {
-    // Initializes LibOVR, and the Rift
-    ovrInitParams initParams = { ovrInit_RequestVersion | ovrInit_FocusAware, OVR_MINOR_VERSION, NULL, 0, 0 };
-    ovrResult result = ovr_Initialize(&initParams);
-    VALIDATE(OVR_SUCCESS(result), "Failed to initialize libOVR.");
+    // -inline traces the shadow and reflection rays with RayQuery from a compute pass
+    DIRECTX.inlineRaytracing = strstr(cmdLine, "-inline") != nullptr;
+
+    // Initializes LibOVR and the Rift, or with -simulate[=script] a headless stand-in for them
+    Hmd = CreateHmdSession(cmdLine);
+    VALIDATE(Hmd->Initialize(), "Failed to initialize libOVR.");
 
     VALIDATE(DIRECTX.InitWindow(hinst, L"Oculus Room Tiny (DX12)"), "Failed to open window.");
 
     DIRECTX.Run(MainLoop);
 
-    ovr_Shutdown();
+    Hmd->Shutdown();
+    delete Hmd;
     return(0);
 }
@@ -0,0 +1,50 @@
+//*********************************************************
+//
+// Sums up what each RAY_BUDGET_TILE_SIZE tile of the eye's frame showed, for the ray
+// budget of a later frame, see RayBudget.h. One group per tile adds its pixels up in
+// group shared memory, the luminance coming from the finished image. Sums are kept in
+// steps of 1 / RAY_BUDGET_UNIT so they can be added atomically.
+//
+//*********************************************************
+
+#include "InlineRaytracing.hlsl"
+
+groupshared uint g_tileStats[4];
+
+[numthreads(RAY_BUDGET_TILE_SIZE, RAY_BUDGET_TILE_SIZE, 1)]
+void MyRayBudgetStatsShader(uint3 groupId : SV_GroupID, uint3 groupThreadId : SV_GroupThreadID, uint groupIndex : SV_GroupIndex)
+{
+    if (groupIndex < 4)
+        g_tileStats[groupIndex] = 0;
+    GroupMemoryBarrierWithGroupSync();
+
+    uint2 dimensions;
+    GBuffer.GetDimensions(dimensions.x, dimensions.y);
+    uint2 index = groupId.xy * RAY_BUDGET_TILE_SIZE + groupThreadId.xy;
+    if (index.x < dimensions.x && index.y < dimensions.y)
+    {
+        uint4 texel = GBuffer[index];
+        if (asfloat(texel.z) >= 0.0f)
+        {
+            if (!(texel.w & SURFACE_UNLIT))
+            {
+                float luminance = dot(RenderTarget[index].rgb, float3(0.2126f, 0.7152f, 0.0722f));
+                InterlockedAdd(g_tileStats[0], 1);
+                InterlockedAdd(g_tileStats[3], uint(saturate(luminance) * RAY_BUDGET_UNIT + 0.5f));
+            }
+            float reflectivity = f16tof32(texel.w & 0xffff);
+            if (reflectivity > 0.0f)
+            {
+                InterlockedAdd(g_tileStats[1], 1);
+                InterlockedAdd(g_tileStats[2], uint(saturate(reflectivity) * RAY_BUDGET_UNIT + 0.5f));
+            }
+        }
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    if (groupIndex == 0)
+    {
+        uint tilesX = (dimensions.x + RAY_BUDGET_TILE_SIZE - 1) / RAY_BUDGET_TILE_SIZE;
+        RayBudgetStats[groupId.y * tilesX + groupId.x] = uint4(g_tileStats[0], g_tileStats[1], g_tileStats[2], g_tileStats[3]);
+    }
+}
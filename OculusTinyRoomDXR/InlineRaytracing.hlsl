@@ -0,0 +1,151 @@
+//*********************************************************
+//
+// Inline raytracing path: resolves the shadow and reflection rays of the G-buffer
+// written by MyRaygenShader with RayQuery from a compute shader, so no ray after
+// the primary one goes through the shader tables.
+//
+// Everything but the two tracing functions comes from Raytracing.hlsl, so both paths
+// shade identically; SecondaryRays.h holds the CPU reference of what this traces.
+//
+//*********************************************************
+
+#define INLINE_RAYTRACING
+#include "Raytracing.hlsl"
+
+// Stands in for MySimpleIntersectionShader on a procedural candidate.
+bool IntersectCandidateSphere(uint instanceId, uint primitiveIndex, float3x4 objectToWorld, RayDesc rayDesc, float tMax,
+    out float thit, out float3 normal)
+{
+    float3 position;
+    float radius;
+    WorldSphere(instanceId, primitiveIndex, objectToWorld, position, radius);
+    Ray ray;
+    ray.origin = rayDesc.Origin;
+    ray.direction = rayDesc.Direction;
+    return RaySphereHit(ray, rayDesc.TMin, tMax, true, position, radius, thit, normal);
+}
+
+SurfacePayload TraceSurface(RayDesc ray, uint instanceMask, RayCone cone)
+{
+    RayQuery<RAY_FLAG_CULL_BACK_FACING_TRIANGLES> query;
+    query.TraceRayInline(Scene, RAY_FLAG_NONE, instanceMask, ray);
+
+    float3 sphereNormal = float3(0, 0, 0);
+    while (query.Proceed())
+    {
+        if (query.CandidateType() == CANDIDATE_NON_OPAQUE_TRIANGLE)
+        {
+            // Stands in for MyAlphaTestAnyHitShader
+            if (!(InstanceMaterial(query.CandidateInstanceContributionToHitGroupIndex()).flags & MATERIAL_FLAG_ALPHA_TESTED) ||
+                PassesAlphaTest(query.CandidateInstanceID(), query.CandidatePrimitiveIndex(), query.CandidateTriangleBarycentrics(),
+                    query.CandidateObjectToWorld3x4()))
+                query.CommitNonOpaqueTriangleHit();
+            continue;
+        }
+
+        float thit;
+        float3 normal;
+        if (IntersectCandidateSphere(query.CandidateInstanceID(), query.CandidatePrimitiveIndex(), query.CandidateObjectToWorld3x4(),
+            ray, query.CommittedRayT(), thit, normal))
+        {
+            query.CommitProceduralPrimitiveHit(thit);
+            sphereNormal = normal;
+        }
+    }
+
+    if (query.CommittedStatus() == COMMITTED_TRIANGLE_HIT)
+        return DescribeTriangle(query.CommittedInstanceID(), query.CommittedPrimitiveIndex(), query.CommittedTriangleBarycentrics(),
+            query.CommittedObjectToWorld3x4(), ray.Direction, query.CommittedRayT(), PropagateRayCone(cone, query.CommittedRayT()).width,
+            InstanceMaterial(query.CommittedInstanceContributionToHitGroupIndex()).flags);
+    if (query.CommittedStatus() == COMMITTED_PROCEDURAL_PRIMITIVE_HIT)
+        return DescribeSphere(query.CommittedInstanceID(), query.CommittedPrimitiveIndex(), sphereNormal, query.CommittedRayT());
+
+    SurfacePayload miss = { 0, 0, -1.0f, 0 };
+    return miss;
+}
+
+bool IsInShadow(float3 lightDir, float3 hitPoint, float maxDist)
+{
+    RayDesc shadowRay;
+    shadowRay.Origin = hitPoint;
+    shadowRay.Direction = lightDir;
+    shadowRay.TMin = 0.001f;
+    shadowRay.TMax = maxDist;
+
+    RayQuery<RAY_FLAG_CULL_BACK_FACING_TRIANGLES | RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH> query;
+    query.TraceRayInline(Scene, RAY_FLAG_NONE, LAYER_SHADOW, shadowRay);
+
+    while (query.Proceed())
+    {
+        if (query.CandidateType() == CANDIDATE_NON_OPAQUE_TRIANGLE)
+        {
+            if (!(InstanceMaterial(query.CandidateInstanceContributionToHitGroupIndex()).flags & MATERIAL_FLAG_ALPHA_TESTED) ||
+                PassesAlphaTest(query.CandidateInstanceID(), query.CandidatePrimitiveIndex(), query.CandidateTriangleBarycentrics(),
+                    query.CandidateObjectToWorld3x4()))
+                query.CommitNonOpaqueTriangleHit();
+            continue;
+        }
+
+        float thit;
+        float3 normal;
+        if (IntersectCandidateSphere(query.CandidateInstanceID(), query.CandidatePrimitiveIndex(), query.CandidateObjectToWorld3x4(),
+            shadowRay, query.CommittedRayT(), thit, normal))
+            query.CommitProceduralPrimitiveHit(thit);
+    }
+    return query.CommittedStatus() != COMMITTED_NOTHING;
+}
+
+// The full resolution pixel whose G-buffer texel a reduced resolution sample traces from.
+uint2 LowResSourcePixel(uint2 lowResIndex, uint2 dimensions)
+{
+    uint scale = g_sceneCB.secondaryScale;
+    return min(lowResIndex * scale + scale / 2, dimensions - 1);
+}
+
+// Hands the lighting and reflection of a full resolution pixel to Denoise.hlsl, or composes them straight away.
+void OutputSecondary(uint2 index, SurfacePayload surface, float3 lighting, float3 reflected)
+{
+    if (g_sceneCB.denoise)
+    {
+        DenoiseSignals[uint3(index, 0)] = float4(lighting, 0.0f);
+        DenoiseSignals[uint3(index, 1)] = float4(reflected, 0.0f);
+        return;
+    }
+    RenderTarget[index] = float4(ComposeSurface(surface, lighting, reflected), 1.0f);
+}
+
+// One thread per pixel, or with a secondaryScale above 1 one thread per block of pixels that
+// leaves its unweighted terms to MySecondaryUpsampleShader instead of writing a color.
+// SecondaryRays is only written at full resolution.
+[numthreads(8, 8, 1)]
+void MyInlineShadingShader(uint3 dispatchThreadId : SV_DispatchThreadID)
+{
+    uint2 dimensions;
+    GBuffer.GetDimensions(dimensions.x, dimensions.y);
+    uint scale = max(g_sceneCB.secondaryScale, 1);
+    uint2 index = dispatchThreadId.xy;
+    if (index.x * scale >= dimensions.x || index.y * scale >= dimensions.y)
+        return;
+
+    uint2 pixel = scale > 1 ? LowResSourcePixel(index, dimensions) : index;
+    uint4 texel = GBuffer[pixel];
+    SurfacePayload surface = { texel.x, texel.y, asfloat(texel.z), texel.w };
+
+    RayDesc ray;
+    GenerateCameraRay(pixel, ray.Origin, ray.Direction);
+    ray.TMin = 0.001;
+    ray.TMax = 10000.0;
+
+    float3 lighting;
+    float3 reflected;
+    float2 secondary;
+    ShadeSecondary(ray, surface, pixel, lighting, reflected, secondary);
+    if (scale > 1)
+    {
+        LowResLighting[index] = float4(lighting, 1.0f);
+        LowResReflection[index] = float4(reflected, 1.0f);
+        return;
+    }
+    OutputSecondary(index, surface, lighting, reflected);
+    SecondaryRays[index] = secondary;
+}